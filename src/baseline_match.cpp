@@ -1,7 +1,18 @@
 /*
   Baseline Image Matching using 7x7 center square and SSD
   
-  Usage: baseline_match <target_image> <image_directory> <num_matches>
+  Usage: baseline_match <target_image> <image_directory> <num_matches> [--threads <n>] [--full-decode]
+         [--stats] [--stats-json <file>]
+
+  Only the 7x7 center of each database image is used, so JPEGs are decoded
+  partially (see jpeg_crop.h).  --full-decode decodes every image in full
+  as before, for timing comparisons.  --stats prints where the time went
+  (see stage_stats.h).
+
+  The SSD of an image is abandoned as soon as it exceeds the distance
+  of the current K-th best image (see early_abandon.h); such images are
+  listed with the partial distance, and the work skipped is reported at
+  the end.
 */
 
 #include <opencv2/opencv.hpp>
@@ -9,68 +20,41 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
-#include <dirent.h>
-#include "csv_util.h"
+#include <atomic>
+#include "image_features.h"
+#include "image_pipeline.h"
+#include "top_k.h"
+#include "jpeg_crop.h"
+#include "stage_stats.h"
+#include "early_abandon.h"
 
 using namespace cv;
 using namespace std;
 
-// Extract 7x7 center square from image as feature vector
-vector<float> extractCenterSquare(Mat &image) {
-    vector<float> features;
-    
-    // Get image center
-    int centerY = image.rows / 2;
-    int centerX = image.cols / 2;
-    
-    // Extract 7x7 region around center
-    int halfSize = 3; // 7/2 = 3
-    
-    for(int i = centerY - halfSize; i <= centerY + halfSize; i++) {
-        for(int j = centerX - halfSize; j <= centerX + halfSize; j++) {
-            // Handle color images (3 channels: B, G, R)
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            features.push_back(pixel[0]); // Blue
-            features.push_back(pixel[1]); // Green
-            features.push_back(pixel[2]); // Red
-        }
-    }
-    
-    return features;
-}
-
-// Compute Sum of Squared Differences between two feature vectors
-float computeSSD(vector<float> &feat1, vector<float> &feat2) {
-    float ssd = 0.0;
-    
-    if(feat1.size() != feat2.size()) {
-        printf("Error: Feature vectors have different sizes!\n");
-        return -1.0;
-    }
+int main(int argc, char *argv[]) {
     
-    for(int i = 0; i < feat1.size(); i++) {
-        float diff = feat1[i] - feat2[i];
-        ssd += diff * diff;
+    // Pull out --threads and --stats before looking at the positional arguments
+    PipelineOptions pipelineOptions;
+    if(parse_pipeline_options(argc, argv, pipelineOptions) != 0 || parse_stats_options(argc, argv) != 0) {
+        return -1;
     }
     
-    return ssd;
-}
-
-// Structure to hold image filename and its distance from target
-struct ImageMatch {
-    string filename;
-    float distance;
-    
-    bool operator<(const ImageMatch &other) const {
-        return distance < other.distance;
+    bool fullDecode = false;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--full-decode") == 0) {
+            fullDecode = true;
+            for(int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            break;
+        }
     }
-};
-
-int main(int argc, char *argv[]) {
     
     // Check arguments
     if(argc < 4) {
-        printf("Usage: %s <target_image> <image_directory> <num_matches>\n", argv[0]);
+        printf("Usage: %s <target_image> <image_directory> <num_matches> [--threads <n>] [--full-decode]\n", argv[0]);
+        printf("       [--stats] [--stats-json <file>]\n");
         printf("Example: %s images/pic.1016.jpg images 5\n", argv[0]);
         return -1;
     }
@@ -91,65 +75,85 @@ int main(int argc, char *argv[]) {
     // Extract features from target image
     vector<float> targetFeatures = extractCenterSquare(targetImage);
     printf("Extracted %lu features from target image\n", targetFeatures.size());
-    
-    // Open directory
-    DIR *dirp = opendir(imageDir);
-    if(dirp == NULL) {
-        printf("Error: Cannot open directory %s\n", imageDir);
-        return -1;
+    EarlyAbandonDistance ssd(&targetFeatures[0], targetFeatures.size(), ABANDON_SSD);
+    
+    // Process all images in directory with the decode/feature pipeline
+    ImagePipeline pipeline(pipelineOptions);
+    vector<TopK> workerBest(pipeline.featureWorkers(), TopK(numMatches));
+    vector<AbandonStats> workerAbandon(pipeline.featureWorkers());
+    
+    // Decode just the center square of each JPEG
+    atomic<int> partialDecodes(0);
+    if(!fullDecode) {
+        pipeline.setDecoder([&partialDecodes](const char *path) {
+            Mat square;
+            bool usedFastPath = false;
+            if(decode_center_square(path, 3, square, &usedFastPath) != 0) {
+                return Mat();
+            }
+            if(usedFastPath) {
+                partialDecodes++;
+            }
+            return square;
+        });
     }
     
-    // Process all images in directory
-    vector<ImageMatch> matches;
-    struct dirent *dp;
-    char buffer[512];
-    
     printf("\nProcessing images in directory: %s\n", imageDir);
     
-    while((dp = readdir(dirp)) != NULL) {
-        // Check if file is an image
-        if(strstr(dp->d_name, ".jpg") || 
-           strstr(dp->d_name, ".png") || 
-           strstr(dp->d_name, ".ppm") || 
-           strstr(dp->d_name, ".tif")) {
-            
-            // Build full path
-            strcpy(buffer, imageDir);
-            strcat(buffer, "/");
-            strcat(buffer, dp->d_name);
-            
-            // Load image
-            Mat image = imread(buffer);
-            if(image.empty()) {
-                printf("Warning: Could not load %s\n", buffer);
-                continue;
-            }
-            
-            // Extract features
-            vector<float> features = extractCenterSquare(image);
-            
-            // Compute distance
-            float distance = computeSSD(targetFeatures, features);
-            
-            // Store result
-            ImageMatch match;
-            match.filename = string(dp->d_name);
-            match.distance = distance;
-            matches.push_back(match);
-            
-            printf("  %s: distance = %.2f\n", dp->d_name, distance);
+    int result = pipeline.run(imageDir, default_image_extensions(), [&](PipelineImage &item, int worker) {
+        // Extract features
+        StageTimer extractTimer(STATS_EXTRACT);
+        vector<float> features = extractCenterSquare(item.image);
+        extractTimer.stop();
+        
+        if(features.size() != ssd.dim()) {
+            printf("Error: Feature vectors have different sizes!\n");
+            return;
+        }
+        
+        // Compute distance, stopping once it cannot make the top matches
+        StageTimer distanceTimer(STATS_DISTANCE);
+        long long abandoned = workerAbandon[worker].abandoned;
+        float distance = ssd.distance(&features[0], workerBest[worker].threshold(), workerAbandon[worker]);
+        distanceTimer.stop();
+        
+        // Keep it if it is among the best so far
+        workerBest[worker].push(item.id, distance);
+        
+        if(workerAbandon[worker].abandoned > abandoned) {
+            printf("  %s: distance > %.2f (abandoned)\n", item.filename, distance);
+        }
+        else {
+            printf("  %s: distance = %.2f\n", item.filename, distance);
         }
+    });
+    if(result != 0) {
+        return -1;
     }
     
-    closedir(dirp);
-    
-    // Sort matches by distance (ascending)
-    sort(matches.begin(), matches.end());
+    // Merge the per-thread heaps
+    StageTimer sortTimer(STATS_SORT);
+    vector<ScoredId> matches = merge_top_k(workerBest).sorted();
+    sortTimer.stop();
     
     // Display top N matches
     printf("\n=== Top %d matches ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)matches.size()); i++) {
-        printf("%d. %s (distance: %.2f)\n", i+1, matches[i].filename.c_str(), matches[i].distance);
+    for(int i = 0; i < (int)matches.size(); i++) {
+        printf("%d. %s (distance: %.2f)\n", i+1, pipeline.filename(matches[i].id), matches[i].distance);
+    }
+    
+    pipeline.printDecodeReport();
+    if(!fullDecode) {
+        printf("Center-only JPEG decodes: %d of %d images\n", partialDecodes.load(), (int)pipeline.fileCount());
+    }
+    AbandonStats abandonTotal;
+    for(size_t w = 0; w < workerAbandon.size(); w++) {
+        abandonTotal.add(workerAbandon[w]);
+    }
+    print_abandon_stats("Early abandoning", abandonTotal);
+    
+    if(report_stats("baseline_match") != 0) {
+        return -1;
     }
     
     return 0;
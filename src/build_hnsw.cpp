@@ -0,0 +1,93 @@
+/*
+  Build an HNSW approximate nearest-neighbor index for an embedding file
+
+  The feature file can be a CSV file or a binary feature store created
+  with csv_to_store (a store written with --normalize is used without a
+  normalized copy).  The index holds only the graph and is searched
+  together with the same feature file, see deep_embedding_match --hnsw.
+
+  --M sets the links per node (2 * M on the bottom level) and
+  --ef-construction the candidate list size while inserting; larger
+  values give a better graph and a slower build.  Nodes are inserted by
+  --threads threads (default: all cores).
+
+  Usage: build_hnsw <feature_file> <index_file> [--M <n>] [--ef-construction <n>] [--threads <n>]
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "feature_store.h"
+#include "embedding_matrix.h"
+#include "hnsw_index.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+
+    // Pull out the options before looking at the positional arguments
+    HnswParams params;
+    params.threads = max(1, (int)thread::hardware_concurrency());
+    for(int i = 1; i < argc; ) {
+        int *value = NULL;
+        if(strcmp(argv[i], "--M") == 0) {
+            value = &params.M;
+        }
+        else if(strcmp(argv[i], "--ef-construction") == 0) {
+            value = &params.efConstruction;
+        }
+        else if(strcmp(argv[i], "--threads") == 0) {
+            value = &params.threads;
+        }
+
+        if(value == NULL) {
+            i++;
+            continue;
+        }
+        if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+            printf("Error: %s needs a positive number\n", argv[i]);
+            return -1;
+        }
+        *value = atoi(argv[i + 1]);
+        for(int j = i; j < argc - 2; j++) {
+            argv[j] = argv[j + 2];
+        }
+        argc -= 2;
+    }
+
+    // Check arguments
+    if(argc < 3) {
+        printf("Usage: %s <feature_file> <index_file> [--M <n>] [--ef-construction <n>] [--threads <n>]\n", argv[0]);
+        printf("Example: %s data/ResNet18_olym.irfs data/ResNet18_olym.hnsw --M 16 --ef-construction 200\n", argv[0]);
+        return -1;
+    }
+
+    char *featureFile = argv[1];
+    char *indexFile = argv[2];
+
+    FeatureStore embeddings;
+    if(embeddings.load(featureFile) != 0) {
+        printf("Error: Failed to read %s\n", featureFile);
+        return -1;
+    }
+
+    EmbeddingMatrix normalized;
+    normalized.assign(embeddings.data(), embeddings.count(), embeddings.dim(), embeddings.stride(), embeddings.isNormalized());
+
+    printf("Indexing %lu embeddings of %lu dimensions (M = %d, efConstruction = %d, %d threads)\n",
+           (unsigned long)normalized.count(), (unsigned long)normalized.dim(),
+           params.M, params.efConstruction, params.threads);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if(build_hnsw_index(embeddings, normalized, params, indexFile) != 0) {
+        return -1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    printf("Wrote HNSW index %s in %.2f s\n", indexFile, seconds);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+  Bulk feature extraction
+
+  Walks an image directory, computes one of the matcher feature vectors
+  for every image and writes them to a feature CSV file (the
+  read_image_data_csv format) through a single buffered writer.  Rows
+  are written in batches with a checkpoint after each batch, so an
+  interrupted run can be continued with --resume.
+
+  Usage: build_index <image_directory> <feature_type> <output_csv> [--resume] [--batch <rows>]
+*/
+
+#include <opencv2/opencv.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <dirent.h>
+#include "image_features.h"
+#include "feature_writer.h"
+
+using namespace cv;
+using namespace std;
+
+static void printUsage(char *program) {
+    printf("Usage: %s <image_directory> <feature_type> <output_csv> [--resume] [--batch <rows>]\n", program);
+    printf("Example: %s images/olympus rg data/rg_olym.csv\n", program);
+    printf("\nFeature types:\n");
+
+    int count;
+    const FeatureExtractor *extractors = feature_extractors(count);
+    for(int i = 0; i < count; i++) {
+        printf("  %-14s %s\n", extractors[i].name, extractors[i].description);
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    // Check arguments
+    if(argc < 4) {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    char *imageDir = argv[1];
+    char *featureType = argv[2];
+    char *outputFile = argv[3];
+    bool resume = false;
+    int batchRows = 256;
+
+    for(int i = 4; i < argc; i++) {
+        if(strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        }
+        else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchRows = atoi(argv[++i]);
+        }
+        else {
+            printf("Error: Unknown option %s\n", argv[i]);
+            printUsage(argv[0]);
+            return -1;
+        }
+    }
+
+    const FeatureExtractor *extractor = find_feature_extractor(featureType);
+    if(extractor == NULL) {
+        printf("Error: Unknown feature type %s\n", featureType);
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    // Collect image filenames; sorted so that runs are reproducible
+    DIR *dirp = opendir(imageDir);
+    if(dirp == NULL) {
+        printf("Error: Cannot open directory %s\n", imageDir);
+        return -1;
+    }
+
+    vector<string> imageFiles;
+    struct dirent *dp;
+    while((dp = readdir(dirp)) != NULL) {
+        if(strstr(dp->d_name, ".jpg") ||
+           strstr(dp->d_name, ".png") ||
+           strstr(dp->d_name, ".ppm") ||
+           strstr(dp->d_name, ".tif")) {
+            imageFiles.push_back(dp->d_name);
+        }
+    }
+    closedir(dirp);
+    sort(imageFiles.begin(), imageFiles.end());
+
+    FeatureWriter writer;
+    if(writer.open(outputFile, resume, batchRows) != 0) {
+        return -1;
+    }
+
+    // Images already written by a previous run are skipped
+    set<string> done(writer.existingNames().begin(), writer.existingNames().end());
+
+    printf("Extracting %s features from %lu images in %s\n",
+           extractor->name, (unsigned long)imageFiles.size(), imageDir);
+    if(!done.empty()) {
+        printf("Skipping %lu images already in %s\n", (unsigned long)done.size(), outputFile);
+    }
+
+    int processedCount = 0;
+    int failedCount = 0;
+    string buffer;
+
+    for(size_t i = 0; i < imageFiles.size(); i++) {
+        if(done.count(imageFiles[i])) {
+            continue;
+        }
+
+        // Build full path
+        buffer = string(imageDir) + "/" + imageFiles[i];
+
+        Mat image = imread(buffer);
+        if(image.empty()) {
+            printf("Warning: Could not load %s\n", buffer.c_str());
+            failedCount++;
+            continue;
+        }
+
+        vector<float> features = extractor->extract(image);
+        if(writer.append(imageFiles[i].c_str(), features) != 0) {
+            return -1;
+        }
+
+        processedCount++;
+        if(processedCount % 100 == 0) {
+            printf("Processed %d images...\n", processedCount);
+        }
+    }
+
+    if(writer.close() != 0) {
+        return -1;
+    }
+
+    printf("Total images processed: %d (%d failed)\n", processedCount, failedCount);
+    printf("Wrote %lu rows to %s\n", (unsigned long)writer.rowsWritten(), outputFile);
+
+    return 0;
+}
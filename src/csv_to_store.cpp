@@ -0,0 +1,136 @@
+/*
+  Convert a feature CSV file into a binary feature store
+
+  The CSV file has the read_image_data_csv format: a filename in the
+  first column followed by the feature values.  The resulting store can
+  be passed anywhere a feature CSV file is accepted.
+
+  --normalize stores every row L2-normalized and marks the store as such,
+  so that cosine matching can use the mapped rows directly instead of
+  normalizing a copy at startup (embedding_matrix.h).  Only use it for
+  embeddings: the other metrics see the normalized values.
+
+  --dtype float16 or bfloat16 stores the rows as 16-bit half-precision
+  values, rounded to nearest, in half the space (see feature_store.h);
+  the default is float32.
+
+  Usage: csv_to_store <csv_file> <store_file> [--normalize] [--dtype <float32|float16|bfloat16>]
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "feature_store.h"
+#include "embedding_matrix.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+
+    // Pull out the options before looking at the positional arguments
+    bool normalize = false;
+    const char *dtypeName = "float32";
+    for(int i = 1; i < argc; ) {
+        if(strcmp(argv[i], "--dtype") == 0 && i + 1 < argc) {
+            dtypeName = argv[i + 1];
+            for(int j = i; j < argc - 2; j++) {
+                argv[j] = argv[j + 2];
+            }
+            argc -= 2;
+        }
+        else if(strcmp(argv[i], "--normalize") == 0) {
+            normalize = true;
+            for(int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+        }
+        else {
+            i++;
+        }
+    }
+
+    FeatureStoreDType dtype;
+    if(parse_feature_dtype(dtypeName, dtype) != 0) {
+        printf("Error: Unknown dtype %s (use float32, float16 or bfloat16)\n", dtypeName);
+        return -1;
+    }
+
+    // Check arguments
+    if(argc < 3) {
+        printf("Usage: %s <csv_file> <store_file> [--normalize] [--dtype <float32|float16|bfloat16>]\n", argv[0]);
+        printf("Example: %s data/ResNet18_olym.csv data/ResNet18_olym.irfs\n", argv[0]);
+        return -1;
+    }
+
+    char *csvFile = argv[1];
+    char *storeFile = argv[2];
+
+    // Read the CSV file into one contiguous matrix
+    FeatureStore features;
+    if(features.load(csvFile) != 0) {
+        printf("Error: Failed to read %s\n", csvFile);
+        return -1;
+    }
+
+    if(features.isMapped()) {
+        printf("Error: %s is already a feature store\n", csvFile);
+        return -1;
+    }
+
+    printf("Read %lu rows with %lu features each\n",
+           (unsigned long)features.count(), (unsigned long)features.dim());
+
+    vector<char *> filenames;
+    for(size_t i = 0; i < features.count(); i++) {
+        filenames.push_back((char *)features.name(i));
+    }
+
+    // Rows as they go into the store: normalized copies with --normalize,
+    // otherwise the CSV rows as they are
+    if(normalize) {
+        printf("Normalizing rows to unit length\n");
+    }
+    EmbeddingMatrix rows;
+    rows.assign(features.data(), features.count(), features.dim(), features.stride(), !normalize);
+
+    // the store holds the rows without the padding of the in-memory table;
+    // for a half-precision store they are rounded here already, so that
+    // they can be compared with what is read back
+    vector<float> packed(rows.count() * rows.dim());
+    vector<uint16_t> rounded(rows.dim());
+    for(size_t i = 0; i < rows.count(); i++) {
+        memcpy(&packed[i * rows.dim()], rows.row(i), rows.dim() * sizeof(float));
+        if(dtype != FS_DTYPE_FLOAT32 && rows.dim() > 0) {
+            narrow_half_row(&packed[i * rows.dim()], rows.dim(), dtype, &rounded[0]);
+            widen_half_row(&rounded[0], rows.dim(), dtype, &packed[i * rows.dim()]);
+        }
+    }
+    if(dtype != FS_DTYPE_FLOAT32) {
+        printf("Storing rows as %s\n", dtypeName);
+    }
+
+    if(write_feature_store(storeFile, filenames, packed.empty() ? NULL : &packed[0], rows.count(), rows.dim(),
+                           normalize, NULL, 0, dtype) != 0) {
+        return -1;
+    }
+
+    // Read the store back and make sure it matches the CSV data
+    FeatureStore check;
+    if(check.load(storeFile) != 0 || check.count() != features.count() || check.dim() != features.dim()) {
+        printf("Error: Verification of %s failed\n", storeFile);
+        return -1;
+    }
+
+    for(size_t i = 0; i < check.count(); i++) {
+        if(strcmp(check.name(i), features.name(i)) != 0 ||
+           memcmp(check.row(i), &packed[i * rows.dim()], rows.dim() * sizeof(float)) != 0) {
+            printf("Error: Row %lu of %s does not match the CSV file\n", (unsigned long)i, storeFile);
+            return -1;
+        }
+    }
+
+    printf("Wrote feature store %s\n", storeFile);
+
+    return 0;
+}
@@ -12,9 +12,15 @@ The function returns a std::vector of char* for the filenames and a 2D std::vect
 */
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <functional>
+#include <thread>
 #include <vector>
 #include "opencv2/opencv.hpp"
+#include "feature_store.h"
+#include "feature_table.h"
 
 /*
   reads a string from a CSV file. the 0-terminated string is returned in the char array os.
@@ -145,20 +151,11 @@ int append_image_data_csv( char *filename, char *image_filename, std::vector<flo
 }
 
 /*
-  Given a file with the format of a string as the first column and
-  floating point numbers as the remaining columns, this function
-  returns the filenames as a std::vector of character arrays, and the
-  remaining data as a 2D std::vector<float>.
-
-  filenames will contain all of the image file names.
-  data will contain the features calculated from each image.
-
-  If echo_file is true, it prints out the contents of the file as read
-  into memory.
-
-  The function returns a non-zero value if something goes wrong.
+  The original character-at-a-time reader.  It is still used for files
+  whose rows have different numbers of columns, which the contiguous
+  reader below cannot represent.
  */
-int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<std::vector<float>> &data, int echo_file ) {
+static int read_image_data_csv_stream( char *filename, std::vector<char *> &filenames, std::vector<std::vector<float>> &data, int echo_file ) {
   FILE *fp;
   float fval;
   char img_file[256];
@@ -210,3 +207,517 @@ int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::ve
 
   return(0);
 }
+
+/*
+  Fast reader
+
+  The file is memory-mapped and split at line boundaries into chunks,
+  one per thread.  A first parallel pass counts the rows of every chunk,
+  so that each chunk knows its first row; the second pass parses the
+  chunks in parallel straight into one preallocated rows x columns
+  matrix.  Numbers are converted with parse_float, which does not
+  depend on the locale.
+ */
+
+// Chunks smaller than this are not worth a thread
+#define CSV_MIN_CHUNK_BYTES (1 << 20)
+
+// The pages of the mapped file are dropped after every this many bytes
+// are read, so that the file does not add its size to the peak memory
+#define CSV_RELEASE_BYTES (4 << 20)
+
+/*
+  Converts the number at the start of [p, end) the way atof does, and
+  returns a pointer to the first character after it.
+
+  Decimal numbers with at most 19 significant digits and a power of ten
+  of at most 22 take Clinger's fast path: the digits and the power of
+  ten are both exact doubles, so one multiplication or division gives
+  the correctly rounded double, the same one strtod returns.  Everything
+  else (more digits, large exponents, inf, nan, hex) goes to strtod.
+ */
+static const char *parse_float( const char *p, const char *end, float *v ) {
+  static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const char *start = p;
+
+  while( p < end && (*p == ' ' || *p == '\t') ) {
+    p++;
+  }
+  bool negative = false;
+  if( p < end && (*p == '-' || *p == '+') ) {
+    negative = *p == '-';
+    p++;
+  }
+
+  unsigned long long mantissa = 0;
+  int digits = 0;       // significant digits in mantissa
+  int exponent = 0;     // power of ten applied to mantissa
+  bool any = false;
+  for( ; p < end && *p >= '0' && *p <= '9'; p++ ) {
+    any = true;
+    if( digits < 19 ) {
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += mantissa != 0;
+    }
+    else {
+      digits++;
+    }
+  }
+  if( digits > 19 ) {
+    exponent += digits - 19;
+  }
+  if( p < end && *p == '.' ) {
+    for( p++; p < end && *p >= '0' && *p <= '9'; p++ ) {
+      any = true;
+      if( digits < 19 ) {
+        mantissa = mantissa * 10 + (*p - '0');
+        digits += mantissa != 0;
+        exponent--;
+      }
+      else {
+        digits++;
+      }
+    }
+  }
+  if( any && p < end && (*p == 'e' || *p == 'E') ) {
+    const char *q = p + 1;
+    bool negativeExponent = false;
+    if( q < end && (*q == '-' || *q == '+') ) {
+      negativeExponent = *q == '-';
+      q++;
+    }
+    if( q < end && *q >= '0' && *q <= '9' ) {
+      int e = 0;
+      for( ; q < end && *q >= '0' && *q <= '9'; q++ ) {
+        if( e < 10000 ) {
+          e = e * 10 + (*q - '0');
+        }
+      }
+      exponent += negativeExponent ? -e : e;
+      p = q;
+    }
+  }
+
+  if( !any ) {
+    // inf, nan, hex, or no number at all (atof returns 0 then)
+    if( p < end && ((*p | 0x20) == 'i' || (*p | 0x20) == 'n') ) {
+      char s[64];
+      size_t n = std::min( (size_t)(end - start), sizeof(s) - 1 );
+      memcpy( s, start, n );
+      s[n] = '\0';
+      char *stop;
+      *v = (float)strtod( s, &stop );
+      return start + (stop - s);
+    }
+    *v = 0.0f;
+    return p;
+  }
+
+  if( digits <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22 ) {
+    double value = (double)mantissa;
+    value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+    *v = (float)(negative ? -value : value);
+    return p;
+  }
+
+  // the slow, exact path; fields longer than the buffer are not numbers
+  char s[256];
+  size_t n = std::min( (size_t)(p - start), sizeof(s) - 1 );
+  memcpy( s, start, n );
+  s[n] = '\0';
+  *v = (float)strtod( s, NULL );
+  return p;
+}
+
+// True for a line with nothing but white space
+static bool blank_line( const char *p, const char *end ) {
+  for( ; p < end; p++ ) {
+    if( *p != ' ' && *p != '\t' && *p != '\r' ) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// One chunk of the file: [begin, end) holds complete lines
+struct CsvChunk {
+  const MappedFile *file;
+  const char *begin;
+  const char *end;
+  size_t rows;          // non-blank lines
+  size_t nameBytes;     // bytes of their filenames, terminators included
+  size_t firstRow;      // rows in the chunks before this one
+  size_t firstName;     // filename bytes in the chunks before this one
+  size_t badRow;        // first row with the wrong number of values, or (size_t)-1
+  size_t badCount;      // number of values in that row
+};
+
+// The mapped file, split into chunks and counted by scan_csv
+struct CsvScan {
+  MappedFile file;
+  size_t rows;
+  size_t cols;
+  size_t nameBytes;
+  std::vector<CsvChunk> chunks;
+};
+
+// Where parse_chunk puts the rows: data + row * stride, and either a
+// new[] string per filename or one arena of filenames
+struct CsvTarget {
+  float *data;
+  size_t stride;
+  char **filenames;     // NULL to use the arena
+  char *arena;
+  size_t *nameOffsets;
+};
+
+// Runs work on every chunk, one thread per chunk
+template <class Work>
+static void for_each_chunk( std::vector<CsvChunk> &chunks, Work work ) {
+  std::vector<std::thread> workers;
+  for( size_t c = 1; c < chunks.size(); c++ ) {
+    workers.push_back( std::thread( work, std::ref( chunks[c] ) ) );
+  }
+  if( !chunks.empty() ) {
+    work( chunks[0] );
+  }
+  for( size_t i = 0; i < workers.size(); i++ ) {
+    workers[i].join();
+  }
+}
+
+// The end of the filename of a line: its first comma, or the line end
+static const char *name_end( const char *line, const char *eol ) {
+  const char *comma = (const char *)memchr( line, ',', eol - line );
+  if( comma ) {
+    return comma;
+  }
+  return eol > line && eol[-1] == '\r' ? eol - 1 : eol;
+}
+
+// Drops the pages of the file from released up to p once enough are read
+static void release_read( const CsvChunk &chunk, const char *&released, const char *p, bool all ) {
+  if( all || p - released >= CSV_RELEASE_BYTES ) {
+    const char *base = (const char *)chunk.file->data();
+    chunk.file->release( released - base, p - released );
+    released = p;
+  }
+}
+
+static void count_chunk( CsvChunk &chunk ) {
+  const char *p = chunk.begin;
+  const char *released = p;
+  while( p < chunk.end ) {
+    release_read( chunk, released, p, false );
+    const char *eol = (const char *)memchr( p, '\n', chunk.end - p );
+    if( !eol ) {
+      eol = chunk.end;
+    }
+    if( !blank_line( p, eol ) ) {
+      chunk.rows++;
+      chunk.nameBytes += name_end( p, eol ) - p + 1;
+    }
+    p = eol + 1;
+  }
+  release_read( chunk, released, chunk.end, true );
+}
+
+// Parses the rows of one chunk into their places in the target
+static void parse_chunk( CsvChunk &chunk, size_t cols, const CsvTarget &target ) {
+  size_t row = chunk.firstRow;
+  size_t nameOffset = chunk.firstName;
+  const char *p = chunk.begin;
+  const char *released = p;
+  while( p < chunk.end ) {
+    release_read( chunk, released, p, false );
+    const char *eol = (const char *)memchr( p, '\n', chunk.end - p );
+    if( !eol ) {
+      eol = chunk.end;
+    }
+    const char *line = p;
+    p = eol + 1;
+    if( blank_line( line, eol ) ) {
+      continue;
+    }
+
+    // the filename runs up to the first comma
+    const char *nameEnd = name_end( line, eol );
+    size_t length = nameEnd - line;
+    char *fname;
+    if( target.filenames ) {
+      fname = new char[length + 1];
+      target.filenames[row] = fname;
+    }
+    else {
+      fname = target.arena + nameOffset;
+      target.nameOffsets[row] = nameOffset;
+      nameOffset += length + 1;
+    }
+    memcpy( fname, line, length );
+    fname[length] = '\0';
+
+    // then one number per field
+    size_t count = 0;
+    float *out = target.data + row * target.stride;
+    if( nameEnd < eol && *nameEnd == ',' ) {
+      for( const char *field = nameEnd + 1; ; ) {
+        float value;
+        const char *next = parse_float( field, eol, &value );
+        const char *fieldEnd = (const char *)memchr( next, ',', eol - next );
+        if( count < cols ) {
+          out[count] = value;
+        }
+        count++;
+        if( !fieldEnd ) {
+          break;
+        }
+        field = fieldEnd + 1;
+      }
+    }
+    if( count != cols && chunk.badRow == (size_t)-1 ) {
+      chunk.badRow = row;
+      chunk.badCount = count;
+    }
+    row++;
+  }
+  release_read( chunk, released, chunk.end, true );
+}
+
+/*
+  Maps the file, splits it at line boundaries and counts the rows and
+  filename bytes of every chunk in parallel.  The number of columns
+  comes from the first row.  Returns a non-zero value if the file
+  cannot be opened.
+ */
+static int scan_csv( const char *filename, CsvScan &scan ) {
+  scan.rows = 0;
+  scan.cols = 0;
+  scan.nameBytes = 0;
+  scan.chunks.clear();
+
+  if( scan.file.open( filename ) != 0 ) {
+    // MappedFile refuses empty files, which simply hold no rows
+    FILE *fp = fopen( filename, "r" );
+    if( !fp ) {
+      printf("Unable to open feature file\n");
+      return(-1);
+    }
+    fclose( fp );
+    return(0);
+  }
+  const char *text = (const char *)scan.file.data();
+  const char *end = text + scan.file.size();
+
+  const char *first = text;
+  for(;;) {
+    const char *eol = (const char *)memchr( first, '\n', end - first );
+    if( !eol ) {
+      eol = end;
+    }
+    if( !blank_line( first, eol ) ) {
+      const char *comma = (const char *)memchr( first, ',', eol - first );
+      for( ; comma; comma = (const char *)memchr( comma + 1, ',', eol - comma - 1 ) ) {
+        scan.cols++;
+      }
+      break;
+    }
+    if( eol == end ) {
+      return(0);
+    }
+    first = eol + 1;
+  }
+
+  int threads = std::max( 1, (int)std::thread::hardware_concurrency() );
+  threads = (int)std::min( (size_t)threads, scan.file.size() / CSV_MIN_CHUNK_BYTES + 1 );
+  const char *p = text;
+  for( int t = 0; t < threads && p < end; t++ ) {
+    const char *stop = t == threads - 1 ? end : p + std::max( (size_t)(end - p) / (threads - t), (size_t)1 );
+    if( stop < end ) {
+      const char *eol = (const char *)memchr( stop, '\n', end - stop );
+      stop = eol ? eol + 1 : end;
+    }
+    CsvChunk chunk = { &scan.file, p, stop, 0, 0, 0, 0, (size_t)-1, 0 };
+    scan.chunks.push_back( chunk );
+    p = stop;
+  }
+
+  for_each_chunk( scan.chunks, count_chunk );
+  for( size_t c = 0; c < scan.chunks.size(); c++ ) {
+    scan.chunks[c].firstRow = scan.rows;
+    scan.chunks[c].firstName = scan.nameBytes;
+    scan.rows += scan.chunks[c].rows;
+    scan.nameBytes += scan.chunks[c].nameBytes;
+  }
+  return(0);
+}
+
+/*
+  Parses all chunks in parallel into the target, which has room for
+  scan.rows rows.  Returns 1 if the rows do not all have scan.cols
+  columns, with the first such row in badRow and its count in badCount.
+ */
+static int parse_csv( CsvScan &scan, const CsvTarget &target, size_t &badRow, size_t &badCount ) {
+  size_t cols = scan.cols;
+  for_each_chunk( scan.chunks, [cols, &target]( CsvChunk &chunk ) { parse_chunk( chunk, cols, target ); } );
+
+  for( size_t c = 0; c < scan.chunks.size(); c++ ) {
+    if( scan.chunks[c].badRow != (size_t)-1 ) {
+      badRow = scan.chunks[c].badRow;
+      badCount = scan.chunks[c].badCount;
+      return(1);
+    }
+  }
+  return(0);
+}
+
+/*
+  Reads the file into one contiguous matrix.  Returns 1 (after printing
+  nothing) if the rows do not all have the same number of columns, so
+  that the caller can decide what to do.
+ */
+static int read_contiguous( const char *filename, std::vector<char *> &filenames, std::vector<float> &data,
+                            size_t &cols, size_t &badRow, size_t &badCount ) {
+  filenames.clear();
+  data.clear();
+  cols = 0;
+
+  CsvScan scan;
+  if( scan_csv( filename, scan ) != 0 ) {
+    return(-1);
+  }
+  cols = scan.cols;
+  if( scan.rows == 0 ) {
+    return(0);
+  }
+
+  filenames.assign( scan.rows, NULL );
+  data.resize( scan.rows * cols );
+  CsvTarget target = { data.empty() ? NULL : &data[0], cols, &filenames[0], NULL, NULL };
+  if( parse_csv( scan, target, badRow, badCount ) != 0 ) {
+    for( size_t i = 0; i < filenames.size(); i++ ) {
+      delete[] filenames[i];
+    }
+    filenames.clear();
+    data.clear();
+    return(1);
+  }
+  return(0);
+}
+
+static void echo_data( const float *data, size_t rows, size_t cols, size_t stride ) {
+  for(size_t i=0;i<rows;i++) {
+    for(size_t j=0;j<cols;j++) {
+      printf("%.4f  ", data[i * stride + j] );
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+/*
+  Given a file with the format of a string as the first column and
+  floating point numbers as the remaining columns, this function
+  returns the filenames as a std::vector of character arrays, and the
+  remaining data as a 2D std::vector<float>.
+
+  filenames will contain all of the image file names.
+  data will contain the features calculated from each image.
+
+  If echo_file is true, it prints out the contents of the file as read
+  into memory.
+
+  The function returns a non-zero value if something goes wrong.
+ */
+int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<std::vector<float>> &data, int echo_file ) {
+  std::vector<char *> names;
+  std::vector<float> matrix;
+  size_t cols, badRow, badCount;
+
+  printf("Reading %s\n", filename);
+  int result = read_contiguous( filename, names, matrix, cols, badRow, badCount );
+  if( result < 0 ) {
+    return(-1);
+  }
+  if( result > 0 ) {
+    // rows of different lengths: fall back to the row-by-row reader
+    return( read_image_data_csv_stream( filename, filenames, data, echo_file ) );
+  }
+
+  for(size_t i=0;i<names.size();i++) {
+    data.push_back( std::vector<float>( matrix.begin() + i * cols, matrix.begin() + (i + 1) * cols ) );
+    filenames.push_back( names[i] );
+  }
+  printf("Finished reading CSV file\n");
+
+  if(echo_file) {
+    echo_data( matrix.empty() ? NULL : &matrix[0], names.size(), cols, cols );
+  }
+
+  return(0);
+}
+
+/*
+  The same, but the data is returned as one contiguous row-major matrix
+  of filenames.size() rows and cols columns.  Every row must have the
+  same number of columns.
+ */
+int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<float> &data, size_t &cols, int echo_file ) {
+  size_t badRow, badCount;
+
+  printf("Reading %s\n", filename);
+  int result = read_contiguous( filename, filenames, data, cols, badRow, badCount );
+  if( result < 0 ) {
+    return(-1);
+  }
+  if( result > 0 ) {
+    printf("Error: row %lu of %s has %lu features, expected %lu\n",
+           (unsigned long)badRow, filename, (unsigned long)badCount, (unsigned long)cols);
+    return(-1);
+  }
+  printf("Finished reading CSV file\n");
+
+  if(echo_file) {
+    echo_data( data.empty() ? NULL : &data[0], filenames.size(), cols, cols );
+  }
+
+  return(0);
+}
+
+/*
+  The same, into a FeatureTable: one aligned matrix with padded rows and
+  one arena for the filenames.  Every row must have the same number of
+  columns.
+ */
+int read_feature_table( char *filename, FeatureTable &table, int echo_file ) {
+  size_t badRow, badCount;
+  CsvScan scan;
+
+  table.clear();
+  printf("Reading %s\n", filename);
+  if( scan_csv( filename, scan ) != 0 ) {
+    return(-1);
+  }
+  if( table.allocate( scan.rows, scan.cols, scan.nameBytes ) != 0 ) {
+    printf("Error: Out of memory for %lu rows of %s\n", (unsigned long)scan.rows, filename);
+    return(-1);
+  }
+  if( scan.rows > 0 ) {
+    CsvTarget target = { table.row( 0 ), table.stride(), NULL, table.nameArena(), table.nameOffsets() };
+    if( parse_csv( scan, target, badRow, badCount ) != 0 ) {
+      printf("Error: row %lu of %s has %lu features, expected %lu\n",
+             (unsigned long)badRow, filename, (unsigned long)badCount, (unsigned long)scan.cols);
+      table.clear();
+      return(-1);
+    }
+  }
+  printf("Finished reading CSV file\n");
+
+  if(echo_file) {
+    echo_data( table.data(), table.count(), table.dim(), table.stride() );
+  }
+
+  return(0);
+}
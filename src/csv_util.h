@@ -10,6 +10,11 @@
 #ifndef CVS_UTIL_H
 #define CVS_UTIL_H
 
+#include <cstddef>
+#include <vector>
+
+class FeatureTable;
+
 /*
   Given a filename, and image filename, and the image features, by
   default the function will append a line of data to the CSV format
@@ -41,4 +46,20 @@ int append_image_data_csv( char *filename, char *image_filename, std::vector<flo
  */
 int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<std::vector<float>> &data, int echo_file = 0 );
 
+/*
+  The same, but the data is returned as one contiguous row-major matrix:
+  row i starts at data[i * cols].  The file is memory-mapped and parsed
+  in parallel chunks straight into the matrix.  Every row must have the
+  same number of columns; the function fails otherwise.
+ */
+int read_image_data_csv( char *filename, std::vector<char *> &filenames, std::vector<float> &data, size_t &cols, int echo_file = 0 );
+
+/*
+  The same, into a FeatureTable (feature_table.h): one aligned matrix
+  with rows padded to the table stride, and one arena holding all the
+  filenames, so that no filename needs its own delete[].  Every row
+  must have the same number of columns; the function fails otherwise.
+ */
+int read_feature_table( char *filename, FeatureTable &table, int echo_file = 0 );
+
 #endif
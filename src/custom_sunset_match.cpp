@@ -7,7 +7,17 @@
   - Texture smoothness (low edge density)
   - Deep network embeddings
   
-  Usage: custom_sunset_match <target_image> <image_directory> <csv_file> <num_matches>
+  The feature file can be a CSV file or a binary feature store created
+  with csv_to_store.
+  
+  The three hand-crafted features come from one pass over each image,
+  with the edge density estimated on a reduced gray image
+  (fused_features.h).  --sunset-compare also runs the original three
+  extractors and reports the time spent in each and how much the ranking
+  changes.  --stats prints where the time went (see stage_stats.h).
+  
+  Usage: custom_sunset_match <target_image> <image_directory> <feature_file> <num_matches> [--threads <n>]
+         [--sunset-compare] [--stats] [--stats-json <file>]
 */
 
 #include <opencv2/opencv.hpp>
@@ -16,205 +26,80 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
-#include <dirent.h>
-#include "csv_util.h"
+#include <chrono>
+#include "image_features.h"
+#include "image_pipeline.h"
+#include "fused_features.h"
+#include "rank_compare.h"
+#include "feature_store.h"
+#include "embedding_matrix.h"
+#include "top_k.h"
+#include "stage_stats.h"
 
 using namespace cv;
 using namespace std;
 
-// Extract warm color percentage from upper portion of image
-float computeWarmColorScore(Mat &image) {
-    int warmPixels = 0;
-    int totalPixels = 0;
-    
-    // Focus on upper 60% of image (where sky/sunset typically is)
-    int endRow = (int)(image.rows * 0.6);
-    
-    for(int i = 0; i < endRow; i++) {
-        for(int j = 0; j < image.cols; j++) {
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            
-            float b = pixel[0];
-            float g = pixel[1];
-            float r = pixel[2];
-            
-            // Check if pixel is "warm" (red/orange/yellow dominant)
-            // Warm colors: R > G > B, with R being significantly higher
-            if(r > g && g >= b && r > 100) {
-                // Additional check: R should be at least 20% more than G
-                if(r > g * 1.2) {
-                    warmPixels++;
-                }
-            }
-            
-            totalPixels++;
-        }
-    }
-    
-    return (float)warmPixels / totalPixels;
-}
-
-// Compute vertical color gradient (sunset transitions from warm to cool)
-float computeVerticalGradient(Mat &image) {
-    // Split image into top third and bottom third
-    int topStart = 0;
-    int topEnd = image.rows / 3;
-    int bottomStart = (2 * image.rows) / 3;
-    int bottomEnd = image.rows;
-    
-    // Average colors in top third
-    float topR = 0, topG = 0, topB = 0;
-    int topCount = 0;
-    
-    for(int i = topStart; i < topEnd; i++) {
-        for(int j = 0; j < image.cols; j++) {
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            topB += pixel[0];
-            topG += pixel[1];
-            topR += pixel[2];
-            topCount++;
-        }
-    }
-    
-    topR /= topCount;
-    topG /= topCount;
-    topB /= topCount;
-    
-    // Average colors in bottom third
-    float bottomR = 0, bottomG = 0, bottomB = 0;
-    int bottomCount = 0;
-    
-    for(int i = bottomStart; i < bottomEnd; i++) {
-        for(int j = 0; j < image.cols; j++) {
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            bottomB += pixel[0];
-            bottomG += pixel[1];
-            bottomR += pixel[2];
-            bottomCount++;
-        }
-    }
-    
-    bottomR /= bottomCount;
-    bottomG /= bottomCount;
-    bottomB /= bottomCount;
-    
-    // Compute gradient: sunsets have warmer top, cooler bottom
-    float warmGradient = (topR - bottomR) + (topG - bottomG) * 0.5;
-    
-    return warmGradient;
-}
-
-// Compute edge density (sunsets are smooth, not busy)
-float computeEdgeDensity(Mat &image) {
-    Mat gray;
-    cvtColor(image, gray, COLOR_BGR2GRAY);
-    
-    Mat edges;
-    Canny(gray, edges, 50, 150);
-    
-    int edgePixels = countNonZero(edges);
-    int totalPixels = edges.rows * edges.cols;
-    
-    return (float)edgePixels / totalPixels;
-}
-
-// Normalize vector
-vector<float> normalizeVector(vector<float> &vec) {
-    vector<float> normalized;
-    float norm = 0.0;
-    
-    for(int i = 0; i < vec.size(); i++) {
-        norm += vec[i] * vec[i];
-    }
-    norm = sqrt(norm);
-    
-    if(norm > 0) {
-        for(int i = 0; i < vec.size(); i++) {
-            normalized.push_back(vec[i] / norm);
-        }
-    } else {
-        normalized = vec;
-    }
-    
-    return normalized;
-}
-
-// Compute cosine distance for DNN embeddings
-float cosineDistance(vector<float> &vec1, vector<float> &vec2) {
-    vector<float> norm1 = normalizeVector(vec1);
-    vector<float> norm2 = normalizeVector(vec2);
-    
-    float dotProd = 0.0;
-    for(int i = 0; i < norm1.size(); i++) {
-        dotProd += norm1[i] * norm2[i];
-    }
-    
-    if(dotProd > 1.0) dotProd = 1.0;
-    if(dotProd < -1.0) dotProd = -1.0;
-    
-    return 1.0 - dotProd;
-}
-
-// Combined custom distance metric for sunset detection
-float computeSunsetDistance(float warmScore1, float gradient1, float edgeDensity1, vector<float> &dnn1,
-                             float warmScore2, float gradient2, float edgeDensity2, vector<float> &dnn2) {
-    
-    // Warm color difference (most important for sunsets)
-    float warmDiff = fabs(warmScore1 - warmScore2);
-    
-    // Gradient difference
-    float gradDiff = fabs(gradient1 - gradient2);
-    
-    // Edge density difference (prefer smooth images)
-    float edgeDiff = fabs(edgeDensity1 - edgeDensity2);
+// Combined custom distance metric for sunset detection (sunset_distance)
+// dnn1 and dnn2 are normalized embeddings of dnnDim floats; a missing
+// embedding (NULL) is treated as a zero vector, at cosine distance 1
+float computeSunsetDistance(float warmScore1, float gradient1, float edgeDensity1, const float *dnn1,
+                             float warmScore2, float gradient2, float edgeDensity2, const float *dnn2,
+                             int dnnDim) {
+    SunsetFeatures features1 = { warmScore1, gradient1, edgeDensity1 };
+    SunsetFeatures features2 = { warmScore2, gradient2, edgeDensity2 };
     
     // DNN embedding distance
-    float dnnDist = cosineDistance(dnn1, dnn2);
-    
-    // Weighted combination
-    // Weights: warm=40%, gradient=20%, smoothness=10%, DNN=30%
-    float combinedDistance = 
-        0.40 * warmDiff +
-        0.20 * (gradDiff / 50.0) +  // Normalize gradient to 0-1 range
-        0.10 * edgeDiff +
-        0.30 * dnnDist;
+    float dnnDist = (dnn1 && dnn2) ? normalized_cosine_distance(dnn1, dnn2, dnnDim) : 1.0f;
     
-    return combinedDistance;
+    return sunset_distance(features1, features2, dnnDist);
 }
 
-struct ImageFeatures {
-    string filename;
+// Hand-crafted scores of one database image, printed with the results
+struct SunsetScores {
+    int id;
     float warmScore;
     float gradient;
     float edgeDensity;
-    vector<float> dnnEmbedding;
-    float distance;
-    
-    bool operator<(const ImageFeatures &other) const {
-        return distance < other.distance;
-    }
 };
 
 int main(int argc, char *argv[]) {
     
+    // Pull out --threads and --stats before looking at the positional arguments
+    PipelineOptions pipelineOptions;
+    if(parse_pipeline_options(argc, argv, pipelineOptions) != 0 || parse_stats_options(argc, argv) != 0) {
+        return -1;
+    }
+    
+    bool compareExtractors = false;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--sunset-compare") == 0) {
+            compareExtractors = true;
+            for(int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+            break;
+        }
+    }
+    
     if(argc < 5) {
-        printf("Usage: %s <target_image> <image_directory> <csv_file> <num_matches>\n", argv[0]);
+        printf("Usage: %s <target_image> <image_directory> <feature_file> <num_matches> [--threads <n>] [--sunset-compare]\n", argv[0]);
+        printf("       [--stats] [--stats-json <file>]\n");
         printf("Example: %s images/pic.0365.jpg images data/ResNet18_olym.csv 10\n", argv[0]);
         return -1;
     }
     
     char *targetImagePath = argv[1];
     char *imageDir = argv[2];
-    char *csvFile = argv[3];
+    char *featureFile = argv[3];
     int numMatches = atoi(argv[4]);
     
-    // Load DNN embeddings
-    vector<char *> embeddingFilenames;
-    vector<vector<float>> embeddings;
+    // Load DNN embeddings (CSV file or memory-mapped feature store)
+    FeatureStore embeddings;
     
-    printf("Loading DNN embeddings from: %s\n", csvFile);
-    if(read_image_data_csv(csvFile, embeddingFilenames, embeddings, 0) != 0) {
-        printf("Error: Failed to read CSV file\n");
+    printf("Loading DNN embeddings from: %s\n", featureFile);
+    if(embeddings.load(featureFile) != 0) {
+        printf("Error: Failed to read feature file\n");
         return -1;
     }
     
@@ -233,105 +118,147 @@ int main(int argc, char *argv[]) {
     string targetFilename = targetPath.substr(targetPath.find_last_of("/\\") + 1);
     
     // Compute target features
-    float targetWarm = computeWarmColorScore(targetImage);
-    float targetGrad = computeVerticalGradient(targetImage);
-    float targetEdge = computeEdgeDensity(targetImage);
+    SunsetFeatures targetFeatures = computeSunsetFeatures(targetImage);
+    float targetWarm = targetFeatures.warmScore;
+    float targetGrad = targetFeatures.gradient;
+    float targetEdge = targetFeatures.edgeDensity;
     
     printf("Warm color score: %.4f\n", targetWarm);
     printf("Vertical gradient: %.2f\n", targetGrad);
     printf("Edge density: %.4f\n", targetEdge);
     
+    // Normalize the embeddings once, so each comparison is a dot product
+    EmbeddingMatrix normalized;
+    normalized.assign(embeddings.data(), embeddings.count(), embeddings.dim(), embeddings.stride(), embeddings.isNormalized());
+    int dnnDim = (int)normalized.dim();
+    
     // Find target DNN embedding
-    vector<float> targetDNN;
-    for(int i = 0; i < embeddingFilenames.size(); i++) {
-        if(strcmp(embeddingFilenames[i], targetFilename.c_str()) == 0) {
-            targetDNN = embeddings[i];
-            break;
-        }
+    const float *targetDNN = NULL;
+    long targetRow = embeddings.find(targetFilename.c_str());
+    if(targetRow >= 0) {
+        targetDNN = normalized.row(targetRow);
     }
-    
-    if(targetDNN.empty()) {
+    else {
         printf("Warning: DNN embedding not found for target, using zeros\n");
-        targetDNN.resize(512, 0.0);
     }
     
-    // Process all images
-    DIR *dirp = opendir(imageDir);
-    if(dirp == NULL) {
-        printf("Error: Cannot open directory %s\n", imageDir);
-        return -1;
-    }
+    // Process all images with the decode/feature pipeline
+    ImagePipeline pipeline(pipelineOptions);
+    vector<vector<SunsetScores>> workerScores(pipeline.featureWorkers());
+    vector<TopK> workerBest(pipeline.featureWorkers(), TopK(numMatches));
+    vector<TopK> workerWorst(pipeline.featureWorkers(), TopK(5));   // by negated distance
     
-    vector<ImageFeatures> results;
-    struct dirent *dp;
-    char buffer[512];
+    // --sunset-compare: the original three-pass features and timings
+    float targetThreePassEdge = compareExtractors ? computeEdgeDensity(targetImage) : 0.0f;
+    RankingComparison comparison(pipeline.featureWorkers());
+    vector<double> fusedSeconds(pipeline.featureWorkers(), 0.0);
+    vector<double> threePassSeconds(pipeline.featureWorkers(), 0.0);
+    
+    vector<string> extensions;
+    extensions.push_back(".jpg");
+    extensions.push_back(".png");
     
     printf("\n=== Processing Database Images ===\n");
     
-    while((dp = readdir(dirp)) != NULL) {
-        if(strstr(dp->d_name, ".jpg") || strstr(dp->d_name, ".png")) {
-            
-            strcpy(buffer, imageDir);
-            strcat(buffer, "/");
-            strcat(buffer, dp->d_name);
-            
-            Mat image = imread(buffer);
-            if(image.empty()) continue;
-            
-            // Compute features
-            ImageFeatures feat;
-            feat.filename = string(dp->d_name);
-            feat.warmScore = computeWarmColorScore(image);
-            feat.gradient = computeVerticalGradient(image);
-            feat.edgeDensity = computeEdgeDensity(image);
-            
-            // Get DNN embedding
-            for(int i = 0; i < embeddingFilenames.size(); i++) {
-                if(strcmp(embeddingFilenames[i], dp->d_name) == 0) {
-                    feat.dnnEmbedding = embeddings[i];
-                    break;
-                }
-            }
-            
-            if(feat.dnnEmbedding.empty()) {
-                feat.dnnEmbedding.resize(512, 0.0);
-            }
+    int result = pipeline.run(imageDir, extensions, [&](PipelineImage &item, int worker) {
+        // Compute features
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        StageTimer extractTimer(STATS_EXTRACT);
+        SunsetFeatures features = computeSunsetFeatures(item.image);
+        extractTimer.stop();
+        fusedSeconds[worker] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        
+        SunsetScores scores;
+        scores.id = item.id;
+        scores.warmScore = features.warmScore;
+        scores.gradient = features.gradient;
+        scores.edgeDensity = features.edgeDensity;
+        
+        // Get DNN embedding (hashed filename lookup)
+        StageTimer distanceTimer(STATS_DISTANCE);
+        long row = embeddings.find(item.filename);
+        const float *dnnEmbedding = row >= 0 ? normalized.row(row) : NULL;
+        
+        // Compute distance
+        float distance = computeSunsetDistance(
+            targetWarm, targetGrad, targetEdge, targetDNN,
+            scores.warmScore, scores.gradient, scores.edgeDensity, dnnEmbedding, dnnDim
+        );
+        distanceTimer.stop();
+        
+        if(compareExtractors) {
+            start = chrono::steady_clock::now();
+            float warm = computeWarmColorScore(item.image);
+            float grad = computeVerticalGradient(item.image);
+            float edge = computeEdgeDensity(item.image);
+            threePassSeconds[worker] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
             
-            // Compute distance
-            feat.distance = computeSunsetDistance(
-                targetWarm, targetGrad, targetEdge, targetDNN,
-                feat.warmScore, feat.gradient, feat.edgeDensity, feat.dnnEmbedding
+            float threePassDistance = computeSunsetDistance(
+                targetWarm, targetGrad, targetThreePassEdge, targetDNN,
+                warm, grad, edge, dnnEmbedding, dnnDim
             );
-            
-            results.push_back(feat);
+            comparison.add(worker, item.id, threePassDistance, distance);
         }
+        
+        workerScores[worker].push_back(scores);
+        workerBest[worker].push(item.id, distance);
+        workerWorst[worker].push(item.id, -distance);
+    });
+    if(result != 0) {
+        return -1;
     }
     
-    closedir(dirp);
-    
-    // Sort by distance
-    sort(results.begin(), results.end());
+    // Merge the per-thread results, indexing the scores by image id
+    vector<SunsetScores> scoresById(pipeline.fileCount());
+    int scoredCount = 0;
+    for(int w = 0; w < (int)workerScores.size(); w++) {
+        for(int i = 0; i < (int)workerScores[w].size(); i++) {
+            scoresById[workerScores[w][i].id] = workerScores[w][i];
+        }
+        scoredCount += (int)workerScores[w].size();
+    }
+    StageTimer sortTimer(STATS_SORT);
+    vector<ScoredId> best = merge_top_k(workerBest).sorted();
+    vector<ScoredId> worst = merge_top_k(workerWorst).sorted();
+    reverse(worst.begin(), worst.end());
+    sortTimer.stop();
     
     // Display top matches
     printf("\n=== Top %d Sunset Matches ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)results.size()); i++) {
+    for(int i = 0; i < (int)best.size(); i++) {
+        const SunsetScores &scores = scoresById[best[i].id];
         printf("%d. %s (dist: %.4f, warm: %.3f, grad: %.1f, edge: %.3f)\n", 
-               i+1, results[i].filename.c_str(), results[i].distance,
-               results[i].warmScore, results[i].gradient, results[i].edgeDensity);
+               i+1, pipeline.filename(best[i].id), best[i].distance,
+               scores.warmScore, scores.gradient, scores.edgeDensity);
     }
     
     // Display least similar (bottom 5)
     printf("\n=== Least Similar Images (Bottom 5) ===\n");
-    int start = max(0, (int)results.size() - 5);
-    for(int i = start; i < results.size(); i++) {
+    int start = scoredCount - (int)worst.size();
+    for(int i = 0; i < (int)worst.size(); i++) {
+        const SunsetScores &scores = scoresById[worst[i].id];
         printf("%d. %s (dist: %.4f, warm: %.3f, grad: %.1f, edge: %.3f)\n", 
-               i+1, results[i].filename.c_str(), results[i].distance,
-               results[i].warmScore, results[i].gradient, results[i].edgeDensity);
+               start + i + 1, pipeline.filename(worst[i].id), -worst[i].distance,
+               scores.warmScore, scores.gradient, scores.edgeDensity);
     }
     
-    // Clean up
-    for(int i = 0; i < embeddingFilenames.size(); i++) {
-        delete[] embeddingFilenames[i];
+    if(compareExtractors) {
+        double fused = 0.0, threePass = 0.0;
+        for(int w = 0; w < (int)fusedSeconds.size(); w++) {
+            fused += fusedSeconds[w];
+            threePass += threePassSeconds[w];
+        }
+        printf("\n=== Sunset feature extraction ===\n");
+        printf("Single pass: %.3f s, three passes: %.3f s (all workers)", fused, threePass);
+        if(fused > 0) {
+            printf(", %.2fx faster", threePass / fused);
+        }
+        printf("\n");
+        print_ranking_agreement("Single-pass vs three-pass features", comparison.compare(numMatches));
+    }
+    
+    if(report_stats("custom_sunset_match") != 0) {
+        return -1;
     }
     
     return 0;
@@ -1,178 +1,734 @@
 /*
   Deep Network Embedding Matching using ResNet18 features
   
-  Usage: deep_embedding_match <target_image> <csv_file> <num_matches>
+  The feature file can be a CSV file or a binary feature store created
+  with csv_to_store, which is memory-mapped instead of parsed.
+  
+  Any feature file written by build_index can be searched the same way;
+  --metric picks the distance: cosine (default, for embeddings), ssd, or
+  intersection (1 - histogram intersection, for histogram features).
+  All three score the whole file in blocks with the vectorized batch
+  kernels in distance_kernels.h; for cosine the embeddings are
+  normalized once after loading (or already are, in a store written
+  with csv_to_store --normalize), so scoring is a matrix-vector product.
+  
+  --queries reads a file of target image names (one per line) and scores
+  all of them in one pass over the feature file: each block of database
+  rows is scored against every query while it is in cache (for cosine a
+  block of the matrix-matrix product).  The top matches are printed per
+  query and are the same as for single queries.
+  --batch-compare also runs the queries one at a time, loading the
+  feature file for each as separate runs of the program would, and
+  reports the throughput of both.
+  
+  --hnsw searches an HNSW index built with build_hnsw instead of scanning
+  the whole file (cosine only).  --ef sets the candidate list size of the
+  search (default 64; larger is slower and more accurate) and --recall
+  also runs the exact search and reports recall@K and the time per query
+  of both.
+  
+  --quantized scans int8 or product-quantized codes written by
+  quantize_embeddings instead of the float embeddings (cosine only), 4x
+  to 32x less memory to read, and re-ranks the best --rerank candidates
+  (default max(10 * K, 100)) with the full-precision embeddings.  The
+  float embeddings are then only read for the queries and the candidates.
+  --recall compares the result with the exact search.
+  
+  --precision float16 or bfloat16 keeps the normalized embeddings of
+  the cosine scan in half precision, half the memory to read, and the
+  kernels widen them to floats as they go; a store written with
+  csv_to_store --dtype float16 or bfloat16 is scanned that way without
+  the option.  --recall also runs the float32 scan and reports recall@K
+  and the largest change in distance.
+  
+  --early-abandon scores ssd and intersection one query at a time and
+  stops evaluating a row as soon as it cannot make that query's top
+  matches (see early_abandon.h), largest query values first; it reports
+  the fraction of the distance work skipped per query.
+  
+  --stats and --stats-json <file> report the time spent loading,
+  scoring and sorting (see stage_stats.h).
+  
+  Usage: deep_embedding_match <target_image> <feature_file> <num_matches> [--metric <cosine|ssd|intersection>]
+                              [--early-abandon]
+         deep_embedding_match --queries <query_file> <feature_file> <num_matches> [--metric <cosine|ssd|intersection>]
+                              [--batch-compare]
+         deep_embedding_match <target_image> | --queries <query_file> <feature_file> <num_matches>
+                              --hnsw <index_file> [--ef <n>] [--recall]
+         deep_embedding_match <target_image> | --queries <query_file> <feature_file> <num_matches>
+                              --quantized <code_file> [--rerank <n>] [--recall]
+         deep_embedding_match <target_image> | --queries <query_file> <feature_file> <num_matches>
+                              [--precision <float32|float16|bfloat16>] [--recall]
 */
 
 #include <opencv2/opencv.hpp>
 #include <cstdio>
 #include <cstring>
+#include <string>
 #include <vector>
 #include <algorithm>
 #include <cmath>
-#include "csv_util.h"
+#include <chrono>
+#include "feature_store.h"
+#include "distance_kernels.h"
+#include "embedding_matrix.h"
+#include "hnsw_index.h"
+#include "quantized_embeddings.h"
+#include "top_k.h"
+#include "stage_stats.h"
+#include "early_abandon.h"
 
 using namespace cv;
 using namespace std;
 
-// Compute L2 norm (Euclidean length) of a vector
-float computeL2Norm(vector<float> &vec) {
-    float sum = 0.0;
-    for(int i = 0; i < vec.size(); i++) {
-        sum += vec[i] * vec[i];
-    }
-    return sqrt(sum);
-}
+enum Metric {
+    METRIC_COSINE,
+    METRIC_SSD,
+    METRIC_INTERSECTION
+};
+
+// Rows scored per batch kernel call for a single query
+#define SCORE_BLOCK_ROWS 1024
+
+// With several queries, database rows per block (small enough to stay in
+// cache while all queries are scored against it) and queries scored per
+// block before their top-K heaps are updated
+#define BATCH_BLOCK_ROWS 256
+#define QUERY_BLOCK 64
+
+// Default candidate list size of an HNSW search
+#define DEFAULT_EF_SEARCH 64
+
+// Candidates re-ranked after a quantized scan: at least this many, and at
+// least RERANK_FACTOR times the number of matches
+#define MIN_RERANK 100
+#define RERANK_FACTOR 10
 
-// Normalize vector by its L2 norm
-vector<float> normalizeVector(vector<float> &vec) {
-    vector<float> normalized;
-    float norm = computeL2Norm(vec);
+// Read the query names, one per line; blank lines and lines starting
+// with # are skipped and directories are stripped
+int readQueryFile(const char *filename, vector<string> &queries) {
+    FILE *fp = fopen(filename, "r");
+    if(!fp) {
+        printf("Unable to open query file %s\n", filename);
+        return -1;
+    }
     
-    if(norm > 0) {
-        for(int i = 0; i < vec.size(); i++) {
-            normalized.push_back(vec[i] / norm);
+    char line[1024];
+    while(fgets(line, sizeof(line), fp)) {
+        string name(line);
+        size_t end = name.find_last_not_of(" \t\r\n");
+        if(end == string::npos || name[0] == '#') {
+            continue;
         }
-    } else {
-        normalized = vec;
+        name = name.substr(0, end + 1);
+        name = name.substr(name.find_first_not_of(" \t"));
+        size_t slash = name.find_last_of("/\\");
+        if(slash != string::npos) {
+            name = name.substr(slash + 1);
+        }
+        queries.push_back(name);
     }
     
-    return normalized;
+    fclose(fp);
+    return 0;
 }
 
-// Compute dot product of two vectors
-float dotProduct(vector<float> &vec1, vector<float> &vec2) {
-    if(vec1.size() != vec2.size()) {
-        printf("Error: Vectors have different sizes!\n");
-        return 0.0;
-    }
+// Score the given rows of the feature file, as queries, against all
+// rows, keeping the best numMatches per query in best
+void scoreQueries(const FeatureStore &embeddings, const EmbeddingMatrix &normalized, Metric metric,
+                  const vector<int> &queryRows, int numMatches, vector<TopK> &best) {
+    int count = (int)embeddings.count();
+    int dim = (int)embeddings.dim();
+    int numQueries = (int)queryRows.size();
+    int blockRows = numQueries == 1 ? SCORE_BLOCK_ROWS : BATCH_BLOCK_ROWS;
+    const float *rows = embeddings.data();
+    size_t stride = embeddings.stride();
+    const DistanceKernelTable &kernels = distance_kernels();
     
-    float sum = 0.0;
-    for(int i = 0; i < vec1.size(); i++) {
-        sum += vec1[i] * vec2[i];
+    // The queries, next to each other (as floats, also when the rows are
+    // kept in half precision)
+    vector<float> queries((size_t)numQueries * dim);
+    for(int q = 0; q < numQueries; q++) {
+        if(metric == METRIC_COSINE) {
+            normalized.copyRow(queryRows[q], &queries[(size_t)q * dim]);
+        }
+        else {
+            memcpy(&queries[(size_t)q * dim], embeddings.row(queryRows[q]), dim * sizeof(float));
+        }
     }
     
-    return sum;
+    best.assign(numQueries, TopK(numMatches));
+    vector<float> scores((size_t)min(numQueries, QUERY_BLOCK) * blockRows);
+    
+    for(int start = 0; start < count; start += blockRows) {
+        int blockCount = min(blockRows, count - start);
+        const float *block = rows + (size_t)start * stride;
+    
+        for(int qStart = 0; qStart < numQueries; qStart += QUERY_BLOCK) {
+            int blockQueries = min(QUERY_BLOCK, numQueries - qStart);
+            const float *query = &queries[(size_t)qStart * dim];
+    
+            StageTimer distanceTimer(STATS_DISTANCE);
+            if(metric == METRIC_COSINE) {
+                normalized.cosineDistances(query, blockQueries, start, blockCount, &scores[0]);
+            }
+            else {
+                for(int q = 0; q < blockQueries; q++) {
+                    float *out = &scores[(size_t)q * blockCount];
+                    if(metric == METRIC_SSD) {
+                        kernels.squaredDistanceBatch(query + (size_t)q * dim, block, blockCount, dim, stride, out);
+                    }
+                    else {
+                        kernels.intersectionBatch(query + (size_t)q * dim, block, blockCount, dim, stride, out);
+                        for(int r = 0; r < blockCount; r++) {
+                            out[r] = 1.0f - out[r];
+                        }
+                    }
+                }
+            }
+            distanceTimer.stop();
+    
+            StageTimer sortTimer(STATS_SORT);
+            for(int q = 0; q < blockQueries; q++) {
+                const float *out = &scores[(size_t)q * blockCount];
+                for(int r = 0; r < blockCount; r++) {
+                    best[qStart + q].push(start + r, out[r]);
+                }
+            }
+        }
+    }
 }
 
-// Compute cosine distance: d = 1 - cos(theta)
-// where cos(theta) = dot product of normalized vectors
-float cosineDistance(vector<float> &vec1, vector<float> &vec2) {
-    // Normalize both vectors
-    vector<float> norm1 = normalizeVector(vec1);
-    vector<float> norm2 = normalizeVector(vec2);
+// Like scoreQueries for ssd and intersection, but one query at a time,
+// abandoning each row as soon as it cannot make the query's top matches
+// (see early_abandon.h); abandon receives the work counters per query
+void scoreQueriesEarlyAbandon(const FeatureStore &embeddings, Metric metric, const vector<int> &queryRows,
+                              int numMatches, vector<TopK> &best, vector<AbandonStats> &abandon) {
+    int count = (int)embeddings.count();
+    int numQueries = (int)queryRows.size();
+    EarlyAbandonMetric type = metric == METRIC_SSD ? ABANDON_SSD : ABANDON_INTERSECTION;
     
-    // Compute dot product (which is cos(theta) for normalized vectors)
-    float cosTheta = dotProduct(norm1, norm2);
+    best.assign(numQueries, TopK(numMatches));
+    abandon.assign(numQueries, AbandonStats());
+    for(int q = 0; q < numQueries; q++) {
+        EarlyAbandonDistance distance(embeddings.row(queryRows[q]), embeddings.dim(), type);
+        for(int start = 0; start < count; start += SCORE_BLOCK_ROWS) {
+            int end = min(start + SCORE_BLOCK_ROWS, count);
+            StageTimer distanceTimer(STATS_DISTANCE);
+            for(int r = start; r < end; r++) {
+                best[q].push(r, distance.distance(embeddings.row(r), best[q].threshold(), abandon[q]));
+            }
+        }
+    }
+}
+
+// Scan the quantized codes for the rerank closest candidates to one query
+// row, then keep the numMatches of them closest by full-precision cosine
+// distance
+void searchQuantized(const FeatureStore &embeddings, const QuantizedEmbeddings &codes, int queryRow,
+                     int numMatches, int rerank, vector<ScoredId> &matches) {
+    int count = (int)embeddings.count();
+    size_t dim = embeddings.dim();
+    vector<float> query(dim), candidate(dim), tables, scores(SCORE_BLOCK_ROWS);
+    normalize_embedding(embeddings.row(queryRow), dim, &query[0]);
+    codes.prepare(&query[0], tables);
     
-    // Clamp to [-1, 1] to avoid numerical issues
-    if(cosTheta > 1.0) cosTheta = 1.0;
-    if(cosTheta < -1.0) cosTheta = -1.0;
+    TopK candidates(rerank);
+    for(int start = 0; start < count; start += SCORE_BLOCK_ROWS) {
+        int blockCount = min(SCORE_BLOCK_ROWS, count - start);
+        StageTimer distanceTimer(STATS_DISTANCE);
+        codes.distances(tables, start, blockCount, &scores[0]);
+        distanceTimer.stop();
+        
+        StageTimer sortTimer(STATS_SORT);
+        for(int r = 0; r < blockCount; r++) {
+            candidates.push(start + r, scores[r]);
+        }
+    }
     
-    // Return distance
-    return 1.0 - cosTheta;
+    TopK best(numMatches);
+    vector<ScoredId> shortlist = candidates.sorted();
+    StageTimer rerankTimer(STATS_DISTANCE);
+    for(int i = 0; i < (int)shortlist.size(); i++) {
+        const float *row = embeddings.row(shortlist[i].id);
+        if(!embeddings.isNormalized()) {
+            normalize_embedding(row, dim, &candidate[0]);
+            row = &candidate[0];
+        }
+        best.push(shortlist[i].id, normalized_cosine_distance(&query[0], row, dim));
+    }
+    rerankTimer.stop();
+    matches = best.sorted();
 }
 
-// Compute sum of squared differences
-float sumSquaredDistance(vector<float> &vec1, vector<float> &vec2) {
-    if(vec1.size() != vec2.size()) {
-        printf("Error: Vectors have different sizes!\n");
-        return -1.0;
+// Load the feature file, normalizing it for cosine distance unless
+// normalize is false.  With halfScan the cosine scan keeps the rows in
+// half precision: those of a float16 or bfloat16 store as they are
+// (widened to floats as well only with keepFloats), and those of a
+// float file rounded to precision unless that is FS_DTYPE_FLOAT32.
+int loadEmbeddings(const char *featureFile, Metric metric, bool normalize, bool halfScan,
+                   FeatureStoreDType precision, bool keepFloats, FeatureStore &embeddings,
+                   EmbeddingMatrix &normalized) {
+    if(embeddings.load(featureFile, !halfScan || keepFloats) != 0) {
+        printf("Error: Failed to read feature file\n");
+        return -1;
     }
     
-    float ssd = 0.0;
-    for(int i = 0; i < vec1.size(); i++) {
-        float diff = vec1[i] - vec2[i];
-        ssd += diff * diff;
+    if(embeddings.count() == 0) {
+        printf("Error: Feature file %s is empty\n", featureFile);
+        return -1;
     }
     
-    return ssd;
+    if(metric == METRIC_COSINE && normalize && halfScan && embeddings.halfData() != NULL) {
+        normalized.assignHalf(embeddings.halfData(), embeddings.count(), embeddings.dim(), embeddings.dim(),
+                              embeddings.dtype(), embeddings.isNormalized());
+    }
+    else if(metric == METRIC_COSINE && normalize) {
+        normalized.setPrecision(halfScan ? precision : FS_DTYPE_FLOAT32);
+        normalized.assign(embeddings.data(), embeddings.count(), embeddings.dim(), embeddings.stride(), embeddings.isNormalized());
+    }
+    return 0;
 }
 
-// Structure to hold image filename and its distance from target
-struct ImageMatch {
-    string filename;
-    float distance;
+// Score one query with a fresh load of the feature file, as a separate
+// run of the program would
+int runSingleQuery(const char *featureFile, Metric metric, FeatureStoreDType precision, const char *queryName,
+                   int numMatches, vector<ScoredId> &matches) {
+    FeatureStore embeddings;
+    EmbeddingMatrix normalized;
+    if(loadEmbeddings(featureFile, metric, true, metric == METRIC_COSINE, precision, false, embeddings,
+                      normalized) != 0) {
+        return -1;
+    }
     
-    bool operator<(const ImageMatch &other) const {
-        return distance < other.distance;
+    vector<int> queryRows(1, (int)embeddings.find(queryName));
+    vector<TopK> best;
+    scoreQueries(embeddings, normalized, metric, queryRows, numMatches, best);
+    matches = best[0].sorted();
+    return 0;
+}
+
+void printMatches(const FeatureStore &embeddings, const vector<ScoredId> &matches) {
+    for(int i = 0; i < (int)matches.size(); i++) {
+        printf("%d. %s (distance: %.4f)\n", i+1, embeddings.name(matches[i].id), matches[i].distance);
     }
-};
+}
+
+// Print the matches of every query, with a heading per query in batch mode
+void printQueryMatches(const FeatureStore &embeddings, bool batch, const vector<string> &names,
+                       const vector<vector<ScoredId>> &matches, int numMatches, const char *title) {
+    for(int q = 0; q < (int)matches.size(); q++) {
+        if(batch) {
+            printf("\n=== Top %d matches for %s (%s) ===\n", numMatches, names[q].c_str(), title);
+        }
+        else {
+            printf("\n=== Top %d matches (Deep Network Embeddings - %s) ===\n", numMatches, title);
+        }
+        printMatches(embeddings, matches[q]);
+    }
+}
+
+// Fraction of the exact top matches that the approximate search found
+double recallAtK(const vector<ScoredId> &exact, const vector<ScoredId> &approximate) {
+    if(exact.empty()) {
+        return 1.0;
+    }
+    int hits = 0;
+    for(int i = 0; i < (int)exact.size(); i++) {
+        for(int j = 0; j < (int)approximate.size(); j++) {
+            if(approximate[j].id == exact[i].id) {
+                hits++;
+                break;
+            }
+        }
+    }
+    return (double)hits / exact.size();
+}
 
 int main(int argc, char *argv[]) {
     
+    // Pull out the options before looking at the positional arguments
+    if(parse_stats_options(argc, argv) != 0) {
+        return -1;
+    }
+    const char *metricName = "cosine";
+    const char *queryFile = NULL;
+    const char *hnswFile = NULL;
+    const char *quantizedFile = NULL;
+    const char *precisionName = NULL;
+    int efSearch = DEFAULT_EF_SEARCH;
+    int rerank = 0;
+    bool compareBatch = false;
+    bool reportRecall = false;
+    bool earlyAbandon = false;
+    for(int i = 1; i < argc; ) {
+        bool hasValue = strcmp(argv[i], "--metric") == 0 || strcmp(argv[i], "--queries") == 0 ||
+                        strcmp(argv[i], "--hnsw") == 0 || strcmp(argv[i], "--ef") == 0 ||
+                        strcmp(argv[i], "--quantized") == 0 || strcmp(argv[i], "--rerank") == 0 ||
+                        strcmp(argv[i], "--precision") == 0;
+        if(hasValue && i + 1 < argc) {
+            if(strcmp(argv[i], "--metric") == 0) {
+                metricName = argv[i + 1];
+            }
+            else if(strcmp(argv[i], "--queries") == 0) {
+                queryFile = argv[i + 1];
+            }
+            else if(strcmp(argv[i], "--hnsw") == 0) {
+                hnswFile = argv[i + 1];
+            }
+            else if(strcmp(argv[i], "--quantized") == 0) {
+                quantizedFile = argv[i + 1];
+            }
+            else if(strcmp(argv[i], "--rerank") == 0) {
+                rerank = atoi(argv[i + 1]);
+            }
+            else if(strcmp(argv[i], "--precision") == 0) {
+                precisionName = argv[i + 1];
+            }
+            else {
+                efSearch = atoi(argv[i + 1]);
+            }
+            for(int j = i; j < argc - 2; j++) {
+                argv[j] = argv[j + 2];
+            }
+            argc -= 2;
+        }
+        else if(strcmp(argv[i], "--batch-compare") == 0 || strcmp(argv[i], "--recall") == 0 ||
+                strcmp(argv[i], "--early-abandon") == 0) {
+            if(strcmp(argv[i], "--recall") == 0) {
+                reportRecall = true;
+            }
+            else if(strcmp(argv[i], "--early-abandon") == 0) {
+                earlyAbandon = true;
+            }
+            else {
+                compareBatch = true;
+            }
+            for(int j = i; j < argc - 1; j++) {
+                argv[j] = argv[j + 1];
+            }
+            argc--;
+        }
+        else {
+            i++;
+        }
+    }
+    
+    Metric metric;
+    if(strcmp(metricName, "cosine") == 0) {
+        metric = METRIC_COSINE;
+    }
+    else if(strcmp(metricName, "ssd") == 0) {
+        metric = METRIC_SSD;
+    }
+    else if(strcmp(metricName, "intersection") == 0) {
+        metric = METRIC_INTERSECTION;
+    }
+    else {
+        printf("Error: Unknown metric %s (use cosine, ssd or intersection)\n", metricName);
+        return -1;
+    }
+    
+    if(hnswFile && metric != METRIC_COSINE) {
+        printf("Error: --hnsw only supports the cosine metric\n");
+        return -1;
+    }
+    if(quantizedFile && (metric != METRIC_COSINE || hnswFile)) {
+        printf("Error: --quantized only supports the cosine metric and cannot be combined with --hnsw\n");
+        return -1;
+    }
+    FeatureStoreDType precision = FS_DTYPE_FLOAT32;
+    if(precisionName && parse_feature_dtype(precisionName, precision) != 0) {
+        printf("Error: Unknown precision %s (use float32, float16 or bfloat16)\n", precisionName);
+        return -1;
+    }
+    if(precisionName && (metric != METRIC_COSINE || hnswFile || quantizedFile)) {
+        printf("Error: --precision only supports the cosine metric without --hnsw or --quantized\n");
+        return -1;
+    }
+    if(earlyAbandon && metric == METRIC_COSINE) {
+        printf("Error: --early-abandon only supports the ssd and intersection metrics\n");
+        return -1;
+    }
+    
     // Check arguments
-    if(argc < 4) {
-        printf("Usage: %s <target_image_name> <csv_file> <num_matches>\n", argv[0]);
+    int positional = queryFile ? 3 : 4;
+    if(argc < positional) {
+        printf("Usage: %s <target_image_name> <feature_file> <num_matches> [--metric <cosine|ssd|intersection>]\n", argv[0]);
+        printf("       %s --queries <query_file> <feature_file> <num_matches> [--metric <cosine|ssd|intersection>] [--batch-compare]\n", argv[0]);
+        printf("       add --hnsw <index_file> [--ef <n>] [--recall] to search an HNSW index\n");
+        printf("       add --quantized <code_file> [--rerank <n>] [--recall] to scan quantized embeddings\n");
+        printf("       add --precision <float32|float16|bfloat16> [--recall] to scan cosine rows in half precision\n");
+        printf("       add --early-abandon to stop ssd and intersection distances that cannot make the top matches\n");
+        printf("       add --stats or --stats-json <file> for a per-stage timing report\n");
         printf("Example: %s pic.0893.jpg data/ResNet18_olym.csv 5\n", argv[0]);
         return -1;
     }
     
-    char *targetImageName = argv[1];
-    char *csvFile = argv[2];
-    int numMatches = atoi(argv[3]);
+    char *targetImageName = queryFile ? NULL : argv[1];
+    char *featureFile = argv[positional - 2];
+    int numMatches = atoi(argv[positional - 1]);
     
-    printf("Target image: %s\n", targetImageName);
-    printf("Loading embeddings from: %s\n", csvFile);
+    vector<string> queryNames;
+    if(queryFile) {
+        if(readQueryFile(queryFile, queryNames) != 0) {
+            return -1;
+        }
+        printf("Queries: %lu from %s\n", (unsigned long)queryNames.size(), queryFile);
+    }
+    else {
+        queryNames.push_back(targetImageName);
+        printf("Target image: %s\n", targetImageName);
+    }
+    printf("Loading embeddings from: %s\n", featureFile);
     
-    // Read CSV file with embeddings
-    vector<char *> filenames;
-    vector<vector<float>> embeddings;
+    chrono::steady_clock::time_point batchStart = chrono::steady_clock::now();
     
-    if(read_image_data_csv(csvFile, filenames, embeddings, 0) != 0) {
-        printf("Error: Failed to read CSV file\n");
+    // Read embeddings (CSV file or memory-mapped feature store); a
+    // quantized scan only needs the normalized copy for the exact search.
+    // The brute-force cosine scan keeps the rows of a half-precision store
+    // as they are, and those of a float file too with --precision; --recall
+    // also needs them as floats, for the float32 ranking.
+    FeatureStore embeddings;
+    EmbeddingMatrix normalized;
+    bool normalize = !quantizedFile || reportRecall;
+    bool halfScan = metric == METRIC_COSINE && !hnswFile && !quantizedFile;
+    if(loadEmbeddings(featureFile, metric, normalize, halfScan, precision, reportRecall, embeddings,
+                      normalized) != 0) {
         return -1;
     }
     
-    printf("Loaded %lu embeddings, each with %lu dimensions\n", 
-           embeddings.size(), embeddings[0].size());
+    printf("Loaded %lu embeddings, each with %lu dimensions\n",
+           (unsigned long)embeddings.count(), (unsigned long)embeddings.dim());
+    if(halfScan && normalized.precision() != FS_DTYPE_FLOAT32) {
+        double halfBytes = (double)normalized.count() * normalized.dim() * sizeof(uint16_t);
+        printf("Scanning %s rows: %.1f MB instead of %.1f MB\n", feature_dtype_name(normalized.precision()),
+               halfBytes / (1024.0 * 1024.0), 2 * halfBytes / (1024.0 * 1024.0));
+    }
     
-    // Find target image in the database
-    int targetIndex = -1;
-    for(int i = 0; i < filenames.size(); i++) {
-        if(strcmp(filenames[i], targetImageName) == 0) {
-            targetIndex = i;
-            break;
+    // Find the query images in the database
+    vector<int> queryRows;
+    vector<string> foundNames;
+    for(int q = 0; q < (int)queryNames.size(); q++) {
+        long row = embeddings.find(queryNames[q].c_str());
+        if(row < 0) {
+            if(!queryFile) {
+                printf("Error: Target image %s not found in feature file\n", queryNames[q].c_str());
+                return -1;
+            }
+            printf("Warning: Query image %s not found in feature file, skipping\n", queryNames[q].c_str());
+            continue;
         }
+        queryRows.push_back((int)row);
+        foundNames.push_back(queryNames[q]);
     }
     
-    if(targetIndex == -1) {
-        printf("Error: Target image %s not found in CSV file\n", targetImageName);
+    if(queryRows.empty()) {
+        printf("Error: None of the query images are in the feature file\n");
         return -1;
     }
     
-    printf("Found target image at index %d\n", targetIndex);
+    if(!queryFile) {
+        printf("Found target image at index %d\n", queryRows[0]);
+    }
     
-    vector<float> &targetEmbedding = embeddings[targetIndex];
+    const char *metricTitle = metric == METRIC_SSD ? "Sum of Squared Differences"
+                            : metric == METRIC_INTERSECTION ? "Histogram Intersection" : "Cosine Distance";
     
-    // Compute distances to all images
-    vector<ImageMatch> matches;
+    // Approximate search through the HNSW graph
+    if(hnswFile) {
+        HnswIndex index;
+        StageTimer loadTimer(STATS_LOAD);
+        if(index.load(hnswFile, embeddings, normalized) != 0) {
+            return -1;
+        }
+        loadTimer.stop();
+        printf("HNSW index: M = %d, efConstruction = %d, top level %d, efSearch = %d\n",
+               index.M(), index.efConstruction(), index.maxLevel(), efSearch);
+        
+        int numQueries = (int)queryRows.size();
+        vector<vector<ScoredId>> approximate(numQueries);
+        chrono::steady_clock::time_point searchStart = chrono::steady_clock::now();
+        for(int q = 0; q < numQueries; q++) {
+            StageTimer searchTimer(STATS_DISTANCE);
+            index.search(normalized.row(queryRows[q]), numMatches, efSearch, approximate[q]);
+        }
+        double searchSeconds = chrono::duration<double>(chrono::steady_clock::now() - searchStart).count();
+        
+        printQueryMatches(embeddings, queryFile != NULL, foundNames, approximate, numMatches, "HNSW Cosine Distance");
+        printf("\nHNSW search: %.3f ms per query\n", 1000.0 * searchSeconds / numQueries);
+        
+        if(reportRecall) {
+            vector<TopK> exactBest;
+            chrono::steady_clock::time_point exactStart = chrono::steady_clock::now();
+            scoreQueries(embeddings, normalized, metric, queryRows, numMatches, exactBest);
+            double exactSeconds = chrono::duration<double>(chrono::steady_clock::now() - exactStart).count();
+            
+            double recall = 0.0;
+            for(int q = 0; q < numQueries; q++) {
+                recall += recallAtK(exactBest[q].sorted(), approximate[q]);
+            }
+            printf("Exact search: %.3f ms per query\n", 1000.0 * exactSeconds / numQueries);
+            printf("Recall@%d: %.4f over %d queries\n", numMatches, recall / numQueries, numQueries);
+        }
+        return report_stats("deep_embedding_match") != 0 ? -1 : 0;
+    }
     
-    for(int i = 0; i < filenames.size(); i++) {
-        // Compute cosine distance
-        float distance = cosineDistance(targetEmbedding, embeddings[i]);
+    // Quantized scan with full-precision re-ranking
+    if(quantizedFile) {
+        QuantizedEmbeddings codes;
+        StageTimer loadTimer(STATS_LOAD);
+        if(codes.load(quantizedFile, embeddings) != 0) {
+            return -1;
+        }
+        loadTimer.stop();
+        if(rerank <= 0) {
+            rerank = max(RERANK_FACTOR * numMatches, MIN_RERANK);
+        }
+        rerank = max(rerank, numMatches);
         
-        // Alternative: use sum-squared distance
-        // float distance = sumSquaredDistance(targetEmbedding, embeddings[i]);
+        double codeBytes = (double)codes.count() * codes.codeSize();
+        stats_add_bytes(STATS_LOAD, (long long)codeBytes);
+        double floatBytes = (double)embeddings.count() * embeddings.dim() * sizeof(float);
+        if(codes.type() == QE_INT8) {
+            printf("Quantized embeddings: int8");
+        }
+        else {
+            printf("Quantized embeddings: PQ with %lu subspaces", (unsigned long)codes.codeSize());
+        }
+        printf(", %.1f MB instead of %.1f MB (%.1fx smaller), re-ranking %d candidates\n",
+               codeBytes / (1024.0 * 1024.0), floatBytes / (1024.0 * 1024.0), floatBytes / codeBytes, rerank);
+        
+        int numQueries = (int)queryRows.size();
+        vector<vector<ScoredId>> approximate(numQueries);
+        chrono::steady_clock::time_point searchStart = chrono::steady_clock::now();
+        for(int q = 0; q < numQueries; q++) {
+            searchQuantized(embeddings, codes, queryRows[q], numMatches, rerank, approximate[q]);
+        }
+        double searchSeconds = chrono::duration<double>(chrono::steady_clock::now() - searchStart).count();
+        
+        printQueryMatches(embeddings, queryFile != NULL, foundNames, approximate, numMatches,
+                          "Quantized Cosine Distance, re-ranked");
+        printf("\nQuantized search (%s kernels): %.3f ms per query\n", distance_kernels().name,
+               1000.0 * searchSeconds / numQueries);
         
-        ImageMatch match;
-        match.filename = string(filenames[i]);
-        match.distance = distance;
-        matches.push_back(match);
+        if(reportRecall) {
+            vector<TopK> exactBest;
+            chrono::steady_clock::time_point exactStart = chrono::steady_clock::now();
+            scoreQueries(embeddings, normalized, metric, queryRows, numMatches, exactBest);
+            double exactSeconds = chrono::duration<double>(chrono::steady_clock::now() - exactStart).count();
+            
+            double recall = 0.0;
+            for(int q = 0; q < numQueries; q++) {
+                recall += recallAtK(exactBest[q].sorted(), approximate[q]);
+            }
+            printf("Exact search: %.3f ms per query\n", 1000.0 * exactSeconds / numQueries);
+            printf("Recall@%d: %.4f over %d queries\n", numMatches, recall / numQueries, numQueries);
+        }
+        return report_stats("deep_embedding_match") != 0 ? -1 : 0;
     }
     
-    // Sort matches by distance (ascending)
-    sort(matches.begin(), matches.end());
+    // Compute distances to all images, keeping only the best numMatches
+    // per query
+    vector<TopK> best;
+    vector<AbandonStats> abandon;
+    chrono::steady_clock::time_point scoreStart = chrono::steady_clock::now();
+    if(earlyAbandon) {
+        scoreQueriesEarlyAbandon(embeddings, metric, queryRows, numMatches, best, abandon);
+    }
+    else {
+        scoreQueries(embeddings, normalized, metric, queryRows, numMatches, best);
+    }
+    chrono::steady_clock::time_point batchEnd = chrono::steady_clock::now();
+    printf("Scored with %s kernels\n", distance_kernels().name);
     
     // Display top N matches
-    printf("\n=== Top %d matches (Deep Network Embeddings - Cosine Distance) ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)matches.size()); i++) {
-        printf("%d. %s (distance: %.4f)\n", i+1, matches[i].filename.c_str(), matches[i].distance);
+    vector<vector<ScoredId>> matches(best.size());
+    StageTimer sortTimer(STATS_SORT);
+    for(int q = 0; q < (int)best.size(); q++) {
+        matches[q] = best[q].sorted();
     }
+    sortTimer.stop();
+    printQueryMatches(embeddings, queryFile != NULL, foundNames, matches, numMatches, metricTitle);
     
-    // Clean up
-    for(int i = 0; i < filenames.size(); i++) {
-        delete[] filenames[i];
+    // Work skipped by early abandoning, per query and in total
+    if(earlyAbandon) {
+        printf("\n");
+        AbandonStats abandonTotal;
+        for(int q = 0; q < (int)abandon.size(); q++) {
+            string label = "Early abandoning for " + foundNames[q];
+            print_abandon_stats(label.c_str(), abandon[q]);
+            abandonTotal.add(abandon[q]);
+        }
+        if(abandon.size() > 1) {
+            print_abandon_stats("Early abandoning, all queries", abandonTotal);
+        }
+        printf("Early abandoning scan: %.3f ms per query\n",
+               1000.0 * chrono::duration<double>(batchEnd - scoreStart).count() / abandon.size());
+    }
+    
+    // Compare the half-precision ranking with the float32 one
+    if(reportRecall && halfScan && normalized.precision() != FS_DTYPE_FLOAT32) {
+        EmbeddingMatrix floats;
+        floats.assign(embeddings.data(), embeddings.count(), embeddings.dim(), embeddings.stride(),
+                      embeddings.isNormalized());
+        vector<TopK> exactBest;
+        chrono::steady_clock::time_point exactStart = chrono::steady_clock::now();
+        scoreQueries(embeddings, floats, metric, queryRows, numMatches, exactBest);
+        double exactSeconds = chrono::duration<double>(chrono::steady_clock::now() - exactStart).count();
+        double halfSeconds = chrono::duration<double>(batchEnd - scoreStart).count();
+        
+        int numQueries = (int)queryRows.size();
+        double recall = 0.0;
+        float maxDifference = 0.0f;
+        for(int q = 0; q < numQueries; q++) {
+            vector<ScoredId> exact = exactBest[q].sorted();
+            recall += recallAtK(exact, matches[q]);
+            for(int i = 0; i < (int)exact.size() && i < (int)matches[q].size(); i++) {
+                maxDifference = max(maxDifference, fabs(exact[i].distance - matches[q][i].distance));
+            }
+        }
+        printf("\n%s scan: %.3f ms per query, float32 scan: %.3f ms per query\n",
+               feature_dtype_name(normalized.precision()), 1000.0 * halfSeconds / numQueries,
+               1000.0 * exactSeconds / numQueries);
+        printf("Recall@%d against float32: %.4f over %d queries, largest distance difference at a rank %g\n",
+               numMatches, recall / numQueries, numQueries, maxDifference);
+    }
+    
+    if(queryFile && compareBatch) {
+        double batchSeconds = chrono::duration<double>(batchEnd - batchStart).count();
+        double scoreSeconds = chrono::duration<double>(batchEnd - scoreStart).count();
+    
+        printf("\n=== Running the queries one at a time ===\n");
+        chrono::steady_clock::time_point loopStart = chrono::steady_clock::now();
+        int identical = 0;
+        for(int q = 0; q < (int)foundNames.size(); q++) {
+            vector<ScoredId> single;
+            if(runSingleQuery(featureFile, metric, precision, foundNames[q].c_str(), numMatches, single) != 0) {
+                return -1;
+            }
+            bool same = single.size() == matches[q].size();
+            for(int i = 0; same && i < (int)single.size(); i++) {
+                same = single[i].id == matches[q][i].id;
+            }
+            identical += same;
+        }
+        double loopSeconds = chrono::duration<double>(chrono::steady_clock::now() - loopStart).count();
+    
+        int numQueries = (int)foundNames.size();
+        printf("\n=== Batch query throughput ===\n");
+        printf("One at a time: %.3f s (%.1f queries/s)\n", loopSeconds, numQueries / loopSeconds);
+        printf("Batch: %.3f s (%.1f queries/s), of which scoring %.3f s",
+               batchSeconds, numQueries / batchSeconds, scoreSeconds);
+        if(batchSeconds > 0) {
+            printf(", %.2fx faster", loopSeconds / batchSeconds);
+        }
+        printf("\n");
+        printf("Identical top %d for %d of %d queries\n", numMatches, identical, numQueries);
+    }
+    
+    if(report_stats("deep_embedding_match") != 0) {
+        return -1;
     }
     
     return 0;
@@ -0,0 +1,199 @@
+/*
+  Scalar distance kernels and the runtime CPU dispatcher.
+*/
+
+#include <cstring>
+#include <algorithm>
+#include "distance_kernels.h"
+#include "half_float.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static float scalarIntersection(const float *a, const float *b, size_t dim) {
+    float sum = 0.0;
+    for(size_t i = 0; i < dim; i++) {
+        sum += min(a[i], b[i]);
+    }
+    return sum;
+}
+
+static float scalarSquaredDistance(const float *a, const float *b, size_t dim) {
+    float sum = 0.0;
+    for(size_t i = 0; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static float scalarDot(const float *a, const float *b, size_t dim) {
+    float sum = 0.0;
+    for(size_t i = 0; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static void scalarIntersectionBatch(const float *query, const float *rows, size_t count,
+                                    size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = scalarIntersection(query, rows + r * stride, dim);
+    }
+}
+
+static void scalarSquaredDistanceBatch(const float *query, const float *rows, size_t count,
+                                       size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = scalarSquaredDistance(query, rows + r * stride, dim);
+    }
+}
+
+static void scalarDotBatch(const float *query, const float *rows, size_t count,
+                           size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = scalarDot(query, rows + r * stride, dim);
+    }
+}
+
+static void scalarCodeDotBatch(const float *query, const unsigned char *codes, size_t count,
+                               size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        float sum = 0.0;
+        for(size_t i = 0; i < dim; i++) {
+            sum += query[i] * row[i];
+        }
+        out[r] = sum;
+    }
+}
+
+static void scalarLookupSumBatch(const float *tables, const unsigned char *codes, size_t count,
+                                 size_t subspaces, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        float sum = 0.0;
+        for(size_t j = 0; j < subspaces; j++) {
+            sum += tables[j * 256 + row[j]];
+        }
+        out[r] = sum;
+    }
+}
+
+static void scalarHalfDotBatch(const float *query, const uint16_t *rows, size_t count,
+                               size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const uint16_t *row = rows + r * stride;
+        float sum = 0.0;
+        for(size_t i = 0; i < dim; i++) {
+            sum += query[i] * half_to_float(row[i]);
+        }
+        out[r] = sum;
+    }
+}
+
+static void scalarBfloat16DotBatch(const float *query, const uint16_t *rows, size_t count,
+                                   size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const uint16_t *row = rows + r * stride;
+        float sum = 0.0;
+        for(size_t i = 0; i < dim; i++) {
+            sum += query[i] * bfloat16_to_float(row[i]);
+        }
+        out[r] = sum;
+    }
+}
+
+static const DistanceKernelTable scalarKernels = {
+    "scalar",
+    scalarIntersection,
+    scalarSquaredDistance,
+    scalarDot,
+    scalarIntersectionBatch,
+    scalarSquaredDistanceBatch,
+    scalarDotBatch,
+    scalarCodeDotBatch,
+    scalarLookupSumBatch,
+    scalarHalfDotBatch,
+    scalarBfloat16DotBatch
+};
+
+const DistanceKernelTable *scalar_distance_kernels() {
+    return &scalarKernels;
+}
+
+// CPU feature checks (including OS support for the wider registers)
+static bool cpuHasAvx2() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    bool f16c = (info[2] & (1 << 29)) != 0;
+    if(!osxsave || !fma || !f16c || (_xgetbv(0) & 0x6) != 0x6) {
+        return false;
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+static bool cpuHasAvx512() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __builtin_cpu_supports("avx512f");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    if(!cpuHasAvx2() || (_xgetbv(0) & 0xE6) != 0xE6) {
+        return false;
+    }
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 16)) != 0;
+#else
+    return false;
+#endif
+}
+
+static const DistanceKernelTable *bestKernels() {
+    if(avx512_distance_kernels() != NULL && cpuHasAvx512()) {
+        return avx512_distance_kernels();
+    }
+    if(avx2_distance_kernels() != NULL && cpuHasAvx2()) {
+        return avx2_distance_kernels();
+    }
+    return &scalarKernels;
+}
+
+static const DistanceKernelTable *selectedKernels = NULL;
+
+const DistanceKernelTable &distance_kernels() {
+    // function-local static: initialized once, thread-safe in C++11
+    static const DistanceKernelTable *best = bestKernels();
+    return selectedKernels != NULL ? *selectedKernels : *best;
+}
+
+int select_distance_kernels(const char *name) {
+    const DistanceKernelTable *table = NULL;
+    if(strcmp(name, "scalar") == 0) {
+        table = &scalarKernels;
+    }
+    else if(strcmp(name, "avx2") == 0 && cpuHasAvx2()) {
+        table = avx2_distance_kernels();
+    }
+    else if(strcmp(name, "avx512") == 0 && cpuHasAvx512()) {
+        table = avx512_distance_kernels();
+    }
+
+    if(table == NULL) {
+        return -1;
+    }
+    selectedKernels = table;
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+  Vectorized distance kernels
+
+  Histogram intersection (sum of bin-wise minimums), sum of squared
+  differences and dot product, for one pair of vectors or for one query
+  against a block of database vectors stored row by row.  The batch
+  forms score a whole feature file in one call and stay close to memory
+  bandwidth for 512-bin histograms and embeddings.  Two more batch
+  kernels score 8-bit quantized embeddings (quantized_embeddings.h), and
+  two score float16 and bfloat16 embeddings (half_float.h), widening
+  them to floats in registers (with F16C and shifts) so that only half
+  the bytes are read from memory.
+
+  There are AVX-512, AVX2 and scalar versions.  The best one the CPU
+  supports is picked on first use; the AVX2 and AVX-512 versions are
+  only available when the compiler accepted the matching flags (see
+  CMakeLists.txt).  The vector versions add the terms in a different
+  order than the scalar loop, so sums can differ in the last bits.
+ */
+
+#ifndef DISTANCE_KERNELS_H
+#define DISTANCE_KERNELS_H
+
+#include <cstddef>
+#include <stdint.h>
+
+/*
+  One implementation of the kernels.  In the batch forms row i of the
+  block starts at rows + i * stride (stride >= dim, in floats) and its
+  result is written to out[i].
+ */
+struct DistanceKernelTable {
+    const char *name;
+
+    float (*intersection)( const float *a, const float *b, size_t dim );
+    float (*squaredDistance)( const float *a, const float *b, size_t dim );
+    float (*dot)( const float *a, const float *b, size_t dim );
+
+    void (*intersectionBatch)( const float *query, const float *rows, size_t count,
+                               size_t dim, size_t stride, float *out );
+    void (*squaredDistanceBatch)( const float *query, const float *rows, size_t count,
+                                  size_t dim, size_t stride, float *out );
+    void (*dotBatch)( const float *query, const float *rows, size_t count,
+                      size_t dim, size_t stride, float *out );
+
+    // Quantized rows (stride in bytes): out[i] is the dot product of the
+    // query with the dim 8-bit codes of row i
+    void (*codeDotBatch)( const float *query, const unsigned char *codes, size_t count,
+                          size_t dim, size_t stride, float *out );
+
+    // Product-quantization lookup (stride in bytes): out[i] is the sum of
+    // tables[j * 256 + code j of row i] over the subspaces j
+    void (*lookupSumBatch)( const float *tables, const unsigned char *codes, size_t count,
+                            size_t subspaces, size_t stride, float *out );
+
+    // Half-precision rows (stride in 16-bit values): out[i] is the dot
+    // product of the query with row i widened to floats
+    void (*halfDotBatch)( const float *query, const uint16_t *rows, size_t count,
+                          size_t dim, size_t stride, float *out );
+    void (*bfloat16DotBatch)( const float *query, const uint16_t *rows, size_t count,
+                              size_t dim, size_t stride, float *out );
+};
+
+/*
+  The kernels in use: the fastest supported by this CPU unless another
+  set was chosen with select_distance_kernels.
+ */
+const DistanceKernelTable &distance_kernels();
+
+/*
+  Chooses the kernels by name ("avx512", "avx2" or "scalar").  Returns a
+  non-zero value, leaving the selection unchanged, if that set is not
+  compiled in or not supported by the CPU.  Not thread-safe; call it
+  before scoring starts.
+ */
+int select_distance_kernels( const char *name );
+
+/*
+  Per-ISA tables, NULL when the compiler did not build that version.
+ */
+const DistanceKernelTable *scalar_distance_kernels();
+const DistanceKernelTable *avx2_distance_kernels();
+const DistanceKernelTable *avx512_distance_kernels();
+
+#endif
@@ -0,0 +1,243 @@
+/*
+  AVX2 distance kernels.  Built with -mavx2 -mfma -mf16c; without them
+  this file compiles to a stub that reports the kernels as unavailable.
+*/
+
+#include <algorithm>
+#include "distance_kernels.h"
+#include "half_float.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+using namespace std;
+
+static inline float horizontalSum(__m256 v) {
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+    return _mm_cvtss_f32(sum);
+}
+
+static inline __m256 multiplyAdd(__m256 a, __m256 b, __m256 c) {
+#if defined(__FMA__)
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+
+// Two independent accumulators of 8 lanes hide the add latency
+static inline float avx2Intersection(const float *a, const float *b, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 16 <= dim; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_min_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        acc1 = _mm256_add_ps(acc1, _mm256_min_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8)));
+    }
+    if(i + 8 <= dim) {
+        acc0 = _mm256_add_ps(acc0, _mm256_min_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+        i += 8;
+    }
+    float sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+    for(; i < dim; i++) {
+        sum += min(a[i], b[i]);
+    }
+    return sum;
+}
+
+static inline float avx2SquaredDistance(const float *a, const float *b, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 16 <= dim; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = multiplyAdd(d0, d0, acc0);
+        acc1 = multiplyAdd(d1, d1, acc1);
+    }
+    if(i + 8 <= dim) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = multiplyAdd(d0, d0, acc0);
+        i += 8;
+    }
+    float sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+    for(; i < dim; i++) {
+        float diff = a[i] - b[i];
+        sum += diff * diff;
+    }
+    return sum;
+}
+
+static inline float avx2Dot(const float *a, const float *b, size_t dim) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 16 <= dim; i += 16) {
+        acc0 = multiplyAdd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = multiplyAdd(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    if(i + 8 <= dim) {
+        acc0 = multiplyAdd(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        i += 8;
+    }
+    float sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+    for(; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+static float avx2IntersectionPair(const float *a, const float *b, size_t dim) {
+    return avx2Intersection(a, b, dim);
+}
+
+static float avx2SquaredDistancePair(const float *a, const float *b, size_t dim) {
+    return avx2SquaredDistance(a, b, dim);
+}
+
+static float avx2DotPair(const float *a, const float *b, size_t dim) {
+    return avx2Dot(a, b, dim);
+}
+
+static void avx2IntersectionBatch(const float *query, const float *rows, size_t count,
+                                  size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx2Intersection(query, rows + r * stride, dim);
+    }
+}
+
+static void avx2SquaredDistanceBatch(const float *query, const float *rows, size_t count,
+                                     size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx2SquaredDistance(query, rows + r * stride, dim);
+    }
+}
+
+static void avx2DotBatch(const float *query, const float *rows, size_t count,
+                         size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx2Dot(query, rows + r * stride, dim);
+    }
+}
+
+// Eight 8-bit codes widened to floats
+static inline __m256 loadCodes(const unsigned char *p) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p)));
+}
+
+static void avx2CodeDotBatch(const float *query, const unsigned char *codes, size_t count,
+                             size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for(; i + 16 <= dim; i += 16) {
+            acc0 = multiplyAdd(_mm256_loadu_ps(query + i), loadCodes(row + i), acc0);
+            acc1 = multiplyAdd(_mm256_loadu_ps(query + i + 8), loadCodes(row + i + 8), acc1);
+        }
+        if(i + 8 <= dim) {
+            acc0 = multiplyAdd(_mm256_loadu_ps(query + i), loadCodes(row + i), acc0);
+            i += 8;
+        }
+        float sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+        for(; i < dim; i++) {
+            sum += query[i] * row[i];
+        }
+        out[r] = sum;
+    }
+}
+
+// Eight table lookups per gather: lane k reads table j + k at the code
+static void avx2LookupSumBatch(const float *tables, const unsigned char *codes, size_t count,
+                               size_t subspaces, size_t stride, float *out) {
+    const __m256i tableOffsets = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        __m256 acc = _mm256_setzero_ps();
+        size_t j = 0;
+        for(; j + 8 <= subspaces; j += 8) {
+            __m256i index = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(row + j))),
+                                             tableOffsets);
+            acc = _mm256_add_ps(acc, _mm256_i32gather_ps(tables + j * 256, index, 4));
+        }
+        float sum = horizontalSum(acc);
+        for(; j < subspaces; j++) {
+            sum += tables[j * 256 + row[j]];
+        }
+        out[r] = sum;
+    }
+}
+
+// Eight 16-bit values widened to floats: float16 with F16C, bfloat16 by
+// moving it to the upper half of a float
+static inline __m256 loadHalf(const uint16_t *p) {
+    return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)p));
+}
+
+static inline __m256 loadBfloat16(const uint16_t *p) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)), 16));
+}
+
+template <__m256 (*load)(const uint16_t *), float (*widen)(uint16_t)>
+static void avx2WidenDotBatch(const float *query, const uint16_t *rows, size_t count,
+                              size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const uint16_t *row = rows + r * stride;
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        size_t i = 0;
+        for(; i + 16 <= dim; i += 16) {
+            acc0 = multiplyAdd(_mm256_loadu_ps(query + i), load(row + i), acc0);
+            acc1 = multiplyAdd(_mm256_loadu_ps(query + i + 8), load(row + i + 8), acc1);
+        }
+        if(i + 8 <= dim) {
+            acc0 = multiplyAdd(_mm256_loadu_ps(query + i), load(row + i), acc0);
+            i += 8;
+        }
+        float sum = horizontalSum(_mm256_add_ps(acc0, acc1));
+        for(; i < dim; i++) {
+            sum += query[i] * widen(row[i]);
+        }
+        out[r] = sum;
+    }
+}
+
+static void avx2HalfDotBatch(const float *query, const uint16_t *rows, size_t count,
+                             size_t dim, size_t stride, float *out) {
+    avx2WidenDotBatch<loadHalf, half_to_float>(query, rows, count, dim, stride, out);
+}
+
+static void avx2Bfloat16DotBatch(const float *query, const uint16_t *rows, size_t count,
+                                 size_t dim, size_t stride, float *out) {
+    avx2WidenDotBatch<loadBfloat16, bfloat16_to_float>(query, rows, count, dim, stride, out);
+}
+
+static const DistanceKernelTable avx2Kernels = {
+    "avx2",
+    avx2IntersectionPair,
+    avx2SquaredDistancePair,
+    avx2DotPair,
+    avx2IntersectionBatch,
+    avx2SquaredDistanceBatch,
+    avx2DotBatch,
+    avx2CodeDotBatch,
+    avx2LookupSumBatch,
+    avx2HalfDotBatch,
+    avx2Bfloat16DotBatch
+};
+
+const DistanceKernelTable *avx2_distance_kernels() {
+    return &avx2Kernels;
+}
+
+#else
+
+const DistanceKernelTable *avx2_distance_kernels() {
+    return NULL;
+}
+
+#endif
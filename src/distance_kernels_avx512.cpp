@@ -0,0 +1,235 @@
+/*
+  AVX-512 distance kernels.  Built with -mavx512f; without it this file
+  compiles to a stub that reports the kernels as unavailable.
+*/
+
+#include "distance_kernels.h"
+#include "half_float.h"
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+// Mask covering the last dim % 16 floats
+static inline __mmask16 tailMask(size_t remaining) {
+    return (__mmask16)((1u << remaining) - 1);
+}
+
+// Two independent accumulators of 16 lanes; the tail uses masked loads,
+// so there is no scalar remainder loop
+static inline float avx512Intersection(const float *a, const float *b, size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for(; i + 32 <= dim; i += 32) {
+        acc0 = _mm512_add_ps(acc0, _mm512_min_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+        acc1 = _mm512_add_ps(acc1, _mm512_min_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16)));
+    }
+    if(i + 16 <= dim) {
+        acc0 = _mm512_add_ps(acc0, _mm512_min_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)));
+        i += 16;
+    }
+    if(i < dim) {
+        __mmask16 mask = tailMask(dim - i);
+        acc1 = _mm512_add_ps(acc1, _mm512_min_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                                                  _mm512_maskz_loadu_ps(mask, b + i)));
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+static inline float avx512SquaredDistance(const float *a, const float *b, size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for(; i + 32 <= dim; i += 32) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    if(i + 16 <= dim) {
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc0 = _mm512_fmadd_ps(d0, d0, acc0);
+        i += 16;
+    }
+    if(i < dim) {
+        __mmask16 mask = tailMask(dim - i);
+        __m512 d1 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i));
+        acc1 = _mm512_fmadd_ps(d1, d1, acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+static inline float avx512Dot(const float *a, const float *b, size_t dim) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+    size_t i = 0;
+    for(; i + 32 <= dim; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    if(i + 16 <= dim) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        i += 16;
+    }
+    if(i < dim) {
+        __mmask16 mask = tailMask(dim - i);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i), _mm512_maskz_loadu_ps(mask, b + i), acc1);
+    }
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+static float avx512IntersectionPair(const float *a, const float *b, size_t dim) {
+    return avx512Intersection(a, b, dim);
+}
+
+static float avx512SquaredDistancePair(const float *a, const float *b, size_t dim) {
+    return avx512SquaredDistance(a, b, dim);
+}
+
+static float avx512DotPair(const float *a, const float *b, size_t dim) {
+    return avx512Dot(a, b, dim);
+}
+
+static void avx512IntersectionBatch(const float *query, const float *rows, size_t count,
+                                    size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx512Intersection(query, rows + r * stride, dim);
+    }
+}
+
+static void avx512SquaredDistanceBatch(const float *query, const float *rows, size_t count,
+                                       size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx512SquaredDistance(query, rows + r * stride, dim);
+    }
+}
+
+static void avx512DotBatch(const float *query, const float *rows, size_t count,
+                           size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        out[r] = avx512Dot(query, rows + r * stride, dim);
+    }
+}
+
+// Sixteen 8-bit codes widened to floats
+static inline __m512 loadCodes(const unsigned char *p) {
+    return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+// Byte-granular masked loads need AVX-512BW, so the tails are scalar
+static void avx512CodeDotBatch(const float *query, const unsigned char *codes, size_t count,
+                               size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        size_t i = 0;
+        for(; i + 32 <= dim; i += 32) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), loadCodes(row + i), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i + 16), loadCodes(row + i + 16), acc1);
+        }
+        if(i + 16 <= dim) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), loadCodes(row + i), acc0);
+            i += 16;
+        }
+        float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+        for(; i < dim; i++) {
+            sum += query[i] * row[i];
+        }
+        out[r] = sum;
+    }
+}
+
+// Sixteen table lookups per gather: lane k reads table j + k at the code
+static void avx512LookupSumBatch(const float *tables, const unsigned char *codes, size_t count,
+                                 size_t subspaces, size_t stride, float *out) {
+    const __m512i tableOffsets = _mm512_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792,
+                                                   2048, 2304, 2560, 2816, 3072, 3328, 3584, 3840);
+    for(size_t r = 0; r < count; r++) {
+        const unsigned char *row = codes + r * stride;
+        __m512 acc = _mm512_setzero_ps();
+        size_t j = 0;
+        for(; j + 16 <= subspaces; j += 16) {
+            __m512i index = _mm512_add_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(row + j))),
+                                             tableOffsets);
+            acc = _mm512_add_ps(acc, _mm512_i32gather_ps(index, tables + j * 256, 4));
+        }
+        float sum = _mm512_reduce_add_ps(acc);
+        for(; j < subspaces; j++) {
+            sum += tables[j * 256 + row[j]];
+        }
+        out[r] = sum;
+    }
+}
+
+// Sixteen 16-bit values widened to floats: float16 with the AVX-512F
+// conversion, bfloat16 by moving it to the upper half of a float
+static inline __m512 loadHalf(const uint16_t *p) {
+    return _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)p));
+}
+
+static inline __m512 loadBfloat16(const uint16_t *p) {
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)p)), 16));
+}
+
+// 16-bit masked loads need AVX-512BW, so the tails are scalar
+template <__m512 (*load)(const uint16_t *), float (*widen)(uint16_t)>
+static void avx512WidenDotBatch(const float *query, const uint16_t *rows, size_t count,
+                                size_t dim, size_t stride, float *out) {
+    for(size_t r = 0; r < count; r++) {
+        const uint16_t *row = rows + r * stride;
+        __m512 acc0 = _mm512_setzero_ps();
+        __m512 acc1 = _mm512_setzero_ps();
+        size_t i = 0;
+        for(; i + 32 <= dim; i += 32) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), load(row + i), acc0);
+            acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i + 16), load(row + i + 16), acc1);
+        }
+        if(i + 16 <= dim) {
+            acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(query + i), load(row + i), acc0);
+            i += 16;
+        }
+        float sum = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+        for(; i < dim; i++) {
+            sum += query[i] * widen(row[i]);
+        }
+        out[r] = sum;
+    }
+}
+
+static void avx512HalfDotBatch(const float *query, const uint16_t *rows, size_t count,
+                               size_t dim, size_t stride, float *out) {
+    avx512WidenDotBatch<loadHalf, half_to_float>(query, rows, count, dim, stride, out);
+}
+
+static void avx512Bfloat16DotBatch(const float *query, const uint16_t *rows, size_t count,
+                                   size_t dim, size_t stride, float *out) {
+    avx512WidenDotBatch<loadBfloat16, bfloat16_to_float>(query, rows, count, dim, stride, out);
+}
+
+static const DistanceKernelTable avx512Kernels = {
+    "avx512",
+    avx512IntersectionPair,
+    avx512SquaredDistancePair,
+    avx512DotPair,
+    avx512IntersectionBatch,
+    avx512SquaredDistanceBatch,
+    avx512DotBatch,
+    avx512CodeDotBatch,
+    avx512LookupSumBatch,
+    avx512HalfDotBatch,
+    avx512Bfloat16DotBatch
+};
+
+const DistanceKernelTable *avx512_distance_kernels() {
+    return &avx512Kernels;
+}
+
+#else
+
+const DistanceKernelTable *avx512_distance_kernels() {
+    return NULL;
+}
+
+#endif
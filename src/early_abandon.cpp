@@ -0,0 +1,131 @@
+/*
+  Early-abandoning distance evaluation.  See early_abandon.h.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+#include "early_abandon.h"
+#include "distance_kernels.h"
+
+using namespace std;
+
+// Margin on the intersection bound for the rounding of the float sums,
+// so that a dropped row is never one whose summed distance would have
+// come out at or below the threshold
+#define INTERSECTION_SLACK 1e-5f
+
+void AbandonStats::add(const AbandonStats &other) {
+    rows += other.rows;
+    abandoned += other.abandoned;
+    dims += other.dims;
+    dimsRead += other.dimsRead;
+}
+
+double AbandonStats::skippedFraction() const {
+    return dims > 0 ? 1.0 - (double)dimsRead / dims : 0.0;
+}
+
+EarlyAbandonDistance::EarlyAbandonDistance() : type(ABANDON_SSD) {
+}
+
+EarlyAbandonDistance::EarlyAbandonDistance(const float *target, size_t dim, EarlyAbandonMetric metric) {
+    setTarget(target, dim, metric);
+}
+
+void EarlyAbandonDistance::setTarget(const float *target, size_t dim, EarlyAbandonMetric metric) {
+    targetValues.assign(target, target + dim);
+    type = metric;
+
+    // Blocks of the target, largest magnitude first
+    vector<pair<double, size_t>> weights;
+    for(size_t start = 0; start < dim; start += EARLY_ABANDON_BLOCK) {
+        size_t end = min(dim, start + EARLY_ABANDON_BLOCK);
+        double weight = 0.0;
+        for(size_t i = start; i < end; i++) {
+            weight += fabs(target[i]);
+        }
+        weights.push_back(make_pair(-weight, start));
+    }
+    sort(weights.begin(), weights.end());
+
+    order.resize(weights.size());
+    for(size_t b = 0; b < weights.size(); b++) {
+        order[b].start = weights[b].second;
+        order[b].length = min(dim, order[b].start + EARLY_ABANDON_BLOCK) - order[b].start;
+    }
+
+    // Target mass still to come after each block, for the intersection
+    // bound; min(target, row) never adds more than the target value
+    remainingMass.assign(order.size() + 1, 0.0f);
+    double mass = 0.0;
+    for(size_t b = order.size(); b-- > 0; ) {
+        for(size_t i = order[b].start; i < order[b].start + order[b].length; i++) {
+            mass += max(target[i], 0.0f);
+        }
+        remainingMass[b] = (float)mass;
+    }
+}
+
+float EarlyAbandonDistance::distance(const float *row, float bound, AbandonStats &stats) const {
+    const DistanceKernelTable &kernels = distance_kernels();
+    const float *target = targetValues.empty() ? NULL : &targetValues[0];
+    stats.rows++;
+    stats.dims += targetValues.size();
+
+    float sum = 0.0f;
+    for(size_t b = 0; b < order.size(); b++) {
+        size_t start = order[b].start;
+        stats.dimsRead += order[b].length;
+        if(type == ABANDON_SSD) {
+            sum += kernels.squaredDistance(target + start, row + start, order[b].length);
+            if(sum > bound && b + 1 < order.size()) {
+                stats.abandoned++;
+                return sum;
+            }
+        }
+        else {
+            sum += kernels.intersection(target + start, row + start, order[b].length);
+            float lowest = 1.0f - (sum + remainingMass[b + 1]);
+            if(lowest > bound + INTERSECTION_SLACK && b + 1 < order.size()) {
+                stats.abandoned++;
+                return lowest;
+            }
+        }
+    }
+    return type == ABANDON_SSD ? sum : 1.0f - sum;
+}
+
+float EarlyAbandonDistance::lowestDistance() const {
+    return type == ABANDON_SSD ? 0.0f : 1.0f - remainingMass[0];
+}
+
+float early_abandon_average(const EarlyAbandonDistance &first, const float *firstRow,
+                            const EarlyAbandonDistance &second, const float *secondRow,
+                            float bound, AbandonStats &stats) {
+    AbandonStats halves;
+    stats.rows++;
+    stats.dims += first.dim() + second.dim();
+
+    // The first half has to beat twice the bound less the best the
+    // second half could do, and the second half what the first one left
+    float firstDistance = first.distance(firstRow, 2.0f * bound - second.lowestDistance(), halves);
+    float result;
+    if(halves.abandoned > 0) {
+        result = (firstDistance + second.lowestDistance()) / 2.0f;
+    }
+    else {
+        float secondDistance = second.distance(secondRow, 2.0f * bound - firstDistance, halves);
+        result = (firstDistance + secondDistance) / 2.0f;
+    }
+
+    stats.abandoned += halves.abandoned > 0 ? 1 : 0;
+    stats.dimsRead += halves.dimsRead;
+    return result;
+}
+
+void print_abandon_stats(const char *label, const AbandonStats &stats) {
+    printf("%s: skipped %.1f%% of the distance work, %lld of %lld rows abandoned early\n", label,
+           100.0 * stats.skippedFraction(), stats.abandoned, stats.rows);
+}
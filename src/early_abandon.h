@@ -0,0 +1,116 @@
+/*
+  Early-abandoning distance evaluation against a top-K threshold
+
+  A matcher that keeps only the best K images does not need the exact
+  distance of an image that cannot make it into the top K.  The sum of
+  squared differences only grows as dimensions are added, so as soon as
+  the partial sum exceeds the distance of the K-th best image so far
+  (TopK::threshold), the image can be dropped.  For histogram
+  intersection the distance is 1 - sum of min(target, row); a bin adds
+  at most the target's own value, so 1 - (partial sum + target mass
+  still to come) is a lower bound on the distance, and the image can be
+  dropped once that bound exceeds the threshold.
+
+  The dimensions are evaluated in blocks of EARLY_ABANDON_BLOCK with the
+  vector kernels of distance_kernels.h, largest target values first, so
+  that the bound grows (or the remaining mass shrinks) as fast as
+  possible.  The distance of an image that is not dropped is the sum
+  over the blocks in that order, so it can differ from the single-call
+  kernels in the last bits.  Dropped images are never ones that would
+  have been kept: the bound has to exceed the threshold strictly.
+
+  Matchers that average the distances of two histograms per image
+  (multi_histogram_match, texture_color_match) use
+  early_abandon_average: each half is abandoned against the bound left
+  over from the other half, so the average of the two bounds is a lower
+  bound on the average distance.
+ */
+
+#ifndef EARLY_ABANDON_H
+#define EARLY_ABANDON_H
+
+#include <cstddef>
+#include <vector>
+
+// dimensions evaluated between two checks against the bound
+#define EARLY_ABANDON_BLOCK 16
+
+enum EarlyAbandonMetric {
+    ABANDON_SSD,            // sum of squared differences
+    ABANDON_INTERSECTION    // 1 - histogram intersection
+};
+
+/*
+  Work counters of one query: rows scored, rows dropped early,
+  dimensions of all rows and dimensions actually read.
+ */
+struct AbandonStats {
+    long long rows;
+    long long abandoned;
+    long long dims;
+    long long dimsRead;
+
+    AbandonStats() : rows(0), abandoned(0), dims(0), dimsRead(0) {}
+
+    void add( const AbandonStats &other );
+
+    // fraction of the dimensions that were not read
+    double skippedFraction() const;
+};
+
+class EarlyAbandonDistance {
+public:
+    EarlyAbandonDistance();
+    EarlyAbandonDistance( const float *target, size_t dim, EarlyAbandonMetric metric );
+
+    /*
+      Copies the target and orders its blocks by magnitude.
+     */
+    void setTarget( const float *target, size_t dim, EarlyAbandonMetric metric );
+
+    /*
+      Distance from the target to row (dim() values).  If the distance is
+      found to be larger than bound before the end, returns a lower bound
+      on it that is larger than bound and counts the row as abandoned.
+      Pass +infinity (TopK::threshold while the heap is not full) for the
+      exact distance.
+     */
+    float distance( const float *row, float bound, AbandonStats &stats ) const;
+
+    /*
+      Smallest distance any row can have: 0 for SSD, 1 - the target mass
+      for intersection.
+     */
+    float lowestDistance() const;
+
+    size_t dim() const { return targetValues.size(); }
+
+private:
+    struct Block {
+        size_t start;
+        size_t length;
+    };
+
+    std::vector<float> targetValues;
+    EarlyAbandonMetric type;
+    std::vector<Block> order;          // largest target values first
+    std::vector<float> remainingMass;  // target mass of blocks i.. in order, for intersection
+};
+
+/*
+  (first distance + second distance) / 2 of an image whose two halves
+  are firstRow and secondRow, or a lower bound on it larger than bound.
+  The second half is not read once the first one rules the image out.
+  Counts the image as one row of both halves' dimensions in stats.
+ */
+float early_abandon_average( const EarlyAbandonDistance &first, const float *firstRow,
+                             const EarlyAbandonDistance &second, const float *secondRow,
+                             float bound, AbandonStats &stats );
+
+/*
+  Prints the skipped fraction of the distance work, as one line with the
+  given label.
+ */
+void print_abandon_stats( const char *label, const AbandonStats &stats );
+
+#endif
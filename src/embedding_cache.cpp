@@ -0,0 +1,145 @@
+/*
+  Persistent embedding cache: lookup by file stamp and atomic rewrite.
+  See embedding_cache.h.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "embedding_cache.h"
+#include "file_sync.h"
+
+using namespace std;
+
+EmbeddingCache::EmbeddingCache() : source(0), numCols(0), hashFiles(false), numHits(0), numMisses(0) {
+}
+
+void EmbeddingCache::open(const char *cacheFile, uint64_t sourceId, size_t dim, bool hashContent) {
+    filename = cacheFile;
+    source = sourceId;
+    numCols = dim;
+    hashFiles = hashContent;
+
+    FILE *fp = fopen(cacheFile, "rb");
+    if(!fp) {
+        printf("Embedding cache %s does not exist yet\n", cacheFile);
+        return;
+    }
+    fclose(fp);
+
+    if(!is_feature_store(cacheFile) || previous.load(cacheFile) != 0) {
+        printf("Warning: ignoring unreadable embedding cache %s\n", cacheFile);
+        previous.close();
+        return;
+    }
+    if(previous.fileStamps() == NULL || previous.sourceId() != sourceId || previous.dim() != dim ||
+       !previous.isNormalized()) {
+        printf("Warning: embedding cache %s was made with another model, ignoring it\n", cacheFile);
+        previous.close();
+        return;
+    }
+    printf("Embedding cache %s: %lu embeddings\n", cacheFile, (unsigned long)previous.count());
+}
+
+const float *EmbeddingCache::lookup(int id, const char *name, const char *path) {
+    // stamping reads the file for the content hash, so do it unlocked
+    FeatureFileStamp stamp;
+    bool stamped = feature_file_stamp(path, hashFiles, stamp) == 0;
+
+    const float *cached = NULL;
+    long row = stamped && previous.count() > 0 ? previous.find(name) : -1;
+    if(row >= 0) {
+        const FeatureFileStamp &old = previous.fileStamps()[row];
+        bool same = old.size == stamp.size &&
+                    (hashFiles ? old.contentHash != 0 && old.contentHash == stamp.contentHash
+                               : old.mtime == stamp.mtime);
+        if(same) {
+            cached = previous.row(row);
+        }
+    }
+
+    lock_guard<mutex> guard(lock);
+    if((int)entries.size() <= id) {
+        entries.resize(id + 1);
+    }
+    Entry &entry = entries[id];
+    entry.name = name;
+    entry.stamp = stamp;
+    entry.stamped = stamped;
+    entry.cached = cached;
+    if(cached) {
+        numHits++;
+    }
+    else {
+        numMisses++;
+    }
+    return cached;
+}
+
+void EmbeddingCache::store(int id, const float *embedding) {
+    lock_guard<mutex> guard(lock);
+    if(id < 0 || id >= (int)entries.size()) {
+        return;
+    }
+    entries[id].computed.assign(embedding, embedding + numCols);
+}
+
+int EmbeddingCache::save() {
+    if(filename.empty()) {
+        return 0;
+    }
+
+    // Collect every stamped image with an embedding, in directory order
+    vector<char *> names;
+    vector<float> data;
+    vector<FeatureFileStamp> stamps;
+    {
+        lock_guard<mutex> guard(lock);
+        for(size_t i = 0; i < entries.size(); i++) {
+            Entry &entry = entries[i];
+            const float *embedding = entry.cached ? entry.cached
+                                   : entry.computed.empty() ? NULL : &entry.computed[0];
+            if(!entry.stamped || embedding == NULL) {
+                continue;
+            }
+            names.push_back(&entry.name[0]);
+            data.insert(data.end(), embedding, embedding + numCols);
+            stamps.push_back(entry.stamp);
+        }
+    }
+
+    // Write a new file, sync it and move it over the old one, so an
+    // interrupted run or a power loss never leaves a broken cache behind
+    string temporary = filename + ".tmp";
+    size_t count = names.size();
+    int result = write_feature_store(temporary.c_str(), names, data.empty() ? NULL : &data[0], count, numCols,
+                                     true, stamps.empty() ? NULL : &stamps[0], source);
+    if(result == 0 && !sync_file(temporary.c_str())) {
+        printf("Error: Unable to write embedding cache %s\n", temporary.c_str());
+        result = -1;
+    }
+    if(result != 0) {
+        remove(temporary.c_str());
+        return -1;
+    }
+
+    // the old cache may still be mapped (and the entries may point into
+    // it, but their rows were copied above)
+    previous.close();
+    if(replace_file(temporary.c_str(), filename.c_str()) != 0) {
+        printf("Error: Unable to replace embedding cache %s\n", filename.c_str());
+        remove(temporary.c_str());
+        return -1;
+    }
+    sync_directory(filename.c_str());
+    return 0;
+}
+
+uint64_t model_source_id( const char *modelPath ) {
+    FeatureFileStamp stamp;
+    if(feature_file_stamp(modelPath, true, stamp) != 0) {
+        return 0;
+    }
+    return stamp.contentHash;
+}
@@ -0,0 +1,99 @@
+/*
+  Persistent embedding cache
+
+  live_dnn_match runs the network on every image of a directory, although
+  the images rarely change between queries.  The cache keeps the
+  normalized embeddings of the last run in a binary feature store
+  (feature_store.h) together with a stamp of every image file: its size
+  and modification time and, with content hashing, a hash of its bytes.
+  A later run reuses the embedding of every file whose stamp still
+  matches and runs the network only for new and modified files.
+
+  A cached row is valid if the file has the same name and size and
+  either the same modification time or, with content hashing, the same
+  content hash (so touching or copying a file does not invalidate it).
+
+  The cache belongs to one image directory and one model.  The model's
+  content hash is stored as the feature store's sourceId, and a cache
+  made with another model or another embedding size is ignored.  Rows
+  are named like the CSV files (the filename inside the directory), so
+  the cache file is also a normalized feature file that
+  deep_embedding_match can search.
+ */
+
+#ifndef EMBEDDING_CACHE_H
+#define EMBEDDING_CACHE_H
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "feature_store.h"
+
+class EmbeddingCache {
+public:
+    EmbeddingCache();
+
+    /*
+      Loads the cache file if it exists.  A missing, unreadable or
+      mismatching cache is reported and treated as empty.  sourceId
+      identifies the model and dim is the embedding size.
+     */
+    void open( const char *filename, uint64_t sourceId, size_t dim, bool hashContent );
+
+    /*
+      Stamps the file of image id and returns its cached normalized
+      embedding if it is still valid, or NULL.  Thread-safe.
+     */
+    const float *lookup( int id, const char *name, const char *path );
+
+    /*
+      Records the normalized embedding computed for image id, which must
+      have been looked up before.  Thread-safe.
+     */
+    void store( int id, const float *embedding );
+
+    /*
+      Replaces the cache file with the embeddings of every image looked
+      up in this run; files that are gone from the directory are dropped.
+      Returns a non-zero value if the file cannot be written.
+     */
+    int save();
+
+    int hits() const { return numHits; }
+    int misses() const { return numMisses; }
+
+private:
+    EmbeddingCache(const EmbeddingCache &);
+    EmbeddingCache &operator=(const EmbeddingCache &);
+
+    struct Entry {
+        std::string name;
+        FeatureFileStamp stamp;
+        bool stamped;               // stamp is valid
+        const float *cached;        // row of the loaded cache, or NULL
+        std::vector<float> computed;
+
+        Entry() : stamped(false), cached(NULL) {}
+    };
+
+    std::string filename;
+    uint64_t source;
+    size_t numCols;
+    bool hashFiles;
+
+    FeatureStore previous;          // the cache as loaded
+    std::mutex lock;
+    std::vector<Entry> entries;     // indexed by image id
+    int numHits;
+    int numMisses;
+};
+
+/*
+  Source id of a model file for the cache: the hash of its contents, or 0
+  if it cannot be read.
+ */
+uint64_t model_source_id( const char *modelPath );
+
+#endif
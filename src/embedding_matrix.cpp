@@ -0,0 +1,141 @@
+/*
+  L2-normalized embedding matrix.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include "distance_kernels.h"
+#include "embedding_matrix.h"
+
+using namespace std;
+
+static inline float clampedDistance(float dot) {
+    if(dot > 1.0f) dot = 1.0f;
+    if(dot < -1.0f) dot = -1.0f;
+    return 1.0f - dot;
+}
+
+void normalize_embedding( const float *in, size_t dim, float *out ) {
+    float norm = sqrt(distance_kernels().dot(in, in, dim));
+    if(norm > 0) {
+        float scale = 1.0f / norm;
+        for(size_t i = 0; i < dim; i++) {
+            out[i] = in[i] * scale;
+        }
+    }
+    else if(out != in) {
+        memcpy(out, in, dim * sizeof(float));
+    }
+}
+
+float normalized_cosine_distance( const float *a, const float *b, size_t dim ) {
+    return clampedDistance(distance_kernels().dot(a, b, dim));
+}
+
+// 16-bit values per padded row: whole cache lines, like FeatureTable rows
+static size_t halfStrideFor(size_t dim) {
+    const size_t perLine = FEATURE_TABLE_ALIGNMENT / sizeof(uint16_t);
+    return (dim + perLine - 1) / perLine * perLine;
+}
+
+EmbeddingMatrix::EmbeddingMatrix() : numRows(0), numCols(0), rowStride(0), matrix(NULL),
+                                     precisionType(FS_DTYPE_FLOAT32), halfType(FS_DTYPE_FLOAT32), halfMatrix(NULL) {
+}
+
+void EmbeddingMatrix::assign(const float *data, size_t count, size_t dim, size_t stride, bool normalized) {
+    numRows = count;
+    numCols = dim;
+    halfMatrix = NULL;
+    vector<uint16_t>().swap(ownedHalf);
+
+    if(precisionType != FS_DTYPE_FLOAT32) {
+        // normalize each row in floats, then round it
+        ownedRows.clear();
+        matrix = NULL;
+        rowStride = halfStrideFor(dim);
+        ownedHalf.assign(count * rowStride, 0);
+        vector<float> normalizedRow(dim);
+        for(size_t i = 0; i < count && dim > 0; i++) {
+            normalize_embedding(data + i * stride, dim, &normalizedRow[0]);
+            narrow_half_row(&normalizedRow[0], dim, precisionType, &ownedHalf[i * rowStride]);
+        }
+        halfType = precisionType;
+        halfMatrix = ownedHalf.empty() ? NULL : &ownedHalf[0];
+        return;
+    }
+
+    if(normalized) {
+        ownedRows.clear();
+        rowStride = stride;
+        matrix = data;
+        return;
+    }
+
+    ownedRows.allocate(count, dim, 0);
+    for(size_t i = 0; i < count; i++) {
+        normalize_embedding(data + i * stride, dim, ownedRows.row(i));
+    }
+    rowStride = ownedRows.stride();
+    matrix = ownedRows.data();
+}
+
+void EmbeddingMatrix::assignHalf(const uint16_t *data, size_t count, size_t dim, size_t stride,
+                                 FeatureStoreDType dtype, bool normalized) {
+    numRows = count;
+    numCols = dim;
+    ownedRows.clear();
+    matrix = NULL;
+    halfType = dtype;
+
+    if(normalized) {
+        vector<uint16_t>().swap(ownedHalf);
+        rowStride = stride;
+        halfMatrix = data;
+        return;
+    }
+
+    rowStride = halfStrideFor(dim);
+    ownedHalf.assign(count * rowStride, 0);
+    vector<float> widened(dim);
+    for(size_t i = 0; i < count && dim > 0; i++) {
+        widen_half_row(data + i * stride, dim, dtype, &widened[0]);
+        normalize_embedding(&widened[0], dim, &widened[0]);
+        narrow_half_row(&widened[0], dim, dtype, &ownedHalf[i * rowStride]);
+    }
+    halfMatrix = ownedHalf.empty() ? NULL : &ownedHalf[0];
+}
+
+void EmbeddingMatrix::copyRow(size_t i, float *out) const {
+    if(halfMatrix) {
+        widen_half_row(halfMatrix + i * rowStride, numCols, halfType, out);
+    }
+    else {
+        memcpy(out, row(i), numCols * sizeof(float));
+    }
+}
+
+void EmbeddingMatrix::cosineDistances(const float *query, size_t start, size_t rows, float *out) const {
+    const DistanceKernelTable &kernels = distance_kernels();
+    if(halfMatrix == NULL) {
+        kernels.dotBatch(query, row(start), rows, numCols, rowStride, out);
+    }
+    else if(halfType == FS_DTYPE_BFLOAT16) {
+        kernels.bfloat16DotBatch(query, halfMatrix + start * rowStride, rows, numCols, rowStride, out);
+    }
+    else {
+        kernels.halfDotBatch(query, halfMatrix + start * rowStride, rows, numCols, rowStride, out);
+    }
+    for(size_t i = 0; i < rows; i++) {
+        out[i] = clampedDistance(out[i]);
+    }
+}
+
+void EmbeddingMatrix::cosineDistances(const float *queries, size_t numQueries, size_t start, size_t rows,
+                                      float *out) const {
+    // Each query against the same block of rows, which stays in cache
+    // after the first one
+    for(size_t q = 0; q < numQueries; q++) {
+        cosineDistances(queries + q * numCols, start, rows, out + q * rows);
+    }
+}
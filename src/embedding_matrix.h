@@ -0,0 +1,120 @@
+/*
+  L2-normalized embedding matrix
+
+  Cosine distance is 1 - (a . b) / (|a| |b|).  Computing the norms for
+  every comparison means that each database row is normalized again for
+  every query.  Instead, the rows are normalized once when the
+  embeddings are loaded (or when the feature store is written, see
+  csv_to_store --normalize) and kept in one contiguous row-major matrix.
+  Scoring a normalized query against the matrix is then a plain
+  matrix-vector product, done in blocks with the dotBatch kernel of
+  distance_kernels.h, and scoring a batch of queries is a matrix-matrix
+  product.
+
+  A zero vector stays zero, so its cosine distance to anything is 1, as
+  with the per-pair formula.
+
+  The rows can also be kept in half precision (float16 or bfloat16, see
+  half_float.h), which halves the memory and the bytes read by every
+  scan.  The kernels widen the rows to floats in registers and
+  accumulate in floats, and the queries stay floats, so the only loss is
+  the rounding of the stored rows.
+ */
+
+#ifndef EMBEDDING_MATRIX_H
+#define EMBEDDING_MATRIX_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "feature_store.h"
+#include "feature_table.h"
+
+class EmbeddingMatrix {
+public:
+    EmbeddingMatrix();
+
+    /*
+      Uses count rows of dim floats, stored row-major in data with row i
+      at data + i * stride.  Unless normalized is true the rows are
+      copied and normalized into an aligned matrix with padded rows (see
+      feature_table.h); otherwise data is used in place and must stay
+      valid (for example a mapped feature store written with
+      --normalize).
+     */
+    void assign( const float *data, size_t count, size_t dim, size_t stride, bool normalized = false );
+
+    /*
+      The same for float16 or bfloat16 rows (dtype), for example the
+      mapped rows of a half-precision feature store.  Rows that are not
+      normalized are normalized into a copy of the same type.
+     */
+    void assignHalf( const uint16_t *data, size_t count, size_t dim, size_t stride, FeatureStoreDType dtype,
+                     bool normalized = false );
+
+    /*
+      Chooses how the next assign() keeps the normalized rows: floats
+      (FS_DTYPE_FLOAT32, the default), or rounded to float16 or bfloat16.
+     */
+    void setPrecision( FeatureStoreDType dtype ) { precisionType = dtype; }
+    FeatureStoreDType precision() const { return halfMatrix ? halfType : FS_DTYPE_FLOAT32; }
+
+    size_t count() const { return numRows; }
+    size_t dim() const { return numCols; }
+    size_t stride() const { return rowStride; }
+
+    // the float rows; NULL when the rows are in half precision
+    const float *data() const { return matrix; }
+    const float *row(size_t i) const { return matrix + i * rowStride; }
+
+    // the half-precision rows, NULL when the rows are floats
+    const uint16_t *halfData() const { return halfMatrix; }
+
+    // row i as floats, widened if it is kept in half precision
+    void copyRow( size_t i, float *out ) const;
+
+    /*
+      Cosine distances between a normalized query and rows [start, start +
+      rows), written to out.
+     */
+    void cosineDistances( const float *query, size_t start, size_t rows, float *out ) const;
+
+    /*
+      The same for numQueries normalized queries (row-major, dim floats
+      each) at once: a block of the matrix-matrix product, so the rows
+      are read from memory once for all the queries when the block fits
+      in cache.  out[q * rows + r] is the distance between query q and
+      row start + r.  The results equal those of the one-query form.
+     */
+    void cosineDistances( const float *queries, size_t numQueries, size_t start, size_t rows,
+                          float *out ) const;
+
+private:
+    EmbeddingMatrix(const EmbeddingMatrix &);
+    EmbeddingMatrix &operator=(const EmbeddingMatrix &);
+
+    size_t numRows;
+    size_t numCols;
+    size_t rowStride;
+    const float *matrix;
+    FeatureTable ownedRows;
+
+    FeatureStoreDType precisionType;    // asked for with setPrecision
+    FeatureStoreDType halfType;         // of halfMatrix
+    const uint16_t *halfMatrix;
+    std::vector<uint16_t> ownedHalf;
+};
+
+/*
+  Writes the L2-normalized vector to out (which may be in).  A zero
+  vector is copied unchanged.
+ */
+void normalize_embedding( const float *in, size_t dim, float *out );
+
+/*
+  Cosine distance of two normalized vectors: 1 - a . b, with the dot
+  product clamped to [-1, 1].
+ */
+float normalized_cosine_distance( const float *a, const float *b, size_t dim );
+
+#endif
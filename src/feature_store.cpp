@@ -0,0 +1,622 @@
+/*
+  Binary feature store: memory-mapped reader, CSV fallback and writer.
+  See feature_store.h for the file layout.
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "csv_util.h"
+#include "feature_store.h"
+#include "half_float.h"
+#include "stage_stats.h"
+
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Alignment of the feature matrix inside the file
+static const uint64_t STORE_ALIGNMENT = 64;
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// bytes per value of the feature matrix
+static uint64_t dtypeSize(uint32_t dtype) {
+    return dtype == FS_DTYPE_FLOAT32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+MappedFile::MappedFile() : base(NULL), length(0) {
+#ifdef _WIN32
+    fileHandle = INVALID_HANDLE_VALUE;
+    mapHandle = NULL;
+#endif
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+int MappedFile::open(const char *filename) {
+    close();
+
+    HANDLE fh = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(fh == INVALID_HANDLE_VALUE) {
+        return -1;
+    }
+
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(fh, &fileSize) || fileSize.QuadPart == 0) {
+        CloseHandle(fh);
+        return -1;
+    }
+
+    HANDLE mh = CreateFileMappingA(fh, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(mh == NULL) {
+        CloseHandle(fh);
+        return -1;
+    }
+
+    void *view = MapViewOfFile(mh, FILE_MAP_READ, 0, 0, 0);
+    if(view == NULL) {
+        CloseHandle(mh);
+        CloseHandle(fh);
+        return -1;
+    }
+
+    fileHandle = fh;
+    mapHandle = mh;
+    base = (const unsigned char *)view;
+    length = (size_t)fileSize.QuadPart;
+    return 0;
+}
+
+void MappedFile::close() {
+    if(base) {
+        UnmapViewOfFile(base);
+    }
+    if(mapHandle) {
+        CloseHandle((HANDLE)mapHandle);
+    }
+    if(fileHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle((HANDLE)fileHandle);
+    }
+    base = NULL;
+    length = 0;
+    fileHandle = INVALID_HANDLE_VALUE;
+    mapHandle = NULL;
+}
+
+void MappedFile::release(size_t offset, size_t bytes) const {
+    // unlocking pages that are not locked removes them from the working set
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t page = info.dwPageSize;
+    size_t start = (offset + page - 1) / page * page;
+    size_t end = min(offset + bytes, length) / page * page;
+    if(base && start < end) {
+        VirtualUnlock((void *)(base + start), end - start);
+    }
+}
+
+#else
+
+int MappedFile::open(const char *filename) {
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return -1;
+    }
+
+    void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if(addr == MAP_FAILED) {
+        return -1;
+    }
+
+    base = (const unsigned char *)addr;
+    length = (size_t)st.st_size;
+    return 0;
+}
+
+void MappedFile::close() {
+    if(base) {
+        munmap((void *)base, length);
+    }
+    base = NULL;
+    length = 0;
+}
+
+void MappedFile::release(size_t offset, size_t bytes) const {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (offset + page - 1) / page * page;
+    size_t end = min(offset + bytes, length) / page * page;
+    if(base && start < end) {
+        madvise((void *)(base + start), end - start, MADV_DONTNEED);
+    }
+}
+
+#endif
+
+uint64_t feature_name_hash( const char *filename ) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(const unsigned char *p = (const unsigned char *)filename; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t feature_names_fingerprint( const FeatureStore &store ) {
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < store.count(); i++) {
+        hash = (hash ^ feature_name_hash(store.name(i))) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+int feature_file_stamp( const char *path, bool hashContent, FeatureFileStamp &stamp ) {
+#ifdef _WIN32
+    struct _stat64 st;
+    if(_stat64(path, &st) != 0) {
+        return -1;
+    }
+#else
+    struct stat st;
+    if(stat(path, &st) != 0) {
+        return -1;
+    }
+#endif
+    stamp.size = (uint64_t)st.st_size;
+    stamp.mtime = (int64_t)st.st_mtime * 1000000000LL;
+#ifdef __linux__
+    stamp.mtime += st.st_mtim.tv_nsec;
+#endif
+    stamp.contentHash = 0;
+    if(!hashContent) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if(!fp) {
+        return -1;
+    }
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+        for(size_t i = 0; i < n; i++) {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+    bool failed = ferror(fp) != 0;
+    fclose(fp);
+    if(failed) {
+        return -1;
+    }
+    // 0 means "not hashed"
+    stamp.contentHash = hash != 0 ? hash : 1;
+    return 0;
+}
+
+size_t name_index_buckets( size_t count ) {
+    size_t buckets = 16;
+    while(buckets < 2 * count) {
+        buckets *= 2;
+    }
+    return buckets;
+}
+
+int build_name_index( const char * const *filenames, size_t count, uint32_t *index, size_t buckets ) {
+    if(count >= FS_INDEX_EMPTY || buckets <= count) {
+        return -1;
+    }
+
+    for(size_t b = 0; b < buckets; b++) {
+        index[b] = FS_INDEX_EMPTY;
+    }
+
+    // linear probing; a repeated filename keeps its first row, like the
+    // linear search it replaces
+    size_t mask = buckets - 1;
+    for(size_t i = 0; i < count; i++) {
+        size_t b = (size_t)feature_name_hash(filenames[i]) & mask;
+        while(index[b] != FS_INDEX_EMPTY) {
+            if(strcmp(filenames[index[b]], filenames[i]) == 0) {
+                break;
+            }
+            b = (b + 1) & mask;
+        }
+        if(index[b] == FS_INDEX_EMPTY) {
+            index[b] = (uint32_t)i;
+        }
+    }
+
+    return 0;
+}
+
+FeatureStore::FeatureStore() : mapped(false), normalized(false), storedType(FS_DTYPE_FLOAT32), numRows(0),
+                               numCols(0), rowStride(0), matrix(NULL), halfMatrix(NULL), nameIndex(NULL), indexBuckets(0), stamps(NULL), source(0) {
+}
+
+FeatureStore::~FeatureStore() {
+    close();
+}
+
+void FeatureStore::close() {
+    file.close();
+    table.clear();
+    names.clear();
+    ownedIndex.clear();
+    nameIndex = NULL;
+    indexBuckets = 0;
+    stamps = NULL;
+    source = 0;
+    mapped = false;
+    normalized = false;
+    storedType = FS_DTYPE_FLOAT32;
+    halfMatrix = NULL;
+    numRows = 0;
+    numCols = 0;
+    rowStride = 0;
+    matrix = NULL;
+}
+
+int FeatureStore::load(const char *filename, bool widenHalf) {
+    close();
+
+    bool binary = is_feature_store(filename);
+    StageTimer timer(binary ? STATS_LOAD : STATS_CSV_PARSE);
+    int result = binary ? loadStore(filename, widenHalf) : loadCSV(filename);
+    if(result == 0 && nameIndex == NULL) {
+        buildIndex();
+    }
+
+    struct stat st;
+    if(result == 0 && stats_enabled() && stat(filename, &st) == 0) {
+        stats_add_bytes(binary ? STATS_LOAD : STATS_CSV_PARSE, st.st_size);
+    }
+    return result;
+}
+
+// Index the filenames in memory, for CSV files and stores without an index
+void FeatureStore::buildIndex() {
+    size_t buckets = name_index_buckets(numRows);
+    ownedIndex.resize(buckets);
+    if(build_name_index(names.empty() ? NULL : &names[0], numRows, &ownedIndex[0], buckets) != 0) {
+        // too many rows for 32-bit entries; find() falls back to a scan
+        ownedIndex.clear();
+        return;
+    }
+    nameIndex = &ownedIndex[0];
+    indexBuckets = buckets;
+}
+
+long FeatureStore::find(const char *filename) const {
+    if(nameIndex == NULL) {
+        for(size_t i = 0; i < numRows; i++) {
+            if(strcmp(names[i], filename) == 0) {
+                return (long)i;
+            }
+        }
+        return -1;
+    }
+
+    size_t mask = indexBuckets - 1;
+    size_t b = (size_t)feature_name_hash(filename) & mask;
+    for(size_t probes = 0; probes < indexBuckets; probes++, b = (b + 1) & mask) {
+        uint32_t row = nameIndex[b];
+        if(row == FS_INDEX_EMPTY) {
+            break;
+        }
+        if(row < numRows && strcmp(names[row], filename) == 0) {
+            return (long)row;
+        }
+    }
+    return -1;
+}
+
+// Map a binary feature store and validate its header
+int FeatureStore::loadStore(const char *filename, bool widenHalf) {
+    if(file.open(filename) != 0) {
+        printf("Unable to map feature store %s\n", filename);
+        return -1;
+    }
+
+    if(file.size() < sizeof(FeatureStoreHeader)) {
+        printf("Feature store %s is truncated\n", filename);
+        close();
+        return -1;
+    }
+
+    const FeatureStoreHeader *header = (const FeatureStoreHeader *)file.data();
+    if(header->version != FEATURE_STORE_VERSION) {
+        printf("Feature store %s has unsupported version %u\n", filename, header->version);
+        close();
+        return -1;
+    }
+    if(header->dtype != FS_DTYPE_FLOAT32 && header->dtype != FS_DTYPE_FLOAT16 &&
+       header->dtype != FS_DTYPE_BFLOAT16) {
+        printf("Feature store %s has unsupported data type %u\n", filename, header->dtype);
+        close();
+        return -1;
+    }
+
+    // count, dim and the offsets can be anything in a damaged file, so the
+    // sizes are compared by division and subtraction, which cannot wrap
+    uint64_t fileSize = file.size();
+    bool sane = header->dataOffset % sizeof(float) == 0 && header->dataOffset <= fileSize &&
+                header->namesOffset % sizeof(uint64_t) == 0 && header->namesOffset <= fileSize &&
+                header->namesSize <= fileSize - header->namesOffset &&
+                header->count < header->namesSize / sizeof(uint64_t);  // room for count + 1 offsets
+    if(sane && header->count > 0) {
+        uint64_t dataValues = (fileSize - header->dataOffset) / dtypeSize(header->dtype);
+        sane = header->dim <= dataValues / header->count;
+    }
+    if(!sane) {
+        printf("Feature store %s is corrupt\n", filename);
+        close();
+        return -1;
+    }
+
+    // Each filename has to end with its 0 before the next one starts, and
+    // the last one before the end of the blob
+    uint64_t tableBytes = (header->count + 1) * sizeof(uint64_t);
+    const uint64_t *offsets = (const uint64_t *)(file.data() + header->namesOffset);
+    const char *blob = (const char *)(offsets + header->count + 1);
+    uint64_t blobSize = header->namesSize - tableBytes;
+    bool namesOk = true;
+    for(uint64_t i = 0; namesOk && i < header->count; i++) {
+        namesOk = offsets[i] < offsets[i + 1] && offsets[i + 1] <= blobSize && blob[offsets[i + 1] - 1] == '\0';
+    }
+    if(!namesOk) {
+        printf("Feature store %s has a corrupt filename table\n", filename);
+        close();
+        return -1;
+    }
+
+    names.resize(header->count);
+    for(uint64_t i = 0; i < header->count; i++) {
+        names[i] = blob + offsets[i];
+    }
+
+    // use the stored filename index if it is there and sane; otherwise
+    // load() builds one
+    if(header->flags & FS_FLAG_NAME_INDEX) {
+        uint64_t buckets = header->indexBuckets;
+        if(buckets > header->count && (buckets & (buckets - 1)) == 0 &&
+           header->indexOffset % sizeof(uint32_t) == 0 &&
+           header->indexOffset <= file.size() &&
+           buckets <= (file.size() - header->indexOffset) / sizeof(uint32_t)) {
+            nameIndex = (const uint32_t *)(file.data() + header->indexOffset);
+            indexBuckets = (size_t)buckets;
+        }
+        else {
+            printf("Warning: ignoring corrupt filename index in %s\n", filename);
+        }
+    }
+
+    // the file stamps are only used when they are complete
+    if(header->flags & FS_FLAG_FILE_STAMPS) {
+        if(header->stampsOffset % sizeof(uint64_t) == 0 && header->stampsOffset <= file.size() &&
+           header->count <= (file.size() - header->stampsOffset) / sizeof(FeatureFileStamp)) {
+            stamps = (const FeatureFileStamp *)(file.data() + header->stampsOffset);
+            source = header->sourceId;
+        }
+        else {
+            printf("Warning: ignoring corrupt file stamps in %s\n", filename);
+        }
+    }
+
+    numRows = header->count;
+    numCols = header->dim;
+    rowStride = numCols;
+    storedType = (FeatureStoreDType)header->dtype;
+    mapped = true;
+    normalized = (header->flags & FS_FLAG_NORMALIZED) != 0;
+
+    if(storedType == FS_DTYPE_FLOAT32) {
+        matrix = (const float *)(file.data() + header->dataOffset);
+        return 0;
+    }
+
+    // Half precision: keep the mapped rows, and widen them for the
+    // callers that need floats
+    halfMatrix = (const uint16_t *)(file.data() + header->dataOffset);
+    if(widenHalf) {
+        if(table.allocate(numRows, numCols, 0) != 0) {
+            printf("Error: Out of memory for %lu rows of %s\n", (unsigned long)numRows, filename);
+            close();
+            return -1;
+        }
+        for(size_t i = 0; i < numRows; i++) {
+            widen_half_row(halfMatrix + i * numCols, numCols, storedType, table.row(i));
+        }
+        matrix = table.data();
+        rowStride = table.stride();
+    }
+
+    return 0;
+}
+
+// Read a feature CSV file into the table: aligned, padded rows and one
+// filename arena
+int FeatureStore::loadCSV(const char *filename) {
+    // parsed in parallel straight into the table
+    if(read_feature_table((char *)filename, table, 0) != 0) {
+        close();
+        return -1;
+    }
+
+    numRows = table.count();
+    numCols = table.dim();
+    rowStride = table.stride();
+    names.resize(numRows);
+    for(size_t i = 0; i < numRows; i++) {
+        names[i] = table.name(i);
+    }
+    matrix = table.data();
+    mapped = false;
+
+    return 0;
+}
+
+bool is_feature_store( const char *filename ) {
+    char magic[4];
+    FILE *fp = fopen(filename, "rb");
+    if(!fp) {
+        return false;
+    }
+
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+
+    return n == sizeof(magic) && memcmp(magic, FEATURE_STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+int write_feature_store( const char *filename, const std::vector<char *> &filenames,
+                         const float *data, size_t count, size_t dim, bool normalized,
+                         const FeatureFileStamp *stamps, uint64_t sourceId, FeatureStoreDType dtype ) {
+    if(filenames.size() != count) {
+        printf("Error: %lu filenames for %lu feature rows\n",
+               (unsigned long)filenames.size(), (unsigned long)count);
+        return -1;
+    }
+
+    // build the filename table
+    vector<uint64_t> offsets(count + 1);
+    uint64_t blobSize = 0;
+    for(size_t i = 0; i < count; i++) {
+        offsets[i] = blobSize;
+        blobSize += strlen(filenames[i]) + 1;
+    }
+    offsets[count] = blobSize;
+
+    // filename index; skipped if there are too many rows for it
+    size_t buckets = name_index_buckets(count);
+    vector<uint32_t> index(buckets);
+    bool hasIndex = build_name_index(count > 0 ? &filenames[0] : NULL, count, &index[0], buckets) == 0;
+
+    FeatureStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FEATURE_STORE_MAGIC, sizeof(header.magic));
+    header.version = FEATURE_STORE_VERSION;
+    header.dtype = dtype;
+    header.flags = normalized ? FS_FLAG_NORMALIZED : 0;
+    header.count = count;
+    header.dim = dim;
+    header.dataOffset = alignUp(sizeof(FeatureStoreHeader), STORE_ALIGNMENT);
+    uint64_t dataEnd = header.dataOffset + (uint64_t)count * dim * dtypeSize(dtype);
+    header.namesOffset = alignUp(dataEnd, sizeof(uint64_t));
+    header.namesSize = (count + 1) * sizeof(uint64_t) + blobSize;
+    if(hasIndex) {
+        header.flags |= FS_FLAG_NAME_INDEX;
+        header.indexOffset = alignUp(header.namesOffset + header.namesSize, sizeof(uint32_t));
+        header.indexBuckets = buckets;
+    }
+    uint64_t end = hasIndex ? header.indexOffset + buckets * sizeof(uint32_t) : header.namesOffset + header.namesSize;
+    if(stamps) {
+        header.flags |= FS_FLAG_FILE_STAMPS;
+        header.stampsOffset = alignUp(end, sizeof(uint64_t));
+        header.sourceId = sourceId;
+    }
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+
+    static const char padding[STORE_ALIGNMENT] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(padding, 1, header.dataOffset - sizeof(header), fp) == header.dataOffset - sizeof(header);
+    if(count * dim > 0 && dtype == FS_DTYPE_FLOAT32) {
+        ok = ok && fwrite(data, sizeof(float), count * dim, fp) == count * dim;
+    }
+    else if(count * dim > 0) {
+        vector<uint16_t> half(dim);
+        for(size_t i = 0; ok && i < count; i++) {
+            narrow_half_row(data + i * dim, dim, dtype, &half[0]);
+            ok = fwrite(&half[0], sizeof(uint16_t), dim, fp) == dim;
+        }
+    }
+    size_t namesPad = header.namesOffset - dataEnd;
+    ok = ok && fwrite(padding, 1, namesPad, fp) == namesPad;
+    ok = ok && fwrite(&offsets[0], sizeof(uint64_t), count + 1, fp) == count + 1;
+    for(size_t i = 0; ok && i < count; i++) {
+        size_t len = strlen(filenames[i]) + 1;
+        ok = fwrite(filenames[i], 1, len, fp) == len;
+    }
+    if(hasIndex) {
+        size_t pad = header.indexOffset - (header.namesOffset + header.namesSize);
+        ok = ok && fwrite(padding, 1, pad, fp) == pad;
+        ok = ok && fwrite(&index[0], sizeof(uint32_t), buckets, fp) == buckets;
+    }
+    if(stamps) {
+        size_t pad = header.stampsOffset - end;
+        ok = ok && fwrite(padding, 1, pad, fp) == pad;
+        if(count > 0) {
+            ok = ok && fwrite(stamps, sizeof(FeatureFileStamp), count, fp) == count;
+        }
+    }
+
+    if(fclose(fp) != 0 || !ok) {
+        printf("Error writing feature store %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+void widen_half_row( const uint16_t *in, size_t dim, FeatureStoreDType dtype, float *out ) {
+    for(size_t i = 0; i < dim; i++) {
+        out[i] = dtype == FS_DTYPE_BFLOAT16 ? bfloat16_to_float(in[i]) : half_to_float(in[i]);
+    }
+}
+
+void narrow_half_row( const float *in, size_t dim, FeatureStoreDType dtype, uint16_t *out ) {
+    for(size_t i = 0; i < dim; i++) {
+        out[i] = dtype == FS_DTYPE_BFLOAT16 ? float_to_bfloat16(in[i]) : float_to_half(in[i]);
+    }
+}
+
+int parse_feature_dtype( const char *name, FeatureStoreDType &dtype ) {
+    if(strcmp(name, "float32") == 0) {
+        dtype = FS_DTYPE_FLOAT32;
+    }
+    else if(strcmp(name, "float16") == 0) {
+        dtype = FS_DTYPE_FLOAT16;
+    }
+    else if(strcmp(name, "bfloat16") == 0) {
+        dtype = FS_DTYPE_BFLOAT16;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *feature_dtype_name( FeatureStoreDType dtype ) {
+    return dtype == FS_DTYPE_FLOAT16 ? "float16" : dtype == FS_DTYPE_BFLOAT16 ? "bfloat16" : "float32";
+}
@@ -0,0 +1,265 @@
+/*
+  Binary feature store
+
+  A feature store holds the same information as a feature CSV file (one
+  filename plus one feature vector per image) in a form that can be
+  memory-mapped and used directly, without any parsing.
+
+  File layout (all integers little-endian):
+
+    FeatureStoreHeader                          128 bytes
+    data[count][dim]                            row-major, starts at dataOffset
+    uint64_t nameOffsets[count + 1]             starts at namesOffset, a multiple of 8
+    char names[]                                0-terminated filenames
+    uint32_t nameIndex[indexBuckets]            optional, starts at indexOffset
+    FeatureFileStamp stamps[count]              optional, starts at stampsOffset
+
+  nameOffsets[i] is the position of filename i relative to the start of
+  the names blob (the byte following the offset table).
+
+  The data are floats, or with dtype FS_DTYPE_FLOAT16 / FS_DTYPE_BFLOAT16
+  16-bit half-precision values (half_float.h): half the size, for
+  embeddings that do not need full precision.
+
+  nameIndex is an open-addressing hash table from filename to row:
+  filename i sits in bucket feature_name_hash(name) & (indexBuckets - 1)
+  or, if that is taken, in one of the buckets after it (wrapping around).
+  Each bucket holds a row number or FS_INDEX_EMPTY.  It is present when
+  flags has FS_FLAG_NAME_INDEX set; stores written before it existed
+  have no index and get one built at load time.
+
+  stamps records, for every row, the size, modification time and
+  (optionally) content hash of the image file the row was computed
+  from, and sourceId identifies what computed it (e.g. the model).  They
+  are present when flags has FS_FLAG_FILE_STAMPS set and let a cache
+  tell which rows are still valid; see embedding_cache.h.
+ */
+
+#ifndef FEATURE_STORE_H
+#define FEATURE_STORE_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "feature_table.h"
+
+#define FEATURE_STORE_MAGIC "IRFS"
+#define FEATURE_STORE_VERSION 1
+
+// header flags
+#define FS_FLAG_NAME_INDEX 1u
+#define FS_FLAG_NORMALIZED 2u   // every row has unit L2 norm (or is zero)
+#define FS_FLAG_FILE_STAMPS 4u  // per-row source file stamps
+
+// unused bucket of the filename index
+#define FS_INDEX_EMPTY 0xffffffffu
+
+// element type of the feature matrix
+enum FeatureStoreDType {
+    FS_DTYPE_FLOAT32 = 1,
+    FS_DTYPE_FLOAT16 = 2,
+    FS_DTYPE_BFLOAT16 = 3
+};
+
+struct FeatureStoreHeader {
+    char magic[4];          // "IRFS"
+    uint32_t version;       // FEATURE_STORE_VERSION
+    uint32_t dtype;         // FeatureStoreDType
+    uint32_t flags;         // FS_FLAG_* bits
+    uint64_t count;         // number of rows (images)
+    uint64_t dim;           // number of features per row
+    uint64_t dataOffset;    // byte offset of the feature matrix
+    uint64_t namesOffset;   // byte offset of the filename table
+    uint64_t namesSize;     // size of the filename table in bytes
+    uint64_t indexOffset;   // byte offset of the filename index
+    uint64_t indexBuckets;  // number of index buckets, a power of two
+    uint64_t stampsOffset;  // byte offset of the file stamps
+    uint64_t sourceId;      // what computed the rows, 0 if unknown
+    uint64_t reserved[5];   // must be 0
+};
+
+// Identity of the file a row was computed from
+struct FeatureFileStamp {
+    uint64_t size;          // file size in bytes
+    int64_t mtime;          // modification time, nanoseconds since the epoch
+    uint64_t contentHash;   // feature_name_hash-style hash of the contents, 0 if not computed
+};
+
+/*
+  Read-only mapping of a whole file into memory.  Uses mmap on POSIX
+  systems and a file mapping on Windows.
+ */
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    // returns a non-zero value if the file cannot be opened or mapped
+    int open(const char *filename);
+    void close();
+
+    const unsigned char *data() const { return base; }
+    size_t size() const { return length; }
+
+    // drops the pages wholly inside [offset, offset + bytes) from the
+    // process's memory; they stay readable and are read again on access
+    void release(size_t offset, size_t bytes) const;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    const unsigned char *base;
+    size_t length;
+#ifdef _WIN32
+    void *fileHandle;
+    void *mapHandle;
+#endif
+};
+
+/*
+  A set of named feature vectors.
+
+  load() accepts either a binary feature store, which is memory-mapped,
+  or a feature CSV file in the read_image_data_csv format, which is read
+  into a FeatureTable.  Either way the rows are available as one
+  contiguous row-major float matrix, and rows can be looked up by
+  filename in constant time.  Row i starts at data() + i * stride(); the
+  stride is dim() for a mapped store, and dim() padded to whole cache
+  lines for a CSV file (see feature_table.h).
+
+  The rows of a float16 or bfloat16 store are widened to floats when it
+  is loaded, unless widenHalf is false: then data() is NULL and only
+  halfData() (dim() values per row) is available, for scorers that work
+  on the half-precision rows directly.
+ */
+class FeatureStore {
+public:
+    FeatureStore();
+    ~FeatureStore();
+
+    // returns a non-zero value if something goes wrong
+    int load(const char *filename, bool widenHalf = true);
+    void close();
+
+    bool isMapped() const { return mapped; }
+    bool isNormalized() const { return normalized; }
+    FeatureStoreDType dtype() const { return storedType; }
+    size_t count() const { return numRows; }
+    size_t dim() const { return numCols; }
+    size_t stride() const { return rowStride; }
+
+    const float *data() const { return matrix; }
+    const float *row(size_t i) const { return matrix + i * rowStride; }
+    const char *name(size_t i) const { return names[i]; }
+
+    // the mapped rows of a float16 or bfloat16 store, NULL otherwise
+    const uint16_t *halfData() const { return halfMatrix; }
+
+    // per-row file stamps, or NULL if the store has none (always NULL
+    // for CSV files)
+    const FeatureFileStamp *fileStamps() const { return stamps; }
+    uint64_t sourceId() const { return source; }
+
+    // row with the given filename, or -1 if there is none
+    long find(const char *filename) const;
+
+private:
+    FeatureStore(const FeatureStore &);
+    FeatureStore &operator=(const FeatureStore &);
+
+    int loadStore(const char *filename, bool widenHalf);
+    int loadCSV(const char *filename);
+    void buildIndex();
+
+    MappedFile file;
+    bool mapped;
+    bool normalized;
+    FeatureStoreDType storedType;
+    size_t numRows;
+    size_t numCols;
+    size_t rowStride;
+    const float *matrix;
+    const uint16_t *halfMatrix;
+    std::vector<const char *> names;
+
+    // filename index, from the file or built at load time
+    const uint32_t *nameIndex;
+    size_t indexBuckets;
+    std::vector<uint32_t> ownedIndex;
+
+    const FeatureFileStamp *stamps;
+    uint64_t source;
+
+    // storage used when the features come from a CSV file, or are
+    // widened from half precision
+    FeatureTable table;
+};
+
+/*
+  Hash used by the filename index (64-bit FNV-1a).
+ */
+uint64_t feature_name_hash( const char *filename );
+
+/*
+  Fills buckets (a power of two, more than count) with the filename
+  index of the given names.  Returns a non-zero value if there are too
+  many rows for 32-bit bucket entries.
+ */
+int build_name_index( const char * const *filenames, size_t count, uint32_t *index, size_t buckets );
+
+/*
+  Number of buckets used for count filenames: a power of two at least
+  twice as large, so probe sequences stay short.
+ */
+size_t name_index_buckets( size_t count );
+
+/*
+  Hash of all filenames of a feature file, in order.  Files derived from
+  a feature file (search indexes, quantized codes) record it to check
+  that they are used with the same file.
+ */
+uint64_t feature_names_fingerprint( const FeatureStore &store );
+
+/*
+  Fills stamp with the size and modification time of a file, and with a
+  hash of its contents if hashContent is true (contentHash is 0
+  otherwise).  Returns a non-zero value if the file cannot be read.
+ */
+int feature_file_stamp( const char *path, bool hashContent, FeatureFileStamp &stamp );
+
+/*
+  Returns true if the file starts with the feature store magic number.
+ */
+bool is_feature_store( const char *filename );
+
+/*
+  Writes count rows of dim floats, stored row-major in data, together
+  with their filenames and the filename index, as a binary feature
+  store.  normalized marks the rows as L2-normalized (FS_FLAG_NORMALIZED);
+  the caller is responsible for that being true.  If stamps is not NULL
+  it holds count file stamps, which are stored with sourceId.  dtype
+  chooses how the rows are stored; floats are rounded to the nearest
+  float16 or bfloat16 value.
+
+  The function returns a non-zero value in case of an error.
+ */
+int write_feature_store( const char *filename, const std::vector<char *> &filenames,
+                         const float *data, size_t count, size_t dim, bool normalized = false,
+                         const FeatureFileStamp *stamps = NULL, uint64_t sourceId = 0,
+                         FeatureStoreDType dtype = FS_DTYPE_FLOAT32 );
+
+/*
+  Converts one row between floats and float16 or bfloat16 values.
+ */
+void widen_half_row( const uint16_t *in, size_t dim, FeatureStoreDType dtype, float *out );
+void narrow_half_row( const float *in, size_t dim, FeatureStoreDType dtype, uint16_t *out );
+
+/*
+  Looks up a dtype by its command-line name: float32, float16 or
+  bfloat16.  Returns a non-zero value for any other name.
+ */
+int parse_feature_dtype( const char *name, FeatureStoreDType &dtype );
+const char *feature_dtype_name( FeatureStoreDType dtype );
+
+#endif
@@ -0,0 +1,82 @@
+/*
+  In-memory feature table: aligned matrix and filename arena.
+*/
+
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "feature_table.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+static float *alignedAlloc(size_t bytes) {
+#ifdef _WIN32
+    return (float *)_aligned_malloc(bytes, FEATURE_TABLE_ALIGNMENT);
+#else
+    void *p = NULL;
+    if(posix_memalign(&p, FEATURE_TABLE_ALIGNMENT, bytes) != 0) {
+        return NULL;
+    }
+    return (float *)p;
+#endif
+}
+
+static void alignedFree(float *p) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+FeatureTable::FeatureTable() : numRows(0), numCols(0), rowStride(0), matrix(NULL) {
+}
+
+FeatureTable::~FeatureTable() {
+    clear();
+}
+
+size_t FeatureTable::strideFor(size_t dim) {
+    const size_t perLine = FEATURE_TABLE_ALIGNMENT / sizeof(float);
+    return (dim + perLine - 1) / perLine * perLine;
+}
+
+int FeatureTable::allocate(size_t count, size_t dim, size_t nameBytes) {
+    clear();
+
+    size_t stride = strideFor(dim);
+    if(count > 0 && stride > 0) {
+        matrix = alignedAlloc(count * stride * sizeof(float));
+        if(matrix == NULL) {
+            return -1;
+        }
+        if(stride > dim) {
+            for(size_t i = 0; i < count; i++) {
+                memset(matrix + i * stride + dim, 0, (stride - dim) * sizeof(float));
+            }
+        }
+    }
+    arena.resize(nameBytes);
+    offsets.resize(count);
+
+    numRows = count;
+    numCols = dim;
+    rowStride = stride;
+    return 0;
+}
+
+void FeatureTable::clear() {
+    if(matrix) {
+        alignedFree(matrix);
+    }
+    matrix = NULL;
+    numRows = 0;
+    numCols = 0;
+    rowStride = 0;
+    vector<char>().swap(arena);
+    vector<size_t>().swap(offsets);
+}
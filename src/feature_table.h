@@ -0,0 +1,70 @@
+/*
+  In-memory feature table
+
+  The rows of a feature file read into memory (a feature CSV file; binary
+  stores are mapped, see feature_store.h) are kept in one float buffer,
+  aligned to FEATURE_TABLE_ALIGNMENT bytes, with the rows stride() floats
+  apart.  stride() is dim() rounded up to a multiple of the alignment, so
+  every row starts on a cache line and the vector kernels never split a
+  load across two lines; the padding floats are 0.
+
+  The filenames are kept in one arena, each 0-terminated, with the
+  offset of every name in a second array.  A table with a million rows
+  is thus three allocations instead of two million, and freeing it needs
+  no per-row delete[].
+ */
+
+#ifndef FEATURE_TABLE_H
+#define FEATURE_TABLE_H
+
+#include <cstddef>
+#include <vector>
+
+// alignment of the buffer and of every row, in bytes
+#define FEATURE_TABLE_ALIGNMENT 64
+
+class FeatureTable {
+public:
+    FeatureTable();
+    ~FeatureTable();
+
+    /*
+      Makes room for count rows of dim floats and nameBytes bytes of
+      filenames (terminators included), discarding the old contents.
+      The padding of every row is zeroed; the rest is left for the
+      caller to fill in.  Returns a non-zero value if the memory cannot
+      be allocated.
+     */
+    int allocate( size_t count, size_t dim, size_t nameBytes );
+    void clear();
+
+    size_t count() const { return numRows; }
+    size_t dim() const { return numCols; }
+    size_t stride() const { return rowStride; }
+
+    const float *data() const { return matrix; }
+    const float *row(size_t i) const { return matrix + i * rowStride; }
+    float *row(size_t i) { return matrix + i * rowStride; }
+    const char *name(size_t i) const { return &arena[offsets[i]]; }
+
+    // the arena and the offset of every name in it, for the readers that
+    // fill the table
+    char *nameArena() { return arena.empty() ? NULL : &arena[0]; }
+    size_t *nameOffsets() { return offsets.empty() ? NULL : &offsets[0]; }
+
+    // floats per row for dim features
+    static size_t strideFor( size_t dim );
+
+private:
+    FeatureTable(const FeatureTable &);
+    FeatureTable &operator=(const FeatureTable &);
+
+    size_t numRows;
+    size_t numCols;
+    size_t rowStride;
+    float *matrix;
+    std::vector<char> arena;
+    std::vector<size_t> offsets;
+};
+
+#endif
@@ -0,0 +1,289 @@
+/*
+  Buffered, checkpointed writer for feature CSV files.
+  See feature_writer.h for details.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "feature_writer.h"
+#include "file_sync.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Cut a file down to length bytes
+static int truncateFile(const char *filename, long long length) {
+#ifdef _WIN32
+    FILE *fp = fopen(filename, "r+b");
+    if(!fp) {
+        return -1;
+    }
+    int result = _chsize_s(_fileno(fp), length);
+    fclose(fp);
+    return result;
+#else
+    return truncate(filename, (off_t)length);
+#endif
+}
+
+void format_feature_value(string &out, float value) {
+    double d = value;
+
+    // values that do not fit the integer path go through printf
+    if(!(fabs(d) < 1e14)) {
+        char tmp[64];
+        snprintf(tmp, sizeof(tmp), "%.4f", value);
+        out += tmp;
+        return;
+    }
+
+    if(signbit(d)) {
+        out += '-';
+        d = -d;
+    }
+
+    // A float has a 24-bit mantissa, so d * 10000 is exact in a double and
+    // rounding it half-to-even gives the same digits printf produces.
+    double scaled = d * 10000.0;
+    double whole = floor(scaled);
+    double frac = scaled - whole;
+    unsigned long long n = (unsigned long long)whole;
+    if(frac > 0.5 || (frac == 0.5 && (n & 1))) {
+        n++;
+    }
+
+    char digits[32];
+    int p = sizeof(digits);
+    unsigned long long intPart = n / 10000;
+    unsigned int fracPart = (unsigned int)(n % 10000);
+
+    for(int i = 0; i < 4; i++) {
+        digits[--p] = '0' + fracPart % 10;
+        fracPart /= 10;
+    }
+    digits[--p] = '.';
+    do {
+        digits[--p] = '0' + intPart % 10;
+        intPart /= 10;
+    } while(intPart > 0);
+
+    out.append(digits + p, sizeof(digits) - p);
+}
+
+FeatureWriter::FeatureWriter() : fp(NULL), batchSize(256), pendingRows(0),
+                                 committedRows(0), committedBytes(0) {
+}
+
+FeatureWriter::~FeatureWriter() {
+    if(fp) {
+        close();
+    }
+}
+
+int FeatureWriter::open(const char *filename, bool resume, int batchRows) {
+    path = filename;
+    checkpointPath = path + ".ckpt";
+    batchSize = batchRows > 0 ? batchRows : 1;
+    buffer.clear();
+    existing.clear();
+    pendingRows = 0;
+    committedRows = 0;
+    committedBytes = 0;
+
+    if(resume) {
+        if(recover() != 0) {
+            return -1;
+        }
+        fp = fopen(filename, "ab");
+    }
+    else {
+        remove(checkpointPath.c_str());
+        fp = fopen(filename, "wb");
+    }
+
+    if(!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Truncate the output to the last checkpoint and collect the kept filenames
+int FeatureWriter::recover() {
+    FILE *in = fopen(path.c_str(), "rb");
+    if(!in) {
+        // nothing to resume from
+        remove(checkpointPath.c_str());
+        return 0;
+    }
+
+    fseek(in, 0, SEEK_END);
+    long long fileSize = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    // the checkpoint holds "<bytes> <rows>"
+    long long keepBytes = -1;
+    FILE *ck = fopen(checkpointPath.c_str(), "r");
+    if(ck) {
+        long long bytes;
+        unsigned long rows;
+        if(fscanf(ck, "%lld %lu", &bytes, &rows) == 2 && bytes >= 0 && bytes <= fileSize) {
+            keepBytes = bytes;
+        }
+        fclose(ck);
+    }
+
+    // Read the kept part of the file, remembering the filename of each
+    // complete line.  Without a checkpoint every complete line is kept.
+    long long limit = keepBytes >= 0 ? keepBytes : fileSize;
+    long long lastLineEnd = 0;
+    long long pos = 0;
+    bool atLineStart = true;
+    bool inName = false;
+    string name;
+    char chunk[65536];
+
+    while(pos < limit) {
+        size_t want = (size_t)min((long long)sizeof(chunk), limit - pos);
+        size_t got = fread(chunk, 1, want, in);
+        if(got == 0) {
+            break;
+        }
+        for(size_t i = 0; i < got; i++) {
+            char ch = chunk[i];
+            if(atLineStart) {
+                name.clear();
+                inName = true;
+                atLineStart = false;
+            }
+            if(ch == '\n') {
+                existing.push_back(name);
+                lastLineEnd = pos + i + 1;
+                atLineStart = true;
+                inName = false;
+            }
+            else if(inName) {
+                if(ch == ',') {
+                    inName = false;
+                }
+                else {
+                    name += ch;
+                }
+            }
+        }
+        pos += got;
+    }
+    fclose(in);
+
+    committedBytes = lastLineEnd;
+    committedRows = existing.size();
+
+    if(committedBytes < fileSize && truncateFile(path.c_str(), committedBytes) != 0) {
+        printf("Unable to truncate %s for resuming\n", path.c_str());
+        return -1;
+    }
+
+    printf("Resuming %s: keeping %lu rows (%lld bytes)\n",
+           path.c_str(), (unsigned long)committedRows, committedBytes);
+
+    return 0;
+}
+
+int FeatureWriter::append(const char *imageName, const float *data, size_t n) {
+    if(!fp) {
+        return -1;
+    }
+
+    buffer += imageName;
+    for(size_t i = 0; i < n; i++) {
+        buffer += ',';
+        format_feature_value(buffer, data[i]);
+    }
+    buffer += '\n';
+    pendingRows++;
+
+    if(pendingRows >= (size_t)batchSize) {
+        return commit();
+    }
+
+    return 0;
+}
+
+int FeatureWriter::append(const char *imageName, const vector<float> &data) {
+    return append(imageName, data.empty() ? NULL : &data[0], data.size());
+}
+
+int FeatureWriter::commit() {
+    if(!fp) {
+        return -1;
+    }
+
+    if(!buffer.empty()) {
+        if(fwrite(buffer.data(), 1, buffer.size(), fp) != buffer.size() || !sync_stream(fp)) {
+            printf("Error writing to %s\n", path.c_str());
+            return -1;
+        }
+        committedBytes += buffer.size();
+        committedRows += pendingRows;
+        buffer.clear();
+        pendingRows = 0;
+    }
+
+    return writeCheckpoint();
+}
+
+// Record the committed size; written to a temporary file, synced and
+// renamed so that a crash never leaves a half-written checkpoint behind
+int FeatureWriter::writeCheckpoint() {
+    string tmpPath = checkpointPath + ".tmp";
+    FILE *ck = fopen(tmpPath.c_str(), "w");
+    if(!ck) {
+        printf("Unable to write checkpoint %s\n", checkpointPath.c_str());
+        return -1;
+    }
+
+    fprintf(ck, "%lld %lu\n", committedBytes, (unsigned long)committedRows);
+    bool synced = sync_stream(ck);
+    if(fclose(ck) != 0 || !synced) {
+        printf("Unable to write checkpoint %s\n", checkpointPath.c_str());
+        return -1;
+    }
+
+    if(replace_file(tmpPath.c_str(), checkpointPath.c_str()) != 0) {
+        printf("Unable to write checkpoint %s\n", checkpointPath.c_str());
+        return -1;
+    }
+    sync_directory(checkpointPath.c_str());
+
+    return 0;
+}
+
+int FeatureWriter::close() {
+    if(!fp) {
+        return -1;
+    }
+
+    int result = commit();
+    if(fclose(fp) != 0) {
+        result = -1;
+    }
+    fp = NULL;
+
+    // a complete file does not need its checkpoint any more
+    if(result == 0) {
+        remove(checkpointPath.c_str());
+    }
+
+    return result;
+}
@@ -0,0 +1,89 @@
+/*
+  Buffered, checkpointed writer for feature CSV files
+
+  Produces files in the same format as append_image_data_csv (filename
+  followed by the features printed with "%.4f"), but keeps the output
+  file open and formats the rows into a memory buffer.  Rows are written
+  to disk in batches; after each batch a small checkpoint file
+  (<filename>.ckpt) records how many bytes and rows are safely on disk.
+  The batch is synced to the disk before the checkpoint is written, and
+  the checkpoint before it replaces the previous one, so a power loss
+  never leaves a checkpoint that claims rows the file does not have.
+
+  When an interrupted run is resumed, anything past the last checkpoint
+  is discarded and the filenames of the rows that were kept are
+  returned, so the caller can skip those images.
+ */
+
+#ifndef FEATURE_WRITER_H
+#define FEATURE_WRITER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+class FeatureWriter {
+public:
+    FeatureWriter();
+    ~FeatureWriter();
+
+    /*
+      Opens the output file.  If resume is false any existing file is
+      overwritten.  If resume is true the file is truncated to its last
+      checkpoint (or to its last complete line if there is no checkpoint)
+      and writing continues from there.
+
+      batchRows is the number of rows buffered between checkpoints.
+
+      The function returns a non-zero value in case of an error.
+     */
+    int open( const char *filename, bool resume = false, int batchRows = 256 );
+
+    /*
+      Filenames of the rows kept from a previous run when resuming.
+     */
+    const std::vector<std::string> &existingNames() const { return existing; }
+
+    /*
+      Appends one row.  Writes a batch and a checkpoint whenever
+      batchRows rows are pending.  Returns a non-zero value on error.
+     */
+    int append( const char *imageName, const float *data, size_t n );
+    int append( const char *imageName, const std::vector<float> &data );
+
+    /*
+      Writes all pending rows and records a checkpoint.
+     */
+    int commit();
+
+    /*
+      Commits pending rows, closes the file and removes the checkpoint.
+     */
+    int close();
+
+    size_t rowsWritten() const { return committedRows + pendingRows; }
+
+private:
+    FeatureWriter(const FeatureWriter &);
+    FeatureWriter &operator=(const FeatureWriter &);
+
+    int recover();
+    int writeCheckpoint();
+
+    std::string path;
+    std::string checkpointPath;
+    FILE *fp;
+    std::string buffer;
+    int batchSize;
+    size_t pendingRows;
+    size_t committedRows;
+    long long committedBytes;
+    std::vector<std::string> existing;
+};
+
+/*
+  Appends value to out formatted exactly like printf("%.4f").
+ */
+void format_feature_value( std::string &out, float value );
+
+#endif
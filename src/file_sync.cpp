@@ -0,0 +1,57 @@
+/*
+  Durable file replacement.  See file_sync.h.
+*/
+
+#include <cstdio>
+#include <string>
+#include "file_sync.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+bool sync_stream(FILE *fp) {
+    if(fflush(fp) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(fp)) == 0;
+#else
+    return fsync(fileno(fp)) == 0;
+#endif
+}
+
+bool sync_file(const char *path) {
+    FILE *fp = fopen(path, "r+b");
+    if(!fp) {
+        return false;
+    }
+    bool ok = sync_stream(fp);
+    return fclose(fp) == 0 && ok;
+}
+
+void sync_directory(const char *path) {
+#ifndef _WIN32
+    string name = path;
+    size_t slash = name.rfind('/');
+    string directory = slash == string::npos ? "." : name.substr(0, slash + 1);
+    int fd = open(directory.c_str(), O_RDONLY);
+    if(fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+int replace_file(const char *from, const char *to) {
+    // Windows refuses to rename onto an existing file
+#ifdef _WIN32
+    remove(to);
+#endif
+    return rename(from, to);
+}
@@ -0,0 +1,41 @@
+/*
+  Durable file replacement
+
+  The feature writers replace files by writing a temporary file and
+  renaming it over the old one.  A rename alone only protects against a
+  crash of the program: after a power loss the rename can reach the disk
+  before the data of the new file, leaving an empty or truncated file
+  under the old name.  So the new file is synced before the rename, and
+  its directory after it, with the functions below.
+ */
+
+#ifndef FILE_SYNC_H
+#define FILE_SYNC_H
+
+#include <cstdio>
+
+/*
+  Flushes a stream and writes its data through to the disk.  Returns
+  false on failure.
+ */
+bool sync_stream( FILE *fp );
+
+/*
+  Writes the data of a closed file through to the disk.  Returns false
+  on failure.
+ */
+bool sync_file( const char *path );
+
+/*
+  Makes a rename into the directory of path durable.  Does nothing on
+  Windows, which cannot sync a directory.
+ */
+void sync_directory( const char *path );
+
+/*
+  rename that replaces an existing target on every platform.  Returns
+  0 on success.
+ */
+int replace_file( const char *from, const char *to );
+
+#endif
@@ -0,0 +1,266 @@
+/*
+  Single-pass feature extractors.
+*/
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "fused_features.h"
+#include "histogram_engine.h"
+#include "image_features.h"
+
+using namespace cv;
+using namespace std;
+
+// OpenCV's fixed-point BGR2GRAY weights (15-bit)
+#define GRAY_SHIFT 15
+#define GRAY_B 3735
+#define GRAY_G 19235
+#define GRAY_R 9798
+
+// Squared magnitudes are bucketed by their float exponent and top
+// MAGNITUDE_BITS mantissa bits, so every value below 2^(MAGNITUDE_BITS + 1)
+// has its own bucket and larger ones share buckets about 0.1% wide.
+// |gx|, |gy| <= 4 * 255, so squared magnitudes stay below 2^21.
+#ifndef MAGNITUDE_BITS
+#define MAGNITUDE_BITS 10
+#endif
+#define MAX_MAGNITUDE_LOG2 21
+#define MAGNITUDE_BUCKETS ((MAX_MAGNITUDE_LOG2 << MAGNITUDE_BITS) + 1)
+
+// Bucket 0 holds 0, bucket 1 holds 1 (float exponent 0), and so on.  No
+// branch, since small and large values are equally common.
+static inline int magnitudeBucket(int squared) {
+    float value = (float)squared;
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return max((int)(bits >> (23 - MAGNITUDE_BITS)) - (127 << MAGNITUDE_BITS) + 1, 0);
+}
+
+// Smallest squared magnitude that falls into a bucket
+static float bucketLowerBound(int bucket) {
+    if(bucket == 0) {
+        return 0.0f;
+    }
+    unsigned int bits = (unsigned int)(bucket - 1 + (127 << MAGNITUDE_BITS)) << (23 - MAGNITUDE_BITS);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Converts a BGR row to gray, with one reflected pixel on each side
+// (BORDER_REFLECT_101, as used by cv::Sobel)
+static void grayRow(const unsigned char *p, int cols, unsigned char *gray) {
+    for(int j = 0; j < cols; j++, p += 3) {
+        gray[j + 1] = (unsigned char)((p[0] * GRAY_B + p[1] * GRAY_G + p[2] * GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+    }
+    gray[0] = gray[2];
+    gray[cols + 1] = gray[cols - 1];
+}
+
+// Interleaved copies of the magnitude buckets, so that runs of equal
+// gradients (flat regions) do not serialize on one counter
+#define BUCKET_COPIES 4
+
+// 3x3 Sobel of the center row into squared magnitudes.  Kept separate
+// from the bucketing so that the compiler can vectorize it.
+static int sobelRow(const unsigned char *above, const unsigned char *center, const unsigned char *below,
+                    int cols, int *squared) {
+    int maxSquared = 0;
+    for(int j = 0; j < cols; j++) {
+        int gx = (above[j + 2] - above[j]) + 2 * (center[j + 2] - center[j]) + (below[j + 2] - below[j]);
+        int gy = (below[j] + 2 * below[j + 1] + below[j + 2]) - (above[j] + 2 * above[j + 1] + above[j + 2]);
+        squared[j] = gx * gx + gy * gy;
+        maxSquared = max(maxSquared, squared[j]);
+    }
+    return maxSquared;
+}
+
+static void countMagnitudes(const int *squared, int cols, unsigned int *buckets) {
+    unsigned int *b0 = buckets;
+    unsigned int *b1 = buckets + MAGNITUDE_BUCKETS;
+    unsigned int *b2 = buckets + 2 * MAGNITUDE_BUCKETS;
+    unsigned int *b3 = buckets + 3 * MAGNITUDE_BUCKETS;
+    int j = 0;
+    for(; j + 4 <= cols; j += 4) {
+        b0[magnitudeBucket(squared[j])]++;
+        b1[magnitudeBucket(squared[j + 1])]++;
+        b2[magnitudeBucket(squared[j + 2])]++;
+        b3[magnitudeBucket(squared[j + 3])]++;
+    }
+    for(; j < cols; j++) {
+        b0[magnitudeBucket(squared[j])]++;
+    }
+}
+
+void computeColorTextureHistograms(Mat &image, int colorBins, int textureBins,
+                                   vector<float> &colorHist, vector<float> &textureHist) {
+    if(image.rows < 2 || image.cols < 2) {
+        colorHist = computeRGBHistogram(image, colorBins);
+        textureHist = computeTextureHistogram(image, textureBins);
+        return;
+    }
+
+    int rows = image.rows;
+    int cols = image.cols;
+    RGBHistogramCounter color(colorBins);
+    vector<unsigned int> buckets(BUCKET_COPIES * MAGNITUDE_BUCKETS, 0);
+    vector<int> squared(cols);
+    int maxSquared = 0;
+
+    // Rolling window of three padded gray rows; row i lives in slot i % 3
+    vector<unsigned char> window(3 * (cols + 2));
+    unsigned char *gray[3] = { &window[0], &window[cols + 2], &window[2 * (cols + 2)] };
+
+    for(int i = 0; i < rows; i++) {
+        const unsigned char *p = image.ptr<unsigned char>(i);
+        color.addRow(p, cols);
+        grayRow(p, cols, gray[i % 3]);
+
+        // Row i completes the window of row i - 1 (row -1 reflects to row 1)
+        if(i >= 1) {
+            int above = i >= 2 ? (i - 2) % 3 : i % 3;
+            maxSquared = max(maxSquared, sobelRow(gray[above], gray[(i - 1) % 3], gray[i % 3], cols, &squared[0]));
+            countMagnitudes(&squared[0], cols, &buckets[0]);
+        }
+    }
+    // The last row reflects to the one above it
+    int last = rows - 1;
+    maxSquared = max(maxSquared, sobelRow(gray[(last - 1) % 3], gray[last % 3], gray[(last - 1) % 3], cols, &squared[0]));
+    countMagnitudes(&squared[0], cols, &buckets[0]);
+
+    // Color histogram
+    vector<unsigned int> colorCounts(colorBins * colorBins * colorBins, 0);
+    int totalPixels = color.finish(&colorCounts[0]);
+    colorHist.assign(colorCounts.size(), 0.0);
+    for(int i = 0; i < (int)colorHist.size(); i++) {
+        colorHist[i] = (float)colorCounts[i] / totalPixels;
+    }
+
+    // Map the buckets to magnitude bins scaled by the largest magnitude,
+    // with the same arithmetic as computeTextureHistogram
+    textureHist.assign(textureBins, 0.0);
+    double maxVal = sqrt((float)maxSquared);
+    for(int b = 0; b < MAGNITUDE_BUCKETS; b++) {
+        unsigned int count = buckets[b] + buckets[b + MAGNITUDE_BUCKETS]
+                           + buckets[b + 2 * MAGNITUDE_BUCKETS] + buckets[b + 3 * MAGNITUDE_BUCKETS];
+        if(count == 0) {
+            continue;
+        }
+        int bin = 0;
+        if(maxVal > 0) {
+            float mag = sqrt(bucketLowerBound(b));
+            bin = (int)((mag / maxVal) * textureBins);
+            if(bin >= textureBins) bin = textureBins - 1;
+        }
+        textureHist[bin] += count;
+    }
+    for(int i = 0; i < textureBins; i++) {
+        textureHist[i] = textureHist[i] / totalPixels;
+    }
+}
+
+int edgeDensityScale(int rows, int cols) {
+    int side = min(rows, cols);
+    int scale = 1;
+    while(scale < 4 && side / (2 * scale) >= EDGE_DENSITY_MIN_SIDE) {
+        scale *= 2;
+    }
+    return scale;
+}
+
+SunsetFeatures computeSunsetFeatures(Mat &image) {
+    int rows = image.rows;
+    int cols = image.cols;
+
+    // Same regions as the separate extractors
+    int warmEnd = (int)(rows * 0.6);
+    int topEnd = rows / 3;
+    int bottomStart = (2 * rows) / 3;
+
+    int warmPixels = 0;
+    int warmTotal = 0;
+    float topR = 0, topG = 0, topB = 0;
+    float bottomR = 0, bottomG = 0, bottomB = 0;
+    int topCount = 0, bottomCount = 0;
+
+    // Reduced gray image for the edge density, built from scale x scale
+    // blocks (leftover rows and columns are dropped)
+    int scale = edgeDensityScale(rows, cols);
+    int smallRows = rows / scale;
+    int smallCols = cols / scale;
+    int blockArea = scale * scale;
+    Mat small(smallRows, smallCols, CV_8U);
+    vector<unsigned int> blockSums(smallCols, 0);
+
+    for(int i = 0; i < rows; i++) {
+        const unsigned char *p = image.ptr<unsigned char>(i);
+
+        if(i < warmEnd) {
+            for(int j = 0; j < cols; j++) {
+                float b = p[3 * j];
+                float g = p[3 * j + 1];
+                float r = p[3 * j + 2];
+
+                // Warm colors: R > G > B, with R at least 20% above G
+                if(r > g && g >= b && r > 100 && r > g * 1.2) {
+                    warmPixels++;
+                }
+            }
+            warmTotal += cols;
+        }
+
+        if(i < topEnd) {
+            for(int j = 0; j < cols; j++) {
+                topB += p[3 * j];
+                topG += p[3 * j + 1];
+                topR += p[3 * j + 2];
+            }
+            topCount += cols;
+        }
+        else if(i >= bottomStart) {
+            for(int j = 0; j < cols; j++) {
+                bottomB += p[3 * j];
+                bottomG += p[3 * j + 1];
+                bottomR += p[3 * j + 2];
+            }
+            bottomCount += cols;
+        }
+
+        if(i < smallRows * scale) {
+            for(int j = 0; j < smallCols * scale; j++) {
+                const unsigned char *q = p + 3 * j;
+                blockSums[j / scale] += (q[0] * GRAY_B + q[1] * GRAY_G + q[2] * GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT;
+            }
+            if(i % scale == scale - 1) {
+                unsigned char *out = small.ptr<unsigned char>(i / scale);
+                for(int j = 0; j < smallCols; j++) {
+                    out[j] = (unsigned char)((blockSums[j] + blockArea / 2) / blockArea);
+                    blockSums[j] = 0;
+                }
+            }
+        }
+    }
+
+    SunsetFeatures features;
+    features.warmScore = (float)warmPixels / warmTotal;
+
+    topR /= topCount;
+    topG /= topCount;
+    topB /= topCount;
+    bottomR /= bottomCount;
+    bottomG /= bottomCount;
+    bottomB /= bottomCount;
+    features.gradient = (topR - bottomR) + (topG - bottomG) * 0.5;
+
+    features.edgeDensity = 0.0;
+    if(smallRows > 0 && smallCols > 0) {
+        Mat edges;
+        Canny(small, edges, 50, 150);
+        features.edgeDensity = (float)countNonZero(edges) / (smallRows * smallCols) / scale;
+    }
+
+    return features;
+}
@@ -0,0 +1,78 @@
+/*
+  Single-pass feature extractors
+
+  The extractors in image_features.cpp each walk the whole image and
+  some allocate full-frame temporaries (gray image, Sobel outputs,
+  magnitudes).  The fused versions here read every image row once and
+  compute several features from it, keeping only a few rows of state.
+  Their results match the separate extractors within a small tolerance.
+ */
+
+#ifndef FUSED_FEATURES_H
+#define FUSED_FEATURES_H
+
+#include <cmath>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+/*
+  computeRGBHistogram(image, colorBins) and
+  computeTextureHistogram(image, textureBins) in one pass.
+
+  Gray values use OpenCV's fixed-point BGR2GRAY weights and the 3x3 Sobel
+  runs on a rolling window of three gray rows with the same reflected
+  border as cv::Sobel.  Gradient magnitudes are not computed per pixel:
+  squared magnitudes are counted in fine buckets (exact below 2048,
+  about 0.1% wide above) and mapped to the final bins once the largest
+  magnitude is known.  Only pixels in a bucket that straddles a bin edge
+  can land in a neighbouring bin; on the olympus set the texture
+  histograms differ from computeTextureHistogram by 2e-4 in L1 on
+  average (at most 1.3e-3).
+
+  The color histogram is identical to computeRGBHistogram.  Images
+  smaller than 2x2 fall back to the separate extractors.
+ */
+void computeColorTextureHistograms( cv::Mat &image, int colorBins, int textureBins,
+                                    std::vector<float> &colorHist, std::vector<float> &textureHist );
+
+/*
+  The three sunset features of custom_sunset_match.
+ */
+struct SunsetFeatures {
+    float warmScore;    // computeWarmColorScore
+    float gradient;     // computeVerticalGradient
+    float edgeDensity;  // estimate of computeEdgeDensity
+};
+
+/*
+  Sunset features in one row sweep.  The warm ratio and the top/bottom
+  color means are accumulated in the same order as the separate
+  extractors, so they are identical.  While sweeping, the rows are also
+  converted to gray and box-averaged into an image reduced by
+  edgeDensityScale(), and Canny runs on that.  The reduced edge density
+  is divided by the scale (edge length shrinks with the side, area with
+  its square), so it estimates the full-resolution density.
+ */
+SunsetFeatures computeSunsetFeatures( cv::Mat &image );
+
+/*
+  Reduction used for the edge density: 4 or 2 while the short side stays
+  at least EDGE_DENSITY_MIN_SIDE pixels, otherwise 1.
+ */
+#define EDGE_DENSITY_MIN_SIDE 160
+int edgeDensityScale( int rows, int cols );
+
+/*
+  The distance custom_sunset_match ranks by, given the sunset features
+  of two images and the cosine distance of their embeddings (1 when
+  either has none): 40% warm score, 20% vertical gradient (divided by 50
+  to bring it to 0-1), 10% edge density and 30% embedding distance.
+ */
+inline float sunset_distance( const SunsetFeatures &a, const SunsetFeatures &b, float dnnDistance ) {
+    float warmDiff = fabs(a.warmScore - b.warmScore);
+    float gradDiff = fabs(a.gradient - b.gradient);
+    float edgeDiff = fabs(a.edgeDensity - b.edgeDensity);
+    return 0.40 * warmDiff + 0.20 * (gradDiff / 50.0) + 0.10 * edgeDiff + 0.30 * dnnDistance;
+}
+
+#endif
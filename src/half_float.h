@@ -0,0 +1,102 @@
+/*
+  Half-precision floats
+
+  Two 16-bit formats for storing embeddings at half the size of floats:
+
+  - float16 (IEEE 754 binary16): 1 sign, 5 exponent and 10 mantissa
+    bits.  About 3 decimal digits over a range of 6e-8 to 65504, which
+    suits normalized embeddings, whose values are all in [-1, 1].
+  - bfloat16: the upper 16 bits of a float, so 1 sign, 8 exponent and 7
+    mantissa bits.  The full float range with about 2 decimal digits.
+
+  Narrowing rounds to the nearest value (ties to even); widening is
+  exact.  The distance kernels widen whole vectors with F16C and shifts
+  (distance_kernels.h); these are the scalar conversions.
+ */
+
+#ifndef HALF_FLOAT_H
+#define HALF_FLOAT_H
+
+#include <cstring>
+#include <stdint.h>
+
+inline float half_to_float( uint16_t h ) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+    if(exponent == 0) {
+        // zero or subnormal: mantissa * 2^-24, exact in a float
+        float value = mantissa * 5.9604644775390625e-8f;
+        memcpy(&bits, &value, sizeof(bits));
+        bits |= sign;
+    }
+    else if(exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline uint16_t float_to_half( float f ) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    uint32_t magnitude = bits & 0x7fffffff;
+
+    if(magnitude >= 0x7f800000) {
+        // infinity stays infinity, NaN stays a (quiet) NaN
+        return (uint16_t)(sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00));
+    }
+    if(magnitude >= 0x477ff000) {
+        // 65520 and up round to infinity
+        return (uint16_t)(sign | 0x7c00);
+    }
+    if(magnitude < 0x38800000) {
+        // below the smallest normal half: a multiple of 2^-24
+        uint32_t shift = 126 - (magnitude >> 23);
+        if(shift > 24) {
+            return (uint16_t)sign;
+        }
+        uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+        uint32_t result = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (result & 1))) {
+            result++;
+        }
+        return (uint16_t)(sign | result);
+    }
+
+    // rebias the exponent and round off 13 mantissa bits; a carry moves
+    // into the exponent, as it should
+    uint32_t result = (magnitude - 0x38000000) >> 13;
+    uint32_t rest = magnitude & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (result & 1))) {
+        result++;
+    }
+    return (uint16_t)(sign | result);
+}
+
+inline float bfloat16_to_float( uint16_t b ) {
+    uint32_t bits = (uint32_t)b << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+inline uint16_t float_to_bfloat16( float f ) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if((bits & 0x7fffffff) > 0x7f800000) {
+        return (uint16_t)((bits >> 16) | 0x40);
+    }
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+#endif
@@ -0,0 +1,156 @@
+/*
+  Lookup-table histogram construction.
+*/
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "histogram_engine.h"
+
+using namespace cv;
+using namespace std;
+
+// Interleaved copies of the counts
+#define SUB_HISTOGRAMS 4
+
+// Above this many counters the copies no longer fit in L1/L2 and a single
+// histogram is faster
+#define MAX_SUB_HISTOGRAM_BINS 16384
+
+// Largest R + G + B of an 8-bit pixel
+#define MAX_INTENSITY (3 * 255)
+
+// rg chromaticity bin of every (intensity, value) pair, for one bin count
+struct ChromaticityLut {
+    vector<unsigned short> bin;     // [intensity * 256 + value]
+};
+
+static const ChromaticityLut &chromaticityLut(int bins) {
+    static mutex lock;
+    static map<int, unique_ptr<ChromaticityLut>> tables;
+
+    lock_guard<mutex> guard(lock);
+    unique_ptr<ChromaticityLut> &table = tables[bins];
+    if(!table) {
+        table.reset(new ChromaticityLut());
+        table->bin.resize((MAX_INTENSITY + 1) * 256, 0);
+        for(int s = 1; s <= MAX_INTENSITY; s++) {
+            // Same float arithmetic as the per-pixel formula it replaces
+            float intensity = (float)s;
+            for(int v = 0; v < 256; v++) {
+                float chrom = (float)v / intensity;
+                int b = (int)(chrom * bins);
+                if(b >= bins) b = bins - 1;
+                table->bin[s * 256 + v] = (unsigned short)b;
+            }
+        }
+    }
+    return *table;
+}
+
+// Adds the interleaved copies into counts
+static void mergeSubHistograms(const vector<unsigned int> &sub, int copies, int numBins, unsigned int *counts) {
+    for(int c = 0; c < copies; c++) {
+        const unsigned int *copy = &sub[c * numBins];
+        for(int i = 0; i < numBins; i++) {
+            counts[i] += copy[i];
+        }
+    }
+}
+
+int count_rg_histogram(const Mat &image, int startRow, int endRow, int bins, unsigned int *counts) {
+    int numBins = bins * bins;
+    int copies = numBins <= MAX_SUB_HISTOGRAM_BINS ? SUB_HISTOGRAMS : 1;
+    vector<unsigned int> sub(copies * numBins, 0);
+    const unsigned short *lut = &chromaticityLut(bins).bin[0];
+    int total = 0;
+
+    for(int i = startRow; i < endRow; i++) {
+        const unsigned char *p = image.ptr<unsigned char>(i);
+        int j = 0;
+
+        if(copies == SUB_HISTOGRAMS) {
+            unsigned int *h0 = &sub[0];
+            unsigned int *h1 = &sub[numBins];
+            unsigned int *h2 = &sub[2 * numBins];
+            unsigned int *h3 = &sub[3 * numBins];
+            for(; j + 4 <= image.cols; j += 4, p += 12) {
+                int s0 = p[0] + p[1] + p[2];
+                int s1 = p[3] + p[4] + p[5];
+                int s2 = p[6] + p[7] + p[8];
+                int s3 = p[9] + p[10] + p[11];
+                // Black pixels (sum 0) add 0 to bin 0, so there is no branch
+                h0[lut[s0 * 256 + p[2]] * bins + lut[s0 * 256 + p[1]]] += s0 != 0;
+                h1[lut[s1 * 256 + p[5]] * bins + lut[s1 * 256 + p[4]]] += s1 != 0;
+                h2[lut[s2 * 256 + p[8]] * bins + lut[s2 * 256 + p[7]]] += s2 != 0;
+                h3[lut[s3 * 256 + p[11]] * bins + lut[s3 * 256 + p[10]]] += s3 != 0;
+                total += (s0 != 0) + (s1 != 0) + (s2 != 0) + (s3 != 0);
+            }
+        }
+
+        for(; j < image.cols; j++, p += 3) {
+            int s = p[0] + p[1] + p[2];
+            if(s == 0) {
+                continue;
+            }
+            sub[lut[s * 256 + p[2]] * bins + lut[s * 256 + p[1]]]++;
+            total++;
+        }
+    }
+
+    mergeSubHistograms(sub, copies, numBins, counts);
+    return total;
+}
+
+RGBHistogramCounter::RGBHistogramCounter(int bins) : pixels(0) {
+    numBins = bins * bins * bins;
+    copies = numBins <= MAX_SUB_HISTOGRAM_BINS ? SUB_HISTOGRAMS : 1;
+    sub.assign(copies * numBins, 0);
+
+    // Each channel's share of the linear bin index
+    for(int v = 0; v < 256; v++) {
+        int b = (v * bins) / 256;
+        if(b >= bins) b = bins - 1;
+        rIndex[v] = b * bins * bins;
+        gIndex[v] = b * bins;
+        bIndex[v] = b;
+    }
+}
+
+void RGBHistogramCounter::addRow(const unsigned char *p, int cols) {
+    int j = 0;
+
+    if(copies == SUB_HISTOGRAMS) {
+        unsigned int *h0 = &sub[0];
+        unsigned int *h1 = &sub[numBins];
+        unsigned int *h2 = &sub[2 * numBins];
+        unsigned int *h3 = &sub[3 * numBins];
+        for(; j + 4 <= cols; j += 4, p += 12) {
+            h0[bIndex[p[0]] + gIndex[p[1]] + rIndex[p[2]]]++;
+            h1[bIndex[p[3]] + gIndex[p[4]] + rIndex[p[5]]]++;
+            h2[bIndex[p[6]] + gIndex[p[7]] + rIndex[p[8]]]++;
+            h3[bIndex[p[9]] + gIndex[p[10]] + rIndex[p[11]]]++;
+        }
+    }
+
+    for(; j < cols; j++, p += 3) {
+        sub[bIndex[p[0]] + gIndex[p[1]] + rIndex[p[2]]]++;
+    }
+    pixels += cols;
+}
+
+int RGBHistogramCounter::finish(unsigned int *counts) const {
+    mergeSubHistograms(sub, copies, numBins, counts);
+    return pixels;
+}
+
+int count_rgb_histogram(const Mat &image, int startRow, int endRow, int bins, unsigned int *counts) {
+    RGBHistogramCounter counter(bins);
+    for(int i = startRow; i < endRow; i++) {
+        counter.addRow(image.ptr<unsigned char>(i), image.cols);
+    }
+    return counter.finish(counts);
+}
@@ -0,0 +1,69 @@
+/*
+  Lookup-table histogram construction
+
+  computeRGHistogram and computeRGBHistogram are the hot loops when
+  features are computed live.  Instead of dividing and clamping per pixel,
+  the bin of each pixel comes from precomputed tables:
+
+  - 3D RGB: one table per channel maps the 8-bit value straight to its
+    share of the linear bin index, so a pixel costs three loads and two
+    adds.
+  - rg chromaticity: a table indexed by R + G + B (0..765) and by the R
+    or G value holds the bin that the original float formula gives, so
+    the results are bit-identical.  Tables are built once per bin count
+    and shared between threads.
+
+  Counts go into several interleaved sub-histograms (consecutive pixels
+  hit different copies), so runs of same-colored pixels do not stall on
+  a store-to-load dependency through the same counter.  The copies are
+  summed at the end.
+
+  The functions work on raw row pointers of an 8-bit, 3-channel BGR
+  image and accept any bin count.
+ */
+
+#ifndef HISTOGRAM_ENGINE_H
+#define HISTOGRAM_ENGINE_H
+
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+/*
+  Adds the rg chromaticity bins (bins x bins, index r_bin * bins + g_bin)
+  of rows [startRow, endRow) to counts.  Black pixels are skipped.
+  Returns the number of pixels counted.
+ */
+int count_rg_histogram( const cv::Mat &image, int startRow, int endRow, int bins, unsigned int *counts );
+
+/*
+  Adds the 3D RGB bins (bins^3, index r_bin * bins^2 + g_bin * bins +
+  b_bin) of rows [startRow, endRow) to counts.  Returns the number of
+  pixels counted.
+ */
+int count_rgb_histogram( const cv::Mat &image, int startRow, int endRow, int bins, unsigned int *counts );
+
+/*
+  The engine behind count_rgb_histogram, fed one row at a time, for
+  extractors that make a single pass over the image and compute other
+  features from the same rows.
+ */
+class RGBHistogramCounter {
+public:
+    explicit RGBHistogramCounter( int bins );
+
+    // Counts cols BGR pixels starting at row
+    void addRow( const unsigned char *row, int cols );
+
+    // Adds the counts so far to counts (bins^3 entries) and returns the
+    // number of pixels counted
+    int finish( unsigned int *counts ) const;
+
+private:
+    int numBins;
+    int copies;
+    int pixels;
+    std::vector<unsigned int> sub;
+    int rIndex[256], gIndex[256], bIndex[256];
+};
+
+#endif
@@ -1,7 +1,16 @@
 /*
   Histogram Matching using rg chromaticity histogram and histogram intersection
   
-  Usage: histogram_match <target_image> <image_directory> <num_matches>
+  Usage: histogram_match <target_image> <image_directory> <num_matches> [--threads <n>]
+         [--decode-scale <1|2|4|8|auto>] [--decode-compare] [--stats] [--stats-json <file>]
+  
+  Only global distributions are computed, so JPEGs can be decoded at
+  reduced resolution; --decode-compare reports how the ranking changes.
+  --stats prints where the time went (see stage_stats.h).
+  
+  The intersection of an image is abandoned as soon as the bins left
+  cannot bring its distance below that of the current K-th best image
+  (see early_abandon.h); the work skipped is reported at the end.
 */
 
 #include <opencv2/opencv.hpp>
@@ -9,96 +18,29 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
-#include <dirent.h>
-#include "csv_util.h"
+#include <limits>
+#include "image_features.h"
+#include "image_pipeline.h"
+#include "top_k.h"
+#include "rank_compare.h"
+#include "stage_stats.h"
+#include "early_abandon.h"
 
 using namespace cv;
 using namespace std;
 
-// Compute 2D rg chromaticity histogram
-// bins: number of bins for each dimension (default 16)
-vector<float> computeRGHistogram(Mat &image, int bins = 16) {
-    vector<float> histogram(bins * bins, 0.0);
-    
-    int totalPixels = 0;
-    
-    for(int i = 0; i < image.rows; i++) {
-        for(int j = 0; j < image.cols; j++) {
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            
-            float b = pixel[0];
-            float g = pixel[1];
-            float r = pixel[2];
-            
-            // Compute intensity
-            float intensity = r + g + b;
-            
-            // Skip very dark pixels to avoid division by zero
-            if(intensity < 1.0) {
-                continue;
-            }
-            
-            // Compute rg chromaticity
-            float r_chrom = r / intensity;
-            float g_chrom = g / intensity;
-            
-            // Map to bin indices [0, bins-1]
-            int r_bin = (int)(r_chrom * bins);
-            int g_bin = (int)(g_chrom * bins);
-            
-            // Clamp to valid range
-            if(r_bin >= bins) r_bin = bins - 1;
-            if(g_bin >= bins) g_bin = bins - 1;
-            
-            // Increment histogram bin
-            int binIndex = r_bin * bins + g_bin;
-            histogram[binIndex]++;
-            totalPixels++;
-        }
-    }
-    
-    // Normalize histogram
-    for(int i = 0; i < histogram.size(); i++) {
-        histogram[i] = histogram[i] / totalPixels;
-    }
-    
-    return histogram;
-}
-
-// Compute histogram intersection distance
-// Returns distance (1 - intersection) so smaller is better
-float histogramIntersection(vector<float> &hist1, vector<float> &hist2) {
-    if(hist1.size() != hist2.size()) {
-        printf("Error: Histograms have different sizes!\n");
-        return -1.0;
-    }
-    
-    float intersection = 0.0;
-    
-    for(int i = 0; i < hist1.size(); i++) {
-        intersection += min(hist1[i], hist2[i]);
-    }
-    
-    // Return distance (1 - intersection)
-    // Higher intersection = more similar = smaller distance
-    return 1.0 - intersection;
-}
-
-// Structure to hold image filename and its distance from target
-struct ImageMatch {
-    string filename;
-    float distance;
+int main(int argc, char *argv[]) {
     
-    bool operator<(const ImageMatch &other) const {
-        return distance < other.distance;
+    // Pull out --threads, --decode-scale and --stats before looking at the positional arguments
+    PipelineOptions pipelineOptions;
+    if(parse_pipeline_options(argc, argv, pipelineOptions, true) != 0 || parse_stats_options(argc, argv) != 0) {
+        return -1;
     }
-};
-
-int main(int argc, char *argv[]) {
     
     // Check arguments
     if(argc < 4) {
-        printf("Usage: %s <target_image> <image_directory> <num_matches>\n", argv[0]);
+        printf("Usage: %s <target_image> <image_directory> <num_matches> [--threads <n>]\n", argv[0]);
+        printf("       [--decode-scale <1|2|4|8|auto>] [--decode-compare] [--stats] [--stats-json <file>]\n");
         printf("Example: %s images/pic.0164.jpg images 5\n", argv[0]);
         return -1;
     }
@@ -108,8 +50,8 @@ int main(int argc, char *argv[]) {
     int numMatches = atoi(argv[3]);
     int bins = 16; // 16x16 bins for rg chromaticity
     
-    // Load target image
-    Mat targetImage = imread(targetImagePath);
+    // Load target image (at the same decode scale as the database images)
+    Mat targetImage = load_image(targetImagePath, pipelineOptions);
     if(targetImage.empty()) {
         printf("Error: Could not load target image: %s\n", targetImagePath);
         return -1;
@@ -121,63 +63,78 @@ int main(int argc, char *argv[]) {
     // Extract histogram from target image
     vector<float> targetHist = computeRGHistogram(targetImage, bins);
     printf("Computed histogram with %lu bins\n", targetHist.size());
+    EarlyAbandonDistance intersection(&targetHist[0], targetHist.size(), ABANDON_INTERSECTION);
     
-    // Open directory
-    DIR *dirp = opendir(imageDir);
-    if(dirp == NULL) {
-        printf("Error: Cannot open directory %s\n", imageDir);
-        return -1;
+    // Full-resolution target histogram for --decode-compare
+    vector<float> targetFullHist;
+    if(pipelineOptions.compareFullDecode) {
+        Mat targetFull = imread(targetImagePath);
+        targetFullHist = computeRGHistogram(targetFull, bins);
     }
     
-    // Process all images in directory
-    vector<ImageMatch> matches;
-    struct dirent *dp;
-    char buffer[512];
+    // Process all images in directory with the decode/feature pipeline
+    ImagePipeline pipeline(pipelineOptions);
+    vector<TopK> workerBest(pipeline.featureWorkers(), TopK(numMatches));
+    RankingComparison comparison(pipeline.featureWorkers());
+    vector<AbandonStats> workerAbandon(pipeline.featureWorkers());
     
     printf("\nProcessing images in directory: %s\n", imageDir);
     
-    while((dp = readdir(dirp)) != NULL) {
-        // Check if file is an image
-        if(strstr(dp->d_name, ".jpg") || 
-           strstr(dp->d_name, ".png") || 
-           strstr(dp->d_name, ".ppm") || 
-           strstr(dp->d_name, ".tif")) {
-            
-            // Build full path
-            strcpy(buffer, imageDir);
-            strcat(buffer, "/");
-            strcat(buffer, dp->d_name);
-            
-            // Load image
-            Mat image = imread(buffer);
-            if(image.empty()) {
-                printf("Warning: Could not load %s\n", buffer);
-                continue;
-            }
-            
-            // Compute histogram
-            vector<float> hist = computeRGHistogram(image, bins);
-            
-            // Compute distance using histogram intersection
-            float distance = histogramIntersection(targetHist, hist);
-            
-            // Store result
-            ImageMatch match;
-            match.filename = string(dp->d_name);
-            match.distance = distance;
-            matches.push_back(match);
+    int result = pipeline.run(imageDir, default_image_extensions(), [&](PipelineImage &item, int worker) {
+        // Compute histogram
+        StageTimer extractTimer(STATS_EXTRACT);
+        vector<float> hist = computeRGHistogram(item.image, bins);
+        extractTimer.stop();
+        
+        // Compute distance using histogram intersection
+        // Higher intersection = more similar = smaller distance; stop
+        // once it cannot make the top matches (--decode-compare ranks
+        // every image, so it needs them all exact)
+        StageTimer distanceTimer(STATS_DISTANCE);
+        float bound = pipelineOptions.compareFullDecode ? numeric_limits<float>::infinity()
+                                                        : workerBest[worker].threshold();
+        float distance = intersection.distance(&hist[0], bound, workerAbandon[worker]);
+        distanceTimer.stop();
+        
+        if(pipelineOptions.compareFullDecode) {
+            vector<float> fullHist = computeRGHistogram(item.fullImage, bins);
+            float fullDistance = 1.0 - histogramIntersection(targetFullHist, fullHist);
+            comparison.add(worker, item.id, fullDistance, distance);
         }
+        
+        // Keep it if it is among the best so far
+        workerBest[worker].push(item.id, distance);
+    });
+    if(result != 0) {
+        return -1;
     }
     
-    closedir(dirp);
-    
-    // Sort matches by distance (ascending)
-    sort(matches.begin(), matches.end());
+    // Merge the per-thread heaps
+    StageTimer sortTimer(STATS_SORT);
+    vector<ScoredId> matches = merge_top_k(workerBest).sorted();
+    sortTimer.stop();
     
     // Display top N matches
     printf("\n=== Top %d matches ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)matches.size()); i++) {
-        printf("%d. %s (distance: %.4f)\n", i+1, matches[i].filename.c_str(), matches[i].distance);
+    for(int i = 0; i < (int)matches.size(); i++) {
+        printf("%d. %s (distance: %.4f)\n", i+1, pipeline.filename(matches[i].id), matches[i].distance);
+    }
+    
+    // Report decode scales and, with --decode-compare, the ranking change
+    if(pipelineOptions.decodeScale != 1 || pipelineOptions.compareFullDecode) {
+        pipeline.printDecodeReport();
+    }
+    AbandonStats abandonTotal;
+    for(size_t w = 0; w < workerAbandon.size(); w++) {
+        abandonTotal.add(workerAbandon[w]);
+    }
+    print_abandon_stats("Early abandoning", abandonTotal);
+    if(pipelineOptions.compareFullDecode) {
+        print_ranking_agreement("Reduced vs full-resolution decode", comparison.compare(numMatches));
+    }
+    
+    if(report_stats("histogram_match") != 0) {
+        return -1;
     }
     
     return 0;
@@ -0,0 +1,551 @@
+/*
+  HNSW approximate nearest-neighbor index: parallel builder, writer and
+  memory-mapped search.  See hnsw_index.h for the file layout.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <thread>
+#include <vector>
+#include "hnsw_index.h"
+
+using namespace std;
+
+// Levels are drawn as floor(-ln(U) / ln(M)); this caps them for
+// pathological draws
+#define HNSW_MAX_LEVEL 16
+
+// Nodes share this many locks while the graph is built
+#define HNSW_LOCK_STRIPES 4096
+
+// Fixed seed, so the node levels of a build are reproducible
+#define HNSW_LEVEL_SEED 100
+
+// Alignment of the link tables inside the file
+static const uint64_t HNSW_ALIGNMENT = 64;
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+struct Candidate {
+    float distance;
+    uint32_t id;
+};
+
+// Orders a priority_queue with the closest candidate on top
+struct CloserOnTop {
+    bool operator()(const Candidate &a, const Candidate &b) const { return a.distance > b.distance; }
+};
+
+// Orders a priority_queue with the farthest candidate on top
+struct FartherOnTop {
+    bool operator()(const Candidate &a, const Candidate &b) const { return a.distance < b.distance; }
+};
+
+static bool closerFirst(const Candidate &a, const Candidate &b) {
+    return a.distance < b.distance;
+}
+
+/*
+  Nodes seen during one layer search.  Marks are stamped with an epoch,
+  so starting a new search does not clear the array.
+ */
+class VisitedSet {
+public:
+    VisitedSet() : epoch(0) {}
+
+    void reset(size_t count) {
+        if(marks.size() != count) {
+            marks.assign(count, 0);
+            epoch = 0;
+        }
+        if(++epoch == 0) {
+            fill(marks.begin(), marks.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    // returns false if the node was already visited
+    bool visit(uint32_t id) {
+        if(marks[id] == epoch) {
+            return false;
+        }
+        marks[id] = epoch;
+        return true;
+    }
+
+private:
+    vector<uint32_t> marks;
+    uint32_t epoch;
+};
+
+/*
+  Best-first search of one level, starting from entries, keeping the ef
+  closest nodes.  found receives them closest first.  Graph provides
+  neighbors(node, level, out), distance(query, node), nodes() and
+  maxLinks().
+ */
+template<class Graph>
+static void searchLayer(const Graph &graph, const float *query, const vector<Candidate> &entries,
+                        int ef, int level, VisitedSet &visited, vector<Candidate> &found) {
+    priority_queue<Candidate, vector<Candidate>, CloserOnTop> candidates;
+    priority_queue<Candidate, vector<Candidate>, FartherOnTop> nearest;
+    vector<uint32_t> links(graph.maxLinks());
+
+    visited.reset(graph.nodes());
+    for(size_t i = 0; i < entries.size(); i++) {
+        if(visited.visit(entries[i].id)) {
+            candidates.push(entries[i]);
+            nearest.push(entries[i]);
+        }
+    }
+    while((int)nearest.size() > ef) {
+        nearest.pop();
+    }
+
+    while(!candidates.empty()) {
+        Candidate current = candidates.top();
+        if((int)nearest.size() >= ef && current.distance > nearest.top().distance) {
+            break;
+        }
+        candidates.pop();
+
+        int n = graph.neighbors(current.id, level, &links[0]);
+        for(int i = 0; i < n; i++) {
+            uint32_t id = links[i];
+            if(!visited.visit(id)) {
+                continue;
+            }
+            float distance = graph.distance(query, id);
+            if((int)nearest.size() < ef || distance < nearest.top().distance) {
+                Candidate c = { distance, id };
+                candidates.push(c);
+                nearest.push(c);
+                if((int)nearest.size() > ef) {
+                    nearest.pop();
+                }
+            }
+        }
+    }
+
+    found.resize(nearest.size());
+    for(int i = (int)nearest.size() - 1; i >= 0; i--) {
+        found[i] = nearest.top();
+        nearest.pop();
+    }
+}
+
+/*
+  Neighbour selection heuristic: going from the closest candidate
+  outwards, keep a candidate only if it is closer to the base node than
+  to every neighbour kept so far.  This spreads the links over different
+  directions instead of spending them all on one tight cluster.
+  candidates must be sorted closest first.
+ */
+template<class Graph>
+static void selectNeighbors(const Graph &graph, const vector<Candidate> &candidates, int maxLinks,
+                            vector<Candidate> &selected) {
+    selected.clear();
+    for(size_t i = 0; i < candidates.size() && (int)selected.size() < maxLinks; i++) {
+        const float *point = graph.row(candidates[i].id);
+        bool keep = true;
+        for(size_t j = 0; j < selected.size(); j++) {
+            if(graph.distance(point, selected[j].id) < candidates[i].distance) {
+                keep = false;
+                break;
+            }
+        }
+        if(keep) {
+            selected.push_back(candidates[i]);
+        }
+    }
+}
+
+/*
+  The graph while it is built, in the same layout as the file.  Link
+  lists are guarded by striped locks so that several threads can insert
+  at once.
+ */
+class GraphBuilder {
+public:
+    GraphBuilder(const EmbeddingMatrix &vectors, const HnswParams &params)
+        : vectors(vectors), numNodes(vectors.count()), M(params.M), maxM0(2 * params.M),
+          efConstruction(params.efConstruction), locks(HNSW_LOCK_STRIPES), entryPoint(0), maxLevel(0) {
+
+        // Draw every node's level up front
+        mt19937 rng(HNSW_LEVEL_SEED);
+        uniform_real_distribution<double> uniform(0.0, 1.0);
+        double levelScale = 1.0 / log((double)M);
+        levels.resize(numNodes);
+        upperStart.resize(numNodes + 1);
+        upperStart[0] = 0;
+        for(size_t i = 0; i < numNodes; i++) {
+            int level = (int)(-log(1.0 - uniform(rng)) * levelScale);
+            levels[i] = (uint8_t)min(level, HNSW_MAX_LEVEL);
+            upperStart[i + 1] = upperStart[i] + (uint64_t)levels[i] * (1 + M);
+        }
+
+        level0.assign(numNodes * (1 + maxM0), 0);
+        upper.assign(upperStart[numNodes], 0);
+    }
+
+    // Graph interface used by searchLayer
+    size_t nodes() const { return numNodes; }
+    int maxLinks() const { return maxM0; }
+    const float *row(uint32_t node) const { return vectors.row(node); }
+    float distance(const float *query, uint32_t node) const {
+        return normalized_cosine_distance(query, vectors.row(node), vectors.dim());
+    }
+    int neighbors(uint32_t node, int level, uint32_t *out) const {
+        lock_guard<mutex> guard(locks[node % HNSW_LOCK_STRIPES]);
+        const uint32_t *list = links(node, level);
+        memcpy(out, list + 1, list[0] * sizeof(uint32_t));
+        return (int)list[0];
+    }
+
+    void insert(uint32_t node, VisitedSet &visited);
+
+    int write(const char *filename, uint64_t fingerprint) const;
+
+private:
+    uint32_t *links(uint32_t node, int level) const {
+        if(level == 0) {
+            return (uint32_t *)&level0[(size_t)node * (1 + maxM0)];
+        }
+        return (uint32_t *)&upper[upperStart[node] + (size_t)(level - 1) * (1 + M)];
+    }
+
+    int linkLimit(int level) const { return level == 0 ? maxM0 : M; }
+
+    void addLink(uint32_t node, uint32_t neighbor, float neighborDistance, int level);
+
+    const EmbeddingMatrix &vectors;
+    size_t numNodes;
+    int M;
+    int maxM0;
+    int efConstruction;
+
+    vector<uint8_t> levels;
+    vector<uint32_t> level0;
+    vector<uint64_t> upperStart;
+    vector<uint32_t> upper;
+
+    mutable vector<mutex> locks;
+    mutex entryLock;
+    uint32_t entryPoint;
+    int maxLevel;
+};
+
+void GraphBuilder::insert(uint32_t node, VisitedSet &visited) {
+    int level = levels[node];
+    const float *query = vectors.row(node);
+
+    // A node that raises the top level holds the entry lock until it is
+    // linked, so that nobody enters the graph through it too early
+    unique_lock<mutex> entryGuard(entryLock);
+    if(node == 0) {
+        maxLevel = level;
+        return;
+    }
+    int topLevel = maxLevel;
+    uint32_t entry = entryPoint;
+    if(level <= topLevel) {
+        entryGuard.unlock();
+    }
+
+    vector<Candidate> entries(1);
+    entries[0].distance = distance(query, entry);
+    entries[0].id = entry;
+    vector<Candidate> found, selected;
+
+    // Greedy descent to the node's own top level
+    for(int l = topLevel; l > level; l--) {
+        searchLayer(*this, query, entries, 1, l, visited, found);
+        entries = found;
+    }
+
+    for(int l = min(level, topLevel); l >= 0; l--) {
+        searchLayer(*this, query, entries, efConstruction, l, visited, found);
+        for(size_t i = 0; i < found.size(); i++) {
+            if(found[i].id == node) {
+                found.erase(found.begin() + i);
+                break;
+            }
+        }
+        selectNeighbors(*this, found, linkLimit(l), selected);
+
+        {
+            lock_guard<mutex> guard(locks[node % HNSW_LOCK_STRIPES]);
+            uint32_t *list = links(node, l);
+            list[0] = (uint32_t)selected.size();
+            for(size_t i = 0; i < selected.size(); i++) {
+                list[1 + i] = selected[i].id;
+            }
+        }
+        for(size_t i = 0; i < selected.size(); i++) {
+            addLink(selected[i].id, node, selected[i].distance, l);
+        }
+        entries = found;
+    }
+
+    if(level > topLevel) {
+        entryPoint = node;
+        maxLevel = level;
+    }
+}
+
+// Add a back link, pruning the list with the heuristic when it is full
+void GraphBuilder::addLink(uint32_t node, uint32_t neighbor, float neighborDistance, int level) {
+    lock_guard<mutex> guard(locks[node % HNSW_LOCK_STRIPES]);
+    uint32_t *list = links(node, level);
+    int limit = linkLimit(level);
+
+    if((int)list[0] < limit) {
+        list[1 + list[0]] = neighbor;
+        list[0]++;
+        return;
+    }
+
+    const float *base = vectors.row(node);
+    vector<Candidate> candidates(list[0] + 1);
+    for(uint32_t i = 0; i < list[0]; i++) {
+        candidates[i].distance = distance(base, list[1 + i]);
+        candidates[i].id = list[1 + i];
+    }
+    candidates[list[0]].distance = neighborDistance;
+    candidates[list[0]].id = neighbor;
+    sort(candidates.begin(), candidates.end(), closerFirst);
+
+    vector<Candidate> selected;
+    selectNeighbors(*this, candidates, limit, selected);
+    list[0] = (uint32_t)selected.size();
+    for(size_t i = 0; i < selected.size(); i++) {
+        list[1 + i] = selected[i].id;
+    }
+}
+
+int GraphBuilder::write(const char *filename, uint64_t fingerprint) const {
+    HnswHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HNSW_MAGIC, sizeof(header.magic));
+    header.version = HNSW_VERSION;
+    header.count = numNodes;
+    header.dim = vectors.dim();
+    header.fingerprint = fingerprint;
+    header.M = M;
+    header.maxM0 = maxM0;
+    header.efConstruction = efConstruction;
+    header.maxLevel = maxLevel;
+    header.entryPoint = entryPoint;
+    header.levelsOffset = sizeof(HnswHeader);
+    header.level0Offset = alignUp(header.levelsOffset + numNodes, HNSW_ALIGNMENT);
+    header.upperOffset = alignUp(header.level0Offset + level0.size() * sizeof(uint32_t), HNSW_ALIGNMENT);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+
+    static const char padding[HNSW_ALIGNMENT] = { 0 };
+    size_t pad0 = header.level0Offset - (header.levelsOffset + numNodes);
+    size_t pad1 = header.upperOffset - (header.level0Offset + level0.size() * sizeof(uint32_t));
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(&levels[0], 1, numNodes, fp) == numNodes;
+    ok = ok && fwrite(padding, 1, pad0, fp) == pad0;
+    ok = ok && fwrite(&level0[0], sizeof(uint32_t), level0.size(), fp) == level0.size();
+    ok = ok && fwrite(padding, 1, pad1, fp) == pad1;
+    ok = ok && fwrite(&upperStart[0], sizeof(uint64_t), upperStart.size(), fp) == upperStart.size();
+    if(!upper.empty()) {
+        ok = ok && fwrite(&upper[0], sizeof(uint32_t), upper.size(), fp) == upper.size();
+    }
+
+    if(fclose(fp) != 0 || !ok) {
+        printf("Error writing HNSW index %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int build_hnsw_index( const FeatureStore &store, const EmbeddingMatrix &vectors,
+                      const HnswParams &params, const char *filename ) {
+    if(vectors.count() == 0 || vectors.count() >= 0xffffffffu) {
+        printf("Error: Cannot index %lu embeddings\n", (unsigned long)vectors.count());
+        return -1;
+    }
+    if(params.M < 2 || params.efConstruction < 1) {
+        printf("Error: M must be at least 2 and efConstruction at least 1\n");
+        return -1;
+    }
+
+    GraphBuilder graph(vectors, params);
+    size_t count = vectors.count();
+
+    // Node 0 is the first entry point; the others are inserted by the
+    // worker threads in order of an atomic counter
+    VisitedSet visited;
+    graph.insert(0, visited);
+
+    atomic<size_t> next(1);
+    atomic<size_t> done(1);
+    size_t reportEvery = max((size_t)1, count / 10);
+    vector<thread> workers;
+    for(int t = 0; t < max(1, params.threads); t++) {
+        workers.push_back(thread([&]() {
+            VisitedSet workerVisited;
+            for(size_t node = next++; node < count; node = next++) {
+                graph.insert((uint32_t)node, workerVisited);
+                size_t finished = ++done;
+                if(finished % reportEvery == 0) {
+                    printf("Inserted %lu of %lu embeddings\n", (unsigned long)finished, (unsigned long)count);
+                }
+            }
+        }));
+    }
+    for(size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    return graph.write(filename, feature_names_fingerprint(store));
+}
+
+/*
+  The mapped graph, as seen by searchLayer.
+ */
+struct MappedGraph {
+    const HnswHeader *header;
+    const uint8_t *levels;
+    const uint32_t *level0;
+    const uint64_t *upperStart;
+    const uint32_t *upper;
+    const float *vectors;
+    size_t stride;          // floats from one vector to the next
+
+    size_t nodes() const { return (size_t)header->count; }
+    int maxLinks() const { return (int)header->maxM0; }
+    float distance(const float *query, uint32_t node) const {
+        return normalized_cosine_distance(query, vectors + (size_t)node * stride, (size_t)header->dim);
+    }
+    int neighbors(uint32_t node, int level, uint32_t *out) const {
+        const uint32_t *list;
+        uint32_t limit;
+        if(level == 0) {
+            list = level0 + (size_t)node * (1 + header->maxM0);
+            limit = header->maxM0;
+        }
+        else {
+            if(level > levels[node]) {
+                return 0;
+            }
+            list = upper + upperStart[node] + (size_t)(level - 1) * (1 + header->M);
+            limit = header->M;
+        }
+
+        // skip anything a damaged file could point outside the graph
+        int n = 0;
+        for(uint32_t i = 0; i < list[0] && i < limit; i++) {
+            if(list[1 + i] < header->count) {
+                out[n++] = list[1 + i];
+            }
+        }
+        return n;
+    }
+};
+
+HnswIndex::HnswIndex() : header(NULL), levels(NULL), level0(NULL), upperStart(NULL), upper(NULL), vectors(NULL), stride(0) {
+}
+
+int HnswIndex::load(const char *filename, const FeatureStore &store, const EmbeddingMatrix &embeddings) {
+    header = NULL;
+    if(file.open(filename) != 0) {
+        printf("Unable to map HNSW index %s\n", filename);
+        return -1;
+    }
+
+    const HnswHeader *h = (const HnswHeader *)file.data();
+    if(file.size() < sizeof(HnswHeader) || memcmp(h->magic, HNSW_MAGIC, sizeof(h->magic)) != 0) {
+        printf("%s is not an HNSW index\n", filename);
+        file.close();
+        return -1;
+    }
+    if(h->version != HNSW_VERSION) {
+        printf("HNSW index %s has unsupported version %u\n", filename, h->version);
+        file.close();
+        return -1;
+    }
+    if(h->count != embeddings.count() || h->dim != embeddings.dim() ||
+       h->fingerprint != feature_names_fingerprint(store)) {
+        printf("HNSW index %s was not built from this feature file\n", filename);
+        file.close();
+        return -1;
+    }
+
+    // Check that every table lies inside the file
+    uint64_t size = file.size();
+    uint64_t level0Bytes = h->count * (1 + (uint64_t)h->maxM0) * sizeof(uint32_t);
+    uint64_t startBytes = (h->count + 1) * sizeof(uint64_t);
+    bool valid = h->count > 0 && h->entryPoint < h->count && h->maxM0 >= h->M &&
+                 h->levelsOffset + h->count <= size &&
+                 h->level0Offset % sizeof(uint32_t) == 0 && h->level0Offset + level0Bytes <= size &&
+                 h->upperOffset % sizeof(uint64_t) == 0 && h->upperOffset + startBytes <= size;
+    if(valid) {
+        const uint8_t *nodeLevels = file.data() + h->levelsOffset;
+        const uint64_t *starts = (const uint64_t *)(file.data() + h->upperOffset);
+        valid = starts[0] == 0 && nodeLevels[h->entryPoint] == h->maxLevel &&
+                starts[h->count] <= (size - h->upperOffset - startBytes) / sizeof(uint32_t);
+        for(uint64_t i = 0; valid && i < h->count; i++) {
+            valid = nodeLevels[i] <= h->maxLevel &&
+                    starts[i + 1] - starts[i] == (uint64_t)nodeLevels[i] * (1 + h->M);
+        }
+    }
+    if(!valid) {
+        printf("HNSW index %s is corrupt\n", filename);
+        file.close();
+        return -1;
+    }
+
+    header = h;
+    levels = file.data() + h->levelsOffset;
+    level0 = (const uint32_t *)(file.data() + h->level0Offset);
+    upperStart = (const uint64_t *)(file.data() + h->upperOffset);
+    upper = (const uint32_t *)(upperStart + h->count + 1);
+    vectors = embeddings.data();
+    stride = embeddings.stride();
+    return 0;
+}
+
+void HnswIndex::search(const float *query, int k, int ef, vector<ScoredId> &results) const {
+    results.clear();
+    if(!header || k <= 0) {
+        return;
+    }
+
+    MappedGraph graph = { header, levels, level0, upperStart, upper, vectors, stride };
+
+    // one visited set per thread, reused across queries
+    static thread_local VisitedSet visited;
+
+    vector<Candidate> entries(1), found;
+    entries[0].distance = graph.distance(query, header->entryPoint);
+    entries[0].id = header->entryPoint;
+
+    for(int l = (int)header->maxLevel; l > 0; l--) {
+        searchLayer(graph, query, entries, 1, l, visited, found);
+        entries = found;
+    }
+    searchLayer(graph, query, entries, max(ef, k), 0, visited, found);
+
+    for(int i = 0; i < (int)found.size() && i < k; i++) {
+        ScoredId match;
+        match.id = (int)found[i].id;
+        match.distance = found[i].distance;
+        results.push_back(match);
+    }
+}
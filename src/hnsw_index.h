@@ -0,0 +1,118 @@
+/*
+  HNSW approximate nearest-neighbor index for embeddings
+
+  Hierarchical navigable small world graph (Malkov and Yashunin): every
+  embedding is a node with links to close nodes on level 0, and a
+  randomly chosen, geometrically shrinking subset of the nodes also
+  appears on the levels above with the same number of links.  A search
+  walks greedily down from the single node on the top level and then
+  runs a best-first search with a candidate list of efSearch entries on
+  level 0, so it visits a few thousand nodes instead of all of them.
+
+  Distances are cosine distances between the normalized embeddings of an
+  EmbeddingMatrix.  The index file holds only the graph; the vectors
+  come from the feature file it was built from, which is checked by
+  row count, dimension and a fingerprint of the filenames.  Both files
+  are memory-mapped at query time.
+
+  File layout (all integers little-endian):
+
+    HnswHeader                                  128 bytes
+    uint8_t level[count]                        starts at levelsOffset
+    uint32_t level0[count][1 + maxM0]           starts at level0Offset
+    uint64_t upperStart[count + 1]              starts at upperOffset
+    uint32_t upper[upperStart[count]]           follows upperStart
+
+  A link list is a neighbour count followed by room for the largest
+  number of neighbours.  Node i has level[i] lists of 1 + M entries on
+  the levels above 0, for levels 1, 2, ..., starting at
+  upper[upperStart[i]].
+ */
+
+#ifndef HNSW_INDEX_H
+#define HNSW_INDEX_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "embedding_matrix.h"
+#include "feature_store.h"
+#include "top_k.h"
+
+#define HNSW_MAGIC "IRHN"
+#define HNSW_VERSION 1
+
+struct HnswHeader {
+    char magic[4];              // "IRHN"
+    uint32_t version;           // HNSW_VERSION
+    uint64_t count;             // number of nodes (rows of the feature file)
+    uint64_t dim;               // embedding dimension
+    uint64_t fingerprint;       // feature_names_fingerprint of the feature file
+    uint32_t M;                 // links per node on levels above 0
+    uint32_t maxM0;             // links per node on level 0
+    uint32_t efConstruction;    // candidate list size used while building
+    uint32_t maxLevel;          // top level
+    uint32_t entryPoint;        // the node on the top level
+    uint32_t reserved0;         // 0
+    uint64_t levelsOffset;      // byte offset of the node levels
+    uint64_t level0Offset;      // byte offset of the level 0 links
+    uint64_t upperOffset;       // byte offset of the upper level links
+    uint64_t reserved[6];       // must be 0
+};
+
+struct HnswParams {
+    int M;                  // links per node (2 * M on level 0)
+    int efConstruction;     // candidate list size while inserting
+    int threads;            // insertion threads
+
+    HnswParams() : M(16), efConstruction(200), threads(1) {}
+};
+
+/*
+  Builds the index over the normalized rows of vectors (which belong to
+  the feature file store) and writes it to filename.  Nodes are inserted
+  by params.threads threads.  Returns a non-zero value if something goes
+  wrong.
+ */
+int build_hnsw_index( const FeatureStore &store, const EmbeddingMatrix &vectors,
+                      const HnswParams &params, const char *filename );
+
+/*
+  Memory-mapped index, searched with the vectors it was built from.
+  search() may be called from several threads at once.
+ */
+class HnswIndex {
+public:
+    HnswIndex();
+
+    // returns a non-zero value if the index cannot be read or does not
+    // belong to the feature file store
+    int load( const char *filename, const FeatureStore &store, const EmbeddingMatrix &vectors );
+
+    /*
+      The k nodes closest to a normalized query, best first, found with
+      a candidate list of max(ef, k) entries.  Larger ef gives higher
+      recall at the cost of speed.
+     */
+    void search( const float *query, int k, int ef, std::vector<ScoredId> &results ) const;
+
+    size_t count() const { return header ? (size_t)header->count : 0; }
+    int M() const { return header ? (int)header->M : 0; }
+    int efConstruction() const { return header ? (int)header->efConstruction : 0; }
+    int maxLevel() const { return header ? (int)header->maxLevel : 0; }
+
+private:
+    HnswIndex(const HnswIndex &);
+    HnswIndex &operator=(const HnswIndex &);
+
+    MappedFile file;
+    const HnswHeader *header;
+    const uint8_t *levels;
+    const uint32_t *level0;
+    const uint64_t *upperStart;
+    const uint32_t *upper;
+    const float *vectors;
+    size_t stride;
+};
+
+#endif
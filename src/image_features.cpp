@@ -0,0 +1,363 @@
+/*
+  Feature extraction and distance functions shared by the matchers and
+  the indexer.
+*/
+
+#include <opencv2/opencv.hpp>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "image_features.h"
+#include "distance_kernels.h"
+#include "histogram_engine.h"
+#include "fused_features.h"
+
+using namespace cv;
+using namespace std;
+
+// Extract 7x7 center square from image as feature vector
+vector<float> extractCenterSquare(Mat &image) {
+    vector<float> features;
+
+    // Get image center
+    int centerY = image.rows / 2;
+    int centerX = image.cols / 2;
+
+    // Extract 7x7 region around center
+    int halfSize = 3; // 7/2 = 3
+
+    for(int i = centerY - halfSize; i <= centerY + halfSize; i++) {
+        for(int j = centerX - halfSize; j <= centerX + halfSize; j++) {
+            // Handle color images (3 channels: B, G, R)
+            Vec3b pixel = image.at<Vec3b>(i, j);
+            features.push_back(pixel[0]); // Blue
+            features.push_back(pixel[1]); // Green
+            features.push_back(pixel[2]); // Red
+        }
+    }
+
+    return features;
+}
+
+// Compute Sum of Squared Differences between two feature vectors
+float computeSSD(vector<float> &feat1, vector<float> &feat2) {
+    float ssd = 0.0;
+
+    if(feat1.size() != feat2.size()) {
+        printf("Error: Feature vectors have different sizes!\n");
+        return -1.0;
+    }
+
+    if(!feat1.empty()) {
+        ssd = distance_kernels().squaredDistance(&feat1[0], &feat2[0], feat1.size());
+    }
+
+    return ssd;
+}
+
+// Compute 2D rg chromaticity histogram
+// bins: number of bins for each dimension (default 16)
+vector<float> computeRGHistogram(Mat &image, int bins) {
+    vector<float> histogram(bins * bins, 0.0);
+
+    // Bin counts from the lookup-table engine (dark pixels are skipped)
+    vector<unsigned int> counts(bins * bins, 0);
+    int totalPixels = count_rg_histogram(image, 0, image.rows, bins, &counts[0]);
+
+    // Normalize histogram
+    for(int i = 0; i < histogram.size(); i++) {
+        histogram[i] = (float)counts[i] / totalPixels;
+    }
+
+    return histogram;
+}
+
+// Compute 3D RGB histogram for entire image
+vector<float> computeRGBHistogram(Mat &image, int bins) {
+    return computeRGBHistogram(image, 0, image.rows, bins);
+}
+
+// Compute 3D RGB histogram for a region of the image
+vector<float> computeRGBHistogram(Mat &image, int startRow, int endRow, int bins) {
+    vector<float> histogram(bins * bins * bins, 0.0);
+
+    // Bin counts from the lookup-table engine
+    vector<unsigned int> counts(bins * bins * bins, 0);
+    int totalPixels = count_rgb_histogram(image, startRow, endRow, bins, &counts[0]);
+
+    // Normalize histogram
+    for(int i = 0; i < histogram.size(); i++) {
+        if(totalPixels > 0) {
+            histogram[i] = (float)counts[i] / totalPixels;
+        }
+    }
+
+    return histogram;
+}
+
+// Compute two histograms: top half and bottom half
+pair<vector<float>, vector<float>> computeTopBottomHistograms(Mat &image, int bins) {
+    int midRow = image.rows / 2;
+
+    vector<float> topHist = computeRGBHistogram(image, 0, midRow, bins);
+    vector<float> bottomHist = computeRGBHistogram(image, midRow, image.rows, bins);
+
+    return make_pair(topHist, bottomHist);
+}
+
+// Compute Sobel gradient magnitude and create histogram
+vector<float> computeTextureHistogram(Mat &image, int bins) {
+    // Convert to grayscale
+    Mat gray;
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+
+    // Apply Sobel filters
+    Mat sobelX, sobelY;
+    Sobel(gray, sobelX, CV_16S, 1, 0, 3);
+    Sobel(gray, sobelY, CV_16S, 0, 1, 3);
+
+    // Compute gradient magnitude
+    Mat magnitude(gray.rows, gray.cols, CV_32F);
+
+    for(int i = 0; i < gray.rows; i++) {
+        for(int j = 0; j < gray.cols; j++) {
+            float gx = sobelX.at<short>(i, j);
+            float gy = sobelY.at<short>(i, j);
+            magnitude.at<float>(i, j) = sqrt(gx * gx + gy * gy);
+        }
+    }
+
+    // Find max magnitude for normalization
+    double minVal, maxVal;
+    minMaxLoc(magnitude, &minVal, &maxVal);
+
+    // Create histogram of gradient magnitudes
+    vector<float> histogram(bins, 0.0);
+    int totalPixels = 0;
+
+    for(int i = 0; i < magnitude.rows; i++) {
+        for(int j = 0; j < magnitude.cols; j++) {
+            float mag = magnitude.at<float>(i, j);
+
+            // Normalize magnitude to [0, bins-1]
+            int bin = (int)((mag / maxVal) * bins);
+
+            // Clamp to valid range
+            if(bin >= bins) bin = bins - 1;
+
+            histogram[bin]++;
+            totalPixels++;
+        }
+    }
+
+    // Normalize histogram
+    for(int i = 0; i < histogram.size(); i++) {
+        if(totalPixels > 0) {
+            histogram[i] = histogram[i] / totalPixels;
+        }
+    }
+
+    return histogram;
+}
+
+// Extract warm color percentage from upper portion of image
+float computeWarmColorScore(Mat &image) {
+    int warmPixels = 0;
+    int totalPixels = 0;
+
+    // Focus on upper 60% of image (where sky/sunset typically is)
+    int endRow = (int)(image.rows * 0.6);
+
+    for(int i = 0; i < endRow; i++) {
+        for(int j = 0; j < image.cols; j++) {
+            Vec3b pixel = image.at<Vec3b>(i, j);
+
+            float b = pixel[0];
+            float g = pixel[1];
+            float r = pixel[2];
+
+            // Check if pixel is "warm" (red/orange/yellow dominant)
+            // Warm colors: R > G > B, with R being significantly higher
+            if(r > g && g >= b && r > 100) {
+                // Additional check: R should be at least 20% more than G
+                if(r > g * 1.2) {
+                    warmPixels++;
+                }
+            }
+
+            totalPixels++;
+        }
+    }
+
+    return (float)warmPixels / totalPixels;
+}
+
+// Compute vertical color gradient (sunset transitions from warm to cool)
+float computeVerticalGradient(Mat &image) {
+    // Split image into top third and bottom third
+    int topStart = 0;
+    int topEnd = image.rows / 3;
+    int bottomStart = (2 * image.rows) / 3;
+    int bottomEnd = image.rows;
+
+    // Average colors in top third
+    float topR = 0, topG = 0, topB = 0;
+    int topCount = 0;
+
+    for(int i = topStart; i < topEnd; i++) {
+        for(int j = 0; j < image.cols; j++) {
+            Vec3b pixel = image.at<Vec3b>(i, j);
+            topB += pixel[0];
+            topG += pixel[1];
+            topR += pixel[2];
+            topCount++;
+        }
+    }
+
+    topR /= topCount;
+    topG /= topCount;
+    topB /= topCount;
+
+    // Average colors in bottom third
+    float bottomR = 0, bottomG = 0, bottomB = 0;
+    int bottomCount = 0;
+
+    for(int i = bottomStart; i < bottomEnd; i++) {
+        for(int j = 0; j < image.cols; j++) {
+            Vec3b pixel = image.at<Vec3b>(i, j);
+            bottomB += pixel[0];
+            bottomG += pixel[1];
+            bottomR += pixel[2];
+            bottomCount++;
+        }
+    }
+
+    bottomR /= bottomCount;
+    bottomG /= bottomCount;
+    bottomB /= bottomCount;
+
+    // Compute gradient: sunsets have warmer top, cooler bottom
+    float warmGradient = (topR - bottomR) + (topG - bottomG) * 0.5;
+
+    return warmGradient;
+}
+
+// Compute edge density (sunsets are smooth, not busy)
+float computeEdgeDensity(Mat &image) {
+    Mat gray;
+    cvtColor(image, gray, COLOR_BGR2GRAY);
+
+    Mat edges;
+    Canny(gray, edges, 50, 150);
+
+    int edgePixels = countNonZero(edges);
+    int totalPixels = edges.rows * edges.cols;
+
+    return (float)edgePixels / totalPixels;
+}
+
+// Compute histogram intersection
+float histogramIntersection(vector<float> &hist1, vector<float> &hist2) {
+    if(hist1.size() != hist2.size()) {
+        printf("Error: Histograms have different sizes!\n");
+        return 0.0;
+    }
+
+    float intersection = 0.0;
+
+    if(!hist1.empty()) {
+        intersection = distance_kernels().intersection(&hist1[0], &hist2[0], hist1.size());
+    }
+
+    return intersection;
+}
+
+// Compute combined distance using two histograms with equal weighting
+float computeMultiHistogramDistance(pair<vector<float>, vector<float>> &hist1,
+                                    pair<vector<float>, vector<float>> &hist2) {
+    // Compute intersection for top halves
+    float topIntersection = histogramIntersection(hist1.first, hist2.first);
+
+    // Compute intersection for bottom halves
+    float bottomIntersection = histogramIntersection(hist1.second, hist2.second);
+
+    // Equal weighting: average the two intersections
+    float avgIntersection = (topIntersection + bottomIntersection) / 2.0;
+
+    // Return distance (1 - intersection)
+    return 1.0 - avgIntersection;
+}
+
+// Compute combined distance with equal weighting
+float computeCombinedDistance(vector<float> &colorHist1, vector<float> &textureHist1,
+                              vector<float> &colorHist2, vector<float> &textureHist2) {
+    // Compute color histogram intersection
+    float colorIntersection = histogramIntersection(colorHist1, colorHist2);
+
+    // Compute texture histogram intersection
+    float textureIntersection = histogramIntersection(textureHist1, textureHist2);
+
+    // Equal weighting: average the two intersections
+    float avgIntersection = (colorIntersection + textureIntersection) / 2.0;
+
+    // Return distance (1 - intersection)
+    return 1.0 - avgIntersection;
+}
+
+// Extractors that produce one flat feature vector per image
+static vector<float> extractBaseline(Mat &image) {
+    return extractCenterSquare(image);
+}
+
+static vector<float> extractRG(Mat &image) {
+    return computeRGHistogram(image, 16);
+}
+
+static vector<float> extractTopBottom(Mat &image) {
+    pair<vector<float>, vector<float>> hists = computeTopBottomHistograms(image, 8);
+    vector<float> features = hists.first;
+    features.insert(features.end(), hists.second.begin(), hists.second.end());
+    return features;
+}
+
+static vector<float> extractTextureColor(Mat &image) {
+    vector<float> features, texture;
+    computeColorTextureHistograms(image, 8, 16, features, texture);
+    features.insert(features.end(), texture.begin(), texture.end());
+    return features;
+}
+
+static vector<float> extractSunset(Mat &image) {
+    SunsetFeatures sunset = computeSunsetFeatures(image);
+    vector<float> features;
+    features.push_back(sunset.warmScore);
+    features.push_back(sunset.gradient);
+    features.push_back(sunset.edgeDensity);
+    return features;
+}
+
+static const FeatureExtractor extractorTable[] = {
+    { "baseline", "7x7 center square (147 values)", extractBaseline },
+    { "rg", "16x16 rg chromaticity histogram (256 values)", extractRG },
+    { "topbottom", "8x8x8 RGB histograms of top and bottom halves (1024 values)", extractTopBottom },
+    { "texturecolor", "8x8x8 RGB histogram + 16-bin Sobel magnitude histogram (528 values)", extractTextureColor },
+    { "sunset", "warm score, vertical gradient, edge density (3 values)", extractSunset }
+};
+
+const FeatureExtractor *feature_extractors(int &count) {
+    count = sizeof(extractorTable) / sizeof(extractorTable[0]);
+    return extractorTable;
+}
+
+const FeatureExtractor *find_feature_extractor(const char *name) {
+    int count;
+    const FeatureExtractor *table = feature_extractors(count);
+    for(int i = 0; i < count; i++) {
+        if(strcmp(table[i].name, name) == 0) {
+            return &table[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,103 @@
+/*
+  Feature extraction and distance functions shared by the matchers and
+  the indexer.
+
+  All extractors expect an 8-bit, 3-channel BGR image as returned by
+  imread.  Histograms are normalized so that their bins sum to 1.
+ */
+
+#ifndef IMAGE_FEATURES_H
+#define IMAGE_FEATURES_H
+
+#include <vector>
+#include <utility>
+#include <opencv2/opencv.hpp>
+
+/*
+  Baseline feature: the 7x7 square of pixels at the image center, as
+  B, G, R values (147 features).
+ */
+std::vector<float> extractCenterSquare( cv::Mat &image );
+
+/*
+  Sum of squared differences between two feature vectors.
+ */
+float computeSSD( std::vector<float> &feat1, std::vector<float> &feat2 );
+
+/*
+  2D rg chromaticity histogram with bins x bins entries.  Pixels with
+  R + G + B == 0 are ignored.
+ */
+std::vector<float> computeRGHistogram( cv::Mat &image, int bins = 16 );
+
+/*
+  3D RGB histogram with bins x bins x bins entries, either over the whole
+  image or over the rows [startRow, endRow).
+ */
+std::vector<float> computeRGBHistogram( cv::Mat &image, int bins = 8 );
+std::vector<float> computeRGBHistogram( cv::Mat &image, int startRow, int endRow, int bins = 8 );
+
+/*
+  RGB histograms of the top half and the bottom half of the image.
+ */
+std::pair<std::vector<float>, std::vector<float>> computeTopBottomHistograms( cv::Mat &image, int bins = 8 );
+
+/*
+  Histogram of Sobel gradient magnitudes, scaled by the largest
+  magnitude in the image.
+ */
+std::vector<float> computeTextureHistogram( cv::Mat &image, int bins = 16 );
+
+/*
+  Sunset features: fraction of warm pixels in the upper 60% of the
+  image, warm-top/cool-bottom color gradient, and Canny edge density.
+ */
+float computeWarmColorScore( cv::Mat &image );
+float computeVerticalGradient( cv::Mat &image );
+float computeEdgeDensity( cv::Mat &image );
+
+/*
+  Histogram intersection (sum of bin-wise minimums).  1 means identical
+  normalized histograms, so distances are computed as 1 - intersection.
+ */
+float histogramIntersection( std::vector<float> &hist1, std::vector<float> &hist2 );
+
+/*
+  Distance for top/bottom histogram pairs: 1 - the average of the two
+  intersections.
+ */
+float computeMultiHistogramDistance( std::pair<std::vector<float>, std::vector<float>> &hist1,
+                                     std::pair<std::vector<float>, std::vector<float>> &hist2 );
+
+/*
+  Distance for color + texture histograms: 1 - the average of the color
+  and texture intersections.
+ */
+float computeCombinedDistance( std::vector<float> &colorHist1, std::vector<float> &textureHist1,
+                               std::vector<float> &colorHist2, std::vector<float> &textureHist2 );
+
+/*
+  Named feature extractors used by the indexer.  Each one turns an image
+  into a single feature vector:
+
+    baseline      extractCenterSquare
+    rg            computeRGHistogram (16 bins)
+    topbottom     computeTopBottomHistograms (8 bins), top then bottom
+    texturecolor  computeRGBHistogram (8 bins) then computeTextureHistogram (16 bins)
+    sunset        warm color score, vertical gradient, edge density
+ */
+struct FeatureExtractor {
+    const char *name;
+    const char *description;
+    std::vector<float> (*extract)( cv::Mat &image );
+};
+
+/*
+  Returns the extractor with the given name, or NULL if there is none.
+  count receives the number of entries in the table returned by
+  feature_extractors.
+ */
+const FeatureExtractor *find_feature_extractor( const char *name );
+const FeatureExtractor *feature_extractors( int &count );
+
+#endif
@@ -0,0 +1,476 @@
+/*
+  Multi-threaded directory scan and decode pipeline.
+  See image_pipeline.h for the overall structure.
+*/
+
+#include <opencv2/opencv.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "image_pipeline.h"
+#include "stage_stats.h"
+
+using namespace cv;
+using namespace std;
+
+// Number of paths allowed to wait for a decode worker
+static const size_t MAX_QUEUED_PATHS = 1024;
+
+const vector<string> &default_image_extensions() {
+    static const char *list[] = { ".jpg", ".png", ".ppm", ".tif" };
+    static const vector<string> extensions(list, list + 4);
+    return extensions;
+}
+
+int parse_pipeline_options(int &argc, char *argv[], PipelineOptions &options, bool allowDecodeScale) {
+    int out = 1;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--threads") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 0) {
+                printf("Error: --threads needs a non-negative thread count\n");
+                return -1;
+            }
+            options.threads = atoi(argv[++i]);
+        }
+        else if(allowDecodeScale && strcmp(argv[i], "--decode-scale") == 0) {
+            const char *value = i + 1 < argc ? argv[++i] : "";
+            if(strcmp(value, "auto") == 0) {
+                options.decodeScale = DECODE_SCALE_AUTO;
+            }
+            else if(strcmp(value, "1") == 0 || strcmp(value, "2") == 0 ||
+                    strcmp(value, "4") == 0 || strcmp(value, "8") == 0) {
+                options.decodeScale = atoi(value);
+            }
+            else {
+                printf("Error: --decode-scale must be 1, 2, 4, 8 or auto\n");
+                return -1;
+            }
+        }
+        else if(allowDecodeScale && strcmp(argv[i], "--decode-compare") == 0) {
+            options.compareFullDecode = true;
+        }
+        else {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = NULL;
+    return 0;
+}
+
+static bool hasImageExtension(const char *name, const vector<string> &extensions) {
+    for(size_t i = 0; i < extensions.size(); i++) {
+        if(strstr(name, extensions[i].c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads the image size from the SOF marker of a JPEG file.  Returns
+// false if the file is not a JPEG or has no frame header.
+static bool readJpegSize(const char *path, int &width, int &height) {
+    FILE *fp = fopen(path, "rb");
+    if(!fp) {
+        return false;
+    }
+
+    bool found = false;
+    if(fgetc(fp) == 0xFF && fgetc(fp) == 0xD8) {
+        for(;;) {
+            int ch = fgetc(fp);
+            if(ch != 0xFF) {
+                break;
+            }
+            int marker;
+            do {
+                marker = fgetc(fp);
+            } while(marker == 0xFF);
+            if(marker == EOF || marker == 0xD9 || marker == 0xDA) {
+                break;
+            }
+            // markers without a length field
+            if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+                continue;
+            }
+
+            int hi = fgetc(fp);
+            int lo = fgetc(fp);
+            if(hi == EOF || lo == EOF) {
+                break;
+            }
+            int length = (hi << 8) | lo;
+
+            // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+            if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+                unsigned char sof[5];
+                if(fread(sof, 1, 5, fp) == 5) {
+                    height = (sof[1] << 8) | sof[2];
+                    width = (sof[3] << 8) | sof[4];
+                    found = width > 0 && height > 0;
+                }
+                break;
+            }
+
+            if(length < 2 || fseek(fp, length - 2, SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+int choose_decode_scale(const char *path, int requested) {
+    if(requested == 1) {
+        return 1;
+    }
+
+    int width, height;
+    if(!readJpegSize(path, width, height)) {
+        return 1;
+    }
+
+    if(requested != DECODE_SCALE_AUTO) {
+        return requested;
+    }
+
+    int shortSide = min(width, height);
+    for(int scale = 8; scale > 1; scale /= 2) {
+        if(shortSide / scale >= AUTO_DECODE_MIN_SIDE) {
+            return scale;
+        }
+    }
+    return 1;
+}
+
+Mat decode_image(const char *path, int scale) {
+    int flags = IMREAD_COLOR;
+    if(scale == 2) flags = IMREAD_REDUCED_COLOR_2;
+    if(scale == 4) flags = IMREAD_REDUCED_COLOR_4;
+    if(scale == 8) flags = IMREAD_REDUCED_COLOR_8;
+
+    return imread(path, flags);
+}
+
+Mat load_image(const char *path, const PipelineOptions &options) {
+    return decode_image(path, choose_decode_scale(path, options.decodeScale));
+}
+
+static long long elapsedNanos(chrono::steady_clock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// readdir, timed as one call of the readdir stage
+static struct dirent *nextEntry(DIR *dirp) {
+    StageTimer timer(STATS_READDIR);
+    return readdir(dirp);
+}
+
+// Runs the callback for one image; the image stage includes its decode
+static void processImage(ImageCallback &callback, PipelineImage &item, int worker) {
+    if(!stats_enabled()) {
+        callback(item, worker);
+        return;
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    callback(item, worker);
+    stats_record(STATS_IMAGE, item.decodeNanos + elapsedNanos(start));
+}
+
+ImagePipeline::ImagePipeline(const PipelineOptions &options)
+    : settings(options), decodeNanos(0), reducedDecodeNanos(0), fullDecodeNanos(0) {
+    for(int i = 0; i < 4; i++) {
+        scaleCounts[i] = 0;
+    }
+
+    int threads = options.threads;
+    if(threads <= 0) {
+        threads = (int)thread::hardware_concurrency();
+    }
+    if(threads <= 1) {
+        // a single thread runs both stages inline
+        numDecoders = 0;
+        numFeatureWorkers = 1;
+    }
+    else {
+        numDecoders = threads / 2;
+        numFeatureWorkers = threads - numDecoders;
+    }
+}
+
+bool ImagePipeline::decode(PipelineImage &item) {
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    if(customDecoder) {
+        item.decodeScale = 1;
+        item.image = customDecoder(item.path.c_str());
+    }
+    else {
+        item.decodeScale = choose_decode_scale(item.path.c_str(), settings.decodeScale);
+        item.image = decode_image(item.path.c_str(), item.decodeScale);
+    }
+    long long nanos = elapsedNanos(start);
+    decodeNanos += nanos;
+    item.decodeNanos = nanos;
+    stats_record(STATS_DECODE, nanos, item.image.empty() ? 0 : 1);
+    if(stats_enabled()) {
+        struct stat info;
+        if(stat(item.path.c_str(), &info) == 0) {
+            stats_add_bytes(STATS_DECODE, info.st_size);
+        }
+    }
+    if(item.decodeScale > 1) {
+        reducedDecodeNanos += nanos;
+    }
+
+    if(item.image.empty()) {
+        printf("Warning: Could not load %s\n", item.path.c_str());
+        return false;
+    }
+
+    int slot = item.decodeScale == 8 ? 3 : item.decodeScale == 4 ? 2 : item.decodeScale == 2 ? 1 : 0;
+    scaleCounts[slot]++;
+
+    if(settings.compareFullDecode) {
+        if(item.decodeScale == 1) {
+            item.fullImage = item.image;
+        }
+        else {
+            start = chrono::steady_clock::now();
+            item.fullImage = imread(item.path);
+            fullDecodeNanos += elapsedNanos(start);
+        }
+        if(item.fullImage.empty()) {
+            printf("Warning: Could not load %s\n", item.path.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void ImagePipeline::printDecodeReport() const {
+    printf("\n=== Decode ===\n");
+    printf("Images decoded at scale 1/1: %d, 1/2: %d, 1/4: %d, 1/8: %d\n",
+           scaleCounts[0].load(), scaleCounts[1].load(), scaleCounts[2].load(), scaleCounts[3].load());
+    printf("Decode time (all workers): %.3f s\n", decodeNanos.load() / 1e9);
+
+    if(settings.compareFullDecode) {
+        int reduced = scaleCounts[1] + scaleCounts[2] + scaleCounts[3];
+        double reducedSeconds = reducedDecodeNanos.load() / 1e9;
+        double fullSeconds = fullDecodeNanos.load() / 1e9;
+        printf("Reduced images: %d, decode %.3f s reduced vs %.3f s at full resolution",
+               reduced, reducedSeconds, fullSeconds);
+        if(reducedSeconds > 0) {
+            printf(" (%.2fx faster)", fullSeconds / reducedSeconds);
+        }
+        printf("\n");
+    }
+}
+
+// The original loop: readdir, imread, callback, all on one thread
+int ImagePipeline::runSequential(const char *directory, const vector<string> &extensions, ImageCallback &callback) {
+    DIR *dirp = opendir(directory);
+    if(dirp == NULL) {
+        printf("Error: Cannot open directory %s\n", directory);
+        return -1;
+    }
+
+    struct dirent *dp;
+    while((dp = nextEntry(dirp)) != NULL) {
+        if(!hasImageExtension(dp->d_name, extensions)) {
+            continue;
+        }
+
+        names.push_back(dp->d_name);
+
+        PipelineImage item;
+        item.id = (int)names.size() - 1;
+        item.filename = names.back().c_str();
+        item.path = string(directory) + "/" + dp->d_name;
+        if(skipFilter && skipFilter(item)) {
+            continue;
+        }
+
+        if(decode(item)) {
+            processImage(callback, item, 0);
+        }
+    }
+
+    closedir(dirp);
+    return 0;
+}
+
+namespace {
+
+// Per-worker deques of paths to decode.  Workers take from the front of
+// their own deque and steal from the back of the others.
+class DecodeQueues {
+public:
+    explicit DecodeQueues(int workers)
+        : queues(workers), locks(new mutex[workers]), queued(0), finished(false) {}
+
+    // Called by the enumerator; blocks while too many paths are waiting
+    void push(int worker, const PipelineImage &item) {
+        {
+            unique_lock<mutex> lock(state);
+            notFull.wait(lock, [this] { return queued < MAX_QUEUED_PATHS; });
+        }
+        {
+            lock_guard<mutex> lock(locks[worker]);
+            queues[worker].push_back(item);
+        }
+        {
+            lock_guard<mutex> lock(state);
+            queued++;
+        }
+        notEmpty.notify_one();
+    }
+
+    void finish() {
+        lock_guard<mutex> lock(state);
+        finished = true;
+        notEmpty.notify_all();
+    }
+
+    // Returns false once enumeration is finished and every path is taken
+    bool take(int worker, PipelineImage &item) {
+        for(;;) {
+            if(takeFrom(worker, item, true)) {
+                return true;
+            }
+            for(int k = 1; k < (int)queues.size(); k++) {
+                if(takeFrom((worker + k) % queues.size(), item, false)) {
+                    return true;
+                }
+            }
+
+            unique_lock<mutex> lock(state);
+            if(finished && queued == 0) {
+                return false;
+            }
+            notEmpty.wait(lock, [this] { return queued > 0 || finished; });
+            if(finished && queued == 0) {
+                return false;
+            }
+        }
+    }
+
+private:
+    bool takeFrom(int owner, PipelineImage &item, bool front) {
+        {
+            lock_guard<mutex> lock(locks[owner]);
+            deque<PipelineImage> &q = queues[owner];
+            if(q.empty()) {
+                return false;
+            }
+            if(front) {
+                item = q.front();
+                q.pop_front();
+            }
+            else {
+                item = q.back();
+                q.pop_back();
+            }
+        }
+        {
+            lock_guard<mutex> lock(state);
+            queued--;
+        }
+        notFull.notify_one();
+        return true;
+    }
+
+    vector<deque<PipelineImage>> queues;
+    unique_ptr<mutex[]> locks;
+    mutex state;
+    condition_variable notEmpty;
+    condition_variable notFull;
+    size_t queued;
+    bool finished;
+};
+
+}
+
+int ImagePipeline::run(const char *directory, const vector<string> &extensions, ImageCallback callback) {
+    names.clear();
+
+    if(numDecoders == 0) {
+        return runSequential(directory, extensions, callback);
+    }
+
+    DIR *dirp = opendir(directory);
+    if(dirp == NULL) {
+        printf("Error: Cannot open directory %s\n", directory);
+        return -1;
+    }
+
+    DecodeQueues paths(numDecoders);
+    BoundedQueue<PipelineImage> decoded(2 * numFeatureWorkers);
+
+    vector<thread> decoders;
+    for(int w = 0; w < numDecoders; w++) {
+        decoders.push_back(thread([this, w, &paths, &decoded] {
+            PipelineImage item;
+            while(paths.take(w, item)) {
+                if(decode(item)) {
+                    decoded.push(item);
+                }
+                item.image.release();
+            }
+        }));
+    }
+
+    vector<thread> featureWorkers;
+    for(int w = 0; w < numFeatureWorkers; w++) {
+        featureWorkers.push_back(thread([w, &decoded, &callback] {
+            PipelineImage item;
+            while(decoded.pop(item)) {
+                processImage(callback, item, w);
+                item.image.release();
+            }
+        }));
+    }
+
+    // Enumerate on this thread, dealing paths out round-robin
+    struct dirent *dp;
+    int next = 0;
+    while((dp = nextEntry(dirp)) != NULL) {
+        if(!hasImageExtension(dp->d_name, extensions)) {
+            continue;
+        }
+
+        names.push_back(dp->d_name);
+
+        PipelineImage item;
+        item.id = (int)names.size() - 1;
+        item.filename = names.back().c_str();
+        item.path = string(directory) + "/" + dp->d_name;
+        if(skipFilter && skipFilter(item)) {
+            continue;
+        }
+
+        paths.push(next, item);
+        next = (next + 1) % numDecoders;
+    }
+    closedir(dirp);
+
+    paths.finish();
+    for(size_t i = 0; i < decoders.size(); i++) {
+        decoders[i].join();
+    }
+
+    decoded.close();
+    for(size_t i = 0; i < featureWorkers.size(); i++) {
+        featureWorkers[i].join();
+    }
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+  Multi-threaded directory scan and decode pipeline shared by the matchers
+
+  The calling thread enumerates the directory and deals the image paths
+  out to a pool of decode workers.  Each decode worker has its own deque
+  of paths and steals from the other workers when its own deque runs
+  dry, so one slow, large JPEG never holds up the images queued behind
+  it.  Decoded images go through a bounded queue to a pool of feature
+  workers, which run the matcher's callback.
+
+  With --threads 1 everything runs on the calling thread in directory
+  order, exactly like the original single-threaded loop.
+
+  Matchers whose features are global distributions (color and texture
+  histograms) can also ask for reduced-resolution JPEG decoding with
+  --decode-scale <1|2|4|8|auto>.  This uses libjpeg's DCT scaling through
+  IMREAD_REDUCED_COLOR_2/4/8, so most of the decode work is skipped.  In
+  auto mode the scale is picked per image from the JPEG header so that
+  the short side keeps at least AUTO_DECODE_MIN_SIDE pixels.  Other image
+  formats are always decoded at full resolution.  --decode-compare also
+  decodes every image at full resolution so the matcher can report how
+  much the ranking changes.
+ */
+
+#ifndef IMAGE_PIPELINE_H
+#define IMAGE_PIPELINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+/*
+  A fixed-capacity FIFO queue for handing work between threads.  push
+  blocks while the queue is full and pop blocks while it is empty.
+  After close, push fails and pop returns the remaining items and then
+  fails.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : limit(capacity > 0 ? capacity : 1), closed(false) {}
+
+    bool push(const T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < limit; });
+        if(closed) {
+            return false;
+        }
+        items.push_back(item);
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if(items.empty()) {
+            return false;
+        }
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<T> items;
+    size_t limit;
+    bool closed;
+};
+
+// decode scale that is chosen per image from its dimensions
+#define DECODE_SCALE_AUTO 0
+
+// short side an automatically scaled image keeps, in pixels
+#define AUTO_DECODE_MIN_SIDE 160
+
+struct PipelineOptions {
+    int threads;            // worker threads, 0 = one per hardware thread
+    int decodeScale;        // 1, 2, 4, 8 or DECODE_SCALE_AUTO
+    bool compareFullDecode; // also decode at full resolution
+
+    PipelineOptions() : threads(0), decodeScale(1), compareFullDecode(false) {}
+};
+
+/*
+  Removes the pipeline options (--threads <n>, and when allowDecodeScale
+  is true --decode-scale <s> and --decode-compare) from argv, adjusting
+  argc, and stores them in options.  Returns a non-zero value if an
+  option is malformed.
+ */
+int parse_pipeline_options( int &argc, char *argv[], PipelineOptions &options, bool allowDecodeScale = false );
+
+/*
+  Returns the decode scale to use for a file: 1 for anything that is not
+  a JPEG, the requested scale otherwise, or for DECODE_SCALE_AUTO the
+  largest of 8, 4, 2 that keeps AUTO_DECODE_MIN_SIDE pixels.
+ */
+int choose_decode_scale( const char *path, int requested );
+
+/*
+  imread with IMREAD_REDUCED_COLOR_<scale> for scales 2, 4 and 8.
+ */
+cv::Mat decode_image( const char *path, int scale );
+
+/*
+  Loads an image the same way the pipeline does (used for the target).
+ */
+cv::Mat load_image( const char *path, const PipelineOptions &options );
+
+/*
+  One decoded image handed to the feature callback.  id is the position
+  of the file in enumeration order and indexes ImagePipeline::filename.
+ */
+struct PipelineImage {
+    int id;
+    const char *filename;   // name inside the directory
+    std::string path;       // full path
+    cv::Mat image;
+    int decodeScale;        // scale image was decoded at
+    long long decodeNanos;  // time spent decoding image
+    cv::Mat fullImage;      // full resolution, only with compareFullDecode
+};
+
+/*
+  Called once per decoded image from a feature worker.  worker is in
+  [0, featureWorkers()) and can be used to index per-thread state.
+ */
+typedef std::function<void(PipelineImage &item, int worker)> ImageCallback;
+
+/*
+  Decodes one file in place of imread; must be safe to call from several
+  decode workers at once.  Returns an empty Mat on failure.
+ */
+typedef std::function<cv::Mat(const char *path)> ImageDecoder;
+
+/*
+  Called on the enumerating thread for every file before it is queued
+  for decoding.  Returns true to skip the file, e.g. because its
+  features are already known.  Skipped files keep their id and filename.
+ */
+typedef std::function<bool(const PipelineImage &item)> ImageFilter;
+
+class ImagePipeline {
+public:
+    explicit ImagePipeline( const PipelineOptions &options );
+
+    /*
+      Decodes every file in directory whose name contains one of the
+      extensions and calls callback for it.  Returns a non-zero value if
+      the directory cannot be opened.
+     */
+    int run( const char *directory, const std::vector<std::string> &extensions, ImageCallback callback );
+
+    /*
+      Uses decoder instead of imread for the directory images, e.g. to
+      decode only the part of the image a matcher looks at.  Decode
+      scaling is not applied to these images.
+     */
+    void setDecoder( ImageDecoder decoder ) { customDecoder = decoder; }
+
+    /*
+      Skips the files for which skip returns true: they are neither
+      decoded nor passed to the callback.
+     */
+    void setSkipFilter( ImageFilter skip ) { skipFilter = skip; }
+
+    /*
+      Prints the decode scales used and the time spent decoding.  With
+      compareFullDecode the full-resolution decode time is shown as well.
+     */
+    void printDecodeReport() const;
+
+    int decodeWorkers() const { return numDecoders; }
+    int featureWorkers() const { return numFeatureWorkers; }
+
+    // enumerated filenames, indexed by PipelineImage::id
+    size_t fileCount() const { return names.size(); }
+    const char *filename( int id ) const { return names[id].c_str(); }
+
+private:
+    int runSequential( const char *directory, const std::vector<std::string> &extensions, ImageCallback &callback );
+
+    bool decode( PipelineImage &item );
+
+    PipelineOptions settings;
+    ImageDecoder customDecoder;
+    ImageFilter skipFilter;
+    int numDecoders;
+    int numFeatureWorkers;
+    std::deque<std::string> names;
+
+    // decode statistics, updated from the decode workers
+    std::atomic<long long> decodeNanos;
+    std::atomic<long long> reducedDecodeNanos;  // images decoded at scale > 1
+    std::atomic<long long> fullDecodeNanos;     // the same images at scale 1
+    std::atomic<int> scaleCounts[4];    // scales 1, 2, 4, 8
+};
+
+/*
+  The extensions accepted by the matchers: .jpg, .png, .ppm and .tif.
+ */
+const std::vector<std::string> &default_image_extensions();
+
+#endif
@@ -0,0 +1,353 @@
+/*
+  Incrementally maintained feature store: journal, tombstones and
+  compaction.  See incremental_index.h for the file layout.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "incremental_index.h"
+#include "file_sync.h"
+
+using namespace std;
+
+// Longest filename accepted from a journal; anything longer is damage
+#define JOURNAL_MAX_NAME 4096
+
+static bool fileExists(const string &path) {
+    FILE *fp = fopen(path.c_str(), "rb");
+    if(fp) {
+        fclose(fp);
+    }
+    return fp != NULL;
+}
+
+// Appends the records of one journal (everything after its header) to
+// another
+static int appendJournalRecords(const string &from, const string &to) {
+    FILE *in = fopen(from.c_str(), "rb");
+    if(!in) {
+        return 0;
+    }
+    FILE *out = fopen(to.c_str(), "ab");
+    if(!out) {
+        fclose(in);
+        return -1;
+    }
+
+    bool ok = fseek(in, sizeof(JournalHeader), SEEK_SET) == 0;
+    char buffer[65536];
+    size_t n;
+    while(ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ok = fwrite(buffer, 1, n, out) == n;
+    }
+    ok = ok && sync_stream(out);
+    fclose(in);
+    if(fclose(out) != 0 || !ok) {
+        return -1;
+    }
+    return 0;
+}
+
+IncrementalIndex::IncrementalIndex() : numCols(0), source(0), numDead(0), journal(NULL), numRecords(0) {
+}
+
+IncrementalIndex::~IncrementalIndex() {
+    if(journal) {
+        fclose(journal);
+    }
+}
+
+int IncrementalIndex::open(const char *storeFile, size_t dim, uint64_t sourceId) {
+    storePath = storeFile;
+    numCols = dim;
+    source = sourceId;
+
+    if(fileExists(storePath)) {
+        FeatureStore store;
+        if(!is_feature_store(storeFile) || store.load(storeFile) != 0) {
+            printf("Error: %s is not a feature store\n", storeFile);
+            return -1;
+        }
+        if(store.count() > 0 && (store.dim() != dim || store.fileStamps() == NULL || store.sourceId() != sourceId)) {
+            printf("Error: %s was not made by watch_index with this feature type\n", storeFile);
+            return -1;
+        }
+        for(size_t i = 0; i < store.count(); i++) {
+            putRow(store.name(i), store.fileStamps()[i], store.row(i));
+        }
+    }
+
+    // Changes since the last compaction, oldest first
+    string journalPath = storePath + ".journal";
+    string compactingPath = journalPath + ".compacting";
+    int replayed = 0;
+    bool leftover = fileExists(compactingPath);
+    const string journals[2] = { compactingPath, journalPath };
+    for(int j = 0; j < 2; j++) {
+        int records = replay(journals[j]);
+        if(records < 0) {
+            return -1;
+        }
+        replayed += records;
+    }
+
+    // Fold replayed changes into the store right away, so that every run
+    // starts from a compacted store and an empty journal
+    if(replayed > 0 || leftover) {
+        printf("Replayed %d journal records of %s\n", replayed, storeFile);
+        return compact();
+    }
+    return openJournal();
+}
+
+int IncrementalIndex::replay(const string &journalFile) {
+    FILE *fp = fopen(journalFile.c_str(), "rb");
+    if(!fp) {
+        return 0;
+    }
+
+    // a journal without a complete header holds no changes
+    JournalHeader header;
+    if(fread(&header, sizeof(header), 1, fp) != 1) {
+        fclose(fp);
+        return 0;
+    }
+    if(memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.version != JOURNAL_VERSION) {
+        printf("Error: %s is not a feature journal\n", journalFile.c_str());
+        fclose(fp);
+        return -1;
+    }
+    if(header.dim != numCols || header.sourceId != source) {
+        printf("Error: %s was written for another feature type\n", journalFile.c_str());
+        fclose(fp);
+        return -1;
+    }
+
+    // Stop at the first incomplete record, which a crash can leave behind
+    vector<float> features(numCols);
+    string name;
+    int replayed = 0;
+    for(;;) {
+        uint32_t fields[2];
+        FeatureFileStamp stamp;
+        if(fread(fields, sizeof(uint32_t), 2, fp) != 2 || fread(&stamp, sizeof(stamp), 1, fp) != 1 ||
+           fields[1] == 0 || fields[1] > JOURNAL_MAX_NAME) {
+            break;
+        }
+        name.resize(fields[1]);
+        if(fread(&name[0], 1, fields[1], fp) != fields[1]) {
+            break;
+        }
+        if(fields[0] == JOURNAL_PUT) {
+            if(numCols > 0 && fread(&features[0], sizeof(float), numCols, fp) != numCols) {
+                break;
+            }
+            putRow(name, stamp, features.empty() ? NULL : &features[0]);
+        }
+        else if(fields[0] == JOURNAL_DELETE) {
+            removeRow(name);
+        }
+        else {
+            break;
+        }
+        replayed++;
+    }
+
+    fclose(fp);
+    return replayed;
+}
+
+// Starts a new, empty journal; called with the lock held or before any
+// other thread uses the index
+int IncrementalIndex::openJournal() {
+    string journalPath = storePath + ".journal";
+    journal = fopen(journalPath.c_str(), "wb");
+    if(!journal) {
+        printf("Unable to open journal %s\n", journalPath.c_str());
+        return -1;
+    }
+
+    JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.dim = numCols;
+    header.sourceId = source;
+    numRecords = 0;
+    if(fwrite(&header, sizeof(header), 1, journal) != 1 || fflush(journal) != 0) {
+        printf("Error writing journal %s\n", journalPath.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+void IncrementalIndex::putRow(const string &name, const FeatureFileStamp &stamp, const float *features) {
+    removeRow(name);
+    rows[name] = names.size();
+    names.push_back(name);
+    stamps.push_back(stamp);
+    data.insert(data.end(), features, features + numCols);
+    alive.push_back(true);
+}
+
+void IncrementalIndex::removeRow(const string &name) {
+    unordered_map<string, size_t>::iterator it = rows.find(name);
+    if(it == rows.end()) {
+        return;
+    }
+    alive[it->second] = false;
+    numDead++;
+    rows.erase(it);
+}
+
+bool IncrementalIndex::isCurrent(const char *name, const FeatureFileStamp &stamp) const {
+    lock_guard<mutex> guard(lock);
+    unordered_map<string, size_t>::const_iterator it = rows.find(name);
+    if(it == rows.end()) {
+        return false;
+    }
+    const FeatureFileStamp &stored = stamps[it->second];
+    return stored.size == stamp.size && stored.mtime == stamp.mtime;
+}
+
+int IncrementalIndex::put(const char *name, const FeatureFileStamp &stamp, const float *features) {
+    lock_guard<mutex> guard(lock);
+    putRow(name, stamp, features);
+
+    uint32_t fields[2] = { JOURNAL_PUT, (uint32_t)strlen(name) };
+    bool ok = journal != NULL &&
+              fwrite(fields, sizeof(uint32_t), 2, journal) == 2 &&
+              fwrite(&stamp, sizeof(stamp), 1, journal) == 1 &&
+              fwrite(name, 1, fields[1], journal) == fields[1] &&
+              fwrite(features, sizeof(float), numCols, journal) == numCols &&
+              fflush(journal) == 0;
+    if(!ok) {
+        printf("Error writing journal for %s\n", storePath.c_str());
+        return -1;
+    }
+    numRecords++;
+    return 0;
+}
+
+int IncrementalIndex::remove(const char *name) {
+    lock_guard<mutex> guard(lock);
+    if(rows.find(name) == rows.end()) {
+        return 0;
+    }
+    removeRow(name);
+
+    uint32_t fields[2] = { JOURNAL_DELETE, (uint32_t)strlen(name) };
+    FeatureFileStamp tombstone;
+    memset(&tombstone, 0, sizeof(tombstone));
+    bool ok = journal != NULL &&
+              fwrite(fields, sizeof(uint32_t), 2, journal) == 2 &&
+              fwrite(&tombstone, sizeof(tombstone), 1, journal) == 1 &&
+              fwrite(name, 1, fields[1], journal) == fields[1] &&
+              fflush(journal) == 0;
+    if(!ok) {
+        printf("Error writing journal for %s\n", storePath.c_str());
+        return -1;
+    }
+    numRecords++;
+    return 1;
+}
+
+vector<string> IncrementalIndex::liveNames() const {
+    lock_guard<mutex> guard(lock);
+    vector<string> live;
+    for(size_t i = 0; i < names.size(); i++) {
+        if(alive[i]) {
+            live.push_back(names[i]);
+        }
+    }
+    return live;
+}
+
+size_t IncrementalIndex::liveRows() const {
+    lock_guard<mutex> guard(lock);
+    return rows.size();
+}
+
+size_t IncrementalIndex::deadRows() const {
+    lock_guard<mutex> guard(lock);
+    return numDead;
+}
+
+size_t IncrementalIndex::journalRecords() const {
+    lock_guard<mutex> guard(lock);
+    return numRecords;
+}
+
+int IncrementalIndex::compact() {
+    lock_guard<mutex> compacting(compactLock);
+    string journalPath = storePath + ".journal";
+    string compactingPath = journalPath + ".compacting";
+
+    // Under the lock: drop the dead rows and switch to a new journal.
+    // The journal being replaced is kept as <store>.journal.compacting
+    // until the new store is in place.
+    vector<string> liveNames;
+    vector<FeatureFileStamp> liveStamps;
+    vector<float> liveData;
+    {
+        lock_guard<mutex> guard(lock);
+        for(size_t i = 0; i < names.size(); i++) {
+            if(alive[i]) {
+                liveNames.push_back(names[i]);
+                liveStamps.push_back(stamps[i]);
+                liveData.insert(liveData.end(), data.begin() + i * numCols, data.begin() + (i + 1) * numCols);
+            }
+        }
+        names = liveNames;
+        stamps = liveStamps;
+        data = liveData;
+        alive.assign(names.size(), true);
+        rows.clear();
+        for(size_t i = 0; i < names.size(); i++) {
+            rows[names[i]] = i;
+        }
+        numDead = 0;
+
+        // the records being compacted must be on disk before the
+        // journal is renamed; they are the only copy until the new
+        // store is
+        if(journal) {
+            bool synced = sync_stream(journal);
+            fclose(journal);
+            journal = NULL;
+            if(!synced) {
+                printf("Error: Unable to write journal %s to disk\n", journalPath.c_str());
+                return -1;
+            }
+        }
+        // a compaction that failed earlier left its journal behind; add
+        // the newer records to it instead of replacing it
+        int moved = fileExists(compactingPath) ? appendJournalRecords(journalPath, compactingPath)
+                  : fileExists(journalPath) ? replace_file(journalPath.c_str(), compactingPath.c_str()) : 0;
+        if(moved != 0 || openJournal() != 0) {
+            printf("Error: Unable to rotate journal %s\n", journalPath.c_str());
+            return -1;
+        }
+    }
+
+    // Without the lock: write the snapshot, flush it to disk and move it
+    // into place; only then can the compacted journal go
+    vector<char *> namePointers(liveNames.size());
+    for(size_t i = 0; i < liveNames.size(); i++) {
+        namePointers[i] = &liveNames[i][0];
+    }
+    string temporary = storePath + ".tmp";
+    size_t count = liveNames.size();
+    if(write_feature_store(temporary.c_str(), namePointers, liveData.empty() ? NULL : &liveData[0], count, numCols,
+                           false, liveStamps.empty() ? NULL : &liveStamps[0], source) != 0 ||
+       !sync_file(temporary.c_str()) || replace_file(temporary.c_str(), storePath.c_str()) != 0) {
+        printf("Error: Compaction of %s failed; its journal is kept\n", storePath.c_str());
+        ::remove(temporary.c_str());
+        return -1;
+    }
+    sync_directory(storePath.c_str());
+    ::remove(compactingPath.c_str());
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+  Incrementally maintained feature store
+
+  Keeps the features of an image directory up to date as files are
+  added, modified and deleted, at a cost proportional to the changes
+  instead of the size of the directory (see watch_index).
+
+  The data lives in two files:
+
+    <store>            a feature store with file stamps (feature_store.h),
+                       the state as of the last compaction
+    <store>.journal    every change since then, appended as it happens
+
+  A changed file appends a put record with its new features; a deleted
+  file appends a delete record, a tombstone.  In memory, the row a put
+  or delete replaces stays in place but is marked dead, so nothing moves
+  while the watcher runs.  Compaction writes the live rows to a new
+  store and starts an empty journal.  The slow part, writing the store,
+  runs without the lock, so changes can still be recorded meanwhile.
+
+  On open, the store is loaded and the journal is replayed.  A journal
+  left over by an interrupted compaction (<store>.journal.compacting) is
+  replayed first.  Replaying a record twice has no effect, and a record
+  cut short by a crash is dropped, so every interruption point leaves a
+  readable state behind.
+
+  Journal layout (all integers little-endian):
+
+    JournalHeader                               32 bytes
+    records, each:
+      uint32_t type                             JOURNAL_PUT or JOURNAL_DELETE
+      uint32_t nameLength                       without terminator
+      FeatureFileStamp stamp                    zero for deletes
+      char name[nameLength]
+      float features[dim]                       puts only
+ */
+
+#ifndef INCREMENTAL_INDEX_H
+#define INCREMENTAL_INDEX_H
+
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include "feature_store.h"
+
+#define JOURNAL_MAGIC "IRFJ"
+#define JOURNAL_VERSION 1
+
+enum JournalRecordType {
+    JOURNAL_PUT = 1,
+    JOURNAL_DELETE = 2
+};
+
+struct JournalHeader {
+    char magic[4];          // "IRFJ"
+    uint32_t version;       // JOURNAL_VERSION
+    uint64_t dim;           // features per row
+    uint64_t sourceId;      // same meaning as in the feature store
+    uint64_t reserved;      // must be 0
+};
+
+class IncrementalIndex {
+public:
+    IncrementalIndex();
+    ~IncrementalIndex();
+
+    /*
+      Loads storeFile and its journals, creating them if they do not
+      exist.  dim is the number of features per row and sourceId
+      identifies the feature type; a store made with other values is an
+      error.  Returns a non-zero value if something goes wrong.
+     */
+    int open( const char *storeFile, size_t dim, uint64_t sourceId );
+
+    /*
+      Returns true if name is stored with the given file stamp.
+     */
+    bool isCurrent( const char *name, const FeatureFileStamp &stamp ) const;
+
+    /*
+      Records the features of a new or modified file.  Returns a non-zero
+      value if the journal cannot be written.
+     */
+    int put( const char *name, const FeatureFileStamp &stamp, const float *features );
+
+    /*
+      Tombstones a deleted file.  Returns 1 if a row was tombstoned, 0 if
+      the name was not indexed (nothing is written), or -1 if the journal
+      cannot be written.
+     */
+    int remove( const char *name );
+
+    /*
+      Names of the live rows.
+     */
+    std::vector<std::string> liveNames() const;
+
+    /*
+      Writes the live rows to a new store and starts an empty journal.
+      May run on a background thread while put and remove are called.
+     */
+    int compact();
+
+    size_t liveRows() const;
+    size_t deadRows() const;
+    size_t journalRecords() const;
+
+private:
+    IncrementalIndex(const IncrementalIndex &);
+    IncrementalIndex &operator=(const IncrementalIndex &);
+
+    int replay( const std::string &journalFile );
+    int openJournal();
+    void putRow( const std::string &name, const FeatureFileStamp &stamp, const float *features );
+    void removeRow( const std::string &name );
+
+    std::string storePath;
+    size_t numCols;
+    uint64_t source;
+
+    mutable std::mutex lock;
+    std::mutex compactLock;     // one compaction at a time
+    std::vector<std::string> names;
+    std::vector<FeatureFileStamp> stamps;
+    std::vector<float> data;
+    std::vector<bool> alive;
+    std::unordered_map<std::string, size_t> rows;   // live name -> row
+    size_t numDead;
+
+    FILE *journal;
+    size_t numRecords;          // records in the current journal
+};
+
+#endif
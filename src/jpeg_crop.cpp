@@ -0,0 +1,204 @@
+/*
+  Partial JPEG decoding of the center of an image.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+#include "jpeg_crop.h"
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+#include <csetjmp>
+#include <jpeglib.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Copies the centered square out of a fully decoded image
+static int cropFullDecode(const char *path, int halfSize, Mat &out) {
+    Mat image = imread(path);
+    if(image.empty()) {
+        return -1;
+    }
+
+    int size = 2 * halfSize + 1;
+    if(image.cols < size || image.rows < size) {
+        out = image;
+        return 0;
+    }
+
+    Rect region(image.cols / 2 - halfSize, image.rows / 2 - halfSize, size, size);
+    out = image(region).clone();
+    return 0;
+}
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+
+// Extra pixels decoded around the square, so that no output pixel lies on
+// the edge of the cropped region where the upsampler has no neighbours
+#define CROP_MARGIN 16
+
+struct CropErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf setjmpBuffer;
+};
+
+static void cropErrorExit(j_common_ptr cinfo) {
+    CropErrorManager *err = (CropErrorManager *)cinfo->err;
+    longjmp(err->setjmpBuffer, 1);
+}
+
+static void cropOutputMessage(j_common_ptr) {
+    // corrupt-data warnings are not interesting for a 7x7 crop
+}
+
+static unsigned int readUint16(const unsigned char *p, bool bigEndian) {
+    return bigEndian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static unsigned int readUint32(const unsigned char *p, bool bigEndian) {
+    return bigEndian ? ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]
+                     : ((unsigned int)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+// EXIF orientation (tag 0x0112 in IFD0) from an APP1 marker, 1 if absent
+static int exifOrientation(const unsigned char *data, unsigned int length) {
+    if(length < 14 || memcmp(data, "Exif\0\0", 6) != 0) {
+        return 1;
+    }
+    const unsigned char *tiff = data + 6;
+    unsigned int size = length - 6;
+
+    bool bigEndian;
+    if(tiff[0] == 'M' && tiff[1] == 'M') {
+        bigEndian = true;
+    }
+    else if(tiff[0] == 'I' && tiff[1] == 'I') {
+        bigEndian = false;
+    }
+    else {
+        return 1;
+    }
+
+    // The offsets come from the file: compare by subtraction, so that a
+    // huge offset cannot wrap around and pass the checks
+    unsigned int ifd = readUint32(tiff + 4, bigEndian);
+    if(ifd > size || size - ifd < 2) {
+        return 1;
+    }
+    unsigned int entries = readUint16(tiff + ifd, bigEndian);
+    unsigned int room = (size - ifd - 2) / 12;
+    for(unsigned int i = 0; i < entries && i < room; i++) {
+        unsigned int entry = ifd + 2 + 12 * i;
+        if(readUint16(tiff + entry, bigEndian) == 0x0112) {
+            return (int)readUint16(tiff + entry + 8, bigEndian);
+        }
+    }
+    return 1;
+}
+
+// Decodes the square with libjpeg-turbo.  Returns 1 if the file has to go
+// through the full decode instead, -1 on a decode error.
+static int cropJpegDecode(FILE *fp, int halfSize, Mat &out) {
+    struct jpeg_decompress_struct cinfo;
+    CropErrorManager jerr;
+    JSAMPARRAY rowBuffer = NULL;
+    int size = 2 * halfSize + 1;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = cropErrorExit;
+    jerr.pub.output_message = cropOutputMessage;
+    if(setjmp(jerr.setjmpBuffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+
+    int width = (int)cinfo.image_width;
+    int height = (int)cinfo.image_height;
+    bool supported = width >= size && height >= size
+        && cinfo.jpeg_color_space != JCS_CMYK && cinfo.jpeg_color_space != JCS_YCCK;
+    for(jpeg_saved_marker_ptr marker = cinfo.marker_list; marker != NULL && supported; marker = marker->next) {
+        if(marker->marker == JPEG_APP0 + 1 && exifOrientation(marker->data, marker->data_length) != 1) {
+            supported = false;
+        }
+    }
+    if(!supported) {
+        jpeg_destroy_decompress(&cinfo);
+        return 1;
+    }
+
+    // Same settings as OpenCV's JPEG decoder
+    cinfo.out_color_space = JCS_EXT_BGR;
+    cinfo.dct_method = JDCT_ISLOW;
+    cinfo.do_fancy_upsampling = TRUE;
+    jpeg_start_decompress(&cinfo);
+
+    int left = width / 2 - halfSize;
+    int top = height / 2 - halfSize;
+    int cropLeft = max(left - CROP_MARGIN, 0);
+    int cropRight = min(left + size + CROP_MARGIN, width);
+    JDIMENSION xoffset = (JDIMENSION)cropLeft;
+    JDIMENSION cropWidth = (JDIMENSION)(cropRight - cropLeft);
+    jpeg_crop_scanline(&cinfo, &xoffset, &cropWidth);
+
+    // jpeg_crop_scanline widens the region to iMCU boundaries
+    int column = left - (int)xoffset;
+    int rowStride = (int)cinfo.output_width * cinfo.output_components;
+    rowBuffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE, rowStride, 1);
+
+    jpeg_skip_scanlines(&cinfo, (JDIMENSION)top);
+
+    out.create(size, size, CV_8UC3);
+    for(int y = 0; y < size; y++) {
+        jpeg_read_scanlines(&cinfo, rowBuffer, 1);
+        memcpy(out.ptr<unsigned char>(y), rowBuffer[0] + 3 * column, 3 * size);
+    }
+
+    // The rest of the image is never decoded
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+}
+
+#endif
+
+int decode_center_square(const char *path, int halfSize, Mat &out, bool *usedFastPath) {
+    if(usedFastPath != NULL) {
+        *usedFastPath = false;
+    }
+
+#ifdef HAVE_JPEG_CROP_SCANLINE
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return -1;
+    }
+
+    unsigned char signature[3];
+    bool isJpeg = fread(signature, 1, 3, fp) == 3
+        && signature[0] == 0xFF && signature[1] == 0xD8 && signature[2] == 0xFF;
+
+    int result = 1;
+    if(isJpeg) {
+        rewind(fp);
+        result = cropJpegDecode(fp, halfSize, out);
+    }
+    fclose(fp);
+
+    if(result == 0) {
+        if(usedFastPath != NULL) {
+            *usedFastPath = true;
+        }
+        return 0;
+    }
+    // A damaged file may still be readable by imread, so fall through
+#endif
+
+    return cropFullDecode(path, halfSize, out);
+}
@@ -0,0 +1,32 @@
+/*
+  Partial JPEG decoding of the center of an image
+
+  baseline_match only looks at the 7x7 pixels around the image center.
+  With libjpeg-turbo (HAVE_JPEG_CROP_SCANLINE) only the iMCU rows and
+  columns covering that region are decoded, using jpeg_skip_scanlines and
+  jpeg_crop_scanline.  The decoder settings match imread (BGR output,
+  ISLOW IDCT, fancy upsampling), so the pixels are the same as from a
+  full decode.
+
+  Anything the fast path cannot reproduce exactly falls back to a full
+  imread: non-JPEG files, CMYK JPEGs, images with an EXIF orientation
+  other than 1 (imread rotates those) and builds without libjpeg-turbo.
+ */
+
+#ifndef JPEG_CROP_H
+#define JPEG_CROP_H
+
+#include <opencv2/opencv.hpp>
+
+/*
+  Decodes the (2 * halfSize + 1) square centered on (cols / 2, rows / 2)
+  into out as a CV_8UC3 BGR image of that size, so that its own center
+  square is the requested region.  If the image is smaller than the
+  square, out receives the full image instead.
+
+  The function returns a non-zero value if the image cannot be read.
+  usedFastPath, if given, is set to whether the partial decode was used.
+ */
+int decode_center_square( const char *path, int halfSize, cv::Mat &out, bool *usedFastPath = NULL );
+
+#endif
@@ -4,7 +4,32 @@
   Extension: Instead of using pre-computed CSV, this program loads the ResNet18
   ONNX model and computes embeddings for each image during matching.
   
-  Usage: live_dnn_match <target_image> <image_directory> <onnx_model> <num_matches>
+  The database images go through a pipeline of stages that run at the
+  same time, connected by bounded queues:
+    1. decode workers read each image and resize it to the 224x224
+       network input,
+    2. batch workers collect the images into batches of --batch images
+       and turn each batch into one input blob with blobFromImages,
+    3. one inference thread runs the network on whole batches,
+    4. one scoring thread compares the embeddings with the target.
+  So decoding overlaps with inference, and the network runs on batches
+  instead of one image at a time.  The images per second of every stage
+  are printed at the end from the stage counters of stage_stats.h; the
+  slowest stage limits the whole pipeline.
+  --batch 1 runs the network on single images for comparison.
+  
+  --cache keeps the embeddings in a feature store file between runs,
+  keyed by each image's name, size and modification time (see
+  embedding_cache.h).  Images with a valid cached embedding are not even
+  decoded, so a repeat query only runs the network for new and modified
+  images.  --cache-hash also stores a hash of each image's contents and
+  matches on that instead of the modification time.
+  
+  --stats and --stats-json <file> add latency percentiles per image and
+  per batch for every stage (see stage_stats.h).
+  
+  Usage: live_dnn_match <target_image> <image_directory> <onnx_model> <num_matches> [--threads <n>] [--batch <n>]
+                        [--cache <cache_file> [--cache-hash]] [--stats] [--stats-json <file>]
 */
 
 #include <opencv2/opencv.hpp>
@@ -14,93 +39,128 @@
 #include <vector>
 #include <algorithm>
 #include <cmath>
-#include <dirent.h>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include "image_pipeline.h"
+#include "top_k.h"
+#include "embedding_matrix.h"
+#include "embedding_cache.h"
+#include "stage_stats.h"
 
 using namespace cv;
 using namespace cv::dnn;
 using namespace std;
 
-// Compute ResNet18 embedding for an image
-int getEmbedding(Mat &src, Mat &embedding, Net &net) {
-    const int ORNet_size = 224;
-    Mat blob;
-    
-    // ImageNet normalization and resize to 224x224
-    dnn::blobFromImage(src,
-                       blob,
-                       (1.0/255.0) * (1/0.226),
-                       Size(ORNet_size, ORNet_size),
-                       Scalar(124, 116, 104),
-                       true,
-                       false,
-                       CV_32F);
-    
-    net.setInput(blob);
-    embedding = net.forward("onnx_node!resnetv22_flatten0_reshape0");
-    
-    return 0;
+// Input size of the network
+#define NET_INPUT_SIZE 224
+
+// Images per forward pass unless --batch is given
+#define DEFAULT_BATCH_SIZE 16
+
+// Batches that may wait for inference and for scoring
+#define BATCH_QUEUE_DEPTH 4
+
+// Images of one batch, as they move from stage to stage
+struct Batch {
+    vector<int> ids;
+    Mat blob;           // network input, N x 3 x 224 x 224
+    Mat embeddings;     // network output, one row per image
+};
+
+// Images per second a pipeline stage can handle with its threads all
+// busy, from the time and images its stage counters recorded
+void printThroughput(const char *name, StatsStage stage, int threads) {
+    StageTotals totals = stats_totals(stage);
+    double seconds = totals.nanos / 1e9;
+    printf("%-26s %2d thread(s) %6lld images  %7.3f s busy  %8.1f images/s\n", name, threads,
+           totals.items, seconds, seconds > 0 ? totals.items * threads / seconds : 0.0);
 }
 
-// Convert Mat to vector<float>
-vector<float> matToVector(Mat &mat) {
-    vector<float> vec;
-    for(int i = 0; i < mat.total(); i++) {
-        vec.push_back(mat.at<float>(0, i));
+// Load an image resized to the network input, which is the resize
+// blobFromImage(s) would otherwise do
+Mat loadNetInput(const char *path) {
+    Mat image = imread(path);
+    if(image.empty()) {
+        return image;
     }
-    return vec;
+    Mat resized;
+    resize(image, resized, Size(NET_INPUT_SIZE, NET_INPUT_SIZE));
+    return resized;
 }
 
-// Normalize vector by L2 norm
-vector<float> normalizeVector(vector<float> &vec) {
-    vector<float> normalized;
-    float norm = 0.0;
-    
-    for(float val : vec) {
-        norm += val * val;
-    }
-    norm = sqrt(norm);
-    
-    if(norm > 0) {
-        for(float val : vec) {
-            normalized.push_back(val / norm);
-        }
-    } else {
-        normalized = vec;
-    }
-    
-    return normalized;
+// ImageNet normalization of 224x224 images into one input blob
+void makeBlob(const vector<Mat> &images, Mat &blob) {
+    dnn::blobFromImages(images,
+                        blob,
+                        (1.0/255.0) * (1/0.226),
+                        Size(NET_INPUT_SIZE, NET_INPUT_SIZE),
+                        Scalar(124, 116, 104),
+                        true,
+                        false,
+                        CV_32F);
 }
 
-// Compute cosine distance
-float cosineDistance(vector<float> &vec1, vector<float> &vec2) {
-    vector<float> norm1 = normalizeVector(vec1);
-    vector<float> norm2 = normalizeVector(vec2);
-    
-    float dotProd = 0.0;
-    for(int i = 0; i < norm1.size(); i++) {
-        dotProd += norm1[i] * norm2[i];
-    }
+// Compute the ResNet18 embeddings of a blob, one row per image
+int getEmbeddings(const Mat &blob, Mat &embeddings, Net &net) {
+    net.setInput(blob);
+    Mat output = net.forward("onnx_node!resnetv22_flatten0_reshape0");
     
-    if(dotProd > 1.0) dotProd = 1.0;
-    if(dotProd < -1.0) dotProd = -1.0;
+    // The output buffer is reused by the next forward pass
+    embeddings = output.reshape(1, blob.size[0]).clone();
     
-    return 1.0 - dotProd;
+    return 0;
 }
 
-struct ImageMatch {
-    string filename;
-    float distance;
+int main(int argc, char *argv[]) {
     
-    bool operator<(const ImageMatch &other) const {
-        return distance < other.distance;
+    // Pull out the options before looking at the positional arguments
+    PipelineOptions pipelineOptions;
+    if(parse_pipeline_options(argc, argv, pipelineOptions) != 0 || parse_stats_options(argc, argv) != 0) {
+        return -1;
+    }
+    // The throughput report reads the stage counters, so they are always on
+    stats_enable();
+    int batchSize = DEFAULT_BATCH_SIZE;
+    const char *cacheFile = NULL;
+    bool hashContent = false;
+    for(int i = 1; i < argc; ) {
+        int consumed = 0;
+        if(strcmp(argv[i], "--batch") == 0) {
+            if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+                printf("Error: --batch needs a positive number\n");
+                return -1;
+            }
+            batchSize = atoi(argv[i + 1]);
+            consumed = 2;
+        }
+        else if(strcmp(argv[i], "--cache") == 0) {
+            if(i + 1 >= argc) {
+                printf("Error: --cache needs a file name\n");
+                return -1;
+            }
+            cacheFile = argv[i + 1];
+            consumed = 2;
+        }
+        else if(strcmp(argv[i], "--cache-hash") == 0) {
+            hashContent = true;
+            consumed = 1;
+        }
+    
+        if(consumed == 0) {
+            i++;
+            continue;
+        }
+        for(int j = i; j < argc - consumed; j++) {
+            argv[j] = argv[j + consumed];
+        }
+        argc -= consumed;
     }
-};
-
-int main(int argc, char *argv[]) {
     
     if(argc < 5) {
-        printf("Usage: %s <target_image> <image_directory> <onnx_model> <num_matches>\n", argv[0]);
-        printf("Example: %s images/pic.0893.jpg images models/resnet18-v2-7.onnx 10\n", argv[0]);
+        printf("Usage: %s <target_image> <image_directory> <onnx_model> <num_matches> [--threads <n>] [--batch <n>]\n", argv[0]);
+        printf("       [--cache <cache_file> [--cache-hash]] [--stats] [--stats-json <file>]\n");
+        printf("Example: %s images/pic.0893.jpg images models/resnet18-v2-7.onnx 10 --batch 16 --cache images.irfs\n", argv[0]);
         return -1;
     }
     
@@ -123,86 +183,174 @@ int main(int argc, char *argv[]) {
     printf("Network has %lu layers\n", layerNames.size());
     
     // Load target image
-    Mat targetImage = imread(targetImagePath);
+    Mat targetImage = loadNetInput(targetImagePath);
     if(targetImage.empty()) {
         printf("Error: Could not load target image: %s\n", targetImagePath);
         return -1;
     }
     
     printf("\n=== Processing Target Image ===\n");
-    printf("Target: %s (%d x %d)\n", targetImagePath, targetImage.cols, targetImage.rows);
+    printf("Target: %s\n", targetImagePath);
     
     // Compute target embedding
-    Mat targetEmbeddingMat;
+    Mat targetBlob, targetEmbeddingMat;
     printf("Computing embedding for target image...\n");
-    getEmbedding(targetImage, targetEmbeddingMat, net);
-    vector<float> targetEmbedding = matToVector(targetEmbeddingMat);
-    printf("Target embedding computed: %lu dimensions\n", targetEmbedding.size());
-    
-    // Process all images in directory
-    DIR *dirp = opendir(imageDir);
-    if(dirp == NULL) {
-        printf("Error: Cannot open directory %s\n", imageDir);
-        return -1;
+    makeBlob(vector<Mat>(1, targetImage), targetBlob);
+    getEmbeddings(targetBlob, targetEmbeddingMat, net);
+    
+    // Normalize the target once; each database embedding is normalized
+    // in place, so a comparison is a single dot product
+    int dim = (int)targetEmbeddingMat.total();
+    vector<float> targetEmbedding(dim);
+    normalize_embedding(targetEmbeddingMat.ptr<float>(), dim, &targetEmbedding[0]);
+    printf("Target embedding computed: %d dimensions\n", dim);
+    
+    // Decode and resize on the pipeline's decode workers
+    ImagePipeline pipeline(pipelineOptions);
+    pipeline.setDecoder(loadNetInput);
+    
+    // Images with a valid cached embedding skip decoding and inference
+    EmbeddingCache cache;
+    vector<pair<int, const float *>> cachedEmbeddings;
+    if(cacheFile) {
+        cache.open(cacheFile, model_source_id(modelPath), dim, hashContent);
+        pipeline.setSkipFilter([&](const PipelineImage &item) {
+            const float *embedding = cache.lookup(item.id, item.filename, item.path.c_str());
+            if(embedding) {
+                cachedEmbeddings.push_back(make_pair(item.id, embedding));
+            }
+            return embedding != NULL;
+        });
     }
     
-    vector<ImageMatch> matches;
-    struct dirent *dp;
-    char buffer[512];
+    BoundedQueue<Batch> inferenceQueue(BATCH_QUEUE_DEPTH);
+    BoundedQueue<Batch> scoringQueue(BATCH_QUEUE_DEPTH);
+    
+    // Inference stage: the only user of the network from here on
+    thread inference([&]() {
+        Batch batch;
+        while(inferenceQueue.pop(batch)) {
+            StageTimer inferenceTimer(STATS_INFERENCE, batch.ids.size());
+            getEmbeddings(batch.blob, batch.embeddings, net);
+            inferenceTimer.stop();
+            batch.blob.release();
+            scoringQueue.push(batch);
+        }
+        scoringQueue.close();
+    });
+    
+    // Scoring stage
+    TopK best(numMatches);
     int processedCount = 0;
+    thread scoring([&]() {
+        Batch batch;
+        while(scoringQueue.pop(batch)) {
+            StageTimer distanceTimer(STATS_DISTANCE, batch.ids.size());
+            for(int i = 0; i < (int)batch.ids.size(); i++) {
+                float *embedding = batch.embeddings.ptr<float>(i);
+                normalize_embedding(embedding, dim, embedding);
+                if(cacheFile) {
+                    cache.store(batch.ids[i], embedding);
+                }
+                best.push(batch.ids[i], normalized_cosine_distance(&targetEmbedding[0], embedding, dim));
     
-    printf("\n=== Processing Database Images ===\n");
-    
-    while((dp = readdir(dirp)) != NULL) {
-        if(strstr(dp->d_name, ".jpg") || strstr(dp->d_name, ".png")) {
-            
-            strcpy(buffer, imageDir);
-            strcat(buffer, "/");
-            strcat(buffer, dp->d_name);
-            
-            Mat image = imread(buffer);
-            if(image.empty()) {
-                printf("Warning: Could not load %s\n", buffer);
-                continue;
+                if(++processedCount % 100 == 0) {
+                    printf("Processed %d images...\n", processedCount);
+                }
             }
-            
-            // Compute embedding for this image
-            Mat embeddingMat;
-            getEmbedding(image, embeddingMat, net);
-            vector<float> embedding = matToVector(embeddingMat);
-            
-            // Compute distance
-            float distance = cosineDistance(targetEmbedding, embedding);
-            
-            ImageMatch match;
-            match.filename = string(dp->d_name);
-            match.distance = distance;
-            matches.push_back(match);
-            
-            processedCount++;
-            if(processedCount % 100 == 0) {
-                printf("Processed %d images...\n", processedCount);
+            distanceTimer.stop();
+        }
+    });
+    
+    // Batch stage, on the pipeline's feature workers: collect the images
+    // and build the blob of every full batch outside the lock
+    mutex pendingLock;
+    vector<Mat> pendingImages;
+    vector<int> pendingIds;
+    auto submitBatch = [&](vector<Mat> &images, vector<int> &ids) {
+        Batch batch;
+        batch.ids.swap(ids);
+        StageTimer blobTimer(STATS_EXTRACT, batch.ids.size());
+        makeBlob(images, batch.blob);
+        blobTimer.stop();
+        inferenceQueue.push(batch);
+    };
+    
+    vector<string> extensions;
+    extensions.push_back(".jpg");
+    extensions.push_back(".png");
+    
+    printf("\n=== Processing Database Images (batches of %d) ===\n", batchSize);
+    
+    chrono::steady_clock::time_point runStart = chrono::steady_clock::now();
+    int result = pipeline.run(imageDir, extensions, [&](PipelineImage &item, int) {
+        vector<Mat> images;
+        vector<int> ids;
+        {
+            lock_guard<mutex> guard(pendingLock);
+            pendingImages.push_back(item.image);
+            pendingIds.push_back(item.id);
+            if((int)pendingIds.size() < batchSize) {
+                return;
             }
+            images.swap(pendingImages);
+            ids.swap(pendingIds);
         }
+        submitBatch(images, ids);
+    });
+    
+    // The last, partial batch
+    if(result == 0 && !pendingIds.empty()) {
+        submitBatch(pendingImages, pendingIds);
+    }
+    inferenceQueue.close();
+    inference.join();
+    scoring.join();
+    double runSeconds = chrono::duration<double>(chrono::steady_clock::now() - runStart).count();
+    if(result != 0) {
+        return -1;
     }
     
-    closedir(dirp);
+    // Score the cached embeddings, then write the cache for the next run
+    for(size_t i = 0; i < cachedEmbeddings.size(); i++) {
+        best.push(cachedEmbeddings[i].first,
+                  normalized_cosine_distance(&targetEmbedding[0], cachedEmbeddings[i].second, dim));
+    }
+    if(cacheFile) {
+        printf("Embedding cache: reused %d embeddings, computed %d\n", cache.hits(), processedCount);
+        if(cache.save() != 0) {
+            printf("Warning: Could not update embedding cache %s\n", cacheFile);
+        }
+    }
     
-    printf("Total images processed: %d\n", processedCount);
+    StageTimer sortTimer(STATS_SORT);
+    vector<ScoredId> matches = best.sorted();
+    sortTimer.stop();
     
-    // Sort by distance
-    sort(matches.begin(), matches.end());
+    printf("Total images processed: %d\n", processedCount + (int)cachedEmbeddings.size());
     
     // Display results
     printf("\n=== Top %d Matches (Live DNN Embeddings) ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)matches.size()); i++) {
-        printf("%d. %s (distance: %.4f)\n", i+1, matches[i].filename.c_str(), matches[i].distance);
+    for(int i = 0; i < (int)matches.size(); i++) {
+        printf("%d. %s (distance: %.4f)\n", i+1, pipeline.filename(matches[i].id), matches[i].distance);
     }
     
+    printf("\n=== Pipeline Throughput ===\n");
+    printThroughput("Decode + resize", STATS_DECODE, max(1, pipeline.decodeWorkers()));
+    printThroughput("Batch (blobFromImages)", STATS_EXTRACT, pipeline.featureWorkers());
+    printThroughput("Inference", STATS_INFERENCE, 1);
+    printThroughput("Scoring", STATS_DISTANCE, 1);
+    printf("End to end: %d images in %.3f s (%.1f images/s)\n", processedCount, runSeconds,
+           runSeconds > 0 ? processedCount / runSeconds : 0.0);
+    
     printf("\n=== Performance Note ===\n");
     printf("This extension computes embeddings in real-time using the ResNet18 ONNX model.\n");
     printf("Pro: No need for pre-computed CSV files\n");
     printf("Con: Slower than using cached embeddings (but more flexible!)\n");
     
+    if(report_stats("live_dnn_match") != 0) {
+        return -1;
+    }
+    
     return 0;
 }
\ No newline at end of file
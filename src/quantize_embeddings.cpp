@@ -0,0 +1,101 @@
+/*
+  Quantize the embeddings of a feature file
+
+  Writes a compressed copy of the normalized embeddings that
+  deep_embedding_match --quantized scans for candidates before it
+  re-ranks them with the full-precision vectors.  By default every
+  dimension becomes an 8-bit code (4x smaller than floats).  With --pq
+  the embeddings are product-quantized instead: the dimensions are split
+  into <subspaces> groups, each stored as one byte naming the nearest of
+  256 k-means centroids (a 512-d embedding with --pq 64 is 32x smaller).
+  Encoding runs on --threads threads (default: all cores).
+
+  The feature file can be a CSV file or a binary feature store created
+  with csv_to_store.
+
+  Usage: quantize_embeddings <feature_file> <output_file> [--pq <subspaces>] [--threads <n>]
+*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include "feature_store.h"
+#include "embedding_matrix.h"
+#include "quantized_embeddings.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+
+    // Pull out the options before looking at the positional arguments
+    int subspaces = 0;
+    int threads = max(1, (int)thread::hardware_concurrency());
+    for(int i = 1; i < argc; ) {
+        int *value = NULL;
+        if(strcmp(argv[i], "--pq") == 0) {
+            value = &subspaces;
+        }
+        else if(strcmp(argv[i], "--threads") == 0) {
+            value = &threads;
+        }
+
+        if(value == NULL) {
+            i++;
+            continue;
+        }
+        if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+            printf("Error: %s needs a positive number\n", argv[i]);
+            return -1;
+        }
+        *value = atoi(argv[i + 1]);
+        for(int j = i; j < argc - 2; j++) {
+            argv[j] = argv[j + 2];
+        }
+        argc -= 2;
+    }
+
+    // Check arguments
+    if(argc < 3) {
+        printf("Usage: %s <feature_file> <output_file> [--pq <subspaces>] [--threads <n>]\n", argv[0]);
+        printf("Example: %s data/ResNet18_olym.irfs data/ResNet18_olym.irqe --pq 64\n", argv[0]);
+        return -1;
+    }
+
+    char *featureFile = argv[1];
+    char *outputFile = argv[2];
+    QuantizationType type = subspaces > 0 ? QE_PQ : QE_INT8;
+
+    FeatureStore embeddings;
+    if(embeddings.load(featureFile) != 0) {
+        printf("Error: Failed to read %s\n", featureFile);
+        return -1;
+    }
+
+    EmbeddingMatrix normalized;
+    normalized.assign(embeddings.data(), embeddings.count(), embeddings.dim(), embeddings.stride(), embeddings.isNormalized());
+
+    size_t codeSize = type == QE_INT8 ? normalized.dim() : (size_t)subspaces;
+    if(type == QE_INT8) {
+        printf("Quantizing %lu embeddings of %lu dimensions to int8\n",
+               (unsigned long)normalized.count(), (unsigned long)normalized.dim());
+    }
+    else {
+        printf("Quantizing %lu embeddings of %lu dimensions with %d PQ subspaces\n",
+               (unsigned long)normalized.count(), (unsigned long)normalized.dim(), subspaces);
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if(write_quantized_embeddings(outputFile, embeddings, normalized, type, subspaces, threads) != 0) {
+        return -1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    double floatBytes = (double)normalized.dim() * sizeof(float);
+    printf("Wrote %s in %.2f s: %lu bytes per embedding instead of %.0f (%.1fx smaller)\n",
+           outputFile, seconds, (unsigned long)codeSize, floatBytes, floatBytes / codeSize);
+
+    return 0;
+}
@@ -0,0 +1,325 @@
+/*
+  Quantized embeddings: int8 and product quantizer training, encoding,
+  writer and memory-mapped scoring.  See quantized_embeddings.h for the
+  file layout.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+#include <opencv2/opencv.hpp>
+#include "distance_kernels.h"
+#include "quantized_embeddings.h"
+
+using namespace std;
+
+// Rows used to train the product quantizer codebooks
+#define PQ_TRAINING_ROWS 25600
+
+// k-means iterations per subspace
+#define PQ_KMEANS_ITERATIONS 25
+
+// Fixed seed, so the training sample and codebooks are reproducible
+#define PQ_SEED 100
+
+// Rows encoded per unit of work handed to a thread
+#define ENCODE_BLOCK_ROWS 1024
+
+// Alignment of the parameter and code tables inside the file
+static const uint64_t QUANTIZED_ALIGNMENT = 64;
+
+static uint64_t alignUp(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static float clampedDistance(float dot) {
+    return 1.0f - max(-1.0f, min(1.0f, dot));
+}
+
+/*
+  Per-dimension range of the rows, as offset[d] = minimum and scale[d] =
+  (maximum - minimum) / 255.
+ */
+static void trainInt8(const EmbeddingMatrix &vectors, vector<float> &params) {
+    size_t dim = vectors.dim();
+    params.assign(2 * dim, 0.0f);
+    vector<float> low(vectors.row(0), vectors.row(0) + dim);
+    vector<float> high(low);
+    for(size_t r = 1; r < vectors.count(); r++) {
+        const float *row = vectors.row(r);
+        for(size_t d = 0; d < dim; d++) {
+            low[d] = min(low[d], row[d]);
+            high[d] = max(high[d], row[d]);
+        }
+    }
+    for(size_t d = 0; d < dim; d++) {
+        params[d] = low[d];
+        params[dim + d] = (high[d] - low[d]) / 255.0f;
+    }
+}
+
+static void encodeInt8(const float *params, const float *row, size_t dim, unsigned char *code) {
+    const float *offset = params;
+    const float *scale = params + dim;
+    for(size_t d = 0; d < dim; d++) {
+        float level = scale[d] > 0.0f ? (row[d] - offset[d]) / scale[d] : 0.0f;
+        code[d] = (unsigned char)max(0.0f, min(255.0f, floor(level + 0.5f)));
+    }
+}
+
+/*
+  Codebooks of PQ_CENTROIDS centroids per subspace, trained with k-means
+  on a random sample of the rows.
+ */
+static int trainPq(const EmbeddingMatrix &vectors, int subspaces, vector<float> &params) {
+    size_t count = vectors.count();
+    size_t dim = vectors.dim();
+    int subDim = (int)(dim / subspaces);
+
+    vector<size_t> sample(count);
+    for(size_t i = 0; i < count; i++) {
+        sample[i] = i;
+    }
+    if(count > PQ_TRAINING_ROWS) {
+        mt19937 rng(PQ_SEED);
+        for(size_t i = 0; i < PQ_TRAINING_ROWS; i++) {
+            size_t j = i + rng() % (count - i);
+            swap(sample[i], sample[j]);
+        }
+        sample.resize(PQ_TRAINING_ROWS);
+    }
+    int clusters = (int)min(sample.size(), (size_t)PQ_CENTROIDS);
+
+    params.assign((size_t)subspaces * PQ_CENTROIDS * subDim, 0.0f);
+    cv::setRNGSeed(PQ_SEED);
+    for(int j = 0; j < subspaces; j++) {
+        cv::Mat points((int)sample.size(), subDim, CV_32F);
+        for(size_t i = 0; i < sample.size(); i++) {
+            memcpy(points.ptr<float>((int)i), vectors.row(sample[i]) + (size_t)j * subDim, subDim * sizeof(float));
+        }
+
+        cv::Mat labels, centers;
+        cv::kmeans(points, clusters, labels,
+                   cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, PQ_KMEANS_ITERATIONS, 1e-4),
+                   1, cv::KMEANS_PP_CENTERS, centers);
+        if(centers.rows != clusters || centers.cols != subDim || centers.type() != CV_32F) {
+            printf("Error: k-means failed for subspace %d\n", j);
+            return -1;
+        }
+
+        // With fewer rows than centroids the spare entries repeat the
+        // first centroid; no code refers to them
+        float *codebook = &params[(size_t)j * PQ_CENTROIDS * subDim];
+        for(int k = 0; k < PQ_CENTROIDS; k++) {
+            memcpy(codebook + (size_t)k * subDim, centers.ptr<float>(k < clusters ? k : 0), subDim * sizeof(float));
+        }
+
+        if((j + 1) % 8 == 0 || j + 1 == subspaces) {
+            printf("Trained %d of %d subspaces\n", j + 1, subspaces);
+        }
+    }
+    return 0;
+}
+
+static void encodePq(const float *params, const float *row, size_t dim, int subspaces, unsigned char *code) {
+    const DistanceKernelTable &kernels = distance_kernels();
+    size_t subDim = dim / subspaces;
+    float distances[PQ_CENTROIDS];
+    for(int j = 0; j < subspaces; j++) {
+        kernels.squaredDistanceBatch(row + j * subDim, params + (size_t)j * PQ_CENTROIDS * subDim,
+                                     PQ_CENTROIDS, subDim, subDim, distances);
+        code[j] = (unsigned char)(min_element(distances, distances + PQ_CENTROIDS) - distances);
+    }
+}
+
+int write_quantized_embeddings( const char *filename, const FeatureStore &store,
+                                const EmbeddingMatrix &vectors, QuantizationType type,
+                                int subspaces, int threads ) {
+    size_t count = vectors.count();
+    size_t dim = vectors.dim();
+    if(count == 0 || dim == 0) {
+        printf("Error: No embeddings to quantize\n");
+        return -1;
+    }
+    if(type == QE_INT8) {
+        subspaces = (int)dim;
+    }
+    else if(subspaces < 1 || dim % subspaces != 0) {
+        printf("Error: %d subspaces do not divide %lu dimensions\n", subspaces, (unsigned long)dim);
+        return -1;
+    }
+
+    vector<float> params;
+    if(type == QE_INT8) {
+        trainInt8(vectors, params);
+    }
+    else if(trainPq(vectors, subspaces, params) != 0) {
+        return -1;
+    }
+
+    // Encode blocks of rows on the worker threads
+    vector<unsigned char> codes(count * subspaces);
+    atomic<size_t> next(0);
+    vector<thread> workers;
+    for(int t = 0; t < max(1, threads); t++) {
+        workers.push_back(thread([&]() {
+            for(size_t start = next.fetch_add(ENCODE_BLOCK_ROWS); start < count;
+                start = next.fetch_add(ENCODE_BLOCK_ROWS)) {
+                size_t end = min(count, start + ENCODE_BLOCK_ROWS);
+                for(size_t r = start; r < end; r++) {
+                    if(type == QE_INT8) {
+                        encodeInt8(&params[0], vectors.row(r), dim, &codes[r * subspaces]);
+                    }
+                    else {
+                        encodePq(&params[0], vectors.row(r), dim, subspaces, &codes[r * subspaces]);
+                    }
+                }
+            }
+        }));
+    }
+    for(size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+
+    QuantizedHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, QUANTIZED_MAGIC, sizeof(header.magic));
+    header.version = QUANTIZED_VERSION;
+    header.count = count;
+    header.dim = dim;
+    header.fingerprint = feature_names_fingerprint(store);
+    header.type = type;
+    header.subspaces = subspaces;
+    header.paramsOffset = sizeof(QuantizedHeader);
+    header.codesOffset = alignUp(header.paramsOffset + params.size() * sizeof(float), QUANTIZED_ALIGNMENT);
+
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+
+    static const char padding[QUANTIZED_ALIGNMENT] = { 0 };
+    size_t pad = header.codesOffset - (header.paramsOffset + params.size() * sizeof(float));
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+    ok = ok && fwrite(&params[0], sizeof(float), params.size(), fp) == params.size();
+    ok = ok && fwrite(padding, 1, pad, fp) == pad;
+    ok = ok && fwrite(&codes[0], 1, codes.size(), fp) == codes.size();
+
+    if(fclose(fp) != 0 || !ok) {
+        printf("Error writing quantized embeddings %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+QuantizedEmbeddings::QuantizedEmbeddings() : header(NULL), params(NULL), codes(NULL) {
+}
+
+int QuantizedEmbeddings::load(const char *filename, const FeatureStore &store) {
+    header = NULL;
+    if(file.open(filename) != 0) {
+        printf("Unable to map quantized embeddings %s\n", filename);
+        return -1;
+    }
+
+    const QuantizedHeader *h = (const QuantizedHeader *)file.data();
+    if(file.size() < sizeof(QuantizedHeader) || memcmp(h->magic, QUANTIZED_MAGIC, sizeof(h->magic)) != 0) {
+        printf("%s is not a quantized embedding file\n", filename);
+        file.close();
+        return -1;
+    }
+    if(h->version != QUANTIZED_VERSION) {
+        printf("Quantized embeddings %s have unsupported version %u\n", filename, h->version);
+        file.close();
+        return -1;
+    }
+    if(h->count != store.count() || h->dim != store.dim() ||
+       h->fingerprint != feature_names_fingerprint(store)) {
+        printf("Quantized embeddings %s were not made from this feature file\n", filename);
+        file.close();
+        return -1;
+    }
+
+    // Check the quantizer and that every table lies inside the file
+    uint64_t size = file.size();
+    uint64_t paramFloats = 0;
+    bool valid = h->dim > 0 && h->subspaces > 0;
+    if(valid && h->type == QE_INT8) {
+        valid = h->subspaces == h->dim;
+        paramFloats = 2 * h->dim;
+    }
+    else if(valid && h->type == QE_PQ) {
+        valid = h->dim % h->subspaces == 0;
+        paramFloats = (uint64_t)PQ_CENTROIDS * h->dim;
+    }
+    else {
+        valid = false;
+    }
+    valid = valid && h->paramsOffset % sizeof(float) == 0 &&
+            h->paramsOffset + paramFloats * sizeof(float) <= size &&
+            h->codesOffset <= size && h->count <= (size - h->codesOffset) / h->subspaces;
+    if(!valid) {
+        printf("Quantized embeddings %s are corrupt\n", filename);
+        file.close();
+        return -1;
+    }
+
+    header = h;
+    params = (const float *)(file.data() + h->paramsOffset);
+    codes = file.data() + h->codesOffset;
+    return 0;
+}
+
+void QuantizedEmbeddings::prepare(const float *query, vector<float> &tables) const {
+    size_t dim = (size_t)header->dim;
+    if(header->type == QE_INT8) {
+        // tables[d] = q[d] * scale[d], and the last entry is the constant
+        // part q . offset of every dot product
+        const float *offset = params;
+        const float *scale = params + dim;
+        tables.resize(dim + 1);
+        float constant = 0.0f;
+        for(size_t d = 0; d < dim; d++) {
+            tables[d] = query[d] * scale[d];
+            constant += query[d] * offset[d];
+        }
+        tables[dim] = constant;
+    }
+    else {
+        // tables[j * 256 + k] = dot product of query subspace j with
+        // centroid k of that subspace
+        size_t subspaces = (size_t)header->subspaces;
+        size_t subDim = dim / subspaces;
+        tables.resize(subspaces * PQ_CENTROIDS);
+        const DistanceKernelTable &kernels = distance_kernels();
+        for(size_t j = 0; j < subspaces; j++) {
+            kernels.dotBatch(query + j * subDim, params + j * PQ_CENTROIDS * subDim,
+                             PQ_CENTROIDS, subDim, subDim, &tables[j * PQ_CENTROIDS]);
+        }
+    }
+}
+
+void QuantizedEmbeddings::distances(const vector<float> &tables, size_t start, size_t rows, float *out) const {
+    const DistanceKernelTable &kernels = distance_kernels();
+    size_t stride = (size_t)header->subspaces;
+    const unsigned char *block = codes + start * stride;
+    if(header->type == QE_INT8) {
+        size_t dim = (size_t)header->dim;
+        kernels.codeDotBatch(&tables[0], block, rows, dim, stride, out);
+        for(size_t r = 0; r < rows; r++) {
+            out[r] = clampedDistance(out[r] + tables[dim]);
+        }
+    }
+    else {
+        kernels.lookupSumBatch(&tables[0], block, rows, stride, stride, out);
+        for(size_t r = 0; r < rows; r++) {
+            out[r] = clampedDistance(out[r]);
+        }
+    }
+}
@@ -0,0 +1,115 @@
+/*
+  Quantized embedding storage
+
+  A compressed copy of the normalized embeddings of a feature file, used
+  to find candidates for a query with much less memory traffic; the
+  candidates are then re-ranked with the full-precision vectors.
+
+  - int8 scalar quantization: every dimension d is stored as an 8-bit
+    code c with x = offset[d] + scale[d] * c, where offset and scale map
+    the range of that dimension onto 0..255.  4x smaller than floats.
+    The dot product with a query q is sum(q * offset) + sum((q * scale)
+    * c), so scoring is one code dot product per row (codeDotBatch).
+  - product quantization: the dimensions are split into subspaces of
+    dim / subspaces consecutive values, and every subspace is stored as
+    the index of the nearest of 256 centroids found with cv::kmeans.
+    One byte per subspace, so 64 subspaces of a 512-d embedding are 32x
+    smaller than floats.  For a query, the dot products with all
+    centroids are computed once (asymmetric distance computation), and
+    scoring a row is a sum of table lookups (lookupSumBatch).
+
+  File layout (all integers little-endian):
+
+    QuantizedHeader                             128 bytes
+    parameters                                  starts at paramsOffset
+      int8: float offset[dim], float scale[dim]
+      PQ:   float centroids[subspaces][256][dim / subspaces]
+    uint8_t codes[count][subspaces]             starts at codesOffset
+
+  Like an HNSW index the file belongs to one feature file and records its
+  row count, dimension and filename fingerprint.
+ */
+
+#ifndef QUANTIZED_EMBEDDINGS_H
+#define QUANTIZED_EMBEDDINGS_H
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+#include "embedding_matrix.h"
+#include "feature_store.h"
+
+#define QUANTIZED_MAGIC "IRQE"
+#define QUANTIZED_VERSION 1
+
+// centroids per product-quantization subspace (one byte per code)
+#define PQ_CENTROIDS 256
+
+enum QuantizationType {
+    QE_INT8 = 1,
+    QE_PQ = 2
+};
+
+struct QuantizedHeader {
+    char magic[4];          // "IRQE"
+    uint32_t version;       // QUANTIZED_VERSION
+    uint64_t count;         // number of rows
+    uint64_t dim;           // embedding dimension
+    uint64_t fingerprint;   // feature_names_fingerprint of the feature file
+    uint32_t type;          // QuantizationType
+    uint32_t subspaces;     // bytes per row: dim for int8, subspaces for PQ
+    uint64_t paramsOffset;  // byte offset of the quantizer parameters
+    uint64_t codesOffset;   // byte offset of the codes
+    uint64_t reserved[9];   // must be 0
+};
+
+/*
+  Trains a quantizer on the normalized rows of vectors (which belong to
+  the feature file store), encodes every row and writes the result to
+  filename.  subspaces is only used for QE_PQ and must divide the
+  dimension.  Encoding runs on threads threads.  Returns a non-zero value
+  if something goes wrong.
+ */
+int write_quantized_embeddings( const char *filename, const FeatureStore &store,
+                                const EmbeddingMatrix &vectors, QuantizationType type,
+                                int subspaces, int threads );
+
+/*
+  Memory-mapped quantized embeddings.
+ */
+class QuantizedEmbeddings {
+public:
+    QuantizedEmbeddings();
+
+    // returns a non-zero value if the file cannot be read or does not
+    // belong to the feature file store
+    int load( const char *filename, const FeatureStore &store );
+
+    QuantizationType type() const { return (QuantizationType)header->type; }
+    size_t count() const { return (size_t)header->count; }
+    size_t dim() const { return (size_t)header->dim; }
+    size_t codeSize() const { return (size_t)header->subspaces; }
+
+    /*
+      Per-query tables of a normalized query, computed once and then
+      passed to distances().
+     */
+    void prepare( const float *query, std::vector<float> &tables ) const;
+
+    /*
+      Approximate cosine distances of the prepared query to rows [start,
+      start + rows), written to out.
+     */
+    void distances( const std::vector<float> &tables, size_t start, size_t rows, float *out ) const;
+
+private:
+    QuantizedEmbeddings(const QuantizedEmbeddings &);
+    QuantizedEmbeddings &operator=(const QuantizedEmbeddings &);
+
+    MappedFile file;
+    const QuantizedHeader *header;
+    const float *params;
+    const unsigned char *codes;
+};
+
+#endif
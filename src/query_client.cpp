@@ -0,0 +1,182 @@
+/*
+  Client for query_server
+
+  Sends one top-K query to a running query_server and prints the matches
+  in the same format as the matcher the metric reproduces:
+  deep_embedding_match for cosine, ssd and intersection (the default is
+  cosine), multi_histogram_match for topbottom, texture_color_match for
+  texturecolor and custom_sunset_match for sunset:<embedding_store>.
+  --stores lists the feature files the server has loaded.
+
+  Usage: query_client <socket_path> <store_name> <target_image> <num_matches> [--metric <metric>]
+         query_client <socket_path> --stores
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include "query_protocol.h"
+
+using namespace std;
+
+// Reads a response header; prints the message of an ERROR response.
+// Returns the text after "OK ", or false
+static bool readStatus(QueryLineReader &reader, string &status) {
+    string line;
+    if(!reader.readLine(line)) {
+        printf("Error: The query server closed the connection\n");
+        return false;
+    }
+    if(line.compare(0, 3, "OK ") != 0) {
+        printf("Error: %s\n", line.compare(0, 6, "ERROR ") == 0 ? line.c_str() + 6 : line.c_str());
+        return false;
+    }
+    status = line.substr(3);
+    return true;
+}
+
+static int listStores(int fd) {
+    QueryLineReader reader(fd);
+    string status, line;
+    if(send_query_text(fd, "STORES\n") != 0 || !readStatus(reader, status)) {
+        return -1;
+    }
+    int count = atoi(status.c_str());
+    for(int i = 0; i < count && reader.readLine(line); i++) {
+        printf("%s\n", line.c_str());
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    // Pull out --metric before looking at the positional arguments
+    const char *metricName = "cosine";
+    bool stores = false;
+    for(int i = 1; i < argc; ) {
+        int consumed = 0;
+        if(strcmp(argv[i], "--metric") == 0 && i + 1 < argc) {
+            metricName = argv[i + 1];
+            consumed = 2;
+        }
+        else if(strcmp(argv[i], "--stores") == 0) {
+            stores = true;
+            consumed = 1;
+        }
+
+        if(consumed == 0) {
+            i++;
+            continue;
+        }
+        for(int j = i; j < argc - consumed; j++) {
+            argv[j] = argv[j + consumed];
+        }
+        argc -= consumed;
+    }
+
+    if(argc < (stores ? 2 : 5)) {
+        printf("Usage: %s <socket_path> <store_name> <target_image> <num_matches> [--metric <metric>]\n", argv[0]);
+        printf("       %s <socket_path> --stores\n", argv[0]);
+        printf("Metrics: cosine, ssd, intersection, topbottom, texturecolor, sunset:<embedding_store>\n");
+        printf("Example: %s /tmp/imagematch.sock olym pic.0893.jpg 5\n", argv[0]);
+        printf("Example: %s /tmp/imagematch.sock sunset pic.0893.jpg 5 --metric sunset:olym\n", argv[0]);
+        return -1;
+    }
+
+    // Header of the matcher whose output the metric reproduces
+    const char *title = NULL;
+    bool sunset = false;
+    if(strcmp(metricName, "cosine") == 0) {
+        title = "Cosine Distance";
+    }
+    else if(strcmp(metricName, "ssd") == 0) {
+        title = "Sum of Squared Differences";
+    }
+    else if(strcmp(metricName, "intersection") == 0) {
+        title = "Histogram Intersection";
+    }
+    else if(strncmp(metricName, "sunset:", 7) == 0 && metricName[7] != '\0') {
+        sunset = true;
+    }
+    else if(strcmp(metricName, "topbottom") != 0 && strcmp(metricName, "texturecolor") != 0) {
+        printf("Error: Unknown metric %s (use cosine, ssd, intersection, topbottom, texturecolor or sunset:<embedding_store>)\n", metricName);
+        return -1;
+    }
+
+    int fd = connect_query_socket(argv[1]);
+    if(fd < 0) {
+        return -1;
+    }
+    if(stores) {
+        int result = listStores(fd);
+        close_query_socket(fd);
+        return result;
+    }
+
+    char *storeName = argv[2];
+    char *targetImageName = argv[3];
+    int numMatches = atoi(argv[4]);
+
+    // Strip directories from the target, like the feature files do
+    const char *slash = strrchr(targetImageName, '/');
+    const char *backslash = strrchr(targetImageName, '\\');
+    const char *baseName = slash > backslash ? slash + 1 : backslash ? backslash + 1 : targetImageName;
+
+    printf("Target image: %s\n", targetImageName);
+    printf("Querying store %s on %s\n", storeName, argv[1]);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    string request = string("QUERY ") + storeName + " " + metricName + " " + to_string(numMatches) + " " +
+                     baseName + "\n";
+    QueryLineReader reader(fd);
+    string status;
+    if(send_query_text(fd, request) != 0 || !readStatus(reader, status)) {
+        close_query_socket(fd);
+        return -1;
+    }
+
+    int row = 0, count = 0;
+    sscanf(status.c_str(), "%d %d", &row, &count);
+    printf("Found target image at index %d\n", row);
+
+    if(title != NULL) {
+        printf("\n=== Top %d matches (Deep Network Embeddings - %s) ===\n", numMatches, title);
+    }
+    else if(sunset) {
+        printf("\n=== Top %d Sunset Matches ===\n", numMatches);
+    }
+    else if(strcmp(metricName, "texturecolor") == 0) {
+        printf("\n=== Top %d matches (Texture + Color) ===\n", numMatches);
+    }
+    else {
+        printf("\n=== Top %d matches ===\n", numMatches);
+    }
+    string line;
+    for(int i = 0; i < count; i++) {
+        if(!reader.readLine(line)) {
+            printf("Error: The query server closed the connection\n");
+            close_query_socket(fd);
+            return -1;
+        }
+        if(sunset) {
+            // <distance> <warm> <gradient> <edge> <name>
+            float distance = 0, warm = 0, grad = 0, edge = 0;
+            int consumed = 0;
+            sscanf(line.c_str(), "%f %f %f %f %n", &distance, &warm, &grad, &edge, &consumed);
+            printf("%d. %s (dist: %.4f, warm: %.3f, grad: %.1f, edge: %.3f)\n", i+1, line.c_str() + consumed,
+                   distance, warm, grad, edge);
+            continue;
+        }
+        size_t space = line.find(' ');
+        float distance = (float)atof(line.c_str());
+        printf("%d. %s (distance: %.4f)\n", i+1, space == string::npos ? "" : line.c_str() + space + 1, distance);
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    close_query_socket(fd);
+
+    printf("\nAnswered by the query server in %.3f ms\n", ms);
+
+    return 0;
+}
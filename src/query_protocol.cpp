@@ -0,0 +1,200 @@
+/*
+  Query server socket helpers.  See query_protocol.h for the protocol.
+*/
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include "query_protocol.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+static int unsupported() {
+    printf("Error: Unix domain sockets are not supported on this platform\n");
+    return -1;
+}
+
+int listen_query_socket( const char * ) { return unsupported(); }
+int accept_query_client( int ) { return -1; }
+int connect_query_socket( const char * ) { return unsupported(); }
+void close_query_socket( int ) {}
+void remove_query_socket( const char * ) {}
+int send_query_text( int, const std::string & ) { return -1; }
+bool QueryLineReader::readLine( std::string & ) { return false; }
+
+#else
+
+// Fills addr with path; returns false if the path does not fit
+static bool socketAddress(const char *path, struct sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+// Removes the socket file at path if no server is listening on it any
+// more; anything else there (another file, or a live server) is left
+// alone.  Returns false after printing an error if path is in use
+static bool removeStaleSocket(const char *path, const struct sockaddr_un &addr) {
+    struct stat info;
+    if(lstat(path, &info) != 0) {
+        if(errno == ENOENT) {
+            return true;
+        }
+        printf("Error: Cannot check %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if(!S_ISSOCK(info.st_mode)) {
+        printf("Error: %s exists and is not a socket\n", path);
+        return false;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        printf("Error: Cannot create socket: %s\n", strerror(errno));
+        return false;
+    }
+    int result = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    int error = errno;
+    close(fd);
+    if(result == 0) {
+        printf("Error: A query server is already listening on %s\n", path);
+        return false;
+    }
+    if(error != ECONNREFUSED) {
+        printf("Error: Cannot check socket %s: %s\n", path, strerror(error));
+        return false;
+    }
+    if(unlink(path) != 0 && errno != ENOENT) {
+        printf("Error: Cannot remove stale socket %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int listen_query_socket( const char *path ) {
+    struct sockaddr_un addr;
+    if(!socketAddress(path, addr)) {
+        return -1;
+    }
+
+    // a client that disconnects early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        printf("Error: Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if(!removeStaleSocket(path, addr)) {
+        close(fd);
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        printf("Error: Cannot listen on %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int accept_query_client( int listener ) {
+    for(;;) {
+        int fd = accept(listener, NULL, NULL);
+        if(fd >= 0 || errno != EINTR) {
+            return fd;
+        }
+    }
+}
+
+int connect_query_socket( const char *path ) {
+    struct sockaddr_un addr;
+    if(!socketAddress(path, addr)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        printf("Error: Cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Error: Cannot connect to query server at %s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void close_query_socket( int fd ) {
+    close(fd);
+}
+
+void remove_query_socket( const char *path ) {
+    unlink(path);
+}
+
+int send_query_text( int fd, const std::string &text ) {
+    size_t sent = 0;
+    while(sent < text.size()) {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return -1;
+        }
+        sent += (size_t)n;
+    }
+    return 0;
+}
+
+bool QueryLineReader::readLine( std::string &line ) {
+    for(;;) {
+        char *newline = (char *)memchr(buffer + start, '\n', end - start);
+        if(newline) {
+            size_t length = newline - (buffer + start);
+            if(length > 0 && buffer[start + length - 1] == '\r') {
+                length--;
+            }
+            line.assign(buffer + start, length);
+            start = newline + 1 - buffer;
+            return true;
+        }
+
+        // move the partial line to the front and read more
+        if(start > 0) {
+            memmove(buffer, buffer + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if(end == sizeof(buffer)) {
+            return false;
+        }
+        ssize_t n = read(socket, buffer + end, sizeof(buffer) - end);
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+        if(n <= 0) {
+            return false;
+        }
+        end += (size_t)n;
+    }
+}
+
+#endif
@@ -0,0 +1,96 @@
+/*
+  Query server protocol and socket helpers
+
+  query_server keeps feature files loaded and answers top-K queries over
+  a Unix domain socket; query_client sends one query and prints the
+  result like the one-shot matchers.  A connection carries any number of
+  requests, one text line each, and every request gets one response:
+
+    QUERY <store> <metric> <k> <image_name>
+        OK <row> <n>                 row of the target in the store,
+        <distance> <name>            followed by n matches, best first
+        ...
+    STORES
+        OK <n>
+        <store> <count> <dim> <file> one line per loaded feature file
+        ...
+
+  <metric> is cosine, ssd or intersection, as for deep_embedding_match;
+  topbottom (multi_histogram_match) or texturecolor (texture_color_match)
+  on build_index stores of those features; or sunset:<embeddings>
+  (custom_sunset_match) on a sunset store, with the embedding distance
+  taken from the loaded store <embeddings>.  Sunset match lines carry
+  the features of the match before its name:
+
+        <distance> <warm> <gradient> <edge> <name>
+
+  The image name is the rest of the line, so it may contain spaces.
+  Distances are printed with 9 significant digits.  A request that
+  cannot be answered gets a single line "ERROR <message>".
+
+  Unix domain sockets are only used on POSIX systems; elsewhere the
+  socket functions fail with an error message.
+ */
+
+#ifndef QUERY_PROTOCOL_H
+#define QUERY_PROTOCOL_H
+
+#include <cstddef>
+#include <string>
+
+// longest request or response line
+#define QUERY_MAX_LINE 4096
+
+/*
+  Creates a listening socket at path, replacing a stale socket file (a
+  socket nobody accepts connections on any more).  Refuses to start if
+  path is some other file or a server is still listening there.
+  Returns the socket, or -1 after printing an error.
+ */
+int listen_query_socket( const char *path );
+
+/*
+  Waits for the next client.  Returns its socket, or -1 on error.
+ */
+int accept_query_client( int listener );
+
+/*
+  Connects to the server at path.  Returns the socket, or -1 after
+  printing an error.
+ */
+int connect_query_socket( const char *path );
+
+void close_query_socket( int fd );
+
+/*
+  Removes the socket file of a listening socket.
+ */
+void remove_query_socket( const char *path );
+
+/*
+  Writes all of text.  Returns a non-zero value if the peer went away.
+ */
+int send_query_text( int fd, const std::string &text );
+
+/*
+  Buffered line reader for one socket.
+ */
+class QueryLineReader {
+public:
+    explicit QueryLineReader( int fd ) : socket(fd), start(0), end(0) {}
+
+    /*
+      Reads the next line without its line ending.  Returns false at the
+      end of the stream, on errors and for lines longer than
+      QUERY_MAX_LINE.
+     */
+    bool readLine( std::string &line );
+
+private:
+    int socket;
+    char buffer[QUERY_MAX_LINE];
+    size_t start;
+    size_t end;
+};
+
+#endif
@@ -0,0 +1,401 @@
+/*
+  Long-running query server that keeps feature files resident
+
+  The one-shot matchers load their feature file for every query, so a
+  query is mostly startup time.  query_server loads any number of
+  feature files once (embedding CSVs, histogram or sunset feature files
+  from build_index, or binary feature stores) and answers top-K queries
+  from query_client over a Unix domain socket (see query_protocol.h).
+
+  Each feature file is registered under a store name.  Queries pick the
+  metric like the matcher whose output they reproduce, and are scored
+  with the same batch kernels:
+
+    cosine, ssd, intersection   deep_embedding_match --metric
+    topbottom                   multi_histogram_match, on build_index
+                                topbottom rows (the two halves weighted
+                                0.5 each)
+    texturecolor                texture_color_match, on build_index
+                                texturecolor rows (color and texture
+                                histograms weighted 0.5 each)
+    sunset:<embedding_store>    custom_sunset_match, on build_index
+                                sunset rows, joined by filename to the
+                                embeddings of another loaded store
+
+  A store is normalized once, on its first query that needs it (cosine,
+  or as the embeddings of a sunset query).  An acceptor thread hands
+  connections to a pool of --workers threads (default: all cores), so
+  several clients are served at once.  Stop the server with Ctrl-C.
+
+  Usage: query_server <socket_path> <store_name>=<feature_file> [<store_name>=<feature_file> ...] [--workers <n>]
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "distance_kernels.h"
+#include "embedding_matrix.h"
+#include "feature_store.h"
+#include "fused_features.h"
+#include "image_pipeline.h"
+#include "query_protocol.h"
+#include "top_k.h"
+
+using namespace std;
+
+enum Metric {
+    METRIC_COSINE,
+    METRIC_SSD,
+    METRIC_INTERSECTION,
+    METRIC_TOPBOTTOM,       // 1 - mean intersection of the two halves
+    METRIC_TEXTURECOLOR,    // 1 - mean of color and texture intersections
+    METRIC_SUNSET           // sunset_distance with a joined embedding store
+};
+
+// Color bins at the start of a texturecolor row (8x8x8), followed by the
+// texture histogram
+#define TEXTURECOLOR_COLOR_BINS 512
+
+// Values of a sunset row: warm score, vertical gradient, edge density
+#define SUNSET_DIM 3
+
+// Rows scored per batch kernel call
+#define SCORE_BLOCK_ROWS 1024
+
+// Connections waiting for a worker
+#define CONNECTION_QUEUE_DEPTH 64
+
+// Largest top-K a client may ask for
+#define MAX_QUERY_MATCHES 10000
+
+// One loaded feature file
+struct LoadedStore {
+    string name;
+    string file;
+    FeatureStore features;
+    EmbeddingMatrix normalized;     // built on the first cosine query
+    once_flag normalizeOnce;
+};
+
+static vector<unique_ptr<LoadedStore>> stores;
+static const char *socketPath = NULL;
+static atomic<long> queriesServed(0);
+
+// Ctrl-C: remove the socket file on the way out
+static void stopServer(int) {
+    if(socketPath) {
+        remove_query_socket(socketPath);
+    }
+    _Exit(0);
+}
+
+static LoadedStore *findStore(const char *name) {
+    for(size_t i = 0; i < stores.size(); i++) {
+        if(stores[i]->name == name) {
+            return stores[i].get();
+        }
+    }
+    return NULL;
+}
+
+static void normalizeStore(LoadedStore &store) {
+    const FeatureStore &features = store.features;
+    call_once(store.normalizeOnce, [&]() {
+        store.normalized.assign(features.data(), features.count(), features.dim(), features.stride(), features.isNormalized());
+    });
+}
+
+// Sunset distances of a block of sunset rows to the query row, with the
+// embedding distances looked up by filename in the embedding store
+static void sunsetDistances(const FeatureStore &features, int row, LoadedStore &embeddings, int start,
+                            int blockCount, float *out) {
+    const EmbeddingMatrix &normalized = embeddings.normalized;
+    long targetRow = embeddings.features.find(features.name(row));
+    const float *target = features.row(row);
+    SunsetFeatures targetFeatures = { target[0], target[1], target[2] };
+    for(int r = 0; r < blockCount; r++) {
+        const float *values = features.row(start + r);
+        SunsetFeatures rowFeatures = { values[0], values[1], values[2] };
+        long embeddingRow = targetRow >= 0 ? embeddings.features.find(features.name(start + r)) : -1;
+        float dnnDistance = embeddingRow >= 0 ? normalized_cosine_distance(normalized.row(targetRow),
+                                                                           normalized.row(embeddingRow),
+                                                                           normalized.dim())
+                                              : 1.0f;
+        out[r] = sunset_distance(targetFeatures, rowFeatures, dnnDistance);
+    }
+}
+
+// Score a row of the store against all rows, keeping the best k;
+// embeddings is the joined store of a sunset query
+static void scoreRow(LoadedStore &store, Metric metric, LoadedStore *embeddings, int row, int k,
+                     vector<ScoredId> &matches) {
+    const FeatureStore &features = store.features;
+    int count = (int)features.count();
+    int dim = (int)features.dim();
+    size_t stride = features.stride();
+    const DistanceKernelTable &kernels = distance_kernels();
+
+    if(metric == METRIC_COSINE) {
+        normalizeStore(store);
+    }
+    if(metric == METRIC_SUNSET) {
+        normalizeStore(*embeddings);
+    }
+
+    // the two histograms of a row, for the split metrics
+    int firstDim = metric == METRIC_TOPBOTTOM ? dim / 2 : TEXTURECOLOR_COLOR_BINS;
+
+    TopK best(k);
+    vector<float> scores(SCORE_BLOCK_ROWS), second(SCORE_BLOCK_ROWS);
+    const float *query = metric == METRIC_COSINE ? store.normalized.row(row) : features.row(row);
+    for(int start = 0; start < count; start += SCORE_BLOCK_ROWS) {
+        int blockCount = min(SCORE_BLOCK_ROWS, count - start);
+        if(metric == METRIC_COSINE) {
+            store.normalized.cosineDistances(query, start, blockCount, &scores[0]);
+        }
+        else if(metric == METRIC_SSD) {
+            kernels.squaredDistanceBatch(query, features.row(start), blockCount, dim, stride, &scores[0]);
+        }
+        else if(metric == METRIC_INTERSECTION) {
+            kernels.intersectionBatch(query, features.row(start), blockCount, dim, stride, &scores[0]);
+            for(int r = 0; r < blockCount; r++) {
+                scores[r] = 1.0f - scores[r];
+            }
+        }
+        else if(metric == METRIC_SUNSET) {
+            sunsetDistances(features, row, *embeddings, start, blockCount, &scores[0]);
+        }
+        else {
+            // equal weighting of the two intersections, as in
+            // computeMultiHistogramDistance and computeCombinedDistance
+            kernels.intersectionBatch(query, features.row(start), blockCount, firstDim, stride, &scores[0]);
+            kernels.intersectionBatch(query + firstDim, features.row(start) + firstDim, blockCount, dim - firstDim,
+                                      stride, &second[0]);
+            for(int r = 0; r < blockCount; r++) {
+                float average = (scores[r] + second[r]) / 2.0;
+                scores[r] = 1.0 - average;
+            }
+        }
+        for(int r = 0; r < blockCount; r++) {
+            best.push(start + r, scores[r]);
+        }
+    }
+    matches = best.sorted();
+}
+
+// Answer one request line
+static string handleRequest(const string &line) {
+    char command[16] = "", storeName[256] = "", metricName[300] = "";
+    int k = 0, consumed = 0;
+    sscanf(line.c_str(), "%15s", command);
+
+    if(strcmp(command, "STORES") == 0) {
+        string response = "OK " + to_string(stores.size()) + "\n";
+        for(size_t i = 0; i < stores.size(); i++) {
+            response += stores[i]->name + " " + to_string(stores[i]->features.count()) + " " +
+                        to_string(stores[i]->features.dim()) + " " + stores[i]->file + "\n";
+        }
+        return response;
+    }
+    if(strcmp(command, "QUERY") != 0) {
+        return "ERROR Unknown request " + string(command) + "\n";
+    }
+
+    if(sscanf(line.c_str(), "%*s %255s %299s %d %n", storeName, metricName, &k, &consumed) < 3 || consumed == 0) {
+        return "ERROR Expected QUERY <store> <metric> <k> <image_name>\n";
+    }
+    string imageName = line.substr(consumed);
+    if(k < 1 || k > MAX_QUERY_MATCHES) {
+        return "ERROR k must be between 1 and " + to_string(MAX_QUERY_MATCHES) + "\n";
+    }
+
+    Metric metric;
+    LoadedStore *embeddings = NULL;
+    if(strcmp(metricName, "cosine") == 0) {
+        metric = METRIC_COSINE;
+    }
+    else if(strcmp(metricName, "ssd") == 0) {
+        metric = METRIC_SSD;
+    }
+    else if(strcmp(metricName, "intersection") == 0) {
+        metric = METRIC_INTERSECTION;
+    }
+    else if(strcmp(metricName, "topbottom") == 0) {
+        metric = METRIC_TOPBOTTOM;
+    }
+    else if(strcmp(metricName, "texturecolor") == 0) {
+        metric = METRIC_TEXTURECOLOR;
+    }
+    else if(strncmp(metricName, "sunset:", 7) == 0) {
+        metric = METRIC_SUNSET;
+        embeddings = findStore(metricName + 7);
+        if(embeddings == NULL) {
+            return "ERROR No embedding store named " + string(metricName + 7) + "\n";
+        }
+    }
+    else {
+        return "ERROR Unknown metric " + string(metricName) +
+               " (use cosine, ssd, intersection, topbottom, texturecolor or sunset:<embedding_store>)\n";
+    }
+
+    LoadedStore *store = findStore(storeName);
+    if(store == NULL) {
+        return "ERROR No store named " + string(storeName) + "\n";
+    }
+    size_t dim = store->features.dim();
+    if((metric == METRIC_TOPBOTTOM && (dim == 0 || dim % 2 != 0)) ||
+       (metric == METRIC_TEXTURECOLOR && dim <= TEXTURECOLOR_COLOR_BINS) ||
+       (metric == METRIC_SUNSET && dim != SUNSET_DIM)) {
+        return "ERROR Store " + store->name + " does not hold " + string(metric == METRIC_SUNSET ? "sunset" : metricName) +
+               " features\n";
+    }
+    long row = store->features.find(imageName.c_str());
+    if(row < 0) {
+        return "ERROR Target image " + imageName + " not found in " + store->name + "\n";
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<ScoredId> matches;
+    scoreRow(*store, metric, embeddings, (int)row, k, matches);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    string response = "OK " + to_string(row) + " " + to_string(matches.size()) + "\n";
+    char entry[128];
+    for(size_t i = 0; i < matches.size(); i++) {
+        snprintf(entry, sizeof(entry), "%.9g ", matches[i].distance);
+        response += entry;
+        if(metric == METRIC_SUNSET) {
+            const float *values = store->features.row(matches[i].id);
+            snprintf(entry, sizeof(entry), "%.9g %.9g %.9g ", values[0], values[1], values[2]);
+            response += entry;
+        }
+        response += store->features.name(matches[i].id);
+        response += "\n";
+    }
+
+    long served = ++queriesServed;
+    printf("Query %ld: %s in %s, top %d by %s, %.3f ms\n", served, imageName.c_str(), store->name.c_str(),
+           k, metricName, ms);
+    fflush(stdout);
+    return response;
+}
+
+// Serve every request of one connection
+static void serveClient(int fd) {
+    QueryLineReader reader(fd);
+    string line;
+    while(reader.readLine(line)) {
+        if(line.empty()) {
+            continue;
+        }
+        if(send_query_text(fd, handleRequest(line)) != 0) {
+            break;
+        }
+    }
+    close_query_socket(fd);
+}
+
+int main(int argc, char *argv[]) {
+
+    // Pull out --workers before looking at the positional arguments
+    int workers = max(1, (int)thread::hardware_concurrency());
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--workers") != 0) {
+            continue;
+        }
+        if(i + 1 >= argc || atoi(argv[i + 1]) < 1) {
+            printf("Error: --workers needs a positive number\n");
+            return -1;
+        }
+        workers = atoi(argv[i + 1]);
+        for(int j = i; j < argc - 2; j++) {
+            argv[j] = argv[j + 2];
+        }
+        argc -= 2;
+        i--;
+    }
+
+    if(argc < 3) {
+        printf("Usage: %s <socket_path> <store_name>=<feature_file> [<store_name>=<feature_file> ...] [--workers <n>]\n", argv[0]);
+        printf("Example: %s /tmp/imagematch.sock olym=data/ResNet18_olym.irfs sunset=data/sunset_olym.csv\n", argv[0]);
+        return -1;
+    }
+
+    // Load every feature file once
+    for(int i = 2; i < argc; i++) {
+        const char *equals = strchr(argv[i], '=');
+        if(equals == NULL || equals == argv[i] || equals[1] == '\0') {
+            printf("Error: Expected <store_name>=<feature_file>, got %s\n", argv[i]);
+            return -1;
+        }
+
+        unique_ptr<LoadedStore> store(new LoadedStore());
+        store->name.assign(argv[i], equals - argv[i]);
+        store->file = equals + 1;
+        if(store->name.find_first_of(" \t") != string::npos || findStore(store->name.c_str())) {
+            printf("Error: Store names must be unique and contain no spaces: %s\n", store->name.c_str());
+            return -1;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if(store->features.load(store->file.c_str()) != 0 || store->features.count() == 0) {
+            printf("Error: Failed to read feature file %s\n", store->file.c_str());
+            return -1;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("Store %s: %lu rows of %lu features from %s (%.3f s)\n", store->name.c_str(),
+               (unsigned long)store->features.count(), (unsigned long)store->features.dim(),
+               store->file.c_str(), seconds);
+        stores.push_back(move(store));
+    }
+
+    socketPath = argv[1];
+    int listener = listen_query_socket(socketPath);
+    if(listener < 0) {
+        return -1;
+    }
+    signal(SIGINT, stopServer);
+    signal(SIGTERM, stopServer);
+
+    // Worker pool; the main thread accepts connections
+    BoundedQueue<int> connections(CONNECTION_QUEUE_DEPTH);
+    vector<thread> pool;
+    for(int w = 0; w < workers; w++) {
+        pool.push_back(thread([&connections]() {
+            int fd;
+            while(connections.pop(fd)) {
+                serveClient(fd);
+            }
+        }));
+    }
+
+    printf("Serving %lu stores on %s with %d workers (%s kernels)\n", (unsigned long)stores.size(), socketPath,
+           workers, distance_kernels().name);
+    fflush(stdout);
+
+    for(;;) {
+        int fd = accept_query_client(listener);
+        if(fd < 0) {
+            printf("Error: accept failed, shutting down\n");
+            break;
+        }
+        connections.push(fd);
+    }
+
+    connections.close();
+    for(size_t w = 0; w < pool.size(); w++) {
+        pool[w].join();
+    }
+    close_query_socket(listener);
+    remove_query_socket(socketPath);
+    return -1;
+}
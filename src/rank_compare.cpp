@@ -0,0 +1,111 @@
+/*
+  Ranking agreement between two ways of scoring the same images.
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "rank_compare.h"
+
+using namespace std;
+
+// Rank of every entry when sorted by ascending distance (ties by index)
+static vector<int> computeRanks(const vector<float> &distances) {
+    vector<int> order(distances.size());
+    for(int i = 0; i < (int)order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&distances](int a, int b) {
+        return distances[a] < distances[b];
+    });
+
+    vector<int> ranks(distances.size());
+    for(int r = 0; r < (int)order.size(); r++) {
+        ranks[order[r]] = r;
+    }
+    return ranks;
+}
+
+RankingAgreement compare_rankings(const vector<float> &reference, const vector<float> &test, int k) {
+    RankingAgreement result;
+    int n = (int)min(reference.size(), test.size());
+
+    result.count = n;
+    result.k = min(k, n);
+    result.overlapAtK = 0.0;
+    result.sameTop1 = false;
+    result.meanRankShift = 0.0;
+    result.spearmanRho = 1.0;
+
+    if(n == 0 || result.k <= 0) {
+        return result;
+    }
+
+    vector<float> ref(reference.begin(), reference.begin() + n);
+    vector<float> tst(test.begin(), test.begin() + n);
+    vector<int> refRanks = computeRanks(ref);
+    vector<int> testRanks = computeRanks(tst);
+
+    int overlap = 0;
+    double shift = 0.0;
+    double squaredRankDiff = 0.0;
+    for(int i = 0; i < n; i++) {
+        if(refRanks[i] < result.k) {
+            if(testRanks[i] < result.k) {
+                overlap++;
+            }
+            shift += abs(refRanks[i] - testRanks[i]);
+        }
+        if(refRanks[i] == 0 && testRanks[i] == 0) {
+            result.sameTop1 = true;
+        }
+        double d = refRanks[i] - testRanks[i];
+        squaredRankDiff += d * d;
+    }
+
+    result.overlapAtK = (double)overlap / result.k;
+    result.meanRankShift = shift / result.k;
+    if(n > 1) {
+        result.spearmanRho = 1.0 - 6.0 * squaredRankDiff / ((double)n * ((double)n * n - 1.0));
+    }
+
+    return result;
+}
+
+void print_ranking_agreement(const char *title, const RankingAgreement &agreement) {
+    printf("\n=== %s ===\n", title);
+    printf("Images compared: %d\n", agreement.count);
+    printf("Top-%d overlap: %.1f%%\n", agreement.k, 100.0 * agreement.overlapAtK);
+    printf("Same top-1 match: %s\n", agreement.sameTop1 ? "yes" : "no");
+    printf("Mean rank shift of reference top %d: %.2f\n", agreement.k, agreement.meanRankShift);
+    printf("Spearman rank correlation: %.4f\n", agreement.spearmanRho);
+}
+
+void RankingComparison::add(int worker, int id, float referenceDistance, float testDistance) {
+    Entry entry;
+    entry.id = id;
+    entry.reference = referenceDistance;
+    entry.test = testDistance;
+    perWorker[worker].push_back(entry);
+}
+
+RankingAgreement RankingComparison::compare(int k) const {
+    // order by id so that the result does not depend on thread timing
+    vector<Entry> all;
+    for(size_t w = 0; w < perWorker.size(); w++) {
+        all.insert(all.end(), perWorker[w].begin(), perWorker[w].end());
+    }
+    sort(all.begin(), all.end(), [](const Entry &a, const Entry &b) {
+        return a.id < b.id;
+    });
+
+    vector<float> reference, test;
+    for(size_t i = 0; i < all.size(); i++) {
+        reference.push_back(all[i].reference);
+        test.push_back(all[i].test);
+    }
+
+    return compare_rankings(reference, test, k);
+}
@@ -0,0 +1,56 @@
+/*
+  Ranking agreement between two ways of scoring the same images
+
+  Used to measure how much a faster approximation (reduced-resolution
+  decode, a cheaper extractor, compressed embeddings, ...) changes the
+  ranking produced by the exact method.  Both methods score the same set
+  of images; smaller distances rank first.
+ */
+
+#ifndef RANK_COMPARE_H
+#define RANK_COMPARE_H
+
+#include <vector>
+
+struct RankingAgreement {
+    int count;              // number of images scored by both methods
+    int k;                  // size of the top-K lists compared
+    double overlapAtK;      // |topK(reference) & topK(test)| / K
+    bool sameTop1;          // both methods rank the same image first
+    double meanRankShift;   // mean |rank change| of the reference top K
+    double spearmanRho;     // rank correlation over all images
+};
+
+/*
+  Computes the agreement between two lists of distances.  Entry i of both
+  lists must refer to the same image.
+ */
+RankingAgreement compare_rankings( const std::vector<float> &reference, const std::vector<float> &test, int k );
+
+/*
+  Prints a RankingAgreement under the given title.
+ */
+void print_ranking_agreement( const char *title, const RankingAgreement &agreement );
+
+/*
+  Collects (reference, test) distance pairs keyed by image id from
+  several worker threads; each worker only touches its own slot.
+ */
+class RankingComparison {
+public:
+    explicit RankingComparison( int workers = 1 ) : perWorker(workers) {}
+
+    void add( int worker, int id, float referenceDistance, float testDistance );
+
+    RankingAgreement compare( int k ) const;
+
+private:
+    struct Entry {
+        int id;
+        float reference;
+        float test;
+    };
+    std::vector<std::vector<Entry>> perWorker;
+};
+
+#endif
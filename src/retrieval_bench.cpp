@@ -0,0 +1,489 @@
+/*
+  Microbenchmarks for the feature extractors and distance functions
+
+  Times every extractor in image_features.h (and the fused versions the
+  matchers use) at several image sizes and bin counts, and every
+  distance function at several vector lengths, including the batch
+  kernels of each kernel set this CPU supports (cosine also on float16
+  and bfloat16 rows).  getEmbedding (one ResNet18 forward pass) is
+  timed when --model is given.
+
+  Each case is run for --warmup samples that are thrown away, then for
+  --samples timed samples.  A sample repeats the function enough times
+  to take at least --min-sample-ms, so that the clock resolution does
+  not matter; the median, p99, minimum and mean time per call over the
+  samples are reported.  The inputs are synthetic (a blurred random
+  image with a fixed seed) unless --image is given, so runs on different
+  commits measure the same work.
+
+  The results are printed as a table and, with --json, written as a JSON
+  file; --label stores a free-form tag (for example the commit) in it.
+  --filter runs only the cases whose name contains the given text.
+
+  Usage: retrieval_bench [--json <file>] [--label <text>] [--filter <text>] [--samples <n>] [--warmup <n>]
+                         [--min-sample-ms <ms>] [--image <file>] [--model <onnx_model>]
+*/
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/dnn.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "image_features.h"
+#include "fused_features.h"
+#include "distance_kernels.h"
+#include "embedding_matrix.h"
+
+using namespace cv;
+using namespace std;
+
+// Image sizes every extractor is timed at: thumbnail, the database
+// images, full HD
+static const Size BENCH_IMAGE_SIZES[] = { Size(160, 120), Size(640, 480), Size(1920, 1080) };
+
+// Vector lengths for the distance functions: baseline features, a
+// ResNet18 embedding, a 16-bin RGB histogram
+static const int BENCH_DIMS[] = { 147, 512, 4096 };
+
+// Rows per call of the batch kernels
+#define BENCH_BATCH_ROWS 1024
+
+#define DEFAULT_SAMPLES 50
+#define DEFAULT_WARMUP 5
+#define DEFAULT_MIN_SAMPLE_MS 2.0
+
+// Keeps the compiler from dropping the benchmarked calls
+static volatile float sink;
+
+struct BenchResult {
+    string name;
+    int width;          // 0 if the case has no image
+    int height;
+    int bins;           // 0 if the case has no bin count
+    int dim;            // 0 if the case has no vector length
+    long iterations;    // calls per sample
+    int samples;
+    double medianNs;
+    double p99Ns;
+    double minNs;
+    double meanNs;
+};
+
+class BenchRunner {
+public:
+    BenchRunner(int samples, int warmup, double minSampleMs, const char *filter)
+        : samples(samples), warmup(warmup), minSampleNs(minSampleMs * 1e6), filter(filter) {}
+
+    /*
+      Times body, a callable returning a float that depends on the work.
+      Returns false if the case was filtered out.
+     */
+    template <typename Body>
+    bool run(const string &name, int width, int height, int bins, int dim, Body body) {
+        if(filter != NULL && name.find(filter) == string::npos) {
+            return false;
+        }
+
+        // Double the iterations until one sample is long enough
+        long iterations = 1;
+        for(;;) {
+            double ns = timeSample(body, iterations);
+            if(ns >= minSampleNs || iterations >= (1L << 30)) {
+                break;
+            }
+            iterations *= ns < minSampleNs / 16 ? 8 : 2;
+        }
+
+        for(int i = 0; i < warmup; i++) {
+            timeSample(body, iterations);
+        }
+        vector<double> perCall(samples);
+        for(int i = 0; i < samples; i++) {
+            perCall[i] = timeSample(body, iterations) / iterations;
+        }
+
+        BenchResult result;
+        result.name = name;
+        result.width = width;
+        result.height = height;
+        result.bins = bins;
+        result.dim = dim;
+        result.iterations = iterations;
+        result.samples = samples;
+        summarize(perCall, result);
+        results.push_back(result);
+        print(result);
+        return true;
+    }
+
+    const vector<BenchResult> &all() const { return results; }
+
+private:
+    template <typename Body>
+    double timeSample(Body &body, long iterations) {
+        float total = 0.0f;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for(long i = 0; i < iterations; i++) {
+            total += body();
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        sink = total;
+        return chrono::duration<double, nano>(end - start).count();
+    }
+
+    static void summarize(vector<double> &perCall, BenchResult &result) {
+        sort(perCall.begin(), perCall.end());
+        size_t n = perCall.size();
+        result.medianNs = n % 2 ? perCall[n / 2] : 0.5 * (perCall[n / 2 - 1] + perCall[n / 2]);
+        // nearest-rank percentile
+        result.p99Ns = perCall[min(n - 1, (size_t)ceil(0.99 * n) - 1)];
+        result.minNs = perCall[0];
+        double sum = 0.0;
+        for(size_t i = 0; i < n; i++) {
+            sum += perCall[i];
+        }
+        result.meanNs = sum / n;
+    }
+
+    static void print(const BenchResult &result) {
+        char params[64] = "";
+        int used = 0;
+        if(result.width > 0) {
+            used += snprintf(params + used, sizeof(params) - used, "%dx%d ", result.width, result.height);
+        }
+        if(result.bins > 0) {
+            used += snprintf(params + used, sizeof(params) - used, "bins=%d ", result.bins);
+        }
+        if(result.dim > 0) {
+            snprintf(params + used, sizeof(params) - used, "dim=%d", result.dim);
+        }
+        printf("%-42s %-22s %14.1f %14.1f %14.1f\n", result.name.c_str(), params, result.medianNs, result.p99Ns,
+               result.minNs);
+        fflush(stdout);
+    }
+
+    int samples;
+    int warmup;
+    double minSampleNs;
+    const char *filter;
+    vector<BenchResult> results;
+};
+
+// Escapes a string for a JSON file
+static string jsonString(const string &text) {
+    string out = "\"";
+    for(size_t i = 0; i < text.size(); i++) {
+        char c = text[i];
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static int writeJson(const char *filename, const char *label, int samples, int warmup, double minSampleMs,
+                     const vector<BenchResult> &results) {
+    FILE *fp = fopen(filename, "w");
+    if(!fp) {
+        printf("Unable to open output file %s\n", filename);
+        return -1;
+    }
+
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"benchmark\": \"retrieval_bench\",\n");
+    fprintf(fp, "  \"version\": 1,\n");
+    fprintf(fp, "  \"label\": %s,\n", jsonString(label ? label : "").c_str());
+    fprintf(fp, "  \"kernels\": %s,\n", jsonString(distance_kernels().name).c_str());
+    fprintf(fp, "  \"opencv\": %s,\n", jsonString(CV_VERSION).c_str());
+    fprintf(fp, "  \"samples\": %d,\n", samples);
+    fprintf(fp, "  \"warmup\": %d,\n", warmup);
+    fprintf(fp, "  \"min_sample_ms\": %g,\n", minSampleMs);
+    fprintf(fp, "  \"results\": [\n");
+    for(size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        fprintf(fp, "    {\"name\": %s", jsonString(r.name).c_str());
+        if(r.width > 0) {
+            fprintf(fp, ", \"width\": %d, \"height\": %d", r.width, r.height);
+        }
+        if(r.bins > 0) {
+            fprintf(fp, ", \"bins\": %d", r.bins);
+        }
+        if(r.dim > 0) {
+            fprintf(fp, ", \"dim\": %d", r.dim);
+        }
+        fprintf(fp, ", \"iterations\": %ld, \"samples\": %d, \"median_ns\": %.1f, \"p99_ns\": %.1f, "
+                    "\"min_ns\": %.1f, \"mean_ns\": %.1f}%s\n",
+                r.iterations, r.samples, r.medianNs, r.p99Ns, r.minNs, r.meanNs,
+                i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n}\n");
+
+    if(fclose(fp) != 0) {
+        printf("Error writing %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// The same, natural-looking input for every run: blurred noise with a
+// fixed seed, or the given image
+static Mat benchImage(const Mat &source, Size size) {
+    Mat image;
+    if(!source.empty()) {
+        resize(source, image, size, 0, 0, INTER_AREA);
+        return image;
+    }
+    setRNGSeed(1234);
+    image.create(size, CV_8UC3);
+    randu(image, Scalar::all(0), Scalar::all(256));
+    GaussianBlur(image, image, Size(7, 7), 0);
+    return image;
+}
+
+static void benchExtractors(BenchRunner &runner, const Mat &source) {
+    static const int rgBins[] = { 8, 16, 32 };
+    static const int rgbBins[] = { 4, 8, 16 };
+    static const int textureBins[] = { 8, 16, 32 };
+
+    for(size_t s = 0; s < sizeof(BENCH_IMAGE_SIZES) / sizeof(BENCH_IMAGE_SIZES[0]); s++) {
+        Mat image = benchImage(source, BENCH_IMAGE_SIZES[s]);
+        int w = image.cols, h = image.rows;
+
+        runner.run("extractCenterSquare", w, h, 0, 0, [&]() {
+            return extractCenterSquare(image)[0];
+        });
+        for(int b = 0; b < 3; b++) {
+            runner.run("computeRGHistogram", w, h, rgBins[b], 0, [&]() {
+                return computeRGHistogram(image, rgBins[b])[0];
+            });
+        }
+        for(int b = 0; b < 3; b++) {
+            runner.run("computeRGBHistogram", w, h, rgbBins[b], 0, [&]() {
+                return computeRGBHistogram(image, rgbBins[b])[0];
+            });
+        }
+        for(int b = 0; b < 3; b++) {
+            runner.run("computeTopBottomHistograms", w, h, rgbBins[b], 0, [&]() {
+                return computeTopBottomHistograms(image, rgbBins[b]).first[0];
+            });
+        }
+        for(int b = 0; b < 3; b++) {
+            runner.run("computeTextureHistogram", w, h, textureBins[b], 0, [&]() {
+                return computeTextureHistogram(image, textureBins[b])[0];
+            });
+        }
+        runner.run("computeColorTextureHistograms", w, h, 8, 0, [&]() {
+            vector<float> colorHist, textureHist;
+            computeColorTextureHistograms(image, 8, 16, colorHist, textureHist);
+            return colorHist[0] + textureHist[0];
+        });
+
+        runner.run("computeWarmColorScore", w, h, 0, 0, [&]() {
+            return computeWarmColorScore(image);
+        });
+        runner.run("computeVerticalGradient", w, h, 0, 0, [&]() {
+            return computeVerticalGradient(image);
+        });
+        runner.run("computeEdgeDensity", w, h, 0, 0, [&]() {
+            return computeEdgeDensity(image);
+        });
+        runner.run("computeSunsetFeatures", w, h, 0, 0, [&]() {
+            return computeSunsetFeatures(image).edgeDensity;
+        });
+    }
+}
+
+// One embedding per call, prepared like live_dnn_match does
+static int benchEmbedding(BenchRunner &runner, const Mat &source, const char *modelPath) {
+    dnn::Net net = dnn::readNet(modelPath);
+    if(net.empty()) {
+        printf("Error: Failed to load model %s\n", modelPath);
+        return -1;
+    }
+
+    Mat image = benchImage(source, Size(640, 480));
+    runner.run("getEmbedding", image.cols, image.rows, 0, 512, [&]() {
+        Mat resized, blob;
+        resize(image, resized, Size(224, 224));
+        dnn::blobFromImage(resized, blob, (1.0/255.0) * (1/0.226), Size(224, 224), Scalar(124, 116, 104), true,
+                           false, CV_32F);
+        net.setInput(blob);
+        Mat embedding = net.forward("onnx_node!resnetv22_flatten0_reshape0");
+        return embedding.ptr<float>(0)[0];
+    });
+    return 0;
+}
+
+static void benchDistances(BenchRunner &runner) {
+    RNG rng(5678);
+    for(size_t d = 0; d < sizeof(BENCH_DIMS) / sizeof(BENCH_DIMS[0]); d++) {
+        int dim = BENCH_DIMS[d];
+
+        // histogram-like rows: non-negative, summing to 1
+        vector<float> rows((size_t)BENCH_BATCH_ROWS * dim);
+        for(int r = 0; r < BENCH_BATCH_ROWS; r++) {
+            float sum = 0.0f;
+            for(int i = 0; i < dim; i++) {
+                rows[(size_t)r * dim + i] = rng.uniform(0.0f, 1.0f);
+                sum += rows[(size_t)r * dim + i];
+            }
+            for(int i = 0; i < dim; i++) {
+                rows[(size_t)r * dim + i] /= sum;
+            }
+        }
+        vector<float> a(rows.begin(), rows.begin() + dim);
+        vector<float> b(rows.begin() + dim, rows.begin() + 2 * dim);
+
+        runner.run("histogramIntersection", 0, 0, 0, dim, [&]() {
+            return histogramIntersection(a, b);
+        });
+        runner.run("computeSSD", 0, 0, 0, dim, [&]() {
+            return computeSSD(a, b);
+        });
+
+        EmbeddingMatrix normalized;
+        normalized.assign(&rows[0], BENCH_BATCH_ROWS, dim, dim);
+        const float *na = normalized.row(0), *nb = normalized.row(1);
+        EmbeddingMatrix halfRows, bfloat16Rows;
+        halfRows.setPrecision(FS_DTYPE_FLOAT16);
+        halfRows.assign(&rows[0], BENCH_BATCH_ROWS, dim, dim);
+        bfloat16Rows.setPrecision(FS_DTYPE_BFLOAT16);
+        bfloat16Rows.assign(&rows[0], BENCH_BATCH_ROWS, dim, dim);
+        runner.run("cosineDistance", 0, 0, 0, dim, [&]() {
+            return normalized_cosine_distance(na, nb, dim);
+        });
+
+        // Batch kernels of every kernel set this CPU supports, per row
+        string defaultKernels = distance_kernels().name;
+        vector<float> out(BENCH_BATCH_ROWS);
+        static const char *kernelSets[] = { "scalar", "avx2", "avx512" };
+        for(int k = 0; k < 3; k++) {
+            if(select_distance_kernels(kernelSets[k]) != 0) {
+                continue;
+            }
+            const DistanceKernelTable &kernels = distance_kernels();
+            string prefix = string(kernels.name) + ".";
+            runner.run(prefix + "intersectionBatch/1024", 0, 0, 0, dim, [&]() {
+                kernels.intersectionBatch(&a[0], &rows[0], BENCH_BATCH_ROWS, dim, dim, &out[0]);
+                return out[0];
+            });
+            runner.run(prefix + "squaredDistanceBatch/1024", 0, 0, 0, dim, [&]() {
+                kernels.squaredDistanceBatch(&a[0], &rows[0], BENCH_BATCH_ROWS, dim, dim, &out[0]);
+                return out[0];
+            });
+            runner.run(prefix + "cosineDistances/1024", 0, 0, 0, dim, [&]() {
+                normalized.cosineDistances(na, 0, BENCH_BATCH_ROWS, &out[0]);
+                return out[0];
+            });
+            runner.run(prefix + "cosineDistances.float16/1024", 0, 0, 0, dim, [&]() {
+                halfRows.cosineDistances(na, 0, BENCH_BATCH_ROWS, &out[0]);
+                return out[0];
+            });
+            runner.run(prefix + "cosineDistances.bfloat16/1024", 0, 0, 0, dim, [&]() {
+                bfloat16Rows.cosineDistances(na, 0, BENCH_BATCH_ROWS, &out[0]);
+                return out[0];
+            });
+        }
+        select_distance_kernels(defaultKernels.c_str());
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    // Pull out the options; there are no positional arguments
+    const char *jsonFile = NULL;
+    const char *label = NULL;
+    const char *filter = NULL;
+    const char *imageFile = NULL;
+    const char *modelPath = NULL;
+    int samples = DEFAULT_SAMPLES;
+    int warmup = DEFAULT_WARMUP;
+    double minSampleMs = DEFAULT_MIN_SAMPLE_MS;
+    for(int i = 1; i < argc; i++) {
+        if(i + 1 >= argc) {
+            printf("Error: Unknown or incomplete option %s\n", argv[i]);
+            return -1;
+        }
+        if(strcmp(argv[i], "--json") == 0) {
+            jsonFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--label") == 0) {
+            label = argv[++i];
+        }
+        else if(strcmp(argv[i], "--filter") == 0) {
+            filter = argv[++i];
+        }
+        else if(strcmp(argv[i], "--image") == 0) {
+            imageFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--model") == 0) {
+            modelPath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--samples") == 0) {
+            samples = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--warmup") == 0) {
+            warmup = max(0, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--min-sample-ms") == 0) {
+            minSampleMs = max(0.0, atof(argv[++i]));
+        }
+        else {
+            printf("Usage: %s [--json <file>] [--label <text>] [--filter <text>] [--samples <n>] [--warmup <n>]\n", argv[0]);
+            printf("       [--min-sample-ms <ms>] [--image <file>] [--model <onnx_model>]\n");
+            printf("Example: %s --json bench.json --label $(git rev-parse --short HEAD)\n", argv[0]);
+            return -1;
+        }
+    }
+
+    Mat source;
+    if(imageFile != NULL) {
+        source = imread(imageFile);
+        if(source.empty()) {
+            printf("Error: Could not load image %s\n", imageFile);
+            return -1;
+        }
+    }
+
+    // Single-threaded OpenCV, so the numbers measure the code itself
+    setNumThreads(1);
+
+    printf("retrieval_bench: %d samples after %d warmup, >= %.1f ms per sample, %s kernels\n\n", samples, warmup,
+           minSampleMs, distance_kernels().name);
+    printf("%-42s %-22s %14s %14s %14s\n", "case", "parameters", "median ns", "p99 ns", "min ns");
+
+    BenchRunner runner(samples, warmup, minSampleMs, filter);
+    benchExtractors(runner, source);
+    if(modelPath != NULL) {
+        if(benchEmbedding(runner, source, modelPath) != 0) {
+            return -1;
+        }
+    }
+    else if(filter == NULL || string("getEmbedding").find(filter) != string::npos) {
+        printf("%-42s (skipped, needs --model)\n", "getEmbedding");
+    }
+    benchDistances(runner);
+
+    if(jsonFile != NULL) {
+        if(writeJson(jsonFile, label, samples, warmup, minSampleMs, runner.all()) != 0) {
+            return -1;
+        }
+        printf("\nWrote %lu results to %s\n", (unsigned long)runner.all().size(), jsonFile);
+    }
+
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+  Per-stage latency and throughput counters.  See stage_stats.h.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "stage_stats.h"
+
+using namespace std;
+
+static const char *stageNames[STATS_STAGE_COUNT] = {
+    "readdir", "imread", "extract", "inference", "distance", "sort", "csv_parse", "load", "image"
+};
+
+// Latency buckets: values below 2 * LATENCY_SUB_BUCKETS ns have a bucket
+// each, and every power of two above is split into LATENCY_SUB_BUCKETS
+// buckets; LATENCY_BUCKETS of them reach 2^63 ns
+#define LATENCY_SUB_BUCKETS 16
+#define LATENCY_BUCKETS 960
+
+namespace {
+
+// The call counters of one stage
+struct LatencyHistogram {
+    long long calls;
+    long long items;
+    long long totalNanos;
+    long long maxNanos;
+    long long buckets[LATENCY_BUCKETS];
+};
+
+// The counters of one thread
+struct ThreadStats {
+    LatencyHistogram latency[STATS_STAGE_COUNT];
+    long long bytes[STATS_STAGE_COUNT];
+
+    ThreadStats() {
+        memset(latency, 0, sizeof(latency));
+        memset(bytes, 0, sizeof(bytes));
+    }
+};
+
+// One stage over all threads
+struct StageSummary {
+    long long calls;
+    long long items;
+    long long totalNanos;
+    long long bytes;
+    double p50, p95, p99, max;    // nanoseconds per call
+};
+
+}
+
+static bool enabled = false;
+static bool printReport = false;
+static const char *jsonFile = NULL;
+static chrono::steady_clock::time_point startTime;
+
+// Every thread's counters; they outlive the threads for the report
+static mutex registryLock;
+static vector<unique_ptr<ThreadStats>> registry;
+
+static ThreadStats &threadStats() {
+    static thread_local ThreadStats *mine = NULL;
+    if(mine == NULL) {
+        lock_guard<mutex> guard(registryLock);
+        registry.push_back(unique_ptr<ThreadStats>(new ThreadStats()));
+        mine = registry.back().get();
+    }
+    return *mine;
+}
+
+int parse_stats_options(int &argc, char *argv[]) {
+    int out = 1;
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--stats") == 0) {
+            printReport = true;
+        }
+        else if(strcmp(argv[i], "--stats-json") == 0) {
+            if(i + 1 >= argc) {
+                printf("Error: --stats-json needs a file name\n");
+                return -1;
+            }
+            jsonFile = argv[++i];
+        }
+        else {
+            argv[out++] = argv[i];
+        }
+    }
+    argc = out;
+    argv[argc] = NULL;
+
+    enabled = printReport || jsonFile != NULL;
+    startTime = chrono::steady_clock::now();
+    return 0;
+}
+
+void stats_enable() {
+    enabled = true;
+}
+
+bool stats_enabled() {
+    return enabled;
+}
+
+// Bucket of a duration: the value itself below 2 * LATENCY_SUB_BUCKETS,
+// above that its top five bits plus LATENCY_SUB_BUCKETS per halving
+static int latencyBucket(long long nanos) {
+    if(nanos < 0) {
+        nanos = 0;
+    }
+    int shift = 0;
+    while((nanos >> shift) >= 2 * LATENCY_SUB_BUCKETS) {
+        shift++;
+    }
+    return shift * LATENCY_SUB_BUCKETS + (int)(nanos >> shift);
+}
+
+// Smallest duration of a bucket, and the number of durations in it
+static long long bucketStart(int bucket, long long &width) {
+    int shift = bucket < 2 * LATENCY_SUB_BUCKETS ? 0 : bucket / LATENCY_SUB_BUCKETS - 1;
+    width = 1LL << shift;
+    return (long long)(bucket - shift * LATENCY_SUB_BUCKETS) << shift;
+}
+
+void stats_record(StatsStage stage, long long nanos, long long items) {
+    if(enabled) {
+        LatencyHistogram &latency = threadStats().latency[stage];
+        latency.calls++;
+        latency.items += items;
+        latency.totalNanos += nanos;
+        latency.maxNanos = max(latency.maxNanos, nanos);
+        latency.buckets[latencyBucket(nanos)]++;
+    }
+}
+
+void stats_add_bytes(StatsStage stage, long long bytes) {
+    if(enabled) {
+        threadStats().bytes[stage] += bytes;
+    }
+}
+
+// Nearest-rank percentile of the merged histogram: the middle of the
+// bucket holding the call of that rank, no larger than the slowest call
+static double percentile(const vector<long long> &buckets, long long calls, long long maxNanos, double p) {
+    long long rank = max((long long)ceil(p * calls), 1LL);
+    long long seen = 0;
+    for(int b = 0; b < LATENCY_BUCKETS; b++) {
+        seen += buckets[b];
+        if(seen >= rank) {
+            long long width;
+            long long start = bucketStart(b, width);
+            return min(start + (width - 1) / 2.0, (double)maxNanos);
+        }
+    }
+    return (double)maxNanos;
+}
+
+static StageSummary summarize(int stage) {
+    vector<long long> buckets(LATENCY_BUCKETS, 0);
+    long long maxNanos = 0;
+    StageSummary summary;
+    memset(&summary, 0, sizeof(summary));
+    for(size_t t = 0; t < registry.size(); t++) {
+        const LatencyHistogram &latency = registry[t]->latency[stage];
+        summary.calls += latency.calls;
+        summary.items += latency.items;
+        summary.totalNanos += latency.totalNanos;
+        summary.bytes += registry[t]->bytes[stage];
+        maxNanos = max(maxNanos, latency.maxNanos);
+        for(int b = 0; b < LATENCY_BUCKETS; b++) {
+            buckets[b] += latency.buckets[b];
+        }
+    }
+
+    if(summary.calls == 0) {
+        return summary;
+    }
+    summary.p50 = percentile(buckets, summary.calls, maxNanos, 0.50);
+    summary.p95 = percentile(buckets, summary.calls, maxNanos, 0.95);
+    summary.p99 = percentile(buckets, summary.calls, maxNanos, 0.99);
+    summary.max = (double)maxNanos;
+    return summary;
+}
+
+StageTotals stats_totals(StatsStage stage) {
+    StageTotals totals = { 0, 0, 0 };
+    lock_guard<mutex> guard(registryLock);
+    for(size_t t = 0; t < registry.size(); t++) {
+        const LatencyHistogram &latency = registry[t]->latency[stage];
+        totals.calls += latency.calls;
+        totals.items += latency.items;
+        totals.nanos += latency.totalNanos;
+    }
+    return totals;
+}
+
+int report_stats(const char *program) {
+    if(!enabled) {
+        return 0;
+    }
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - startTime).count();
+
+    StageSummary summaries[STATS_STAGE_COUNT];
+    lock_guard<mutex> guard(registryLock);
+    for(int s = 0; s < STATS_STAGE_COUNT; s++) {
+        summaries[s] = summarize(s);
+    }
+
+    if(printReport) {
+        // Thread time can exceed the wall time when stages run in parallel
+        printf("\n=== Stage statistics (wall time %.3f ms, %lu threads) ===\n", wallMs,
+               (unsigned long)registry.size());
+        printf("%-10s %9s %12s %12s %10s %10s %10s %10s\n", "stage", "calls", "total ms", "MB read",
+               "p50 us", "p95 us", "p99 us", "max us");
+        for(int s = 0; s < STATS_STAGE_COUNT; s++) {
+            const StageSummary &st = summaries[s];
+            if(st.calls == 0 && st.bytes == 0) {
+                continue;
+            }
+            printf("%-10s %9lld %12.3f %12.3f %10.1f %10.1f %10.1f %10.1f\n", stageNames[s], st.calls,
+                   st.totalNanos / 1e6, st.bytes / 1e6, st.p50 / 1e3, st.p95 / 1e3, st.p99 / 1e3, st.max / 1e3);
+        }
+    }
+
+    if(jsonFile != NULL) {
+        FILE *fp = fopen(jsonFile, "w");
+        if(!fp) {
+            printf("Unable to open stats file %s\n", jsonFile);
+            return -1;
+        }
+        fprintf(fp, "{\n");
+        fprintf(fp, "  \"program\": \"%s\",\n", program);
+        fprintf(fp, "  \"wall_ms\": %.3f,\n", wallMs);
+        fprintf(fp, "  \"threads\": %lu,\n", (unsigned long)registry.size());
+        fprintf(fp, "  \"stages\": {");
+        bool first = true;
+        for(int s = 0; s < STATS_STAGE_COUNT; s++) {
+            const StageSummary &st = summaries[s];
+            if(st.calls == 0 && st.bytes == 0) {
+                continue;
+            }
+            fprintf(fp, "%s\n    \"%s\": {\"calls\": %lld, \"items\": %lld, \"total_ms\": %.3f, \"bytes\": %lld, "
+                        "\"p50_us\": %.1f, \"p95_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+                    first ? "" : ",", stageNames[s], st.calls, st.items, st.totalNanos / 1e6, st.bytes,
+                    st.p50 / 1e3, st.p95 / 1e3, st.p99 / 1e3, st.max / 1e3);
+            first = false;
+        }
+        fprintf(fp, "\n  }\n}\n");
+        if(fclose(fp) != 0) {
+            printf("Error writing stats file %s\n", jsonFile);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,140 @@
+/*
+  Per-stage latency and throughput counters for the matchers
+
+  A query spends its time in a handful of stages: listing the directory,
+  decoding images, extracting features, computing distances, sorting the
+  results, parsing CSV files.  Wrapping each stage in a StageTimer
+  records how long every call took, and stats_add_bytes records how much
+  input it read.  Each thread aggregates into its own counters, so the
+  timers take no locks; the counters of all threads are combined when
+  the report is made, after the worker threads are done.
+
+  The call times go into a fixed histogram per thread and stage, with
+  16 buckets per power of two (exact below 32 ns), so the counters do
+  not grow with the number of calls and a percentile is off by at most
+  half a bucket, about 3%.
+
+  The timers are always compiled in but only read the clock after
+  --stats or --stats-json turned them on, so they cost a branch when
+  off.  --stats prints a table with the calls, total time, bytes read
+  and the p50/p95/p99 latency per call of every stage; --stats-json
+  writes the same numbers to a file for monitoring.  The "image" stage
+  is the whole time spent on one directory image (decode plus the
+  matcher's work on it).
+
+  A call can cover several items, such as a batch of images; the items
+  and the busy time of a stage are available from stats_totals, for
+  programs that report their own throughput.
+ */
+
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <chrono>
+
+enum StatsStage {
+    STATS_READDIR,      // one readdir call
+    STATS_DECODE,       // imread of one image
+    STATS_EXTRACT,      // feature extraction for one image
+    STATS_INFERENCE,    // one network forward pass
+    STATS_DISTANCE,     // distance of one image, or one block of rows
+    STATS_SORT,         // merging and sorting the results
+    STATS_CSV_PARSE,    // reading one feature CSV file
+    STATS_LOAD,         // mapping one binary feature file
+    STATS_IMAGE,        // one directory image, end to end
+    STATS_STAGE_COUNT
+};
+
+/*
+  Removes --stats and --stats-json <file> from argv, adjusting argc, and
+  turns the counters on if either is present.  Returns a non-zero value
+  if --stats-json has no file name.
+ */
+int parse_stats_options( int &argc, char *argv[] );
+
+/*
+  Turns the counters on without a report, for a program that reads
+  stats_totals itself.  --stats and --stats-json still report as usual.
+ */
+void stats_enable();
+
+/*
+  True once parse_stats_options or stats_enable turned the counters on.
+ */
+bool stats_enabled();
+
+/*
+  Adds one call of the given duration, covering items items, to a stage.
+ */
+void stats_record( StatsStage stage, long long nanos, long long items = 1 );
+
+/*
+  Adds input bytes read by a stage.
+ */
+void stats_add_bytes( StatsStage stage, long long bytes );
+
+// One stage summed over all threads
+struct StageTotals {
+    long long calls;
+    long long items;
+    long long nanos;    // busy time of all threads together
+};
+
+/*
+  Totals of a stage so far.  Call it once the threads that record the
+  stage have finished.
+ */
+StageTotals stats_totals( StatsStage stage );
+
+/*
+  Prints the report and writes the JSON file, as requested on the
+  command line; does nothing if the counters are off.  Call it once the
+  worker threads have finished.  Returns a non-zero value if the JSON
+  file cannot be written.
+ */
+int report_stats( const char *program );
+
+/*
+  Times the enclosing scope, or the time until stop(), as one call of a
+  stage covering items items.
+ */
+class StageTimer {
+public:
+    explicit StageTimer( StatsStage stage, long long items = 1 ) : stage(stage), items(items), running(stats_enabled()) {
+        if(running) {
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Changes the items of the call, for a count only known at the end
+    void setItems( long long count ) {
+        items = count;
+    }
+
+    ~StageTimer() {
+        stop();
+    }
+
+    // Records the call now; returns its duration (0 if the counters are off)
+    long long stop() {
+        if(!running) {
+            return 0;
+        }
+        running = false;
+        long long nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        stats_record(stage, nanos, items);
+        return nanos;
+    }
+
+private:
+    StageTimer( const StageTimer & );
+    StageTimer &operator=( const StageTimer & );
+
+    StatsStage stage;
+    long long items;
+    bool running;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
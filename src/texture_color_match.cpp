@@ -1,7 +1,18 @@
 /*
   Texture and Color Matching using RGB histogram + Sobel gradient magnitude histogram
   
-  Usage: texture_color_match <target_image> <image_directory> <num_matches>
+  Usage: texture_color_match <target_image> <image_directory> <num_matches> [--threads <n>]
+         [--decode-scale <1|2|4|8|auto>] [--decode-compare] [--stats] [--stats-json <file>]
+  
+  Only global distributions are computed, so JPEGs can be decoded at
+  reduced resolution; --decode-compare reports how the ranking changes.
+  Both histograms come from one pass over the image (fused_features.h).
+  --stats prints where the time went (see stage_stats.h).
+  
+  The distance of an image is abandoned as soon as the bins left in its
+  color and texture histograms cannot bring it below that of the current
+  K-th best image (see early_abandon.h); the work skipped is reported at
+  the end.
 */
 
 #include <opencv2/opencv.hpp>
@@ -9,156 +20,31 @@
 #include <cstring>
 #include <vector>
 #include <algorithm>
-#include <dirent.h>
+#include <limits>
 #include <cmath>
-#include "csv_util.h"
+#include "image_features.h"
+#include "fused_features.h"
+#include "image_pipeline.h"
+#include "top_k.h"
+#include "rank_compare.h"
+#include "stage_stats.h"
+#include "early_abandon.h"
 
 using namespace cv;
 using namespace std;
 
-// Compute 3D RGB histogram for entire image
-vector<float> computeRGBHistogram(Mat &image, int bins = 8) {
-    vector<float> histogram(bins * bins * bins, 0.0);
-    
-    int totalPixels = 0;
-    
-    for(int i = 0; i < image.rows; i++) {
-        for(int j = 0; j < image.cols; j++) {
-            Vec3b pixel = image.at<Vec3b>(i, j);
-            
-            int b = pixel[0];
-            int g = pixel[1];
-            int r = pixel[2];
-            
-            // Map to bin indices [0, bins-1]
-            int r_bin = (r * bins) / 256;
-            int g_bin = (g * bins) / 256;
-            int b_bin = (b * bins) / 256;
-            
-            // Clamp to valid range
-            if(r_bin >= bins) r_bin = bins - 1;
-            if(g_bin >= bins) g_bin = bins - 1;
-            if(b_bin >= bins) b_bin = bins - 1;
-            
-            // Compute linear index
-            int binIndex = r_bin * bins * bins + g_bin * bins + b_bin;
-            histogram[binIndex]++;
-            totalPixels++;
-        }
-    }
-    
-    // Normalize histogram
-    for(int i = 0; i < histogram.size(); i++) {
-        if(totalPixels > 0) {
-            histogram[i] = histogram[i] / totalPixels;
-        }
-    }
-    
-    return histogram;
-}
-
-// Compute Sobel gradient magnitude and create histogram
-vector<float> computeTextureHistogram(Mat &image, int bins = 16) {
-    // Convert to grayscale
-    Mat gray;
-    cvtColor(image, gray, COLOR_BGR2GRAY);
-    
-    // Apply Sobel filters
-    Mat sobelX, sobelY;
-    Sobel(gray, sobelX, CV_16S, 1, 0, 3);
-    Sobel(gray, sobelY, CV_16S, 0, 1, 3);
-    
-    // Compute gradient magnitude
-    Mat magnitude(gray.rows, gray.cols, CV_32F);
-    
-    for(int i = 0; i < gray.rows; i++) {
-        for(int j = 0; j < gray.cols; j++) {
-            float gx = sobelX.at<short>(i, j);
-            float gy = sobelY.at<short>(i, j);
-            magnitude.at<float>(i, j) = sqrt(gx * gx + gy * gy);
-        }
-    }
-    
-    // Find max magnitude for normalization
-    double minVal, maxVal;
-    minMaxLoc(magnitude, &minVal, &maxVal);
-    
-    // Create histogram of gradient magnitudes
-    vector<float> histogram(bins, 0.0);
-    int totalPixels = 0;
-    
-    for(int i = 0; i < magnitude.rows; i++) {
-        for(int j = 0; j < magnitude.cols; j++) {
-            float mag = magnitude.at<float>(i, j);
-            
-            // Normalize magnitude to [0, bins-1]
-            int bin = (int)((mag / maxVal) * bins);
-            
-            // Clamp to valid range
-            if(bin >= bins) bin = bins - 1;
-            
-            histogram[bin]++;
-            totalPixels++;
-        }
-    }
-    
-    // Normalize histogram
-    for(int i = 0; i < histogram.size(); i++) {
-        if(totalPixels > 0) {
-            histogram[i] = histogram[i] / totalPixels;
-        }
-    }
-    
-    return histogram;
-}
-
-// Compute histogram intersection
-float histogramIntersection(vector<float> &hist1, vector<float> &hist2) {
-    if(hist1.size() != hist2.size()) {
-        printf("Error: Histograms have different sizes!\n");
-        return 0.0;
-    }
-    
-    float intersection = 0.0;
+int main(int argc, char *argv[]) {
     
-    for(int i = 0; i < hist1.size(); i++) {
-        intersection += min(hist1[i], hist2[i]);
+    // Pull out --threads, --decode-scale and --stats before looking at the positional arguments
+    PipelineOptions pipelineOptions;
+    if(parse_pipeline_options(argc, argv, pipelineOptions, true) != 0 || parse_stats_options(argc, argv) != 0) {
+        return -1;
     }
     
-    return intersection;
-}
-
-// Compute combined distance with equal weighting
-float computeCombinedDistance(vector<float> &colorHist1, vector<float> &textureHist1,
-                               vector<float> &colorHist2, vector<float> &textureHist2) {
-    // Compute color histogram intersection
-    float colorIntersection = histogramIntersection(colorHist1, colorHist2);
-    
-    // Compute texture histogram intersection
-    float textureIntersection = histogramIntersection(textureHist1, textureHist2);
-    
-    // Equal weighting: average the two intersections
-    float avgIntersection = (colorIntersection + textureIntersection) / 2.0;
-    
-    // Return distance (1 - intersection)
-    return 1.0 - avgIntersection;
-}
-
-// Structure to hold image filename and its distance from target
-struct ImageMatch {
-    string filename;
-    float distance;
-    
-    bool operator<(const ImageMatch &other) const {
-        return distance < other.distance;
-    }
-};
-
-int main(int argc, char *argv[]) {
-    
     // Check arguments
     if(argc < 4) {
-        printf("Usage: %s <target_image> <image_directory> <num_matches>\n", argv[0]);
+        printf("Usage: %s <target_image> <image_directory> <num_matches> [--threads <n>]\n", argv[0]);
+        printf("       [--decode-scale <1|2|4|8|auto>] [--decode-compare] [--stats] [--stats-json <file>]\n");
         printf("Example: %s images/pic.0535.jpg images 5\n", argv[0]);
         return -1;
     }
@@ -169,8 +55,8 @@ int main(int argc, char *argv[]) {
     int colorBins = 8;    // 8x8x8 RGB histogram
     int textureBins = 16; // 16 bins for gradient magnitude
     
-    // Load target image
-    Mat targetImage = imread(targetImagePath);
+    // Load target image (at the same decode scale as the database images)
+    Mat targetImage = load_image(targetImagePath, pipelineOptions);
     if(targetImage.empty()) {
         printf("Error: Could not load target image: %s\n", targetImagePath);
         return -1;
@@ -181,69 +67,85 @@ int main(int argc, char *argv[]) {
            colorBins, colorBins, colorBins, textureBins);
     
     // Extract features from target image
-    vector<float> targetColorHist = computeRGBHistogram(targetImage, colorBins);
-    vector<float> targetTextureHist = computeTextureHistogram(targetImage, textureBins);
+    vector<float> targetColorHist, targetTextureHist;
+    computeColorTextureHistograms(targetImage, colorBins, textureBins, targetColorHist, targetTextureHist);
     printf("Computed color histogram: %lu bins\n", targetColorHist.size());
     printf("Computed texture histogram: %lu bins\n", targetTextureHist.size());
-    
-    // Open directory
-    DIR *dirp = opendir(imageDir);
-    if(dirp == NULL) {
-        printf("Error: Cannot open directory %s\n", imageDir);
-        return -1;
+    EarlyAbandonDistance colorIntersection(&targetColorHist[0], targetColorHist.size(), ABANDON_INTERSECTION);
+    EarlyAbandonDistance textureIntersection(&targetTextureHist[0], targetTextureHist.size(), ABANDON_INTERSECTION);
+    
+    // Full-resolution target histograms for --decode-compare
+    vector<float> targetFullColorHist, targetFullTextureHist;
+    if(pipelineOptions.compareFullDecode) {
+        Mat targetFull = imread(targetImagePath);
+        computeColorTextureHistograms(targetFull, colorBins, textureBins, targetFullColorHist, targetFullTextureHist);
     }
     
-    // Process all images in directory
-    vector<ImageMatch> matches;
-    struct dirent *dp;
-    char buffer[512];
+    // Process all images in directory with the decode/feature pipeline
+    ImagePipeline pipeline(pipelineOptions);
+    vector<TopK> workerBest(pipeline.featureWorkers(), TopK(numMatches));
+    RankingComparison comparison(pipeline.featureWorkers());
+    vector<AbandonStats> workerAbandon(pipeline.featureWorkers());
     
     printf("\nProcessing images in directory: %s\n", imageDir);
     
-    while((dp = readdir(dirp)) != NULL) {
-        // Check if file is an image
-        if(strstr(dp->d_name, ".jpg") || 
-           strstr(dp->d_name, ".png") || 
-           strstr(dp->d_name, ".ppm") || 
-           strstr(dp->d_name, ".tif")) {
-            
-            // Build full path
-            strcpy(buffer, imageDir);
-            strcat(buffer, "/");
-            strcat(buffer, dp->d_name);
-            
-            // Load image
-            Mat image = imread(buffer);
-            if(image.empty()) {
-                printf("Warning: Could not load %s\n", buffer);
-                continue;
-            }
-            
-            // Compute features
-            vector<float> colorHist = computeRGBHistogram(image, colorBins);
-            vector<float> textureHist = computeTextureHistogram(image, textureBins);
-            
-            // Compute distance
-            float distance = computeCombinedDistance(targetColorHist, targetTextureHist,
-                                                      colorHist, textureHist);
-            
-            // Store result
-            ImageMatch match;
-            match.filename = string(dp->d_name);
-            match.distance = distance;
-            matches.push_back(match);
+    int result = pipeline.run(imageDir, default_image_extensions(), [&](PipelineImage &item, int worker) {
+        // Compute features
+        vector<float> colorHist, textureHist;
+        StageTimer extractTimer(STATS_EXTRACT);
+        computeColorTextureHistograms(item.image, colorBins, textureBins, colorHist, textureHist);
+        extractTimer.stop();
+        
+        // Compute distance, stopping once it cannot make the top matches
+        // (--decode-compare ranks every image, so it needs them all exact)
+        StageTimer distanceTimer(STATS_DISTANCE);
+        float bound = pipelineOptions.compareFullDecode ? numeric_limits<float>::infinity()
+                                                        : workerBest[worker].threshold();
+        float distance = early_abandon_average(colorIntersection, &colorHist[0],
+                                               textureIntersection, &textureHist[0], bound, workerAbandon[worker]);
+        distanceTimer.stop();
+        
+        if(pipelineOptions.compareFullDecode) {
+            vector<float> fullColorHist, fullTextureHist;
+            computeColorTextureHistograms(item.fullImage, colorBins, textureBins, fullColorHist, fullTextureHist);
+            float fullDistance = computeCombinedDistance(targetFullColorHist, targetFullTextureHist,
+                                                         fullColorHist, fullTextureHist);
+            comparison.add(worker, item.id, fullDistance, distance);
         }
+        
+        // Keep it if it is among the best so far
+        workerBest[worker].push(item.id, distance);
+    });
+    if(result != 0) {
+        return -1;
     }
     
-    closedir(dirp);
-    
-    // Sort matches by distance (ascending)
-    sort(matches.begin(), matches.end());
+    // Merge the per-thread heaps
+    StageTimer sortTimer(STATS_SORT);
+    vector<ScoredId> matches = merge_top_k(workerBest).sorted();
+    sortTimer.stop();
     
     // Display top N matches
     printf("\n=== Top %d matches (Texture + Color) ===\n", numMatches);
-    for(int i = 0; i < min(numMatches, (int)matches.size()); i++) {
-        printf("%d. %s (distance: %.4f)\n", i+1, matches[i].filename.c_str(), matches[i].distance);
+    for(int i = 0; i < (int)matches.size(); i++) {
+        printf("%d. %s (distance: %.4f)\n", i+1, pipeline.filename(matches[i].id), matches[i].distance);
+    }
+    
+    // Report decode scales and, with --decode-compare, the ranking change
+    if(pipelineOptions.decodeScale != 1 || pipelineOptions.compareFullDecode) {
+        pipeline.printDecodeReport();
+    }
+    AbandonStats abandonTotal;
+    for(size_t w = 0; w < workerAbandon.size(); w++) {
+        abandonTotal.add(workerAbandon[w]);
+    }
+    print_abandon_stats("Early abandoning", abandonTotal);
+    if(pipelineOptions.compareFullDecode) {
+        print_ranking_agreement("Reduced vs full-resolution decode", comparison.compare(numMatches));
+    }
+    
+    if(report_stats("texture_color_match") != 0) {
+        return -1;
     }
     
     return 0;
@@ -0,0 +1,40 @@
+/*
+  Bounded top-K selection of the closest images.
+*/
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include "top_k.h"
+
+using namespace std;
+
+float TopK::threshold() const {
+    if(limit == 0) {
+        return -numeric_limits<float>::infinity();
+    }
+    if((int)heap.size() < limit) {
+        return numeric_limits<float>::infinity();
+    }
+    return heap.front().distance;
+}
+
+void TopK::merge(const TopK &other) {
+    for(size_t i = 0; i < other.heap.size(); i++) {
+        push(other.heap[i].id, other.heap[i].distance);
+    }
+}
+
+vector<ScoredId> TopK::sorted() const {
+    vector<ScoredId> result(heap);
+    sort(result.begin(), result.end(), ranks_before);
+    return result;
+}
+
+TopK merge_top_k(const vector<TopK> &heaps) {
+    TopK merged(heaps.empty() ? 0 : heaps[0].capacity());
+    for(size_t i = 0; i < heaps.size(); i++) {
+        merged.merge(heaps[i]);
+    }
+    return merged;
+}
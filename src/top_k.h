@@ -0,0 +1,88 @@
+/*
+  Bounded top-K selection of the closest images
+
+  The matchers only print the best few of thousands of scored images, so
+  instead of collecting and sorting every (filename, distance) pair they
+  keep a fixed-size max-heap of (id, distance) pairs.  The worst of the K
+  kept entries sits at the top of the heap and a new candidate only
+  costs O(log K) if it beats it.  Each worker thread fills its own TopK
+  and the heaps are merged once at the end; filenames are looked up only
+  for the final K ids.
+
+  Entries are ordered by distance and then by id, so the result does not
+  depend on how the images were spread over the workers.
+ */
+
+#ifndef TOP_K_H
+#define TOP_K_H
+
+#include <algorithm>
+#include <vector>
+
+struct ScoredId {
+    int id;
+    float distance;
+};
+
+/*
+  Returns true if a ranks before b: smaller distance first, ties by id.
+ */
+inline bool ranks_before( const ScoredId &a, const ScoredId &b ) {
+    return a.distance < b.distance || (a.distance == b.distance && a.id < b.id);
+}
+
+class TopK {
+public:
+    explicit TopK( int k = 0 ) : limit(k > 0 ? k : 0) {
+        heap.reserve(limit);
+    }
+
+    /*
+      Offers one scored image.  Never allocates once the heap is full.
+     */
+    void push( int id, float distance ) {
+        ScoredId entry;
+        entry.id = id;
+        entry.distance = distance;
+
+        if((int)heap.size() < limit) {
+            heap.push_back(entry);
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        }
+        else if(limit > 0 && ranks_before(entry, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), ranks_before);
+            heap.back() = entry;
+            std::push_heap(heap.begin(), heap.end(), ranks_before);
+        }
+    }
+
+    /*
+      The distance a new entry has to beat to be kept, or +infinity while
+      fewer than K entries are held.
+     */
+    float threshold() const;
+
+    /*
+      Adds every entry of other to this heap.
+     */
+    void merge( const TopK &other );
+
+    /*
+      The kept entries, best first.
+     */
+    std::vector<ScoredId> sorted() const;
+
+    int capacity() const { return limit; }
+    int size() const { return (int)heap.size(); }
+
+private:
+    std::vector<ScoredId> heap;
+    int limit;
+};
+
+/*
+  Merges per-worker heaps into one of the same capacity.
+ */
+TopK merge_top_k( const std::vector<TopK> &heaps );
+
+#endif
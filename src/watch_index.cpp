@@ -0,0 +1,437 @@
+/*
+  Keep a feature store up to date while an image directory changes
+
+  Instead of rebuilding the whole feature file when images are added,
+  watch_index maintains an incremental index (incremental_index.h) and
+  only extracts features for files that are new or modified:
+
+  1. At startup the directory is compared with the store by file size
+     and modification time, which catches up with everything that
+     changed while the watcher was not running.
+  2. Then it follows inotify events on the directory (Linux), which it
+     subscribed to before step 1 so that nothing changed in between is
+     missed, and extracts features for every image that is written or
+     moved in.
+     Deleted or moved-out images are tombstoned.  On other systems the
+     directory is re-checked every --poll seconds instead.
+  3. A background thread compacts the store (drops tombstoned rows and
+     folds the journal into it) once the journal holds more than
+     --compact-ratio times as many records as there are live rows.
+
+  The store is a normalized-or-not feature store of the given
+  build_index feature type, readable by the matchers as of its last
+  compaction.  Ctrl-C compacts once more and exits.  --once does step 1,
+  compacts and exits.
+
+  Usage: watch_index <image_directory> <feature_type> <store_file> [--compact-ratio <r>] [--poll <seconds>] [--once]
+*/
+
+#include <opencv2/opencv.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include "image_features.h"
+#include "image_pipeline.h"
+#include "incremental_index.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+using namespace cv;
+using namespace std;
+
+// Default journal size, relative to the live rows, that triggers a compaction
+#define DEFAULT_COMPACT_RATIO 0.1
+
+// Small journals are never worth a compaction
+#define COMPACT_MIN_RECORDS 64
+
+// Default seconds between directory checks without inotify
+#define DEFAULT_POLL_SECONDS 2
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+    stopRequested = 1;
+}
+
+static bool isImageName(const char *name) {
+    const vector<string> &extensions = default_image_extensions();
+    for(size_t i = 0; i < extensions.size(); i++) {
+        if(strstr(name, extensions[i].c_str())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+class Watcher {
+public:
+    Watcher(const char *directory, const FeatureExtractor *extractor, IncrementalIndex &index)
+        : directory(directory), extractor(extractor), index(index), extracted(0), removed(0), failed(0) {}
+
+    /*
+      Extracts the features of one file if it is new or modified.
+     */
+    void update(const char *name) {
+        string path = directory + "/" + name;
+        FeatureFileStamp stamp;
+        if(feature_file_stamp(path.c_str(), false, stamp) != 0) {
+            // gone again before we got to it
+            forget(name);
+            return;
+        }
+        if(index.isCurrent(name, stamp)) {
+            return;
+        }
+
+        Mat image = imread(path);
+        if(image.empty()) {
+            // possibly still being written; the next close event retries
+            printf("Warning: Could not load %s\n", path.c_str());
+            failed++;
+            return;
+        }
+        vector<float> features = extractor->extract(image);
+        if(index.put(name, stamp, &features[0]) == 0) {
+            extracted++;
+        }
+    }
+
+    /*
+      Tombstones a deleted file; names that were never indexed are not
+      counted.
+     */
+    void forget(const char *name) {
+        if(index.remove(name) == 1) {
+            removed++;
+        }
+    }
+
+    /*
+      Compares the whole directory with the index.  Returns a non-zero
+      value if the directory cannot be read.
+     */
+    int reconcile() {
+        DIR *dirp = opendir(directory.c_str());
+        if(dirp == NULL) {
+            printf("Error: Cannot open directory %s\n", directory.c_str());
+            return -1;
+        }
+        set<string> present;
+        struct dirent *dp;
+        while((dp = readdir(dirp)) != NULL) {
+            if(isImageName(dp->d_name)) {
+                present.insert(dp->d_name);
+            }
+        }
+        closedir(dirp);
+
+        for(set<string>::iterator it = present.begin(); it != present.end(); ++it) {
+            update(it->c_str());
+        }
+        vector<string> live = index.liveNames();
+        for(size_t i = 0; i < live.size(); i++) {
+            if(!present.count(live[i])) {
+                forget(live[i].c_str());
+            }
+        }
+        return 0;
+    }
+
+    int extractedCount() const { return extracted; }
+    int removedCount() const { return removed; }
+    int failedCount() const { return failed; }
+
+private:
+    string directory;
+    const FeatureExtractor *extractor;
+    IncrementalIndex &index;
+    int extracted;
+    int removed;
+    int failed;
+};
+
+/*
+  Runs compactions on a background thread when asked to.
+ */
+class Compactor {
+public:
+    Compactor(IncrementalIndex &index, double ratio)
+        : index(index), ratio(ratio), requested(false), stopping(false), compactions(0),
+          worker(&Compactor::run, this) {}
+
+    ~Compactor() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // Starts a compaction if the journal has grown enough
+    void check() {
+        size_t records = index.journalRecords();
+        if(records < COMPACT_MIN_RECORDS || records < ratio * index.liveRows()) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            requested = true;
+        }
+        wake.notify_one();
+    }
+
+    int count() const { return compactions; }
+
+private:
+    void run() {
+        unique_lock<mutex> guard(lock);
+        for(;;) {
+            wake.wait(guard, [this] { return requested || stopping; });
+            if(stopping) {
+                return;
+            }
+            requested = false;
+            guard.unlock();
+
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            size_t dead = index.deadRows();
+            if(index.compact() == 0) {
+                compactions++;
+                printf("Compacted: %lu live rows, %lu tombstones dropped (%.3f s)\n",
+                       (unsigned long)index.liveRows(), (unsigned long)dead,
+                       chrono::duration<double>(chrono::steady_clock::now() - start).count());
+            }
+            guard.lock();
+        }
+    }
+
+    IncrementalIndex &index;
+    double ratio;
+    mutex lock;
+    condition_variable wake;
+    bool requested;
+    bool stopping;
+    atomic<int> compactions;
+    thread worker;
+};
+
+#ifdef __linux__
+// Subscribes to inotify events on the directory.  Returns the inotify
+// descriptor, or -1 if the directory cannot be watched.
+static int openWatch(const char *directory) {
+    int fd = inotify_init();
+    if(fd < 0) {
+        printf("Error: inotify is not available\n");
+        return -1;
+    }
+    uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF;
+    if(inotify_add_watch(fd, directory, mask) < 0) {
+        printf("Error: Cannot watch directory %s\n", directory);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Follows the events of a descriptor from openWatch until a stop is
+// requested, then closes it
+static void watchEvents(int fd, const char *directory, Watcher &watcher, Compactor &compactor) {
+    printf("Watching %s for changes (Ctrl-C to stop)\n", directory);
+    fflush(stdout);
+
+    // large enough for many events; aligned for struct inotify_event
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    while(!stopRequested) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if(poll(&pfd, 1, 500) <= 0) {
+            continue;
+        }
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if(length <= 0) {
+            continue;
+        }
+
+        int before = watcher.extractedCount() + watcher.removedCount();
+        for(char *p = buffer; p < buffer + length; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & IN_Q_OVERFLOW) {
+                // events were lost; compare the whole directory instead
+                watcher.reconcile();
+            }
+            else if(event->mask & IN_DELETE_SELF) {
+                printf("Directory %s was deleted\n", directory);
+                stopRequested = 1;
+            }
+            else if(event->len > 0 && isImageName(event->name)) {
+                if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    watcher.forget(event->name);
+                }
+                else {
+                    watcher.update(event->name);
+                }
+            }
+        }
+
+        int changes = watcher.extractedCount() + watcher.removedCount() - before;
+        if(changes > 0) {
+            printf("%d changes indexed (%d extracted, %d removed so far)\n", changes,
+                   watcher.extractedCount(), watcher.removedCount());
+            fflush(stdout);
+        }
+        compactor.check();
+    }
+
+    close(fd);
+}
+#endif
+
+// Re-checks the directory every pollSeconds until a stop is requested
+static void pollDirectory(const char *directory, int pollSeconds, Watcher &watcher, Compactor &compactor) {
+    printf("Checking %s for changes every %d s (Ctrl-C to stop)\n", directory, pollSeconds);
+    fflush(stdout);
+    while(!stopRequested) {
+        for(int i = 0; i < pollSeconds * 10 && !stopRequested; i++) {
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        int before = watcher.extractedCount() + watcher.removedCount();
+        if(watcher.reconcile() != 0) {
+            return;
+        }
+        int changes = watcher.extractedCount() + watcher.removedCount() - before;
+        if(changes > 0) {
+            printf("%d changes indexed\n", changes);
+            fflush(stdout);
+        }
+        compactor.check();
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    // Pull out the options before looking at the positional arguments
+    double compactRatio = DEFAULT_COMPACT_RATIO;
+    int pollSeconds = DEFAULT_POLL_SECONDS;
+    bool once = false;
+    for(int i = 1; i < argc; ) {
+        int consumed = 0;
+        if(strcmp(argv[i], "--compact-ratio") == 0 && i + 1 < argc) {
+            compactRatio = atof(argv[i + 1]);
+            consumed = 2;
+        }
+        else if(strcmp(argv[i], "--poll") == 0 && i + 1 < argc) {
+            pollSeconds = max(1, atoi(argv[i + 1]));
+            consumed = 2;
+        }
+        else if(strcmp(argv[i], "--once") == 0) {
+            once = true;
+            consumed = 1;
+        }
+
+        if(consumed == 0) {
+            i++;
+            continue;
+        }
+        for(int j = i; j < argc - consumed; j++) {
+            argv[j] = argv[j + consumed];
+        }
+        argc -= consumed;
+    }
+
+    if(argc < 4) {
+        printf("Usage: %s <image_directory> <feature_type> <store_file> [--compact-ratio <r>] [--poll <seconds>] [--once]\n", argv[0]);
+        printf("Example: %s images/olympus texturecolor data/texcolor_olym.irfs\n", argv[0]);
+        return -1;
+    }
+
+    char *imageDir = argv[1];
+    char *featureType = argv[2];
+    char *storeFile = argv[3];
+
+    const FeatureExtractor *extractor = find_feature_extractor(featureType);
+    if(extractor == NULL) {
+        printf("Error: Unknown feature type %s\n", featureType);
+        return -1;
+    }
+
+    // The extractors have a fixed output size; measure it on a blank image
+    Mat probe(64, 64, CV_8UC3, Scalar(128, 128, 128));
+    size_t dim = extractor->extract(probe).size();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    IncrementalIndex index;
+    if(index.open(storeFile, dim, feature_name_hash(extractor->name)) != 0) {
+        return -1;
+    }
+    printf("Index %s: %lu images with %lu %s features\n", storeFile, (unsigned long)index.liveRows(),
+           (unsigned long)dim, extractor->name);
+
+    // Subscribe to events before catching up, so that nothing changed
+    // during the catch-up is missed; an image seen by both is only
+    // extracted once, as update skips files that are current
+    int watchFd = -1;
+#ifdef __linux__
+    if(!once) {
+        watchFd = openWatch(imageDir);
+    }
+#endif
+
+    // Catch up with changes made while nobody was watching
+    Watcher watcher(imageDir, extractor, index);
+    if(watcher.reconcile() != 0) {
+#ifdef __linux__
+        if(watchFd >= 0) {
+            close(watchFd);
+        }
+#endif
+        return -1;
+    }
+    printf("Caught up in %.3f s: %d images extracted, %d removed, %lu unchanged\n",
+           chrono::duration<double>(chrono::steady_clock::now() - start).count(),
+           watcher.extractedCount(), watcher.removedCount(),
+           (unsigned long)(index.liveRows() - watcher.extractedCount()));
+
+    if(!once) {
+        signal(SIGINT, requestStop);
+        signal(SIGTERM, requestStop);
+
+        Compactor compactor(index, compactRatio);
+#ifdef __linux__
+        if(watchFd >= 0) {
+            watchEvents(watchFd, imageDir, watcher, compactor);
+        }
+        else {
+            pollDirectory(imageDir, pollSeconds, watcher, compactor);
+        }
+#else
+        pollDirectory(imageDir, pollSeconds, watcher, compactor);
+#endif
+        printf("\nStopping: %d images extracted, %d removed, %d compactions\n",
+               watcher.extractedCount(), watcher.removedCount(), compactor.count());
+    }
+
+    // Leave a compacted store behind
+    if(index.compact() != 0) {
+        return -1;
+    }
+    printf("Wrote %s with %lu images\n", storeFile, (unsigned long)index.liveRows());
+
+    return 0;
+}